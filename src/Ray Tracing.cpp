@@ -1,364 +1,604 @@
 /**
 \file
-\brief .cpp file of ray color function, demos and output
+\brief .cpp file of command line options, scene setup, render loop and output
 */
 
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <thread>
 
 #include "utility.h"
 
 #include "color.h"
 #include "hittable_list.h"
-#include "sphere.h"
 #include "camera.h"
-#include "material.h"
-#include "moving_sphere.h"
-#include "aarect.h"
-#include "box.h"
-#include "constant_medium.h"
 #include "bvh.h"
+#include "instance.h"
+#include "dispatch.h"
+#include "arena.h"
+#include "renderer.h"
+#include "integrator.h"
+#include "image_output.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "distributed.h"
+#include "preview.h"
+#include "denoise.h"
 
-color ray_color(const ray& r, const color& background, const hittable& world, int depth) {
-    hit_record rec;
-
-    // If we've exceeded the ray bounce limit, no more light is gathered.
-    if (depth <= 0)
-        return color(0, 0, 0);
-
-    // If the ray hits nothing, return the background color.
-    if (!world.hit(r, 0.001, infinity, rec))
-        return background;
-
-    ray scattered;
-    color attenuation;
-    color emitted = rec.mat_ptr->emitted(rec.u, rec.v, rec.p);
-
-    if (!rec.mat_ptr->scatter(r, rec, attenuation, scattered))
-        return emitted;
-
-    return emitted + attenuation * ray_color(scattered, background, world, depth - 1);
-}
-
-// Demos
-hittable_list random_scene() {
-    hittable_list world;
-
-    auto ground_material = make_shared<lambertian>(color(0.5, 0.5, 0.5));
-    world.add(make_shared<sphere>(point3(0, -1000, 0), 1000, ground_material));
-
-    for (int a = -11; a < 11; a++) {
-        for (int b = -11; b < 11; b++) {
-            auto choose_mat = random_double();
-            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+/**
+\brief Command line options.
+*/
+struct options {
+    int threads = static_cast<int>(std::thread::hardware_concurrency()); // number of render threads
+    unsigned int seed = 0; // image seed, same seed gives the same image for any number of threads
+    sampler_kind sampler = sampler_kind::sobol; // pattern of the sample values of camera, lights and materials
+    bool packets = true; // trace primary rays of 2x2 pixel quads as packets
+    bool wavefront = false; // advance all paths of a tile bounce by bounce instead of one path at a time
+    bool sample_lights = true; // next-event estimation with shadow rays towards the lights
+    int samples = 0; // maximum samples per pixel, 0 keeps the scene default
+    double target_error = 0; // stop sampling pixels whose error after gamma is below it, 0 turns adaptive sampling off
+    double time_budget = 0; // seconds to render at most, 0 means no limit
+    int pass_samples = 16; // samples per pixel in one progressive pass
+    const char* preview = nullptr; // file the image is written to after every pass
+    const char* interactive = nullptr; // shared image of the interactive preview, edits are read from the console
+    const char* output = nullptr; // image file, nullptr writes to stdout
+    image_format format = image_format::ppm; // format of output and preview
+    bool format_set = false; // format was given by --format, not by the file extension
+    display_settings display; // exposure, tonemapping and gamma of 8 bit formats
+    const char* denoise = nullptr; // denoiser run on the finished image (see make_denoiser), nullptr keeps the noisy image
+    const char* aov = nullptr; // prefix of the albedo, normal and depth images, nullptr writes none
+    int builtin = 0; // built-in scene rendered when no scene file is given (see builtin_scene), 0 picks the mesh scene with --mesh and scene 2 without
+    const char* mesh = nullptr; // OBJ or PLY file of the mesh scene, selects it unless --builtin is given
+    bvh_build_method bvh = bvh_build_method::sah; // how the BVHs of the scene are built
+    double texture_memory = 0; // megabytes of image texture tiles kept in memory, 0 keeps the cache default
+    const char* scene = nullptr; // scene file rendered instead of the built-in scene
+    const char* save_scene = nullptr; // scene file the built-in scene is written to, then the program exits
+    const char* trace = nullptr; // Chrome trace JSON of the stages and tiles, needs RT_ENABLE_STATS (see stats.h)
+    int coordinator = 0; // port the coordinator listens on for workers, 0 renders locally
+    const char* worker = nullptr; // host:port of the coordinator this process renders units for
+    int unit_samples = 0; // samples per pixel of one distributed work unit, 0 means an eighth of the samples
+    double unit_timeout = 120; // seconds a worker may keep a unit before its units go to the others (see render_coordinator)
+};
 
-            if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
-                shared_ptr<material> sphere_material;
+/**
+\brief Reads command line options: --threads N, --seed S, --sampler independent|stratified|sobol|bluenoise, --no-packets, --wavefront, --no-lights,
+--spp N, --target-error E, --time SECONDS, --pass N, --preview FILE, --interactive FILE,
+--output FILE, --format p3|ppm|pfm|exr, --exposure STOPS, --tonemap clamp|reinhard, --denoise atrous|oidn, --aov PREFIX, --builtin N, --mesh FILE, --bvh sah|lbvh, --texture-memory MB, --scene FILE, --save-scene FILE, --trace FILE,
+--coordinator PORT, --worker HOST:PORT, --unit-spp N and --unit-timeout SECONDS.
+*/
+options parse_options(int argc, char* argv[]) {
+    options opt;
+    if (opt.threads < 1) opt.threads = 1;
 
-                if (choose_mat < 0.8) {
-                    // diffuse
-                    auto albedo = color::random() * color::random();
-                    sphere_material = make_shared<lambertian>(albedo);
-                    auto center2 = center + vec3(0, random_double(0, .5), 0);
-                    world.add(make_shared<moving_sphere>(
-                        center, center2, 0.0, 1.0, 0.2, sphere_material));
-                }
-                else if (choose_mat < 0.95) {
-                    // metal
-                    auto albedo = color::random(0.5, 1);
-                    auto fuzz = random_double(0, 0.5);
-                    sphere_material = make_shared<metal>(albedo, fuzz);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
-                else {
-                    // glass
-                    sphere_material = make_shared<dielectric>(1.5);
-                    world.add(make_shared<sphere>(center, 0.2, sphere_material));
-                }
+    for (int a = 1; a < argc; ++a) {
+        if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            opt.threads = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            opt.seed = static_cast<unsigned int>(std::strtoul(argv[++a], nullptr, 10));
+        }
+        else if (std::strcmp(argv[a], "--sampler") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "independent") == 0) opt.sampler = sampler_kind::independent;
+            else if (std::strcmp(name, "stratified") == 0) opt.sampler = sampler_kind::stratified;
+            else if (std::strcmp(name, "sobol") == 0) opt.sampler = sampler_kind::sobol;
+            else if (std::strcmp(name, "bluenoise") == 0) opt.sampler = sampler_kind::blue_noise;
+            else {
+                std::cerr << "Unknown sampler '" << name << "', use independent, stratified, sobol or bluenoise.\n";
+                std::exit(1);
             }
         }
-
+        else if (std::strcmp(argv[a], "--no-packets") == 0) {
+            opt.packets = false;
+        }
+        else if (std::strcmp(argv[a], "--wavefront") == 0) {
+            opt.wavefront = true;
+        }
+        else if (std::strcmp(argv[a], "--no-lights") == 0) {
+            opt.sample_lights = false;
+        }
+        else if (std::strcmp(argv[a], "--spp") == 0 && a + 1 < argc) {
+            opt.samples = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--target-error") == 0 && a + 1 < argc) {
+            opt.target_error = std::atof(argv[++a]);
+        }
+        else if (std::strcmp(argv[a], "--time") == 0 && a + 1 < argc) {
+            opt.time_budget = std::atof(argv[++a]);
+        }
+        else if (std::strcmp(argv[a], "--pass") == 0 && a + 1 < argc) {
+            opt.pass_samples = std::max(2, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--preview") == 0 && a + 1 < argc) {
+            opt.preview = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--interactive") == 0 && a + 1 < argc) {
+            opt.interactive = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--output") == 0 && a + 1 < argc) {
+            opt.output = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--format") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            opt.format_set = true;
+            if (std::strcmp(name, "p3") == 0) opt.format = image_format::ppm_text;
+            else if (std::strcmp(name, "ppm") == 0) opt.format = image_format::ppm;
+            else if (std::strcmp(name, "pfm") == 0) opt.format = image_format::pfm;
+            else if (std::strcmp(name, "exr") == 0) opt.format = image_format::exr;
+            else {
+                std::cerr << "Unknown format '" << name << "', use p3, ppm, pfm or exr.\n";
+                std::exit(1);
+            }
+        }
+        else if (std::strcmp(argv[a], "--denoise") == 0 && a + 1 < argc) {
+            opt.denoise = argv[++a];
+            if (!make_denoiser(opt.denoise)) {
+                std::cerr << "Unknown denoiser '" << opt.denoise << "', use atrous" << (RT_ENABLE_OIDN ? " or oidn" : " (oidn needs RT_ENABLE_OIDN=1)") << ".\n";
+                std::exit(1);
+            }
+        }
+        else if (std::strcmp(argv[a], "--aov") == 0 && a + 1 < argc) {
+            opt.aov = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--builtin") == 0 && a + 1 < argc) {
+            opt.builtin = std::atoi(argv[++a]);
+            if (opt.builtin < 1 || opt.builtin > 11) {
+                std::cerr << "Unknown built-in scene '" << argv[a] << "', use 1 to 11.\n";
+                std::exit(1);
+            }
+        }
+        else if (std::strcmp(argv[a], "--mesh") == 0 && a + 1 < argc) {
+            opt.mesh = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--bvh") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "sah") == 0) opt.bvh = bvh_build_method::sah;
+            else if (std::strcmp(name, "lbvh") == 0) opt.bvh = bvh_build_method::lbvh;
+            else {
+                std::cerr << "Unknown BVH build '" << name << "', use sah or lbvh.\n";
+                std::exit(1);
+            }
+        }
+        else if (std::strcmp(argv[a], "--scene") == 0 && a + 1 < argc) {
+            opt.scene = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--save-scene") == 0 && a + 1 < argc) {
+            opt.save_scene = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--trace") == 0 && a + 1 < argc) {
+            opt.trace = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--coordinator") == 0 && a + 1 < argc) {
+            opt.coordinator = std::atoi(argv[++a]);
+            if (opt.coordinator <= 0 || opt.coordinator > 65535) {
+                std::cerr << "Invalid coordinator port '" << argv[a] << "'.\n";
+                std::exit(1);
+            }
+        }
+        else if (std::strcmp(argv[a], "--worker") == 0 && a + 1 < argc) {
+            opt.worker = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--unit-spp") == 0 && a + 1 < argc) {
+            opt.unit_samples = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--unit-timeout") == 0 && a + 1 < argc) {
+            opt.unit_timeout = std::max(1.0, std::atof(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--texture-memory") == 0 && a + 1 < argc) {
+            opt.texture_memory = std::atof(argv[++a]);
+        }
+        else if (std::strcmp(argv[a], "--exposure") == 0 && a + 1 < argc) {
+            opt.display.exposure = std::atof(argv[++a]);
+        }
+        else if (std::strcmp(argv[a], "--tonemap") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "clamp") == 0) opt.display.tonemap = tonemap_operator::clamp;
+            else if (std::strcmp(name, "reinhard") == 0) opt.display.tonemap = tonemap_operator::reinhard;
+            else {
+                std::cerr << "Unknown tonemap '" << name << "', use clamp or reinhard.\n";
+                std::exit(1);
+            }
+        }
+        else {
+            std::cerr << "Unknown option '" << argv[a] << "'.\n"
+                << "Usage: " << argv[0] << " [--threads N] [--seed S] [--sampler independent|stratified|sobol|bluenoise] [--no-packets] [--wavefront] [--no-lights]"
+                << " [--spp N] [--target-error E] [--time SECONDS] [--pass N] [--preview FILE] [--interactive FILE]"
+                << " [--output FILE] [--format p3|ppm|pfm|exr] [--exposure STOPS] [--tonemap clamp|reinhard] [--denoise atrous|oidn] [--aov PREFIX] [--builtin N] [--mesh FILE] [--bvh sah|lbvh] [--texture-memory MB] [--scene FILE] [--save-scene FILE] [--trace FILE]"
+                << " [--coordinator PORT | --worker HOST:PORT] [--unit-spp N] [--unit-timeout SECONDS] > image.ppm\n";
+            std::exit(1);
+        }
     }
 
-    auto material1 = make_shared<dielectric>(1.5);
-    world.add(make_shared<sphere>(point3(0, 1, 0), 1.0, material1));
-
-    auto material2 = make_shared<lambertian>(color(0.4, 0.2, 0.1));
-    world.add(make_shared<sphere>(point3(-4, 1, 0), 1.0, material2));
-
-    auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
-    world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
-
-    return world;
-}
-
-hittable_list two_spheres() {
-    hittable_list objects;
+    if (opt.builtin == 0)
+        opt.builtin = opt.mesh ? 10 : 2;
 
-    auto checker = make_shared<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+    if (opt.output && !opt.format_set)
+        opt.format = format_from_filename(opt.output);
 
-    objects.add(make_shared<sphere>(point3(0, -10, 0), 10, make_shared<lambertian>(checker)));
-    objects.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
-
-    return objects;
+    return opt;
 }
 
-hittable_list two_perlin_spheres() {
-    hittable_list objects;
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
-
-    return objects;
-}
+int main(int argc, char* argv[]) {
 
-hittable_list earth() {
-    auto earth_texture = make_shared<image_texture>("earthmap.jpg");
-    auto earth_surface = make_shared<lambertian>(earth_texture);
-    auto globe = make_shared<sphere>(point3(0, 0, 0), 2, earth_surface);
+    const options opt = parse_options(argc, argv);
 
-    return hittable_list(globe);
-}
+    const int max_depth = 50;
+    display_settings display = opt.display; // the interactive preview can change it
 
-hittable_list simple_light() {
-    hittable_list objects;
+    // World
 
-    auto pertext = make_shared<noise_texture>(4);
-    objects.add(make_shared<sphere>(point3(0, -1000, 0), 1000, make_shared<lambertian>(pertext)));
-    objects.add(make_shared<sphere>(point3(0, 2, 0), 2, make_shared<lambertian>(pertext)));
+    bvh_build_defaults().method = opt.bvh;
+    bvh_build_defaults().threads = opt.threads;
+    if (opt.texture_memory > 0)
+        shared_texture_cache().set_memory_budget(static_cast<size_t>(opt.texture_memory * (1 << 20)));
+    const auto build_start = std::chrono::steady_clock::now();
+    RT_TIMER_START(scene_timer, "scene build");
 
-    auto difflight = make_shared<diffuse_light>(color(4, 4, 4));
-    objects.add(make_shared<xy_rect>(3, 5, 1, 3, -2, difflight));
+    scene_file loaded_scene; // mapped file the loaded objects read from, so it is declared before the arena
+    scene_arena arena; // owns the objects of the scene, so it is declared before everything that points into it
+    hittable_list world;
+    scene_view view; // camera and render settings of the scene
 
-    return objects;
-}
+    if (opt.scene) {
+        if (!loaded_scene.load(opt.scene, arena, world, view))
+            return 1;
+        std::cerr << "Scene file: " << loaded_scene.size() << " bytes mapped.\n";
+    }
+    else {
+        world = builtin_scene(opt.builtin, arena, view, opt.mesh, opt.threads);
+    }
 
-hittable_list cornell_box() {
-    hittable_list objects;
+    // Chains of translate and rotate_y become one instance each
 
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(15, 15, 15));
+    for (auto& object : world.objects)
+        object = flatten_transforms(object);
+    RT_TIMER_STOP(scene_timer);
 
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(213, 343, 227, 332, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    if (opt.save_scene) {
+        if (!scene_writer().write(opt.save_scene, world, view))
+            return 1;
+        std::cerr << "Scene saved to '" << opt.save_scene << "'.\n";
+        return 0;
+    }
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
-    objects.add(box1);
+    // Global fog is tested by the integrator after the scene, it does not go into the BVH
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
-    objects.add(box2);
+    const auto fog = take_global_fog(world);
 
-    return objects;
-}
+    // Top level acceleration structure over the scene objects
 
-hittable_list cornell_smoke() {
-    hittable_list objects;
+    const auto top_level_start = std::chrono::steady_clock::now();
+    const bvh_node world_bvh(world, 0.0, 1.0);
+    const auto build_end = std::chrono::steady_clock::now();
 
-    auto red = make_shared<lambertian>(color(.65, .05, .05));
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    auto green = make_shared<lambertian>(color(.12, .45, .15));
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+    std::cerr << "Scene built in " << std::chrono::duration<double, std::milli>(build_end - build_start).count() << " ms (top level BVH "
+        << std::chrono::duration<double, std::milli>(build_end - top_level_start).count() << " ms, "
+        << world_bvh.tree.nodes.size() << " nodes).\n";
 
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
-    objects.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
-    objects.add(make_shared<xz_rect>(113, 443, 127, 432, 554, light));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
-    objects.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
-    objects.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+    // Lights for shadow rays: emitters at the top level of the scene that can be sampled
 
-    shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
-    box1 = make_shared<rotate_y>(box1, 15);
-    box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+    hittable_list lights;
+    for (const auto& object : world.objects)
+        if (object->emits_light())
+            lights.add(object);
 
-    shared_ptr<hittable> box2 = make_shared<box>(point3(0, 0, 0), point3(165, 165, 165), white);
-    box2 = make_shared<rotate_y>(box2, -18);
-    box2 = make_shared<translate>(box2, vec3(130, 0, 65));
+    // Camera
 
-    objects.add(make_shared<constant_medium>(box1, 0.01, color(0, 0, 0)));
-    objects.add(make_shared<constant_medium>(box2, 0.01, color(1, 1, 1)));
+    const int image_width = view.image_width;
+    const int image_height = static_cast<int>(image_width / view.aspect_ratio);
+    int samples_per_pixel = view.samples_per_pixel;
 
-    return objects;
-}
+    camera cam(scene_vector(view.lookfrom), scene_vector(view.lookat), scene_vector(view.vup), view.vfov, view.aspect_ratio,
+        view.aperture, view.dist_to_focus, view.time0, view.time1);
 
-hittable_list presentation() {
-    hittable_list boxes1;
-    auto ground = make_shared<lambertian>(color(0.48, 0.83, 0.53));
+    // Render
 
-    const int boxes_per_side = 20;
-    for (int i = 0; i < boxes_per_side; i++) {
-        for (int j = 0; j < boxes_per_side; j++) {
-            auto w = 100.0;
-            auto x0 = -1000.0 + i * w;
-            auto z0 = -1000.0 + j * w;
-            auto y0 = 0.0;
-            auto x1 = x0 + w;
-            auto y1 = random_double(1, 101);
-            auto z1 = z0 + w;
+    framebuffer fb(image_width, image_height);
+    const int tile_size = 16;
+    if ((opt.denoise || opt.aov) && opt.coordinator == 0)
+        fb.enable_aovs(); // workers do not send AOVs, distributed renders are denoised from color alone
+
+    integrator_settings settings;
+    settings.background = scene_vector(view.background);
+    settings.max_depth = max_depth;
+    settings.pixel_spread = 2 * tan(degrees_to_radians(view.vfov) / 2) / image_height;
+    settings.fog = fog.get();
+    if (opt.sample_lights && !lights.objects.empty())
+        settings.lights = &lights;
+
+    // Progressive passes: every pass adds pass_samples samples to the pixels that are not converged yet.
+    // Without target error, time budget or preview the whole image is one pass.
+
+    if (opt.samples > 0)
+        samples_per_pixel = opt.samples;
+
+    sampler_settings sampling;
+    sampling.kind = opt.sampler;
+    sampling.seed = opt.seed;
+    sampling.image_width = image_width;
+    sampling.image_height = image_height;
+    sampling.samples_per_pixel = samples_per_pixel;
+
+    auto camera_path = [&](int i, int j, int s) {
+        sampler smp(sampling, i, j, s);
+        const auto jitter = smp.get_2d();
+        auto u = (i + jitter.u) / (image_width - 1);
+        auto v = (j + jitter.v) / (image_height - 1);
+        const ray r = cam.get_ray(u, v, smp);
+        return path_state(r, smp);
+    };
+    const bool progressive = opt.target_error > 0 || opt.time_budget > 0 || opt.preview;
+    const int pass_samples = progressive ? std::min(opt.pass_samples, samples_per_pixel) : samples_per_pixel;
+
+    int first_sample = 0;
+    int sample_count = 0;
+
+    auto render_tile = [&](const tile& t) {
+        if (opt.wavefront) {
+            thread_local wavefront_integrator integrator;
+            integrator.render_tile(fb, t, first_sample, sample_count, world_bvh, settings, camera_path);
+            return;
+        }
 
-            boxes1.add(make_shared<box>(point3(x0, y0, z0), point3(x1, y1, z1), ground));
+        render_tile_paths(fb, t, first_sample, sample_count, world_bvh, settings, camera_path, opt.packets);
+    };
+
+    // Distributed rendering: workers render units of tiles and samples of the same scene, the coordinator merges them.
+    // Everything that changes the estimate goes into the job, so a worker started with other options is rejected.
+
+    render_job job = { image_width, image_height, samples_per_pixel, opt.seed, 0 };
+    if (opt.coordinator > 0 || opt.worker) {
+        const std::int32_t estimator[3] = { max_depth, settings.lights ? 1 : 0, static_cast<std::int32_t>(opt.sampler) };
+        const std::uint64_t sizes[2] = { world.objects.size(), world_bvh.tree.nodes.size() };
+        job.scene_hash = hash_bytes(&view, sizeof(view));
+        job.scene_hash = hash_bytes(estimator, sizeof(estimator), job.scene_hash);
+        job.scene_hash = hash_bytes(sizes, sizeof(sizes), job.scene_hash);
+        if (!world_bvh.tree.nodes.empty()) {
+            const auto& root = world_bvh.tree.nodes[0];
+            job.scene_hash = hash_bytes(root.bounds_min, sizeof(root.bounds_min), job.scene_hash);
+            job.scene_hash = hash_bytes(root.bounds_max, sizeof(root.bounds_max), job.scene_hash);
         }
     }
 
-    hittable_list objects;
-
-    objects.add(make_shared<bvh_node>(boxes1, 0, 1));
-
-    auto light = make_shared<diffuse_light>(color(7, 7, 7));
-    objects.add(make_shared<xz_rect>(123, 423, 147, 412, 554, light));
-
-    auto center1 = point3(400, 400, 200);
-    auto center2 = center1 + vec3(30, 0, 0);
-    auto moving_sphere_material = make_shared<lambertian>(color(0.7, 0.3, 0.1));
-    objects.add(make_shared<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
-
-    objects.add(make_shared<sphere>(point3(260, 150, 45), 50, make_shared<dielectric>(1.5)));
-    objects.add(make_shared<sphere>(
-        point3(0, 150, 145), 50, make_shared<metal>(color(0.8, 0.8, 0.9), 1.0)
-        ));
-
-    auto boundary = make_shared<sphere>(point3(360, 150, 145), 70, make_shared<dielectric>(1.5));
-    objects.add(boundary);
-    objects.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0, 0, 0), 5000, make_shared<dielectric>(1.5));
-    objects.add(make_shared<constant_medium>(boundary, .0001, color(1, 1, 1)));
-
-    auto emat = make_shared<lambertian>(make_shared<image_texture>("earthmap.jpg"));
-    objects.add(make_shared<sphere>(point3(400, 200, 400), 100, emat));
-    auto pertext = make_shared<noise_texture>(0.1);
-    objects.add(make_shared<sphere>(point3(220, 280, 300), 80, make_shared<lambertian>(pertext)));
-
-    hittable_list boxes2;
-    auto white = make_shared<lambertian>(color(.73, .73, .73));
-    int ns = 1000;
-    for (int j = 0; j < ns; j++) {
-        boxes2.add(make_shared<sphere>(point3::random(0, 165), 10, white));
+    if (opt.worker) {
+        auto render_unit = [&](const work_unit& u, framebuffer& pixels) {
+            auto unit_path = [&](int i, int j, int s) { return camera_path(u.x0 + i, u.y0 + j, s); };
+            const tile t = { 0, 0, 0, pixels.width, pixels.height };
+            if (opt.wavefront) {
+                thread_local wavefront_integrator integrator;
+                integrator.render_tile(pixels, t, u.first_sample, u.sample_count, world_bvh, settings, unit_path);
+                return;
+            }
+            render_tile_paths(pixels, t, u.first_sample, u.sample_count, world_bvh, settings, unit_path, opt.packets);
+        };
+
+        const auto worker_start = std::chrono::steady_clock::now();
+        const int units = run_render_worker(opt.worker, job, opt.threads, render_unit);
+        if (units < 0)
+            return 1;
+        const std::chrono::duration<double> worker_time = std::chrono::steady_clock::now() - worker_start;
+        std::cerr << "Done. Rendered " << units << " units in " << worker_time.count() << " s.\n";
+        return 0;
     }
 
-    objects.add(make_shared<translate>(
-        make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2, 0.0, 1.0), 15),
-        vec3(-100, 270, 395)
-        )
-    );
-
-    return objects;
-}
-
-int main() {
-
-    // Image
-
-    auto aspect_ratio = 16.0 / 9.0;
-    int image_width = 400;
-    int samples_per_pixel = 100;
-    const int max_depth = 50;
-
-    // World
+    const auto start = std::chrono::steady_clock::now();
+    const auto deadline = opt.time_budget > 0
+        ? start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(opt.time_budget))
+        : std::chrono::steady_clock::time_point::max();
+
+    if (opt.coordinator > 0) {
+        if (opt.target_error > 0 || opt.time_budget > 0 || opt.preview)
+            std::cerr << "Distributed render: --target-error, --time and --preview are ignored, every pixel gets " << samples_per_pixel << " samples.\n";
+        const int unit_samples = opt.unit_samples > 0 ? opt.unit_samples : std::max(1, samples_per_pixel / 8);
+        render_coordinator coordinator(fb, job, 32, unit_samples, opt.unit_timeout);
+        if (!coordinator.run(opt.coordinator))
+            return 1;
+    }
+    else if (opt.interactive) {
+        // Interactive preview: passes of 1, 2, 4... samples go to the shared image. Edits restart accumulation
+        // with the same BVHs and textures, material edits change the material in place.
+
+        shared_image image;
+        if (!image.open(opt.interactive, image_width, image_height)) {
+            std::cerr << "Cannot map '" << opt.interactive << "'.\n";
+            return 1;
+        }
+        std::cerr << "Interactive preview in '" << opt.interactive << "'.\n" << preview_command_help();
+
+        command_reader reader;
+        std::deque<preview_command> commands;
+        std::uint32_t restarts = 0;
+        int pass = 1;
+        bool quit = false;
+        auto restart_time = build_start;
+
+        auto material_at = [&](const preview_command& c) -> material* {
+            const int i = static_cast<int>(c.values[0]);
+            const int j = image_height - 1 - static_cast<int>(c.values[1]);
+            if (i < 0 || i >= image_width || j < 0 || j >= image_height) {
+                std::cerr << "\nPixel " << c.values[0] << ' ' << c.values[1] << " is outside the image.\n";
+                return nullptr;
+            }
+            sampler smp;
+            const ray r = cam.get_ray((i + 0.5) / (image_width - 1), (j + 0.5) / (image_height - 1), smp);
+            hit_record rec;
+            if (!hit_primitive(world_bvh, r, settings.t_min, infinity, rec, smp.generator())) {
+                std::cerr << "\nNo surface at pixel " << c.values[0] << ' ' << c.values[1] << ".\n";
+                return nullptr;
+            }
+            rec.finalize(r);
+            return const_cast<material*>(rec.mat_ptr); // materials belong to the scene, render threads are stopped
+        };
+
+        while (!quit) {
+            bool restart = false;
+            bool redisplay = false;
+            reader.take(commands);
+            for (const auto& c : commands) {
+                if (apply_view_command(view, c)) {
+                    restart = true;
+                    continue;
+                }
+                switch (c.type) {
+                case preview_command_type::depth:
+                    settings.max_depth = std::max(1, static_cast<int>(c.values[0]));
+                    restart = true;
+                    break;
+                case preview_command_type::lights:
+                    settings.lights = c.text != "off" && !lights.objects.empty() ? &lights : nullptr;
+                    restart = true;
+                    break;
+                case preview_command_type::spp:
+                    samples_per_pixel = std::max(1, static_cast<int>(c.values[0]));
+                    break;
+                case preview_command_type::exposure:
+                    display.exposure = c.values[0];
+                    redisplay = true;
+                    break;
+                case preview_command_type::tonemap:
+                    display.tonemap = c.text == "reinhard" ? tonemap_operator::reinhard : tonemap_operator::clamp;
+                    redisplay = true;
+                    break;
+                case preview_command_type::pick:
+                    if (material* m = material_at(c))
+                        std::cerr << "\nPixel " << c.values[0] << ' ' << c.values[1] << ": " << material_kind_names[static_cast<int>(m->kind)] << " material.\n";
+                    break;
+                case preview_command_type::quit:
+                    quit = true;
+                    break;
+                default:
+                    if (material* m = material_at(c)) {
+                        if (edit_material(*m, c))
+                            restart = true;
+                        else
+                            std::cerr << "\nThe " << material_kind_names[static_cast<int>(m->kind)] << " material has no such parameter.\n";
+                    }
+                    break;
+                }
+            }
+            commands.clear();
+            if (quit)
+                break;
+
+            if (restart) {
+                cam = camera(scene_vector(view.lookfrom), scene_vector(view.lookat), scene_vector(view.vup), view.vfov, view.aspect_ratio,
+                    view.aperture, view.dist_to_focus, view.time0, view.time1);
+                settings.background = scene_vector(view.background);
+                settings.pixel_spread = 2 * tan(degrees_to_radians(view.vfov) / 2) / image_height;
+                fb.clear();
+                first_sample = 0;
+                pass = 1;
+                ++restarts;
+                restart_time = std::chrono::steady_clock::now();
+            }
 
-    hittable_list world;
+            if (first_sample >= samples_per_pixel) {
+                if (redisplay || restart)
+                    image.update(fb, display, restarts, first_sample);
+                if (reader.closed())
+                    break;
+                reader.wait();
+                continue;
+            }
 
-    point3 lookfrom;
-    point3 lookat;
-    auto vfov = 40.0;
-    auto aperture = 0.0;
-    color background(0, 0, 0);
-
-
-    switch (2) {
-    case 1:
-        world = random_scene();
-        background = color(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        aperture = 0.1;
-        break;
-
-    case 2:
-        world = two_spheres();
-        background = color(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        break;
-    case 3:
-        world = two_perlin_spheres();
-        background = color(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        break;
-    case 4:
-        world = earth();
-        background = color(0.70, 0.80, 1.00);
-        lookfrom = point3(13, 2, 3);
-        lookat = point3(0, 0, 0);
-        vfov = 20.0;
-        break;
-    case 5:
-        world = simple_light();
-        samples_per_pixel = 400;
-        background = color(0, 0, 0);
-        lookfrom = point3(26, 3, 6);
-        lookat = point3(0, 2, 0);
-        vfov = 20.0;
-        break;
-    case 7:
-        world = cornell_smoke();
-        aspect_ratio = 1.0;
-        image_width = 600;
-        samples_per_pixel = 200;
-        lookfrom = point3(278, 278, -800);
-        lookat = point3(278, 278, 0);
-        vfov = 40.0;
-        break;
-    default:
-    case 8:
-        world = presentation();
-        aspect_ratio = 1.0;
-        image_width = 800;
-        samples_per_pixel = 10000;
-        background = color(0, 0, 0);
-        lookfrom = point3(478, 278, -600);
-        lookat = point3(278, 278, 0);
-        vfov = 40.0;
-        break;
+            // Sample 0 is rendered in two passes, block corners first (see preview_block_size)
+            const bool coarse = pass == 1 && first_sample == 0;
+            if (coarse)
+                select_preview_pixels(fb, true);
+            sample_count = std::min(pass, samples_per_pixel - first_sample);
+            render_tiles(fb, tile_size, opt.threads, render_tile, deadline, &reader.pending());
+            if (reader.pending())
+                continue; // cancelled, the command restarts accumulation anyway
+            if (coarse) {
+                image.update(fb, display, restarts, 0);
+                const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - restart_time;
+                std::cerr << "\rFirst frame " << (restarts == 0 ? "after start: " : "after edit: ") << elapsed.count() << " ms\n";
+
+                select_preview_pixels(fb, false);
+                render_tiles(fb, tile_size, opt.threads, render_tile, deadline, &reader.pending());
+                std::fill(fb.converged.begin(), fb.converged.end(), 0);
+                if (reader.pending())
+                    continue;
+            }
+            first_sample += sample_count;
+            pass = std::min(2 * pass, opt.pass_samples);
+            image.update(fb, display, restarts, first_sample);
+            std::cerr << "\rPreview: " << first_sample << " spp, restart " << restarts << ' ' << std::flush;
+        }
     }
+    else {
+        size_t active_pixels = fb.pixels.size();
+        while (active_pixels > 0 && std::chrono::steady_clock::now() < deadline) {
+            sample_count = std::min(pass_samples, samples_per_pixel - first_sample);
+            render_tiles(fb, tile_size, opt.threads, render_tile, deadline);
+            first_sample += sample_count;
+
+            active_pixels = fb.update_convergence(opt.target_error, pass_samples, samples_per_pixel);
+
+            if (progressive) {
+                const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                std::cerr << "\rPass done: " << first_sample << " spp, " << active_pixels << " pixels active, "
+                    << elapsed.count() << " s\n";
+            }
 
-    // Camera
-
-    vec3 vup(0, 1, 0);
-    auto dist_to_focus = 10.0;
-    const int image_height = static_cast<int>(image_width / aspect_ratio);
+            if (opt.preview)
+                write_image(opt.preview, fb, opt.format, opt.display);
+        }
+    }
 
-    camera cam(lookfrom, lookat, vup, vfov, aspect_ratio, aperture, dist_to_focus, 0.0, 1.0);
+    // Denoise stage on the finished image, AOVs are written before it
 
-    // Render
+    if (opt.aov) {
+        if (!fb.has_aovs() || !write_aovs(opt.aov, fb, opt.format))
+            std::cerr << "\nCannot write the AOVs to '" << opt.aov << "'.\n";
+    }
+    if (opt.denoise) {
+        RT_TIMER("denoise");
+        const auto filter = make_denoiser(opt.denoise);
+        const auto denoise_start = std::chrono::steady_clock::now();
+        std::vector<color> denoised;
+        if (filter->denoise(fb, denoised, opt.threads)) {
+            apply_denoised(fb, denoised);
+            std::cerr << "\n" << filter->name() << " denoised in "
+                << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - denoise_start).count() << " ms.";
+        }
+        else {
+            std::cerr << "\n" << filter->name() << " failed, the image is not denoised.";
+        }
+    }
 
-    std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
-
-    for (int j = image_height - 1; j >= 0; --j) {
-        std::cerr << "\rScanlines remaining: " << j << ' ' << std::flush << std::endl;
-        for (int i = 0; i < image_width; ++i) {
-            color pixel_color(0, 0, 0);
-            for (int s = 0; s < samples_per_pixel; ++s) {
-                auto u = (i + random_double()) / (image_width - 1);
-                auto v = (j + random_double()) / (image_height - 1);
-                ray r = cam.get_ray(u, v);
-                pixel_color += ray_color(r, background, world, max_depth);
+    {
+        RT_TIMER("output");
+        if (opt.output) {
+            if (!write_image(opt.output, fb, opt.format, display)) {
+                std::cerr << "\nCannot write '" << opt.output << "'.\n";
+                return 1;
             }
-            write_color(std::cout, pixel_color, samples_per_pixel);
-
         }
+        else {
+            set_binary_stdout();
+            write_image(std::cout, fb, opt.format, display);
+        }
+    }
+
+    const std::chrono::duration<double> render_time = std::chrono::steady_clock::now() - start;
+    std::cerr << "\nDone. Rendered in " << render_time.count() << " s.\n";
+    if (shared_texture_cache().image_count() > 0)
+        shared_texture_cache().report(std::cerr);
+#if RT_ENABLE_STATS
+    flush_thread_stats();
+    report_stats(std::cerr, material_kind_names, sizeof(material_kind_names) / sizeof(material_kind_names[0]));
+    if (opt.trace) {
+        if (write_trace(opt.trace))
+            std::cerr << "Trace written to '" << opt.trace << "'.\n";
+        else
+            std::cerr << "Cannot write '" << opt.trace << "'.\n";
     }
-    std::cerr << "\nDone.\n";
+#else
+    if (opt.trace)
+        std::cerr << "No trace written, build with RT_ENABLE_STATS=1 to record one.\n";
+#endif
 }
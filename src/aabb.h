@@ -35,25 +35,26 @@ public:
     point3 max() const { return maximum; }
 
     /**
-    \brief Andrew Kensler optimized AABB hit method
+    \brief Branchless slab test with the inverse direction and signs cached in the ray.
+
+    Sign picks which plane of the slab the ray enters first, so there is no division and no swap. Ternary min/max compile to minsd/maxsd,
+    and a NaN from 0 * infinity (ray lies in the slab plane) just keeps the old interval.
 
     \param r input ray for bounding boxes
     \param t_min minimum time
     \param t_max maximum time
     */
     bool hit(const ray& r, double t_min, double t_max) const {
+        const point3* bounds[2] = { &minimum, &maximum };
+        const vec3& inv = r.inverse_direction();
+
         for (int a = 0; a < 3; a++) {
-            auto invD = 1.0f / r.direction()[a];
-            auto t0 = (min()[a] - r.origin()[a]) * invD;
-            auto t1 = (max()[a] - r.origin()[a]) * invD;
-            if (invD < 0.0f)
-                std::swap(t0, t1);
+            auto t0 = ((*bounds[r.sign[a]])[a] - r.orig[a]) * inv[a];
+            auto t1 = ((*bounds[1 - r.sign[a]])[a] - r.orig[a]) * inv[a];
             t_min = t0 > t_min ? t0 : t_min;
             t_max = t1 < t_max ? t1 : t_max;
-            if (t_max <= t_min)
-                return false;
         }
-        return true;
+        return t_min < t_max;
     }
 
     point3 minimum;
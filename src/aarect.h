@@ -9,6 +9,7 @@
 #include "utility.h"
 
 #include "hittable.h"
+#include "material.h"
 
 /**
 \brief Rectangle class.
@@ -17,15 +18,23 @@ To determine whether a ray hits such a rectangle, we first determine where the r
 Rearranging those terms we can solve for what the t is where z=k: t = (k−A_z)/b_z.
 Once we have t, we can plug that into the equations for x and y: x=A_x+tb_x and y=A_y+tb_y. It is a hit if x_0<x<x_1 and y_0<y<y_1. 
 */
-class xy_rect : public hittable {
+class xy_rect final : public hittable {
 public:
-    xy_rect() {}
+    xy_rect() : hittable(hittable_kind::xy_rect) {}
 
     xy_rect(double _x0, double _x1, double _y0, double _y1, double _k,
         shared_ptr<material> mat)
-        : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
+        : hittable(hittable_kind::xy_rect), x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+
+    virtual bool emits_light() const override { return mp->is_emissive(); }
+
+    virtual double pdf_value(const point3& o, const vec3& v, rng& gen) const override;
+
+    virtual vec3 random(const point3& o, sampler& smp) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -42,7 +51,7 @@ public:
 /**
 \brief Rectangle (x,y) hit function. (look at class desc.)
 */
-bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
     auto t = (k - r.origin().z()) / r.direction().z();
     if (t < t_min || t > t_max)
         return false;
@@ -50,28 +59,42 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto y = r.origin().y() + t * r.direction().y();
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
-    rec.t = t;
+    rec.defer(t, this);
+    return true;
+}
+
+/**
+\brief Rectangle (x,y) surface details of the closest hit.
+*/
+void xy_rect::finalize(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.y() - y0) / (y1 - y0);
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 /**
 \brief Rectangle class in (x,z) coordinates.
 */
-class xz_rect : public hittable {
+class xz_rect final : public hittable {
 public:
-    xz_rect() {}
+    xz_rect() : hittable(hittable_kind::xz_rect) {}
 
     xz_rect(double _x0, double _x1, double _z0, double _z1, double _k,
         shared_ptr<material> mat)
-        : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+        : hittable(hittable_kind::xz_rect), x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual void finalize(const ray& r, hit_record& rec) const override;
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool emits_light() const override { return mp->is_emissive(); }
+
+    virtual double pdf_value(const point3& o, const vec3& v, rng& gen) const override;
+
+    virtual vec3 random(const point3& o, sampler& smp) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -88,15 +111,23 @@ public:
 /**
 \brief Rectangle class in (y,z) coordinates.
 */
-class yz_rect : public hittable {
+class yz_rect final : public hittable {
 public:
-    yz_rect() {}
+    yz_rect() : hittable(hittable_kind::yz_rect) {}
 
     yz_rect(double _y0, double _y1, double _z0, double _z1, double _k,
         shared_ptr<material> mat)
-        : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+        : hittable(hittable_kind::yz_rect), y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual void finalize(const ray& r, hit_record& rec) const override;
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool emits_light() const override { return mp->is_emissive(); }
+
+    virtual double pdf_value(const point3& o, const vec3& v, rng& gen) const override;
+
+    virtual vec3 random(const point3& o, sampler& smp) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the X
@@ -113,7 +144,7 @@ public:
 /**
 \brief Rectangle (x,z) hit function. (look at class desc.)
 */
-bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
     auto t = (k - r.origin().y()) / r.direction().y();
     if (t < t_min || t > t_max)
         return false;
@@ -121,20 +152,26 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    rec.defer(t, this);
+    return true;
+}
+
+/**
+\brief Rectangle (x,z) surface details of the closest hit.
+*/
+void xz_rect::finalize(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 /**
 \brief Rectangle (y,z) hit function. (look at class desc.)
 */
-bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
     auto t = (k - r.origin().x()) / r.direction().x();
     if (t < t_min || t > t_max)
         return false;
@@ -142,14 +179,95 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y - y0) / (y1 - y0);
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    rec.defer(t, this);
+    return true;
+}
+
+/**
+\brief Rectangle (y,z) surface details of the closest hit.
+*/
+void yz_rect::finalize(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.y() - y0) / (y1 - y0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
+}
+
+/**
+\brief Rectangle (x,y) density of directions from o. See xz_rect::pdf_value.
+*/
+double xy_rect::pdf_value(const point3& o, const vec3& v, rng& gen) const {
+    hit_record rec;
+    if (!xy_rect::hit(ray(o, v), 0.001, infinity, rec, gen))
+        return 0;
+
+    auto area = (x1 - x0) * (y1 - y0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(v.z()) / v.length();
+
+    return distance_squared / (cosine * area);
+}
+
+/**
+\brief Direction from o to a uniformly chosen point of the rectangle (x,y).
+*/
+vec3 xy_rect::random(const point3& o, sampler& smp) const {
+    const auto s = smp.get_2d();
+    auto random_point = point3(x0 + s.u * (x1 - x0), y0 + s.v * (y1 - y0), k);
+    return random_point - o;
+}
+
+/**
+\brief Rectangle (x,z) density of directions from o.
+
+Point is chosen uniformly on the area A, so density per area is 1/A. Small patch dA seen from distance d at angle theta covers
+solid angle dA*cos(theta)/d^2, so density per solid angle is d^2/(cos(theta)*A).
+*/
+double xz_rect::pdf_value(const point3& o, const vec3& v, rng& gen) const {
+    hit_record rec;
+    if (!xz_rect::hit(ray(o, v), 0.001, infinity, rec, gen))
+        return 0;
+
+    auto area = (x1 - x0) * (z1 - z0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(v.y()) / v.length();
+
+    return distance_squared / (cosine * area);
+}
+
+/**
+\brief Direction from o to a uniformly chosen point of the rectangle (x,z).
+*/
+vec3 xz_rect::random(const point3& o, sampler& smp) const {
+    const auto s = smp.get_2d();
+    auto random_point = point3(x0 + s.u * (x1 - x0), k, z0 + s.v * (z1 - z0));
+    return random_point - o;
+}
+
+/**
+\brief Rectangle (y,z) density of directions from o. See xz_rect::pdf_value.
+*/
+double yz_rect::pdf_value(const point3& o, const vec3& v, rng& gen) const {
+    hit_record rec;
+    if (!yz_rect::hit(ray(o, v), 0.001, infinity, rec, gen))
+        return 0;
+
+    auto area = (y1 - y0) * (z1 - z0);
+    auto distance_squared = rec.t * rec.t * v.length_squared();
+    auto cosine = fabs(v.x()) / v.length();
+
+    return distance_squared / (cosine * area);
+}
+
+/**
+\brief Direction from o to a uniformly chosen point of the rectangle (y,z).
+*/
+vec3 yz_rect::random(const point3& o, sampler& smp) const {
+    const auto s = smp.get_2d();
+    auto random_point = point3(k, y0 + s.u * (y1 - y0), z0 + s.v * (z1 - z0));
+    return random_point - o;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,135 @@
+/**
+\file
+\brief .h file that contains scene arena: typed pools that own all objects of a scene
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "utility.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+\brief Base of the pools, so the arena can keep pools of different types in one vector.
+*/
+class pool_base {
+public:
+    virtual ~pool_base() {}
+};
+
+/**
+\brief Contiguous storage for objects of one type. Objects are created in chunks and never move.
+*/
+template <typename T>
+class typed_pool : public pool_base {
+public:
+    static const size_t chunk_size = 256; // objects per chunk
+
+    ~typed_pool() override {
+        if (std::is_trivially_destructible<T>::value)
+            return;
+        for (size_t k = count; k-- > 0;)
+            slot(k)->~T();
+    }
+
+    /**
+    \brief Constructs a new object in the pool.
+    */
+    template <typename... Args>
+    T* create(Args&&... args) {
+        if (count == chunks.size() * chunk_size)
+            chunks.emplace_back(new storage[chunk_size]);
+
+        T* object = new (slot(count)) T(std::forward<Args>(args)...);
+        ++count;
+        return object;
+    }
+
+    size_t size() const { return count; }
+
+private:
+    struct alignas(T) storage {
+        unsigned char bytes[sizeof(T)];
+    };
+
+    T* slot(size_t k) {
+        return reinterpret_cast<T*>(chunks[k / chunk_size][k % chunk_size].bytes);
+    }
+
+    std::vector<std::unique_ptr<storage[]>> chunks;
+    size_t count = 0;
+};
+
+/**
+\brief Arena that owns all primitives, materials and textures of a scene in one pool per type.
+
+A scene of a million spheres makes a few thousand chunk allocations instead of a million make_shared calls, and it is freed chunk by chunk.
+make() returns non-owning shared_ptr (aliasing constructor with an empty owner), so scene code and the classes that take shared_ptr
+keep working, but no object gets a control block and copying these pointers never touches a reference count.
+The arena must outlive everything that points into it: declare it before the scene.
+*/
+class scene_arena {
+public:
+    scene_arena() {}
+    scene_arena(const scene_arena&) = delete;
+    scene_arena& operator=(const scene_arena&) = delete;
+
+    /**
+    \brief Creates an object owned by the arena and returns raw pointer to it.
+    */
+    template <typename T, typename... Args>
+    T* create(Args&&... args) {
+        return pool<T>().create(std::forward<Args>(args)...);
+    }
+
+    /**
+    \brief Creates an object owned by the arena and returns non-owning shared_ptr to it.
+    */
+    template <typename T, typename... Args>
+    shared_ptr<T> make(Args&&... args) {
+        return shared_ptr<T>(shared_ptr<void>(), create<T>(std::forward<Args>(args)...));
+    }
+
+    /**
+    \brief Number of objects of type T in the arena.
+    */
+    template <typename T>
+    size_t count() {
+        return pool<T>().size();
+    }
+
+private:
+    /**
+    \brief Pool of type T. Type ids are handed out on first use, so pools is indexed directly.
+    */
+    template <typename T>
+    typed_pool<T>& pool() {
+        const size_t id = type_id<T>();
+        if (id >= pools.size())
+            pools.resize(id + 1);
+        if (!pools[id])
+            pools[id].reset(new typed_pool<T>());
+        return *static_cast<typed_pool<T>*>(pools[id].get());
+    }
+
+    static size_t next_type_id() {
+        static size_t next = 0;
+        return next++;
+    }
+
+    template <typename T>
+    static size_t type_id() {
+        static const size_t id = next_type_id();
+        return id;
+    }
+
+    std::vector<std::unique_ptr<pool_base>> pools; // pool of every type, by type id
+};
+
+#endif
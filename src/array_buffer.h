@@ -0,0 +1,111 @@
+/**
+\file
+\brief .h file that contains array that owns its elements or points into memory owned by someone else
+*/
+
+#ifndef ARRAY_BUFFER_H
+#define ARRAY_BUFFER_H
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/**
+\brief Array of a primitive batch, mesh or tree: a std::vector, or a read only view of memory it does not own (a memory mapped scene file, see scene_file.h).
+
+Build code uses it like a vector. Reads go through one pointer, so they cost the same in both modes. Anything that modifies a view
+first copies it into its own storage. Owner of the viewed memory must outlive the buffer.
+*/
+template <typename T>
+class array_buffer {
+public:
+    array_buffer() {}
+    array_buffer(const array_buffer& other) { *this = other; }
+    array_buffer(array_buffer&& other) noexcept { *this = std::move(other); }
+
+    array_buffer& operator=(const array_buffer& other) {
+        if (this == &other)
+            return *this;
+        storage = other.storage;
+        if (other.is_view()) {
+            first = other.first;
+            count = other.count;
+        }
+        else {
+            sync();
+        }
+        return *this;
+    }
+
+    array_buffer& operator=(array_buffer&& other) noexcept {
+        const bool view = other.is_view();
+        storage = std::move(other.storage);
+        if (view) {
+            first = other.first;
+            count = other.count;
+        }
+        else {
+            sync();
+        }
+        other.storage.clear();
+        other.sync();
+        return *this;
+    }
+
+    /**
+    \brief Buffer that reads count elements at data without copying them.
+    */
+    static array_buffer view(const T* data, size_t count) {
+        array_buffer b;
+        b.first = const_cast<T*>(data);
+        b.count = count;
+        return b;
+    }
+
+    bool is_view() const { return first != storage.data() && count > 0; }
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    size_t capacity() const { return storage.capacity(); } // owned elements, 0 for a view
+
+    const T* data() const { return first; }
+    const T& operator[](size_t i) const { return first[i]; }
+    const T* begin() const { return first; }
+    const T* end() const { return first + count; }
+
+    T* data() { own(); return first; }
+    T& operator[](size_t i) { own(); return first[i]; }
+    T* begin() { own(); return first; }
+    T* end() { own(); return first + count; }
+
+    void push_back(const T& value) { own(); storage.push_back(value); sync(); }
+    void reserve(size_t n) { own(); storage.reserve(n); sync(); }
+    void resize(size_t n) { own(); storage.resize(n); sync(); }
+    void resize(size_t n, const T& value) { own(); storage.resize(n, value); sync(); }
+    void clear() { storage.clear(); sync(); }
+    void shrink_to_fit() { own(); storage.shrink_to_fit(); sync(); }
+
+    /**
+    \brief Exchanges the elements with a vector, e.g. one that was sorted into a new order.
+    */
+    void swap(std::vector<T>& other) { own(); storage.swap(other); sync(); }
+
+private:
+    void sync() {
+        first = storage.data();
+        count = storage.size();
+    }
+
+    void own() {
+        if (is_view()) {
+            storage.assign(first, first + count);
+            sync();
+        }
+    }
+
+    std::vector<T> storage;
+    T* first = nullptr; // elements, storage.data() unless the buffer is a view
+    size_t count = 0;
+};
+
+#endif
@@ -0,0 +1,382 @@
+/**
+\file
+\brief .cpp file of the benchmark: renders the built-in scenes with fixed settings and reports rays per second, stage timings and BVH work per ray
+*/
+
+// Counters of stats.h are compiled in for this program only.
+#define RT_ENABLE_STATS 1
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "utility.h"
+
+#include "hittable_list.h"
+#include "camera.h"
+#include "bvh.h"
+#include "instance.h"
+#include "dispatch.h"
+#include "arena.h"
+#include "renderer.h"
+#include "integrator.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "stats.h"
+
+/**
+\brief Benchmark options. Defaults are small enough to run all scenes in a few minutes on one core.
+*/
+struct bench_options {
+    int threads = static_cast<int>(std::thread::hardware_concurrency()); // number of render threads
+    unsigned int seed = 0; // image seed
+    sampler_kind sampler = sampler_kind::sobol; // pattern of the sample values
+    int width = 200; // image width of every scene, height follows the aspect ratio of the scene
+    int samples = 16; // samples per pixel of every scene
+    std::vector<int> scenes = { 1, 2, 3, 4, 5, 6, 7, 8 }; // built-in scene numbers
+    const char* mesh = nullptr; // OBJ or PLY file of scene 10, nullptr for the torus
+    bool micro = true; // run the micro benchmarks
+};
+
+/**
+\brief Reads command line options: --threads N, --seed S, --sampler independent|stratified|sobol|bluenoise, --width W, --spp N, --scenes 1,2,9, --mesh FILE and --no-micro.
+*/
+bench_options parse_bench_options(int argc, char* argv[]) {
+    bench_options opt;
+    if (opt.threads < 1)
+        opt.threads = 1;
+
+    for (int a = 1; a < argc; ++a) {
+        if (std::strcmp(argv[a], "--threads") == 0 && a + 1 < argc) {
+            opt.threads = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            opt.seed = static_cast<unsigned int>(std::strtoul(argv[++a], nullptr, 10));
+        }
+        else if (std::strcmp(argv[a], "--sampler") == 0 && a + 1 < argc) {
+            const char* name = argv[++a];
+            if (std::strcmp(name, "independent") == 0) opt.sampler = sampler_kind::independent;
+            else if (std::strcmp(name, "stratified") == 0) opt.sampler = sampler_kind::stratified;
+            else if (std::strcmp(name, "sobol") == 0) opt.sampler = sampler_kind::sobol;
+            else if (std::strcmp(name, "bluenoise") == 0) opt.sampler = sampler_kind::blue_noise;
+            else {
+                std::cerr << "Unknown sampler '" << name << "', use independent, stratified, sobol or bluenoise.\n";
+                std::exit(1);
+            }
+        }
+        else if (std::strcmp(argv[a], "--width") == 0 && a + 1 < argc) {
+            opt.width = std::max(2, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--spp") == 0 && a + 1 < argc) {
+            opt.samples = std::max(1, std::atoi(argv[++a]));
+        }
+        else if (std::strcmp(argv[a], "--scenes") == 0 && a + 1 < argc) {
+            opt.scenes.clear();
+            for (const char* s = argv[++a]; *s; ) {
+                char* end;
+                const long number = std::strtol(s, &end, 10);
+                if (end == s)
+                    break;
+                opt.scenes.push_back(static_cast<int>(number));
+                s = *end == ',' ? end + 1 : end;
+            }
+        }
+        else if (std::strcmp(argv[a], "--mesh") == 0 && a + 1 < argc) {
+            opt.mesh = argv[++a];
+        }
+        else if (std::strcmp(argv[a], "--no-micro") == 0) {
+            opt.micro = false;
+        }
+        else {
+            std::cerr << "Unknown option '" << argv[a] << "'.\n"
+                << "Usage: " << argv[0] << " [--threads N] [--seed S] [--sampler independent|stratified|sobol|bluenoise] [--width W] [--spp N] [--scenes 1,2,9] [--mesh FILE] [--no-micro] > bench.json\n";
+            std::exit(1);
+        }
+    }
+
+    return opt;
+}
+
+/**
+\brief Measurements of one scene.
+
+Primary rays are timed in a pass of their own that only intersects camera rays. Full render time includes the same primary rays again,
+so secondary rays per second are the bounce and shadow rays over the render time minus the primary pass: an estimate that also counts shading.
+*/
+struct scene_result {
+    int number = 0; // built-in scene number
+    int width = 0; // image size
+    int height = 0;
+    int samples = 0; // samples per pixel
+    double scene_ms = 0; // objects and their own BVHs
+    double top_level_ms = 0; // top level BVH over the objects
+    double primary_s = 0; // camera rays only
+    double render_s = 0; // full paths
+    ray_stats primary; // counters of the primary pass
+    ray_stats render; // counters of the full render
+
+    double primary_rays_per_second() const { return primary_s > 0 ? primary.primary_rays / primary_s : 0; }
+
+    double secondary_rays_per_second() const {
+        const double t = render_s - primary_s;
+        return t > 0 ? (render.secondary_rays + render.shadow_rays) / t : 0;
+    }
+
+    double rays_per_second() const { return render_s > 0 ? render.rays() / render_s : 0; }
+    double nodes_per_ray() const { return render.rays() > 0 ? static_cast<double>(render.nodes_visited) / render.rays() : 0; }
+    double primitives_per_ray() const { return render.rays() > 0 ? static_cast<double>(render.primitives_tested) / render.rays() : 0; }
+};
+
+/**
+\brief Seconds since start.
+*/
+inline double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+/**
+\brief Builds, renders and measures one built-in scene. The image is thrown away.
+*/
+scene_result bench_scene(int number, const bench_options& opt) {
+    scene_result result;
+    result.number = number;
+
+    const auto build_start = std::chrono::steady_clock::now();
+    scene_arena arena;
+    scene_view view;
+    hittable_list world = builtin_scene(number, arena, view, opt.mesh, opt.threads);
+    for (auto& object : world.objects)
+        object = flatten_transforms(object);
+    const auto fog = take_global_fog(world);
+    result.scene_ms = seconds_since(build_start) * 1000;
+
+    const auto top_level_start = std::chrono::steady_clock::now();
+    const bvh_node world_bvh(world, 0.0, 1.0);
+    result.top_level_ms = seconds_since(top_level_start) * 1000;
+
+    hittable_list lights;
+    for (const auto& object : world.objects)
+        if (object->emits_light())
+            lights.add(object);
+
+    result.width = opt.width;
+    result.height = std::max(1, static_cast<int>(opt.width / view.aspect_ratio));
+    result.samples = opt.samples;
+    const int image_width = result.width;
+    const int image_height = result.height;
+
+    camera cam(scene_vector(view.lookfrom), scene_vector(view.lookat), scene_vector(view.vup), view.vfov, view.aspect_ratio,
+        view.aperture, view.dist_to_focus, view.time0, view.time1);
+
+    integrator_settings settings;
+    settings.background = scene_vector(view.background);
+    settings.max_depth = 50;
+    settings.pixel_spread = 2 * tan(degrees_to_radians(view.vfov) / 2) / image_height;
+    settings.fog = fog.get();
+    if (!lights.objects.empty())
+        settings.lights = &lights;
+
+    sampler_settings sampling;
+    sampling.kind = opt.sampler;
+    sampling.seed = opt.seed;
+    sampling.image_width = image_width;
+    sampling.image_height = image_height;
+    sampling.samples_per_pixel = opt.samples;
+
+    auto camera_path = [&](int i, int j, int s) {
+        sampler smp(sampling, i, j, s);
+        const auto jitter = smp.get_2d();
+        auto u = (i + jitter.u) / (image_width - 1);
+        auto v = (j + jitter.v) / (image_height - 1);
+        const ray r = cam.get_ray(u, v, smp);
+        return path_state(r, smp);
+    };
+
+    framebuffer fb(image_width, image_height);
+    const int tile_size = 16;
+    const auto no_deadline = std::chrono::steady_clock::time_point::max();
+
+    // Primary pass: closest hit of every camera ray, nothing else
+
+    reset_stats();
+    const auto primary_start = std::chrono::steady_clock::now();
+    render_tiles(fb, tile_size, opt.threads, [&](const tile& t) {
+        for (int j = t.y0; j < t.y1; ++j) {
+            for (int i = t.x0; i < t.x1; ++i) {
+                for (int s = 0; s < opt.samples; ++s) {
+                    path_state path = camera_path(i, j, s);
+                    hit_record rec;
+                    count_path_ray(path);
+                    hit_primitive(world_bvh, path.r, settings.t_min, infinity, rec, path.smp.generator());
+                }
+            }
+        }
+    }, no_deadline);
+    result.primary_s = seconds_since(primary_start);
+    result.primary = collect_stats();
+
+    // Full render with the default integrator
+
+    reset_stats();
+    const auto render_start = std::chrono::steady_clock::now();
+    render_tiles(fb, tile_size, opt.threads, [&](const tile& t) {
+        render_tile_paths(fb, t, 0, opt.samples, world_bvh, settings, camera_path, true);
+    }, no_deadline);
+    result.render_s = seconds_since(render_start);
+    result.render = collect_stats();
+
+    return result;
+}
+
+/**
+\brief Average nanoseconds per call of f over enough iterations to run for about 0.2 s.
+*/
+template <typename function>
+double nanoseconds_per_call(const function& f) {
+    std::uint64_t iterations = 1024;
+    while (true) {
+        const auto start = std::chrono::steady_clock::now();
+        for (std::uint64_t k = 0; k < iterations; ++k)
+            f(k);
+        const double elapsed = seconds_since(start);
+        if (elapsed > 0.2 || iterations >= (std::uint64_t(1) << 34))
+            return elapsed * 1e9 / iterations;
+        iterations *= 4;
+    }
+}
+
+/**
+\brief Result of one micro benchmark.
+*/
+struct micro_result {
+    const char* name;
+    double ns_per_call;
+};
+
+/**
+\brief Times the innermost functions of the renderer on fixed inputs. Results go into sink so the calls are not optimized away.
+*/
+std::vector<micro_result> micro_benchmarks() {
+    std::vector<micro_result> results;
+    rng gen;
+    volatile double sink = 0;
+
+    // Rays from a ring around the origin towards random points near it, half of them miss the unit box and sphere
+
+    const int ray_count = 1024;
+    std::vector<ray> rays;
+    for (int k = 0; k < ray_count; ++k) {
+        const vec3 origin = 5 * random_unit_vector(gen);
+        const vec3 target = vec3(random_double(gen, -2, 2), random_double(gen, -2, 2), random_double(gen, -2, 2));
+        rays.push_back(ray(origin, target - origin));
+    }
+
+    const aabb box(point3(-1, -1, -1), point3(1, 1, 1));
+    results.push_back({ "aabb::hit", nanoseconds_per_call([&](std::uint64_t k) {
+        sink = sink + box.hit(rays[k % ray_count], 0.001, infinity);
+    }) });
+
+    const sphere ball(point3(0, 0, 0), 1.0);
+    results.push_back({ "sphere::hit", nanoseconds_per_call([&](std::uint64_t k) {
+        hit_record rec;
+        sink = sink + ball.hit(rays[k % ray_count], 0.001, infinity, rec, gen);
+    }) });
+
+    const perlin noise;
+    results.push_back({ "perlin::turb", nanoseconds_per_call([&](std::uint64_t k) {
+        sink = sink + noise.turb(rays[k % ray_count].origin() + 0.001 * static_cast<double>(k & 1023) * vec3(1, 1, 1));
+    }) });
+
+    results.push_back({ "random_double", nanoseconds_per_call([&](std::uint64_t) {
+        sink = sink + random_double(gen);
+    }) });
+
+    // One camera sample: constructing the sampler and the pixel jitter, as camera_path does
+
+    static const char* const sampler_names[] = { "sampler independent", "sampler stratified", "sampler sobol", "sampler bluenoise" };
+    for (int kind = 0; kind < 4; ++kind) {
+        sampler_settings sampling;
+        sampling.kind = static_cast<sampler_kind>(kind);
+        sampling.image_width = 512;
+        sampling.image_height = 512;
+        sampling.samples_per_pixel = 16;
+        results.push_back({ sampler_names[kind], nanoseconds_per_call([&](std::uint64_t k) {
+            sampler smp(sampling, static_cast<int>(k & 511), static_cast<int>((k >> 9) & 511), static_cast<int>((k >> 18) & 15));
+            const auto s = smp.get_2d();
+            sink = sink + s.u + s.v;
+        }) });
+    }
+
+    return results;
+}
+
+int main(int argc, char* argv[]) {
+
+    const bench_options opt = parse_bench_options(argc, argv);
+    bvh_build_defaults().threads = opt.threads;
+
+    std::vector<scene_result> results;
+    for (const int number : opt.scenes) {
+        std::cerr << "Scene " << number << ":\n";
+        results.push_back(bench_scene(number, opt));
+        std::cerr << "\n";
+    }
+
+    const std::vector<micro_result> micro = opt.micro ? micro_benchmarks() : std::vector<micro_result>();
+
+    // Table for people to stderr
+
+    std::cerr << std::fixed << std::setprecision(2)
+        << "scene   build ms  top ms  primary Mray/s  secondary Mray/s  total Mray/s  nodes/ray  prims/ray\n";
+    for (const auto& r : results) {
+        std::cerr << std::setw(5) << r.number
+            << std::setw(11) << r.scene_ms
+            << std::setw(8) << r.top_level_ms
+            << std::setw(16) << r.primary_rays_per_second() / 1e6
+            << std::setw(18) << r.secondary_rays_per_second() / 1e6
+            << std::setw(14) << r.rays_per_second() / 1e6
+            << std::setw(11) << r.nodes_per_ray()
+            << std::setw(11) << r.primitives_per_ray() << "\n";
+    }
+    for (const auto& m : micro)
+        std::cerr << m.name << ": " << m.ns_per_call << " ns\n";
+
+    // JSON for scripts to stdout
+
+    std::cout << std::setprecision(6) << "{\n"
+        << "  \"threads\": " << opt.threads << ",\n"
+        << "  \"seed\": " << opt.seed << ",\n"
+        << "  \"sampler\": \"" << sampler_kind_names[static_cast<int>(opt.sampler)] << "\",\n"
+        << "  \"width\": " << opt.width << ",\n"
+        << "  \"samples_per_pixel\": " << opt.samples << ",\n"
+        << "  \"scenes\": [";
+    for (size_t k = 0; k < results.size(); ++k) {
+        const auto& r = results[k];
+        std::cout << (k ? "," : "") << "\n    {"
+            << "\"scene\": " << r.number
+            << ", \"width\": " << r.width
+            << ", \"height\": " << r.height
+            << ", \"scene_build_ms\": " << r.scene_ms
+            << ", \"top_level_bvh_ms\": " << r.top_level_ms
+            << ", \"primary_pass_s\": " << r.primary_s
+            << ", \"render_s\": " << r.render_s
+            << ", \"primary_rays\": " << r.render.primary_rays
+            << ", \"secondary_rays\": " << r.render.secondary_rays
+            << ", \"shadow_rays\": " << r.render.shadow_rays
+            << ", \"primary_rays_per_s\": " << r.primary_rays_per_second()
+            << ", \"secondary_rays_per_s\": " << r.secondary_rays_per_second()
+            << ", \"rays_per_s\": " << r.rays_per_second()
+            << ", \"nodes_per_ray\": " << r.nodes_per_ray()
+            << ", \"primitives_per_ray\": " << r.primitives_per_ray()
+            << "}";
+    }
+    std::cout << "\n  ],\n  \"micro_ns\": {";
+    for (size_t k = 0; k < micro.size(); ++k)
+        std::cout << (k ? ", " : "") << "\"" << micro[k].name << "\": " << micro[k].ns_per_call;
+    std::cout << "}\n}\n";
+}
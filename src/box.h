@@ -8,18 +8,99 @@
 
 #include "utility.h"
 
-#include "aarect.h"
-#include "hittable_list.h"
+#include "hittable.h"
+#include "material.h"
+
+#include <utility>
+
+/**
+\brief Slab test of a ray against an axis aligned box ("An Efficient and Robust Ray-Box Intersection Algorithm", Williams et al.).
+
+Every axis gives the interval of t between its two planes, the ray is inside the box where all three intervals overlap.
+Entry is the largest near plane, exit the smallest far plane. Entry is the hit, or exit if the ray starts inside the box.
+Face is 2 * axis + side, side 1 is the max plane. Math is double like in hit_sphere.
+
+\param o ray origin
+\param d ray direction
+\param box_min minimum corner
+\param box_max maximum corner
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param t t of the hit
+\param face face that was hit
+*/
+inline bool hit_box(const point3& o, const vec3& d, const point3& box_min, const point3& box_max,
+    double t_min, double t_max, double& t, int& face) {
+    double t_enter = -infinity;
+    double t_exit = infinity;
+    int enter_face = 0;
+    int exit_face = 0;
+
+    for (int a = 0; a < 3; ++a) {
+        const double inv_d = 1.0 / static_cast<double>(d[a]);
+        double t0 = (static_cast<double>(box_min[a]) - o[a]) * inv_d;
+        double t1 = (static_cast<double>(box_max[a]) - o[a]) * inv_d;
+        int face0 = 2 * a;
+        int face1 = 2 * a + 1;
+        if (inv_d < 0) {
+            std::swap(t0, t1);
+            std::swap(face0, face1);
+        }
+        if (t0 > t_enter) { t_enter = t0; enter_face = face0; }
+        if (t1 < t_exit) { t_exit = t1; exit_face = face1; }
+    }
+
+    if (t_enter > t_exit)
+        return false;
+
+    if (t_enter >= t_min && t_enter <= t_max) {
+        t = t_enter;
+        face = enter_face;
+        return true;
+    }
+    if (t_exit >= t_min && t_exit <= t_max) {
+        t = t_exit;
+        face = exit_face;
+        return true;
+    }
+    return false;
+}
+
+/**
+\brief Outward normal and (u,v) of a point on a box face. (u,v) are laid out like on the old sides: xy_rect (x, y), xz_rect (x, z), yz_rect (y, z).
+
+\param p point on the face
+\param face face from hit_box
+\param box_min minimum corner
+\param box_max maximum corner
+\param rec record to fill
+\param r ray in the space of the box
+*/
+inline void set_box_surface(const point3& p, int face, const point3& box_min, const point3& box_max, hit_record& rec, const ray& r) {
+    const int axis = face / 2;
+    const int u_axis = axis == 0 ? 1 : 0;
+    const int v_axis = axis == 2 ? 1 : 2;
+
+    rec.u = (p[u_axis] - box_min[u_axis]) / (box_max[u_axis] - box_min[u_axis]);
+    rec.v = (p[v_axis] - box_min[v_axis]) / (box_max[v_axis] - box_min[v_axis]);
+
+    vec3 outward_normal(0, 0, 0);
+    outward_normal[axis] = (face & 1) ? 1 : -1;
+    rec.set_face_normal(r, outward_normal);
+}
 
 /**
-\brief Box class. Consists of 6 rectangles.
+\brief Axis aligned box. It used to be 6 rectangles, now it is one slab test; the face comes from the entry axis.
 */
-class box : public hittable {
+class box final : public hittable {
 public:
-    box() {}
-    box(const point3& p0, const point3& p1, shared_ptr<material> ptr);
+    box() : hittable(hittable_kind::box) {}
+    box(const point3& p0, const point3& p1, shared_ptr<material> ptr)
+        : hittable(hittable_kind::box), box_min(p0), box_max(p1), mp(ptr) {}
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void finalize(const ray& r, hit_record& rec) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         output_box = aabb(box_min, box_max);
@@ -29,41 +110,35 @@ public:
 public:
     point3 box_min;
     point3 box_max;
-    hittable_list sides;
+    shared_ptr<material> mp;
 };
 
 /**
-\brief Creates a box out of two points.
+\brief Computes hits with one slab test. The face goes to prim_index, finalize turns it into normal and (u,v).
 
-\param p0 first point
-\param p1 second point
-\param ptr material pointer
+\param r ray that goes through object
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param rec bunch of arguments in the struct
+\param gen generator of the current sample
 */
-box::box(const point3& p0, const point3& p1, shared_ptr<material> ptr) {
-    box_min = p0;
-    box_max = p1;
-
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p1.z(), ptr));
-    sides.add(make_shared<xy_rect>(p0.x(), p1.x(), p0.y(), p1.y(), p0.z(), ptr));
+bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    double t;
+    int face;
+    if (!hit_box(r.origin(), r.direction(), box_min, box_max, t_min, t_max, t, face))
+        return false;
 
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p1.y(), ptr));
-    sides.add(make_shared<xz_rect>(p0.x(), p1.x(), p0.z(), p1.z(), p0.y(), ptr));
-
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p1.x(), ptr));
-    sides.add(make_shared<yz_rect>(p0.y(), p1.y(), p0.z(), p1.z(), p0.x(), ptr));
+    rec.defer(t, this, static_cast<std::uint32_t>(face));
+    return true;
 }
 
 /**
-\brief Computes hits.
-Since it consists out of rectangles, so it addreses to each side to compute it independently.
-
-\param r ray that goes through object
-\param t_min minimum t(in a ray) which can be counted as a hit
-\param t_max maximum t(in a ray) which can be counted as a hit
-\param rec bunch of arguments in the struct
+\brief Box surface details of the closest hit.
 */
-bool box::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    return sides.hit(r, t_min, t_max, rec);
+void box::finalize(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    set_box_surface(rec.p, static_cast<int>(rec.prim_index), box_min, box_max, rec, r);
+    rec.mat_ptr = mp.get();
 }
 
-#endif
\ No newline at end of file
+#endif
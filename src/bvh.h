@@ -6,164 +6,189 @@
 #ifndef BVH_H
 #define BVH_H
 
-#include <algorithm>
+#include <cstdint>
+#include <vector>
 
 #include "utility.h"
 
 #include "hittable.h"
 #include "hittable_list.h"
+#include "bvh_tree.h"
+#include "bvh4.h"
 
 /**
 \brief Bounding Volume Hierarchies class implementation.
 
-It’s really a container, but it can respond to the query “does this ray hit you?”. 
-The children pointers are to generic hittables. They can be other bvh_nodes, or spheres, or any other hittable. 
+It’s really a container, but it can respond to the query “does this ray hit you?”.
+Primitives are generic hittables. They can be other BVHs, or spheres, or any other hittable.
+Tree itself is a flat bvh_tree, so traversal is a loop over an array instead of a virtual call per node.
+
+Boxes of moving objects cover the whole shutter, so a tree over them is full of big overlapping boxes. When some object moves, the shutter is
+cut into time_slice_count slices and every slice gets its own tree over the boxes of that slice only. Ray walks the tree of its time,
+where the objects are almost as small as static ones.
 */
-class bvh_node : public hittable {
+class flat_bvh final : public hittable {
 public:
-    bvh_node();
+    static const int time_slice_count = 8;
+
+    flat_bvh() : hittable(hittable_kind::bvh) {}
 
-    bvh_node(const hittable_list& list, double time0, double time1)
-        : bvh_node(list.objects, 0, list.objects.size(), time0, time1)
+    flat_bvh(const hittable_list& list, double time0, double time1)
+        : flat_bvh(list.objects, 0, list.objects.size(), time0, time1)
     {}
 
-    bvh_node(
+    flat_bvh(
         const std::vector<shared_ptr<hittable>>& src_objects,
         size_t start, size_t end, double time0, double time1);
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual int hit_packet(const ray_packet& packet, double t_min, double t_max,
+        hit_record rec[ray_packet::size], rng* gen[ray_packet::size]) const override;
+
+    /**
+    \brief Tree for rays at time t: the tree of its slice, or the whole shutter tree if nothing moves.
+    */
+    const bvh_tree& tree_at(double t) const {
+        if (slices.empty())
+            return tree;
+        const auto k = static_cast<int>((t - time_begin) / (time_end - time_begin) * time_slice_count);
+        return slices[k < 0 ? 0 : (k >= time_slice_count ? time_slice_count - 1 : k)];
+    }
+
 public:
-    shared_ptr<hittable> left;
-    shared_ptr<hittable> right;
-    aabb box;
+    std::vector<shared_ptr<hittable>> objects; // primitives, leaves store indices into it
+    bvh_tree tree; // binary tree for single rays over the whole shutter
+    bvh4 wide; // 4-wide tree for packets, only built if nothing moves
+    std::vector<bvh_tree> slices; // one tree per time slice, empty if nothing moves
+    double time_begin = 0, time_end = 1; // shutter the slices cover
 };
 
 /**
-\brief Sets box from the class.
-*/
-bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
-    output_box = box;
-    return true;
-}
-
-/**
-\brief Check whether the box for the node is hit, and if so, check the children and sort out any details.
+\brief Collects boxes of the objects and builds the tree over them.
 
-\param r input ray
-\param t_min on minimum time
-\param t_max on maximum time
-\param rec struct with params
+\param src_objects scene objects
+\param start first object
+\param end one past the last object
+\param time0 shutter open time
+\param time1 shutter close time
 */
-bool bvh_node::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    if (!box.hit(r, t_min, t_max))
-        return false;
-
-    bool hit_left = left->hit(r, t_min, t_max, rec);
-    bool hit_right = right->hit(r, t_min, hit_left ? rec.t : t_max, rec);
-
-    return hit_left || hit_right;
-}
-
-/**
-\brief Generic comparator returns true if the first argument is less than the second, given an additional axis index argument.
+inline flat_bvh::flat_bvh(
+    const std::vector<shared_ptr<hittable>>& src_objects,
+    size_t start, size_t end, double time0, double time1
+) : hittable(hittable_kind::bvh), objects(src_objects.begin() + start, src_objects.begin() + end) {
+    std::vector<aabb> boxes(objects.size());
+    bool moving = false;
+
+    for (size_t i = 0; i < objects.size(); ++i) {
+        if (!objects[i]->bounding_box(time0, time1, boxes[i]))
+            std::cerr << "No bounding box in bvh_node constructor.\n";
+
+        // Box over the shutter bigger than the box at its start means the object moves
+        aabb start_box;
+        if (time1 > time0 && objects[i]->bounding_box(time0, time0, start_box)) {
+            for (int a = 0; a < 3; ++a)
+                moving |= start_box.min()[a] != boxes[i].min()[a] || start_box.max()[a] != boxes[i].max()[a];
+        }
+    }
 
-\param a hittable element a
-\param a hittable element b
-\param axis axis by which we compare our elements
-*/
-inline bool box_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b, int axis) {
-    aabb box_a;
-    aabb box_b;
+    tree.build(boxes);
 
-    if (!a->bounding_box(0, 0, box_a) || !b->bounding_box(0, 0, box_b))
-        std::cerr << "No bounding box in bvh_node constructor.\n";
+    if (!moving) {
+        wide.build(tree);
+        return;
+    }
 
-    return box_a.min().e[axis] < box_b.min().e[axis];
+    time_begin = time0;
+    time_end = time1;
+    slices.resize(time_slice_count);
+    for (int k = 0; k < time_slice_count; ++k) {
+        const double slice0 = time0 + (time1 - time0) * k / time_slice_count;
+        const double slice1 = time0 + (time1 - time0) * (k + 1) / time_slice_count;
+        for (size_t i = 0; i < objects.size(); ++i)
+            objects[i]->bounding_box(slice0, slice1, boxes[i]);
+        slices[k].build(boxes);
+    }
 }
 
 /**
-\brief Compare at x axis.
-
-\param a box1
-\param b box2
+\brief Sets box of the whole tree.
 */
-bool box_x_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 0);
+bool flat_bvh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (tree.empty())
+        return false;
+    if (slices.empty()) {
+        output_box = tree.root_box();
+        return true;
+    }
+
+    // Union of the slices the interval touches
+    const double duration = time_end - time_begin;
+    bool first = true;
+    for (int k = 0; k < time_slice_count; ++k) {
+        const double slice0 = time_begin + duration * k / time_slice_count;
+        const double slice1 = time_begin + duration * (k + 1) / time_slice_count;
+        if (slice1 < time0 || slice0 > time1)
+            continue;
+        output_box = first ? slices[k].root_box() : surrounding_box(output_box, slices[k].root_box());
+        first = false;
+    }
+    if (first)
+        output_box = tree.root_box();
+    return true;
 }
 
 /**
-\brief Compare at y axis.
+\brief Walks the tree and tests primitives of every leaf the ray gets to.
 
-\param a box1
-\param b box2
+\param r input ray
+\param t_min on minimum time
+\param t_max on maximum time
+\param rec struct with params
+\param gen generator of the current sample
 */
-bool box_y_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 1);
+bool flat_bvh::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    return tree_at(r.time()).traverse(r, t_min, t_max, [&](std::uint32_t prim, double t0, double& t1) {
+        if (!hit_primitive(*objects[prim], r, t0, t1, rec, gen))
+            return false;
+        t1 = rec.t;
+        return true;
+    });
 }
 
 /**
-\brief Compare at z axis.
-
-\param a box1
-\param b box2
+\brief Packet traversal of the 4-wide tree. Every ray of the packet tests primitives on its own.
+Rays of a packet have different times, so with time slices every ray walks the tree of its own slice.
+
+\param packet rays
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param rec hit record of every ray
+\param gen generator of every ray
 */
-bool box_z_compare(const shared_ptr<hittable> a, const shared_ptr<hittable> b) {
-    return box_compare(a, b, 2);
+int flat_bvh::hit_packet(const ray_packet& packet, double t_min, double t_max,
+    hit_record rec[ray_packet::size], rng* gen[ray_packet::size]) const {
+    if (!slices.empty())
+        return hittable::hit_packet(packet, t_min, t_max, rec, gen);
+
+    double t_far[ray_packet::size];
+    for (int k = 0; k < ray_packet::size; ++k)
+        t_far[k] = t_max;
+
+    return wide.traverse_packet(packet, t_min, t_far, [&](std::uint32_t prim, int k, double t0, double& t1) {
+        if (!hit_primitive(*objects[prim], *packet.rays[k], t0, t1, rec[k], *gen[k]))
+            return false;
+        t1 = rec[k].t;
+        return true;
+    });
 }
 
 /**
-\brief Splitting BVH Volumes. 
-
-As the list of objects in a bvh_node gets divided into two sub-lists, the hit function will work. At each node split the list along one axis.
-When the list coming in is two elements, function puts one in each subtree and end the recursion. The traversal algorithm should be smooth and not have to check for null pointers, 
-so if I just have one element function duplicates it in each subtree.
+\brief Compatibility name of the BVH. It used to be a tree of shared_ptr nodes, now it is a flat_bvh.
 */
-inline bvh_node::bvh_node(
-    const std::vector<shared_ptr<hittable>>& src_objects,
-    size_t start, size_t end, double time0, double time1
-) {
-    auto objects = src_objects; // Create a modifiable array of the source scene objects
-
-    int axis = random_int(0, 2);
-    auto comparator = (axis == 0) ? box_x_compare
-        : (axis == 1) ? box_y_compare
-        : box_z_compare;
-
-    size_t object_span = end - start;
-
-    if (object_span == 1) {
-        left = right = objects[start];
-    }
-    else if (object_span == 2) {
-        if (comparator(objects[start], objects[start + 1])) {
-            left = objects[start];
-            right = objects[start + 1];
-        }
-        else {
-            left = objects[start + 1];
-            right = objects[start];
-        }
-    }
-    else {
-        std::sort(objects.begin() + start, objects.begin() + end, comparator);
-
-        auto mid = start + object_span / 2;
-        left = make_shared<bvh_node>(objects, start, mid, time0, time1);
-        right = make_shared<bvh_node>(objects, mid, end, time0, time1);
-    }
-
-    aabb box_left, box_right;
-
-    if (!left->bounding_box(time0, time1, box_left)
-        || !right->bounding_box(time0, time1, box_right)
-        )
-        std::cerr << "No bounding box in bvh_node constructor.\n";
-
-    box = surrounding_box(box_left, box_right);
-}
+using bvh_node = flat_bvh;
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,392 @@
+/**
+\file
+\brief .h file that contains 4-wide Bounding Volume Hierarchy with single ray and packet traversal
+*/
+
+#ifndef BVH4_H
+#define BVH4_H
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "simd.h"
+#include "ray_packet.h"
+#include "bvh_tree.h"
+#include "stats.h"
+
+/**
+\brief Node of the 4-wide BVH. Boxes of the four children are stored as structure of arrays, so one SSE op tests one axis of all four children.
+
+128 bytes, two cache lines, aligned so that one node never touches a third line.
+*/
+struct alignas(64) bvh4_node {
+    float bounds_min[3][4]; // [axis][child]
+    float bounds_max[3][4]; // [axis][child]
+    std::uint32_t child[4]; // node index of interior child or first primitive index of leaf child
+    std::uint16_t count[4]; // primitives of leaf child, 0 for interior child
+    std::uint32_t child_count; // used slots, they are always the first ones
+    std::uint32_t padding;
+};
+
+static_assert(sizeof(bvh4_node) == 128, "bvh4_node must stay 128 bytes");
+
+/**
+\brief 4-wide BVH (BVH4) collapsed from the binary bvh_tree.
+
+Every binary interior node is opened until it has four children, always opening the child with the biggest surface area
+(https://www.embree.org/papers/2008-HPG-QBVH.pdf), so one node fetch tests four boxes.
+Single rays test four children per SSE op, packets test one child against four rays per SSE op.
+*/
+class bvh4 {
+public:
+    // Every wide node is at least one binary level below its parent, so a path has fewer than bvh_tree::stack_size of them,
+    // and each one leaves at most three siblings on the stack
+    static const int stack_size = 3 * bvh_tree::stack_size;
+
+    bvh4() {}
+
+    /**
+    \brief Builds the wide tree out of a binary one.
+
+    \param tree binary tree, it must be built already
+    */
+    void build(const bvh_tree& tree) {
+        nodes.clear();
+        indices.assign(tree.indices.begin(), tree.indices.end());
+        if (tree.empty())
+            return;
+
+        nodes.reserve(tree.nodes.size() / 2 + 1);
+        collapse(tree, 0);
+    }
+
+    /**
+    \brief Returns true if there are no primitives.
+    */
+    bool empty() const { return nodes.empty(); }
+
+    /**
+    \brief Traversal of one ray. Children that are hit are visited nearest first.
+
+    \param r input ray
+    \param t_min minimum t(in a ray) which can be counted as a hit
+    \param t_max maximum t(in a ray), shrinks to the closest hit
+    \param hit_leaf function (primitive index, t_min, t_max&) -> bool that tests one primitive and lowers t_max on hit
+    */
+    template <typename leaf_function>
+    bool traverse(const ray& r, double t_min, double& t_max, const leaf_function& hit_leaf) const {
+        if (nodes.empty())
+            return false;
+
+        float o[3], inv[3];
+        for (int a = 0; a < 3; ++a) {
+            o[a] = static_cast<float>(r.orig[a]);
+            inv[a] = static_cast<float>(r.inverse_direction()[a]);
+        }
+
+        stack_entry stack[stack_size];
+        int stack_top = 0;
+        stack[stack_top++] = { 0, 0, 0, static_cast<float>(t_min) };
+        bool hit_anything = false;
+
+        while (stack_top > 0) {
+            const stack_entry e = stack[--stack_top];
+            if (e.t > t_max)
+                continue;
+
+            if (e.count > 0) {
+                RT_COUNT(primitives_tested, e.count);
+                for (std::uint32_t k = 0; k < e.count; ++k) {
+                    if (hit_leaf(indices[e.index + k], t_min, t_max))
+                        hit_anything = true;
+                }
+                continue;
+            }
+
+            const auto& node = nodes[e.index];
+            RT_COUNT(nodes_visited, node.child_count);
+            float t_near[4];
+            const int mask = hit_children(node, o, inv, static_cast<float>(t_min), static_cast<float>(t_max), t_near);
+            push_sorted(node, mask, t_near, 0, stack, stack_top);
+        }
+
+        return hit_anything;
+    }
+
+    /**
+    \brief Traversal of a packet of rays. Every child box is tested against all rays of the packet at once.
+
+    \param packet rays
+    \param t_min minimum t(in a ray) which can be counted as a hit
+    \param t_max maximum t of every ray, shrinks to the closest hit
+    \param hit_leaf function (primitive index, ray index, t_min, t_max&) -> bool that tests one primitive with one ray
+    */
+    template <typename leaf_function>
+    int traverse_packet(const ray_packet& packet, double t_min, double t_max[ray_packet::size], const leaf_function& hit_leaf) const {
+        if (nodes.empty() || packet.active == 0)
+            return 0;
+
+        alignas(16) float t_far[ray_packet::size];
+        for (int k = 0; k < ray_packet::size; ++k)
+            t_far[k] = static_cast<float>(t_max[k]);
+
+        stack_entry stack[stack_size];
+        int stack_top = 0;
+        stack[stack_top++] = { 0, 0, packet.active, static_cast<float>(t_min) };
+        int hit_mask = 0;
+
+        while (stack_top > 0) {
+            const stack_entry e = stack[--stack_top];
+
+            int lanes = 0;
+            for (int k = 0; k < ray_packet::size; ++k)
+                if ((e.lanes & (1 << k)) && e.t <= t_far[k]) lanes |= 1 << k;
+            if (lanes == 0)
+                continue;
+
+            if (e.count > 0) {
+                RT_COUNT(primitives_tested, e.count * lane_count(lanes));
+                for (std::uint32_t i = 0; i < e.count; ++i) {
+                    const auto prim = indices[e.index + i];
+                    for (int k = 0; k < ray_packet::size; ++k) {
+                        if ((lanes & (1 << k)) && hit_leaf(prim, k, t_min, t_max[k])) {
+                            hit_mask |= 1 << k;
+                            t_far[k] = static_cast<float>(t_max[k]);
+                        }
+                    }
+                }
+                continue;
+            }
+
+            const auto& node = nodes[e.index];
+            RT_COUNT(nodes_visited, node.child_count * lane_count(lanes));
+            float t_near[4];
+            int child_lanes[4];
+            int mask = 0;
+            for (std::uint32_t c = 0; c < node.child_count; ++c) {
+                child_lanes[c] = hit_child_packet(node, c, packet, static_cast<float>(t_min), t_far, t_near[c]) & lanes;
+                if (child_lanes[c]) mask |= 1 << c;
+            }
+            push_sorted(node, mask, t_near, child_lanes, stack, stack_top);
+        }
+
+        return hit_mask;
+    }
+
+public:
+    std::vector<bvh4_node> nodes; // depth first node array, root first
+    std::vector<std::uint32_t> indices; // primitive indices referenced by leaves
+
+private:
+    /**
+    \brief Number of rays in a lane mask.
+    */
+    static int lane_count(int lanes) {
+        int n = 0;
+        for (; lanes; lanes &= lanes - 1)
+            ++n;
+        return n;
+    }
+
+    /**
+    \brief Node or leaf waiting on the stack with the distance where the ray enters it.
+    */
+    struct stack_entry {
+        std::uint32_t index; // node index, or first primitive index when count > 0
+        std::uint32_t count; // primitives of a leaf
+        int lanes; // rays of the packet that entered the box
+        float t; // entry distance
+    };
+
+    /**
+    \brief Pushes the children that were hit, farthest first, so the nearest one is popped next.
+    */
+    static void push_sorted(const bvh4_node& node, int mask, const float t_near[4], const int* child_lanes,
+        stack_entry* stack, int& stack_top) {
+        stack_entry hits[4];
+        int n = 0;
+
+        for (std::uint32_t c = 0; c < node.child_count; ++c) {
+            if (!(mask & (1 << c)))
+                continue;
+            stack_entry e = { node.child[c], node.count[c], child_lanes ? child_lanes[c] : 1, t_near[c] };
+            // insertion sort, largest distance first
+            int k = n++;
+            while (k > 0 && hits[k - 1].t < e.t) {
+                hits[k] = hits[k - 1];
+                --k;
+            }
+            hits[k] = e;
+        }
+
+        assert(stack_top + n <= stack_size);
+        for (int k = 0; k < n; ++k)
+            stack[stack_top++] = hits[k];
+    }
+
+    /**
+    \brief Tests one ray against the four child boxes. Returns mask of children that were hit, and their entry distances.
+
+    min/max return their second operand when the first one is NaN (0 * infinity for a ray in the slab plane), so t_min and t_max go last.
+    */
+    static int hit_children(const bvh4_node& node, const float o[3], const float inv[3], float t_min, float t_max, float t_near[4]) {
+#if RT_SSE2
+        __m128 entry = _mm_set1_ps(t_min);
+        __m128 exit = _mm_set1_ps(t_max);
+        for (int a = 2; a >= 0; --a) {
+            const __m128 orig = _mm_set1_ps(o[a]);
+            const __m128 inv_dir = _mm_set1_ps(inv[a]);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_min[a]), orig), inv_dir);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_max[a]), orig), inv_dir);
+            entry = _mm_max_ps(_mm_min_ps(t0, t1), entry);
+            exit = _mm_min_ps(_mm_max_ps(t0, t1), exit);
+        }
+        _mm_storeu_ps(t_near, entry);
+        return _mm_movemask_ps(_mm_cmple_ps(entry, exit)) & ((1 << node.child_count) - 1);
+#else
+        int mask = 0;
+        for (std::uint32_t c = 0; c < node.child_count; ++c) {
+            float entry = t_min;
+            float exit = t_max;
+            for (int a = 0; a < 3; ++a) {
+                const float t0 = (node.bounds_min[a][c] - o[a]) * inv[a];
+                const float t1 = (node.bounds_max[a][c] - o[a]) * inv[a];
+                const float lo = t0 < t1 ? t0 : t1;
+                const float hi = t0 < t1 ? t1 : t0;
+                entry = lo > entry ? lo : entry;
+                exit = hi < exit ? hi : exit;
+            }
+            t_near[c] = entry;
+            if (entry <= exit) mask |= 1 << c;
+        }
+        return mask;
+#endif
+    }
+
+    /**
+    \brief Tests one child box against all rays of the packet. Returns mask of rays that hit it, and the smallest entry distance.
+    */
+    static int hit_child_packet(const bvh4_node& node, std::uint32_t c, const ray_packet& packet, float t_min,
+        const float t_far[ray_packet::size], float& t_near) {
+#if RT_SSE2
+        __m128 entry = _mm_set1_ps(t_min);
+        __m128 exit = _mm_load_ps(t_far);
+        for (int a = 2; a >= 0; --a) {
+            const __m128 orig = _mm_load_ps(packet.orig[a]);
+            const __m128 inv_dir = _mm_load_ps(packet.inv_dir[a]);
+            const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds_min[a][c]), orig), inv_dir);
+            const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.bounds_max[a][c]), orig), inv_dir);
+            entry = _mm_max_ps(_mm_min_ps(t0, t1), entry);
+            exit = _mm_min_ps(_mm_max_ps(t0, t1), exit);
+        }
+        const int mask = _mm_movemask_ps(_mm_cmple_ps(entry, exit));
+
+        alignas(16) float e[ray_packet::size];
+        _mm_store_ps(e, entry);
+        t_near = infinity;
+        for (int k = 0; k < ray_packet::size; ++k)
+            if ((mask & (1 << k)) && e[k] < t_near) t_near = e[k];
+        return mask;
+#else
+        int mask = 0;
+        t_near = infinity;
+        for (int k = 0; k < ray_packet::size; ++k) {
+            float entry = t_min;
+            float exit = t_far[k];
+            for (int a = 0; a < 3; ++a) {
+                const float t0 = (node.bounds_min[a][c] - packet.orig[a][k]) * packet.inv_dir[a][k];
+                const float t1 = (node.bounds_max[a][c] - packet.orig[a][k]) * packet.inv_dir[a][k];
+                const float lo = t0 < t1 ? t0 : t1;
+                const float hi = t0 < t1 ? t1 : t0;
+                entry = lo > entry ? lo : entry;
+                exit = hi < exit ? hi : exit;
+            }
+            if (entry <= exit) {
+                mask |= 1 << k;
+                if (entry < t_near) t_near = entry;
+            }
+        }
+        return mask;
+#endif
+    }
+
+    /**
+    \brief Creates wide node for binary node and everything below it. Returns index of the new node.
+    */
+    std::uint32_t collapse(const bvh_tree& tree, std::uint32_t binary_index) {
+        std::uint32_t open[4];
+        std::uint32_t open_count = 0;
+
+        const auto& root = tree.nodes[binary_index];
+        if (root.is_leaf()) {
+            open[open_count++] = binary_index;
+        }
+        else {
+            open[open_count++] = binary_index + 1;
+            open[open_count++] = root.offset;
+        }
+
+        // Open the interior child with the biggest surface area until there are four children.
+        while (open_count < 4) {
+            int best = -1;
+            double best_area = -1.0;
+            for (std::uint32_t k = 0; k < open_count; ++k) {
+                const auto& n = tree.nodes[open[k]];
+                if (n.is_leaf())
+                    continue;
+                const double area = surface_area(node_box(n));
+                if (area > best_area) {
+                    best_area = area;
+                    best = static_cast<int>(k);
+                }
+            }
+            if (best < 0)
+                break;
+
+            const auto opened = open[best];
+            open[best] = opened + 1;
+            open[open_count++] = tree.nodes[opened].offset;
+        }
+
+        const auto index = static_cast<std::uint32_t>(nodes.size());
+        nodes.emplace_back();
+        {
+            auto& node = nodes[index];
+            node.child_count = open_count;
+            node.padding = 0;
+            for (int c = 0; c < 4; ++c) {
+                const bool used = c < static_cast<int>(open_count);
+                for (int a = 0; a < 3; ++a) {
+                    node.bounds_min[a][c] = used ? tree.nodes[open[c]].bounds_min[a] : 0.0f;
+                    node.bounds_max[a][c] = used ? tree.nodes[open[c]].bounds_max[a] : 0.0f;
+                }
+                node.child[c] = 0;
+                node.count[c] = 0;
+            }
+        }
+
+        for (std::uint32_t c = 0; c < open_count; ++c) {
+            const auto& n = tree.nodes[open[c]];
+            if (n.is_leaf()) {
+                nodes[index].child[c] = n.offset;
+                nodes[index].count[c] = n.count;
+            }
+            else {
+                const auto child = collapse(tree, open[c]);
+                nodes[index].child[c] = child;
+            }
+        }
+
+        return index;
+    }
+
+    static aabb node_box(const flat_bvh_node& n) {
+        return aabb(
+            point3(n.bounds_min[0], n.bounds_min[1], n.bounds_min[2]),
+            point3(n.bounds_max[0], n.bounds_max[1], n.bounds_max[2]));
+    }
+};
+
+#endif
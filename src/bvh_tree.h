@@ -0,0 +1,749 @@
+/**
+\file
+\brief .h file that contains flat Bounding Volume Hierarchy tree with binned SAH build
+*/
+
+#ifndef BVH_TREE_H
+#define BVH_TREE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+#include "utility.h"
+#include "simd.h"
+#include "aabb.h"
+#include "array_buffer.h"
+#include "stats.h"
+
+/**
+\brief One node of the flat BVH, exactly 32 bytes so two nodes fit in a cache line.
+
+Bounds are stored as floats rounded outwards, so the box never gets smaller than the double box of its primitives.
+Interior node: its first child is the next node in the array and offset is the index of the second child.
+Leaf node: offset is the first entry in the primitive index array and count is the number of primitives.
+*/
+struct alignas(32) flat_bvh_node {
+    float bounds_min[3];
+    std::uint32_t offset; // second child (interior) or first primitive index (leaf)
+    float bounds_max[3];
+    std::uint16_t count; // number of primitives, 0 for interior node
+    std::uint16_t axis; // split axis of interior node
+
+    bool is_leaf() const { return count > 0; }
+};
+
+static_assert(sizeof(flat_bvh_node) == 32, "flat_bvh_node must stay 32 bytes");
+
+/**
+\brief Rounds double down to the nearest float that is not bigger.
+*/
+inline float float_round_down(double x) {
+    auto f = static_cast<float>(x);
+    return static_cast<double>(f) > x ? std::nextafter(f, -std::numeric_limits<float>::infinity()) : f;
+}
+
+/**
+\brief Rounds double up to the nearest float that is not smaller.
+*/
+inline float float_round_up(double x) {
+    auto f = static_cast<float>(x);
+    return static_cast<double>(f) < x ? std::nextafter(f, std::numeric_limits<float>::infinity()) : f;
+}
+
+/**
+\brief Surface area of the box, used by the Surface Area Heuristic.
+*/
+inline double surface_area(const aabb& box) {
+    auto d = box.max() - box.min();
+    return 2.0 * (d.x() * d.y() + d.y() * d.z() + d.z() * d.x());
+}
+
+/**
+\brief How bvh_tree is built.
+
+sah is the binned Surface Area Heuristic, the best trees for rendering. lbvh sorts the primitives along a Morton curve and splits
+at the bits of the codes (https://research.nvidia.com/publication/2012-06_maximizing-parallelism-construction-bvhs-octrees-and-k-d-trees):
+it is several times faster to build and gives slower trees, good for previews of big scenes.
+*/
+enum class bvh_build_method {
+    sah,
+    lbvh
+};
+
+/**
+\brief Options of the BVH build.
+*/
+struct bvh_build_settings {
+    bvh_build_method method = bvh_build_method::sah;
+    int threads = 0; // build threads, 0 means all cores
+};
+
+/**
+\brief Settings used by every tree that is not given its own, set once from the command line before the scene is built.
+*/
+inline bvh_build_settings& bvh_build_defaults() {
+    static bvh_build_settings settings;
+    return settings;
+}
+
+/**
+\brief Flat Bounding Volume Hierarchy over abstract primitives, which are only known by their index and box.
+
+Build uses binned Surface Area Heuristic (https://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf): centroids are dropped into bins
+along every axis and the plane with the smallest cost = area_left * count_left + area_right * count_right is chosen. Nodes are stored depth first in one array.
+Owner of the primitives (flat_bvh, batches, meshes) does the leaf test inside traverse.
+Big nodes are built in parallel: boxes and bins of a node are collected by all free threads, the two children of a node become
+two tasks. Every task writes its own node array and the arrays are joined in depth first order, so the tree does not depend on the number of threads.
+Tree is at most stack_size levels deep: a node that would otherwise not fit its subtree under that depth is split at the object median from there on.
+*/
+class bvh_tree {
+public:
+    static const int bin_count = 16;
+    static const int max_leaf_size = 4;
+    static const int stack_size = 64;
+    static const size_t task_span = 4096; // smallest node whose children are built as two tasks
+    static const size_t parallel_span = 65536; // smallest node whose boxes and bins are collected on several threads
+
+    bvh_tree() {}
+
+    /**
+    \brief Builds the tree.
+
+    \param prim_bounds box of every primitive
+    \param simd_width number of primitives the owner tests in one go; SAH then counts a leaf of up to simd_width primitives as one test
+    \param settings build method and number of threads
+    */
+    void build(const std::vector<aabb>& prim_bounds, int simd_width = 1, const bvh_build_settings& settings = bvh_build_defaults()) {
+        RT_TIMER("bvh build");
+        leaf_width = simd_width;
+        nodes.clear();
+        indices.resize(prim_bounds.size());
+        for (size_t i = 0; i < indices.size(); ++i)
+            indices[i] = static_cast<std::uint32_t>(i);
+
+        if (prim_bounds.empty())
+            return;
+
+        int threads = settings.threads > 0 ? settings.threads : static_cast<int>(std::thread::hardware_concurrency());
+        std::atomic<int> free_threads(std::max(threads, 1) - 1);
+        spare_threads = &free_threads;
+
+        bounds = &prim_bounds;
+        centroids.resize(prim_bounds.size());
+        const int parts = take_threads(prim_bounds.size());
+        parallel_parts(parts, prim_bounds.size(), [&](int, size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i)
+                centroids[i] = 0.5 * (prim_bounds[i].min() + prim_bounds[i].max());
+        });
+        release_threads(parts);
+
+        std::vector<flat_bvh_node> built;
+        built.reserve(2 * prim_bounds.size());
+        if (settings.method == bvh_build_method::lbvh) {
+            sort_by_morton_code();
+            build_morton(0, prim_bounds.size(), built, 0);
+            morton_codes.clear();
+            morton_codes.shrink_to_fit();
+        }
+        else {
+            build_recursive(0, prim_bounds.size(), built, 0);
+        }
+        nodes.swap(built);
+
+        bounds = nullptr;
+        spare_threads = nullptr;
+        centroids.clear();
+        centroids.shrink_to_fit();
+    }
+
+    /**
+    \brief Returns true if there are no primitives.
+    */
+    bool empty() const { return nodes.empty(); }
+
+    /**
+    \brief Box of the whole tree.
+    */
+    aabb root_box() const {
+        const auto& n = nodes[0];
+        return aabb(
+            point3(n.bounds_min[0], n.bounds_min[1], n.bounds_min[2]),
+            point3(n.bounds_max[0], n.bounds_max[1], n.bounds_max[2]));
+    }
+
+    /**
+    \brief Stack based traversal, visits nearer child first so far boxes are often culled by the closer hit.
+
+    \param r input ray
+    \param t_min minimum t(in a ray) which can be counted as a hit
+    \param t_max maximum t(in a ray), shrinks to the closest hit
+    \param hit_leaf function (primitive index, t_min, t_max&) -> bool that tests one primitive and lowers t_max on hit
+    */
+    template <typename leaf_function>
+    bool traverse(const ray& r, double t_min, double& t_max, const leaf_function& hit_leaf) const {
+        return traverse_leaves(r, t_min, t_max, [&](std::uint32_t first, std::uint32_t count, double t0, double& t1) {
+            bool hit_anything = false;
+            for (std::uint32_t k = 0; k < count; ++k) {
+                if (hit_leaf(indices[first + k], t0, t1))
+                    hit_anything = true;
+            }
+            return hit_anything;
+        });
+    }
+
+    /**
+    \brief Same traversal, but the whole leaf goes to the owner at once, so it can test all its primitives with SIMD.
+
+    \param r input ray
+    \param t_min minimum t(in a ray) which can be counted as a hit
+    \param t_max maximum t(in a ray), shrinks to the closest hit
+    \param hit_leaf function (first index, count, t_min, t_max&) -> bool that tests entries [first, first + count) of the index array
+    */
+    template <typename leaf_function>
+    bool traverse_leaves(const ray& r, double t_min, double& t_max, const leaf_function& hit_leaf) const {
+        if (nodes.empty())
+            return false;
+
+        const node_ray nr(r);
+
+        RT_COUNT(nodes_visited, 1);
+        float t_entry;
+        if (!hit_node(nodes[0], nr, t_min, t_max, t_entry))
+            return false;
+
+        std::uint32_t stack[stack_size];
+        int stack_top = 0;
+        std::uint32_t current = 0;
+        bool hit_anything = false;
+
+        while (true) {
+            const auto& node = nodes[current];
+
+            if (node.is_leaf()) {
+                RT_COUNT(primitives_tested, node.count);
+                if (hit_leaf(node.offset, node.count, t_min, t_max))
+                    hit_anything = true;
+            }
+            else {
+                RT_COUNT(nodes_visited, 2);
+                const std::uint32_t first = current + 1;
+                const std::uint32_t second = node.offset;
+                float t_first, t_second;
+                bool hit_first = hit_node(nodes[first], nr, t_min, t_max, t_first);
+                bool hit_second = hit_node(nodes[second], nr, t_min, t_max, t_second);
+
+                if (hit_first && hit_second) {
+                    assert(stack_top < stack_size);
+                    if (t_second < t_first) {
+                        stack[stack_top++] = first;
+                        current = second;
+                    }
+                    else {
+                        stack[stack_top++] = second;
+                        current = first;
+                    }
+                    continue;
+                }
+                if (hit_first) { current = first; continue; }
+                if (hit_second) { current = second; continue; }
+            }
+
+            if (stack_top == 0)
+                break;
+            current = stack[--stack_top];
+        }
+
+        return hit_anything;
+    }
+
+public:
+    array_buffer<flat_bvh_node> nodes; // depth first node array
+    array_buffer<std::uint32_t> indices; // primitive indices referenced by leaves
+
+    /**
+    \brief Owners that reorder their primitives into index order can drop the indirection and read leaf ranges directly.
+    */
+    void make_indices_identity() {
+        for (size_t i = 0; i < indices.size(); ++i)
+            indices[i] = static_cast<std::uint32_t>(i);
+    }
+
+private:
+    /**
+    \brief Ray origin and inverse direction in float, prepared once per traversal for the node tests.
+    */
+    struct node_ray {
+        explicit node_ray(const ray& r) {
+            const auto& inv = r.inverse_direction();
+#if RT_SSE2
+            // Lane 3 lines up with offset/count of the node, the test never reads it.
+            orig = _mm_set_ps(0.0f, static_cast<float>(r.orig.z()), static_cast<float>(r.orig.y()), static_cast<float>(r.orig.x()));
+            inv_dir = _mm_set_ps(0.0f, static_cast<float>(inv.z()), static_cast<float>(inv.y()), static_cast<float>(inv.x()));
+#else
+            for (int a = 0; a < 3; ++a) {
+                orig[a] = static_cast<float>(r.orig[a]);
+                inv_dir[a] = static_cast<float>(inv[a]);
+            }
+#endif
+        }
+
+#if RT_SSE2
+        __m128 orig;
+        __m128 inv_dir;
+#else
+        float orig[3];
+        float inv_dir[3];
+#endif
+    };
+
+    /**
+    \brief Branchless slab test of one node, all three axes at once with SSE. Returns entry distance in t_entry.
+
+    min/max return their second operand when the first one is NaN (0 * infinity for a ray in the slab plane), so t_min and t_max go last.
+    */
+    static bool hit_node(const flat_bvh_node& node, const node_ray& nr, double t_min, double t_max, float& t_entry) {
+#if RT_SSE2
+        const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_min), nr.orig), nr.inv_dir);
+        const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds_max), nr.orig), nr.inv_dir);
+        const __m128 t_near = _mm_min_ps(t0, t1);
+        const __m128 t_far = _mm_max_ps(t0, t1);
+
+        __m128 entry = _mm_max_ss(_mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(2, 2, 2, 2)), _mm_set_ss(static_cast<float>(t_min)));
+        entry = _mm_max_ss(_mm_shuffle_ps(t_near, t_near, _MM_SHUFFLE(1, 1, 1, 1)), entry);
+        entry = _mm_max_ss(t_near, entry);
+
+        __m128 exit = _mm_min_ss(_mm_shuffle_ps(t_far, t_far, _MM_SHUFFLE(2, 2, 2, 2)), _mm_set_ss(static_cast<float>(t_max)));
+        exit = _mm_min_ss(_mm_shuffle_ps(t_far, t_far, _MM_SHUFFLE(1, 1, 1, 1)), exit);
+        exit = _mm_min_ss(t_far, exit);
+
+        t_entry = _mm_cvtss_f32(entry);
+        return _mm_comile_ss(entry, exit) != 0;
+#else
+        float entry = static_cast<float>(t_min);
+        float exit = static_cast<float>(t_max);
+        for (int a = 0; a < 3; a++) {
+            const float t0 = (node.bounds_min[a] - nr.orig[a]) * nr.inv_dir[a];
+            const float t1 = (node.bounds_max[a] - nr.orig[a]) * nr.inv_dir[a];
+            const float t_near = t0 < t1 ? t0 : t1;
+            const float t_far = t0 < t1 ? t1 : t0;
+            entry = t_near > entry ? t_near : entry;
+            exit = t_far < exit ? t_far : exit;
+        }
+        t_entry = entry;
+        return entry <= exit;
+#endif
+    }
+
+    /**
+    \brief Boxes of the primitives and of their centroids in [begin, end) of the index array.
+    */
+    void range_bounds(size_t begin, size_t end, aabb& node_box, aabb& centroid_box) const {
+        node_box = (*bounds)[indices[begin]];
+        centroid_box = aabb(centroids[indices[begin]], centroids[indices[begin]]);
+        for (size_t i = begin + 1; i < end; ++i) {
+            node_box = surrounding_box(node_box, (*bounds)[indices[i]]);
+            centroid_box = surrounding_box(centroid_box, aabb(centroids[indices[i]], centroids[indices[i]]));
+        }
+    }
+
+    /**
+    \brief True if the subtree of span primitives at depth has to be balanced to stay within stack_size levels: halving the span
+    reaches leaves in ceil_log2(span) levels.
+    */
+    static bool needs_median_split(size_t span, int depth) {
+        return depth + ceil_log2(static_cast<std::uint32_t>(span)) >= stack_size - 1;
+    }
+
+    /**
+    \brief Builds node for primitives [begin, end) of the index array and everything below it, appends them to out.
+    */
+    void build_recursive(size_t begin, size_t end, std::vector<flat_bvh_node>& out, int depth) {
+        const auto node_index = out.size();
+        out.emplace_back();
+
+        const size_t span = end - begin;
+        aabb node_box, centroid_box;
+        const int parts = take_threads(span);
+        if (parts > 1) {
+            std::vector<aabb> part_box(parts), part_centroids(parts);
+            parallel_parts(parts, span, [&](int part, size_t first, size_t last) {
+                range_bounds(begin + first, begin + last, part_box[part], part_centroids[part]);
+            });
+            node_box = part_box[0];
+            centroid_box = part_centroids[0];
+            for (int k = 1; k < parts; ++k) {
+                node_box = surrounding_box(node_box, part_box[k]);
+                centroid_box = surrounding_box(centroid_box, part_centroids[k]);
+            }
+        }
+        else {
+            range_bounds(begin, end, node_box, centroid_box);
+        }
+        release_threads(parts);
+        set_bounds(out[node_index], node_box);
+
+        int split_axis = -1;
+        size_t mid = begin;
+
+        if (span > 1) {
+            if (!needs_median_split(span, depth))
+                split_axis = find_split(begin, end, node_box, centroid_box, mid);
+
+            if (split_axis < 0 && span > max_leaf_size) {
+                // All centroids in the same spot (or SAH prefers a leaf that is too big, or the tree gets too deep): split the list in half.
+                split_axis = longest_axis(centroid_box);
+                mid = begin + span / 2;
+                std::nth_element(indices.begin() + begin, indices.begin() + mid, indices.begin() + end,
+                    [&](std::uint32_t a, std::uint32_t b) { return centroids[a][split_axis] < centroids[b][split_axis]; });
+            }
+        }
+
+        if (split_axis < 0) {
+            set_leaf(out[node_index], begin, span);
+            return;
+        }
+
+        build_children(begin, mid, end, out, node_index, split_axis, depth, &bvh_tree::build_recursive);
+    }
+
+    /**
+    \brief Builds both children of out[node_index] (which is at depth), as two tasks if the node is big and a thread is free.
+    */
+    void build_children(size_t begin, size_t mid, size_t end, std::vector<flat_bvh_node>& out, size_t node_index, int split_axis, int depth,
+        void (bvh_tree::*build_node)(size_t, size_t, std::vector<flat_bvh_node>&, int)) {
+        size_t second;
+        if (end - begin >= task_span && take_thread()) {
+            std::vector<flat_bvh_node> left, right;
+            std::thread worker([&]() { (this->*build_node)(begin, mid, left, depth + 1); });
+            (this->*build_node)(mid, end, right, depth + 1);
+            worker.join();
+            release_threads(2);
+
+            append_subtree(out, left);
+            second = out.size();
+            append_subtree(out, right);
+        }
+        else {
+            (this->*build_node)(begin, mid, out, depth + 1);
+            second = out.size();
+            (this->*build_node)(mid, end, out, depth + 1);
+        }
+
+        out[node_index].offset = static_cast<std::uint32_t>(second);
+        out[node_index].count = 0;
+        out[node_index].axis = static_cast<std::uint16_t>(split_axis);
+    }
+
+    /**
+    \brief Appends a subtree built in its own array. Its second child offsets were relative to that array.
+    */
+    static void append_subtree(std::vector<flat_bvh_node>& out, const std::vector<flat_bvh_node>& subtree) {
+        const auto base = static_cast<std::uint32_t>(out.size());
+        for (auto node : subtree) {
+            if (!node.is_leaf())
+                node.offset += base;
+            out.push_back(node);
+        }
+    }
+
+    /**
+    \brief Takes free threads for a loop over span items: 1 (only the caller) for small loops, otherwise the caller and every free thread.
+    Give them back with release_threads(result).
+    */
+    int take_threads(size_t span) {
+        if (span < parallel_span)
+            return 1;
+        const int taken = spare_threads->exchange(0);
+        return taken + 1;
+    }
+
+    void release_threads(int parts) {
+        if (parts > 1)
+            *spare_threads += parts - 1;
+    }
+
+    /**
+    \brief Takes one free thread for a task, returns false if there is none. Give it back with release_threads(2).
+    */
+    bool take_thread() {
+        int free = spare_threads->load();
+        while (free > 0 && !spare_threads->compare_exchange_weak(free, free - 1)) {}
+        return free > 0;
+    }
+
+    /**
+    \brief Bins of the three axes, kept apart for every thread and summed at the end.
+    */
+    struct split_bins {
+        aabb box[3][bin_count];
+        size_t size[3][bin_count] = {};
+
+        void add(int axis, int b, const aabb& prim_box) {
+            box[axis][b] = size[axis][b] ? surrounding_box(box[axis][b], prim_box) : prim_box;
+            ++size[axis][b];
+        }
+
+        void merge(const split_bins& other) {
+            for (int axis = 0; axis < 3; ++axis) {
+                for (int b = 0; b < bin_count; ++b) {
+                    if (other.size[axis][b])
+                        add_bin(axis, b, other.box[axis][b], other.size[axis][b]);
+                }
+            }
+        }
+
+    private:
+        void add_bin(int axis, int b, const aabb& bin_box, size_t bin_size) {
+            box[axis][b] = size[axis][b] ? surrounding_box(box[axis][b], bin_box) : bin_box;
+            size[axis][b] += bin_size;
+        }
+    };
+
+    /**
+    \brief Drops primitives [begin, end) into the bins of every axis with a nonzero centroid extent.
+    */
+    void fill_bins(size_t begin, size_t end, const aabb& centroid_box, split_bins& bins) const {
+        for (int axis = 0; axis < 3; ++axis) {
+            const double cmin = centroid_box.min()[axis];
+            const double extent = centroid_box.max()[axis] - cmin;
+            if (extent <= 0)
+                continue;
+            const double scale = bin_count / extent;
+
+            for (size_t i = begin; i < end; ++i) {
+                const auto b = bin_of(centroids[indices[i]][axis], cmin, scale);
+                bins.add(axis, b, (*bounds)[indices[i]]);
+            }
+        }
+    }
+
+    /**
+    \brief Binned SAH split. Returns split axis and partitions indices around mid, or returns -1 when a leaf is cheaper.
+    */
+    int find_split(size_t begin, size_t end, const aabb& node_box, const aabb& centroid_box, size_t& mid) {
+        const size_t span = end - begin;
+        const double leaf_cost = intersection_cost(span);
+        const double node_area = surface_area(node_box);
+
+        split_bins bins;
+        const int parts = take_threads(span);
+        if (parts > 1) {
+            std::vector<split_bins> part_bins(parts);
+            parallel_parts(parts, span, [&](int part, size_t first, size_t last) {
+                fill_bins(begin + first, begin + last, centroid_box, part_bins[part]);
+            });
+            for (const auto& part : part_bins)
+                bins.merge(part);
+        }
+        else {
+            fill_bins(begin, end, centroid_box, bins);
+        }
+        release_threads(parts);
+
+        double best_cost = infinity;
+        int best_axis = -1;
+        int best_bin = 0;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            if (centroid_box.max()[axis] - centroid_box.min()[axis] <= 0)
+                continue;
+
+            const aabb* bin_box = bins.box[axis];
+            const size_t* bin_size = bins.size[axis];
+
+            // Sweep from the right to get area and count of every right side, then from the left to evaluate the planes.
+            double right_area[bin_count];
+            size_t right_size[bin_count];
+            aabb acc;
+            size_t acc_size = 0;
+            for (int b = bin_count - 1; b > 0; --b) {
+                if (bin_size[b]) {
+                    acc = acc_size ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+                    acc_size += bin_size[b];
+                }
+                right_area[b] = acc_size ? surface_area(acc) : 0.0;
+                right_size[b] = acc_size;
+            }
+
+            acc_size = 0;
+            for (int b = 0; b < bin_count - 1; ++b) {
+                if (bin_size[b]) {
+                    acc = acc_size ? surrounding_box(acc, bin_box[b]) : bin_box[b];
+                    acc_size += bin_size[b];
+                }
+                if (acc_size == 0 || right_size[b + 1] == 0)
+                    continue;
+
+                const double cost = 1.0 + (surface_area(acc) * intersection_cost(acc_size) + right_area[b + 1] * intersection_cost(right_size[b + 1])) / node_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = b;
+                }
+            }
+        }
+
+        if (best_axis < 0 || (best_cost >= leaf_cost && span <= max_leaf_size))
+            return -1;
+
+        const double cmin = centroid_box.min()[best_axis];
+        const double scale = bin_count / (centroid_box.max()[best_axis] - cmin);
+        auto middle = std::partition(indices.begin() + begin, indices.begin() + end,
+            [&](std::uint32_t p) { return bin_of(centroids[p][best_axis], cmin, scale) <= best_bin; });
+        mid = static_cast<size_t>(middle - indices.begin());
+
+        return best_axis;
+    }
+
+    /**
+    \brief Spreads the low 10 bits of v so there are two zero bits between any two of them.
+    */
+    static std::uint32_t spread_bits(std::uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    /**
+    \brief Computes 30 bit Morton codes of the centroids (10 bits per axis in the centroid box) and sorts the index array by them.
+    Code and index are sorted as one 64 bit key, so equal codes keep the index order. Parts are sorted on free threads and merged.
+    */
+    void sort_by_morton_code() {
+        const size_t count = indices.size();
+        aabb centroid_box(centroids[0], centroids[0]);
+        for (size_t i = 1; i < count; ++i)
+            centroid_box = surrounding_box(centroid_box, aabb(centroids[i], centroids[i]));
+
+        double scale[3];
+        for (int a = 0; a < 3; ++a) {
+            const double extent = centroid_box.max()[a] - centroid_box.min()[a];
+            scale[a] = extent > 0 ? 1023.0 / extent : 0.0;
+        }
+
+        std::vector<std::uint64_t> keys(count);
+        const int parts = take_threads(count);
+        parallel_parts(parts, count, [&](int, size_t first, size_t last) {
+            for (size_t i = first; i < last; ++i) {
+                std::uint32_t code = 0;
+                for (int a = 0; a < 3; ++a) {
+                    const auto cell = static_cast<std::uint32_t>((centroids[i][a] - centroid_box.min()[a]) * scale[a]);
+                    code |= spread_bits(std::min(cell, 1023u)) << (2 - a);
+                }
+                keys[i] = (static_cast<std::uint64_t>(code) << 32) | i;
+            }
+        });
+
+        std::vector<size_t> part_begin(parts + 1, count);
+        for (int k = 0; k < parts; ++k)
+            part_begin[k] = count * k / parts;
+        parallel_parts(parts, parts, [&](int, size_t first, size_t last) {
+            for (size_t k = first; k < last; ++k)
+                std::sort(keys.begin() + part_begin[k], keys.begin() + part_begin[k + 1]);
+        });
+        release_threads(parts);
+
+        for (size_t width = 1; width < static_cast<size_t>(parts); width *= 2) {
+            for (size_t k = 0; k + width < static_cast<size_t>(parts); k += 2 * width) {
+                std::inplace_merge(keys.begin() + part_begin[k], keys.begin() + part_begin[k + width],
+                    keys.begin() + part_begin[std::min(k + 2 * width, static_cast<size_t>(parts))]);
+            }
+        }
+
+        morton_codes.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            morton_codes[i] = static_cast<std::uint32_t>(keys[i] >> 32);
+            indices[i] = static_cast<std::uint32_t>(keys[i]);
+        }
+    }
+
+    /**
+    \brief Builds node for Morton sorted primitives [begin, end): splits where the highest bit that differs in the range turns to 1.
+    Node box is the union of the child boxes, so it is computed after the children.
+    */
+    void build_morton(size_t begin, size_t end, std::vector<flat_bvh_node>& out, int depth) {
+        const auto node_index = out.size();
+        out.emplace_back();
+
+        const size_t span = end - begin;
+        if (span <= static_cast<size_t>(std::max(leaf_width, 1))) {
+            aabb node_box, centroid_box;
+            range_bounds(begin, end, node_box, centroid_box);
+            set_bounds(out[node_index], node_box);
+            set_leaf(out[node_index], begin, span);
+            return;
+        }
+
+        const std::uint32_t first_code = morton_codes[begin];
+        const std::uint32_t last_code = morton_codes[end - 1];
+        size_t mid;
+        int split_axis;
+        if (first_code == last_code || needs_median_split(span, depth)) {
+            // Same cell (or the tree gets too deep): split the list in half
+            mid = begin + span / 2;
+            split_axis = 0;
+        }
+        else {
+            int bit = 31;
+            while (!(((first_code ^ last_code) >> bit) & 1))
+                --bit;
+            const std::uint32_t mask = 1u << bit;
+            mid = static_cast<size_t>(std::partition_point(morton_codes.begin() + begin, morton_codes.begin() + end,
+                [&](std::uint32_t code) { return (code & mask) == 0; }) - morton_codes.begin());
+            split_axis = 2 - bit % 3;
+        }
+
+        build_children(begin, mid, end, out, node_index, split_axis, depth, &bvh_tree::build_morton);
+
+        auto& node = out[node_index];
+        const auto& left = out[node_index + 1];
+        const auto& right = out[node.offset];
+        for (int a = 0; a < 3; ++a) {
+            node.bounds_min[a] = std::min(left.bounds_min[a], right.bounds_min[a]);
+            node.bounds_max[a] = std::max(left.bounds_max[a], right.bounds_max[a]);
+        }
+    }
+
+    /**
+    \brief SAH cost of testing n primitives, relative to one node test.
+    */
+    double intersection_cost(size_t n) const {
+        return static_cast<double>((n + leaf_width - 1) / leaf_width);
+    }
+
+    static int bin_of(double centroid, double cmin, double scale) {
+        auto b = static_cast<int>((centroid - cmin) * scale);
+        return b < 0 ? 0 : (b >= bin_count ? bin_count - 1 : b);
+    }
+
+    static int longest_axis(const aabb& box) {
+        auto d = box.max() - box.min();
+        return d.x() > d.y() ? (d.x() > d.z() ? 0 : 2) : (d.y() > d.z() ? 1 : 2);
+    }
+
+    static void set_leaf(flat_bvh_node& node, size_t first, size_t count) {
+        node.offset = static_cast<std::uint32_t>(first);
+        node.count = static_cast<std::uint16_t>(count);
+        node.axis = 0;
+    }
+
+    static void set_bounds(flat_bvh_node& node, const aabb& box) {
+        for (int a = 0; a < 3; ++a) {
+            node.bounds_min[a] = float_round_down(box.min()[a]);
+            node.bounds_max[a] = float_round_up(box.max()[a]);
+        }
+    }
+
+    int leaf_width = 1; // primitives per intersection test of the owner
+    const std::vector<aabb>* bounds = nullptr; // primitive boxes, only valid during build
+    std::vector<point3> centroids; // primitive centroids, only valid during build
+    std::vector<std::uint32_t> morton_codes; // sorted Morton codes of the lbvh build
+    std::atomic<int>* spare_threads = nullptr; // threads not used by the build yet, only valid during build
+};
+
+#endif
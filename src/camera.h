@@ -49,15 +49,17 @@ public:
 
     \param s u double that leads ray to particular pixel on x axis (horizontal)
     \param t v double that leads ray to particular pixel on y axis (vertical)
+    \param smp sampler of the current sample, gives the lens point (2 dimensions) and the time (1 dimension)
     */
-    ray get_ray(double s, double t) const {
-        vec3 rd = lens_radius * random_in_unit_disk();
+    ray get_ray(double s, double t, sampler& smp) const {
+        const auto lens = smp.get_2d(); // taken even without aperture, so the dimensions after it do not move
+        vec3 rd = lens_radius > 0 ? lens_radius * sample_in_unit_disk(lens.u, lens.v) : vec3(0, 0, 0);
         vec3 offset = u * rd.x() + v * rd.y(); // offset from lens
 
         return ray(
             origin + offset, // origin
             lower_left_corner + s * horizontal + t * vertical - origin - offset, // direction
-            random_double(time0, time1)
+            time0 + (time1 - time0) * smp.get_1d()
         );
     }
 
@@ -10,6 +10,13 @@
 
 #include <iostream>
 
+/**
+\brief Relative luminance of a linear color (Rec. 709 weights).
+*/
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
 /**
 \brief Output stream we use to generate ppm file.
 
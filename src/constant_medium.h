@@ -11,6 +11,7 @@
 #include "hittable.h"
 #include "material.h"
 #include "texture.h"
+#include "volume.h"
 
 /**
 \brief Volume of constant density. Medium tells how far the ray has to travel through the volume also determines how likely it is for the ray to make it through. 
@@ -20,22 +21,24 @@ The probability that the ray scatters in any small distance delta(L) is: probabi
 If you go through all the differential equations, for a random number you get a distance where the scattering occurs. If that distance is outside the volume, 
 then there is no 'hit'. For a constant volume we just need the density C and the boundary. I’ll use another hittable for the boundary.
 */
-class constant_medium : public hittable {
+class constant_medium final : public hittable {
 public:
     constant_medium(shared_ptr<hittable> b, double d, shared_ptr<texture> a)
-        : boundary(b),
+        : hittable(hittable_kind::constant_medium),
+        boundary(b),
         neg_inv_density(-1 / d),
         phase_function(make_shared<isotropic>(a))
     {}
 
     constant_medium(shared_ptr<hittable> b, double d, color c)
-        : boundary(b),
+        : hittable(hittable_kind::constant_medium),
+        boundary(b),
         neg_inv_density(-1 / d),
         phase_function(make_shared<isotropic>(c))
     {}
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         return boundary->bounding_box(time0, time1, output_box);
@@ -52,57 +55,20 @@ public:
 
 Once a ray exits the constant medium boundary, it will continue forever outside the boundary. 
 Put another way, it assumes that the boundary shape is convex. So this particular implementation will work for boundaries like boxes or spheres, 
-but will not work with toruses or shapes that contain voids.
+but will not work with toruses or shapes that contain voids. Entry and exit come from boundary_interval, in closed form for spheres and boxes.
 
 \param r ray that goes through object
 \param t_min minimum t(in a ray) which can be counted as a hit
 \param t_max maximum t(in a ray) which can be counted as a hit
 \param rec bunch of arguments in the struct
+\param gen generator of the current sample
 */
-bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    const bool enableDebug = false; // Print occasional samples when debugging. To enable, set enableDebug true.
-    const bool debugging = enableDebug && random_double() < 0.00001;
-
-    hit_record rec1, rec2;
-
-    if (!boundary->hit(r, -infinity, infinity, rec1))
-        return false;
-
-    if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2))
-        return false;
-
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
-
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
-
-    if (rec1.t >= rec2.t)
+bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    double t0, t1;
+    if (!boundary_interval(*boundary, r, t0, t1, gen))
         return false;
 
-    if (rec1.t < 0)
-        rec1.t = 0;
-
-    const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
-    const auto hit_distance = neg_inv_density * log(random_double());
-
-    if (hit_distance > distance_inside_boundary)
-        return false;
-
-    rec.t = rec1.t + hit_distance / ray_length;
-    rec.p = r.at(rec.t);
-
-    if (debugging) {
-        std::cerr << "hit_distance = " << hit_distance << '\n'
-            << "rec.t = " << rec.t << '\n'
-            << "rec.p = " << rec.p << '\n';
-    }
-
-    rec.normal = vec3(1, 0, 0);  // arbitrary
-    rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
-
-    return true;
+    return sample_homogeneous(r, std::max(t0, t_min), std::min(t1, t_max), neg_inv_density, phase_function.get(), rec, gen);
 }
 
 #endif
\ No newline at end of file
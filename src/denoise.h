@@ -0,0 +1,292 @@
+/**
+\file
+\brief .h file that contains the post-render denoise stage: an edge-avoiding A-Trous filter guided by the AOVs and an Open Image Denoise hook
+*/
+
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "utility.h"
+#include "color.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+/**
+\brief Open Image Denoise is used only when RT_ENABLE_OIDN is 1; the program then has to be linked with it (-lOpenImageDenoise).
+*/
+#ifndef RT_ENABLE_OIDN
+#define RT_ENABLE_OIDN 0
+#endif
+
+#if RT_ENABLE_OIDN
+#include <OpenImageDenoise/oidn.hpp>
+#endif
+
+/**
+\brief Post-render filter. It reads the averages, sample statistics and (if the framebuffer keeps them) AOVs, and writes one linear color per pixel.
+*/
+class denoiser {
+public:
+    virtual ~denoiser() {}
+
+    virtual const char* name() const = 0;
+
+    /**
+    \brief Filters the image. Returns false if it could not, output is then undefined.
+
+    \param fb rendered image
+    \param output filtered linear radiance in framebuffer order, resized here
+    \param threads number of threads
+    */
+    virtual bool denoise(const framebuffer& fb, std::vector<color>& output, int threads) const = 0;
+};
+
+/**
+\brief Edge-avoiding A-Trous wavelet filter (Dammertz et al. 2010) with the variance guided luminance weight of SVGF (Schied et al. 2017).
+
+Every iteration is a 5x5 B3 spline kernel whose taps are step = 2^iteration pixels apart, so five iterations cover 125 pixels with 25 taps each.
+Tap weights fall off with the difference of normals and depth and with the luminance difference relative to the noise (standard error) of the pixel,
+whose estimate is filtered along. Color is divided by the albedo first and multiplied back at the end, so textures stay sharp, and lights
+seen directly (emission AOV) are left out of the filter, so they do not bleed into their surroundings.
+Without AOVs (e.g. distributed renders) only luminance stops the filter.
+*/
+class atrous_denoiser : public denoiser {
+public:
+    virtual const char* name() const override { return "A-Trous"; }
+
+    virtual bool denoise(const framebuffer& fb, std::vector<color>& output, int threads) const override;
+
+public:
+    int iterations = 5;
+    double sigma_luminance = 4; // luminance differences of that many standard errors get weight 1/e
+    double sigma_normal = 128; // exponent of the cosine between normals
+    double sigma_depth = 1; // depth differences of that many times the depth gradient over the tap offset get weight 1/e
+
+private:
+    struct guide {
+        vec3 normal;
+        double depth;
+        double depth_dx, depth_dy; // screen space depth gradient
+        bool surface; // camera ray hit something
+    };
+
+    void iterate(int width, int height, int step, bool guided, const std::vector<guide>& guides, const std::vector<color>& in,
+        const std::vector<double>& in_variance, std::vector<color>& out, std::vector<double>& out_variance, int threads) const;
+};
+
+inline bool atrous_denoiser::denoise(const framebuffer& fb, std::vector<color>& output, int threads) const {
+    const int width = fb.width, height = fb.height;
+    const size_t count = fb.pixels.size();
+    const bool guided = fb.has_aovs();
+    const double tiny = 1e-4;
+
+    // Demodulated illumination, variance of its mean luminance and guides
+
+    std::vector<color> albedo(count, color(1, 1, 1)), illumination(count), next(count);
+    std::vector<double> variance(count), next_variance(count);
+    std::vector<guide> guides(count, guide{ vec3(0, 0, 0), 0, 0, 0, false });
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            const size_t k = fb.index(i, j);
+            color c = fb.average(i, j);
+            if (guided) {
+                c = c - fb.emission(i, j); // lights seen directly are exact, they are added back after the filter
+                const color a = fb.albedo(i, j);
+                albedo[k] = color(a.x() > tiny ? a.x() : 1, a.y() > tiny ? a.y() : 1, a.z() > tiny ? a.z() : 1);
+                const vec3 n = fb.normal(i, j);
+                guides[k].surface = n.length_squared() > 0.01;
+                guides[k].normal = guides[k].surface ? unit_vector(n) : vec3(0, 0, 0);
+                guides[k].depth = fb.depth(i, j);
+            }
+            illumination[k] = color(c.x() / albedo[k].x(), c.y() / albedo[k].y(), c.z() / albedo[k].z());
+
+            const int n = fb.samples[k];
+            const double y = luminance(illumination[k]);
+            const double a = std::max(tiny, luminance(albedo[k]));
+            variance[k] = n > 1 ? fb.m2[k] / (n - 1) / n / (a * a) : y * y; // one sample: as noisy as it is bright
+        }
+    }
+    if (guided) {
+        for (int j = 0; j < height; ++j) {
+            for (int i = 0; i < width; ++i) {
+                auto& g = guides[fb.index(i, j)];
+                const auto& left = guides[fb.index(std::max(i - 1, 0), j)];
+                const auto& right = guides[fb.index(std::min(i + 1, width - 1), j)];
+                const auto& down = guides[fb.index(i, std::max(j - 1, 0))];
+                const auto& up = guides[fb.index(i, std::min(j + 1, height - 1))];
+                g.depth_dx = std::min(std::fabs(right.depth - g.depth), std::fabs(g.depth - left.depth)); // one sided: silhouettes stay edges
+                g.depth_dy = std::min(std::fabs(up.depth - g.depth), std::fabs(g.depth - down.depth));
+            }
+        }
+    }
+
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        iterate(width, height, 1 << iteration, guided, guides, illumination, variance, next, next_variance, threads);
+        illumination.swap(next);
+        variance.swap(next_variance);
+    }
+
+    output.resize(count);
+    for (int j = 0; j < height; ++j) {
+        for (int i = 0; i < width; ++i) {
+            const size_t k = fb.index(i, j);
+            output[k] = illumination[k] * albedo[k];
+            if (guided)
+                output[k] += fb.emission(i, j);
+        }
+    }
+    return true;
+}
+
+inline void atrous_denoiser::iterate(int width, int height, int step, bool guided, const std::vector<guide>& guides, const std::vector<color>& in,
+    const std::vector<double>& in_variance, std::vector<color>& out, std::vector<double>& out_variance, int threads) const
+{
+    static const double kernel[3] = { 3.0 / 8, 1.0 / 4, 1.0 / 16 }; // B3 spline, by distance from the center
+
+    parallel_parts(std::max(1, threads), static_cast<size_t>(height), [&](int, size_t row_begin, size_t row_end) {
+        for (int j = static_cast<int>(row_begin); j < static_cast<int>(row_end); ++j) {
+            for (int i = 0; i < width; ++i) {
+                const size_t p = static_cast<size_t>(j) * width + i;
+                const guide& gp = guides[p];
+                const double yp = luminance(in[p]);
+
+                // Noise of the pixel, smoothed over its 3x3 neighbourhood so single outliers do not stop the filter
+                double local_variance = 0, local_weight = 0;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        const int x = i + dx, y = j + dy;
+                        if (x < 0 || x >= width || y < 0 || y >= height)
+                            continue;
+                        const double h = (dx == 0 ? 0.5 : 0.25) * (dy == 0 ? 0.5 : 0.25);
+                        local_variance += h * in_variance[static_cast<size_t>(y) * width + x];
+                        local_weight += h;
+                    }
+                }
+                const double luminance_scale = sigma_luminance * sqrt(std::max(0.0, local_variance / local_weight)) + 1e-10;
+
+                color sum(0, 0, 0);
+                double variance_sum = 0, weight_sum = 0;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        const int x = i + dx * step, y = j + dy * step;
+                        if (x < 0 || x >= width || y < 0 || y >= height)
+                            continue;
+                        const size_t q = static_cast<size_t>(y) * width + x;
+                        const guide& gq = guides[q];
+
+                        double w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+                        w *= std::exp(-std::fabs(yp - luminance(in[q])) / luminance_scale);
+                        if (guided && (gp.surface || gq.surface)) {
+                            if (gp.surface != gq.surface)
+                                continue;
+                            w *= std::pow(std::max(0.0, static_cast<double>(dot(gp.normal, gq.normal))), sigma_normal);
+                            const double depth_scale = sigma_depth * step * (std::abs(dx) * gp.depth_dx + std::abs(dy) * gp.depth_dy) + 1e-3 * gp.depth + 1e-10;
+                            w *= std::exp(-std::fabs(gp.depth - gq.depth) / depth_scale);
+                        }
+                        sum += w * in[q];
+                        variance_sum += w * w * in_variance[q];
+                        weight_sum += w;
+                    }
+                }
+                // Center tap always has weight kernel[0]^2
+                out[p] = sum / weight_sum;
+                out_variance[p] = variance_sum / (weight_sum * weight_sum);
+            }
+        }
+    });
+}
+
+#if RT_ENABLE_OIDN
+
+/**
+\brief Intel Open Image Denoise (the "RT" filter for HDR images) with albedo and normal AOVs when the framebuffer keeps them.
+*/
+class oidn_denoiser : public denoiser {
+public:
+    virtual const char* name() const override { return "Open Image Denoise"; }
+
+    virtual bool denoise(const framebuffer& fb, std::vector<color>& output, int threads) const override {
+        const size_t count = fb.pixels.size();
+        std::vector<float> beauty(3 * count), albedo, normal, filtered(3 * count);
+        auto store = [](std::vector<float>& buffer, size_t k, const vec3& v) {
+            buffer[3 * k] = static_cast<float>(v.x());
+            buffer[3 * k + 1] = static_cast<float>(v.y());
+            buffer[3 * k + 2] = static_cast<float>(v.z());
+        };
+
+        // OIDN wants the top row first
+        for (int j = 0; j < fb.height; ++j) {
+            for (int i = 0; i < fb.width; ++i) {
+                const size_t k = static_cast<size_t>(fb.height - 1 - j) * fb.width + i;
+                store(beauty, k, fb.average(i, j));
+                if (fb.has_aovs()) {
+                    albedo.resize(3 * count);
+                    normal.resize(3 * count);
+                    store(albedo, k, fb.albedo(i, j));
+                    store(normal, k, fb.normal(i, j));
+                }
+            }
+        }
+
+        oidn::DeviceRef device = oidn::newDevice();
+        device.set("numThreads", threads);
+        device.commit();
+
+        oidn::FilterRef filter = device.newFilter("RT");
+        filter.setImage("color", beauty.data(), oidn::Format::Float3, fb.width, fb.height);
+        if (!albedo.empty()) {
+            filter.setImage("albedo", albedo.data(), oidn::Format::Float3, fb.width, fb.height);
+            filter.setImage("normal", normal.data(), oidn::Format::Float3, fb.width, fb.height);
+        }
+        filter.setImage("output", filtered.data(), oidn::Format::Float3, fb.width, fb.height);
+        filter.set("hdr", true);
+        filter.commit();
+        filter.execute();
+
+        const char* message = nullptr;
+        if (device.getError(message) != oidn::Error::None) {
+            std::cerr << "Open Image Denoise: " << (message ? message : "error") << "\n";
+            return false;
+        }
+
+        output.resize(count);
+        for (int j = 0; j < fb.height; ++j) {
+            for (int i = 0; i < fb.width; ++i) {
+                const size_t k = static_cast<size_t>(fb.height - 1 - j) * fb.width + i;
+                output[fb.index(i, j)] = color(filtered[3 * k], filtered[3 * k + 1], filtered[3 * k + 2]);
+            }
+        }
+        return true;
+    }
+};
+
+#endif
+
+/**
+\brief Denoiser by name: "atrous", or "oidn" when built with RT_ENABLE_OIDN. Returns nullptr for other names.
+*/
+inline shared_ptr<denoiser> make_denoiser(const std::string& name) {
+    if (name == "atrous")
+        return make_shared<atrous_denoiser>();
+#if RT_ENABLE_OIDN
+    if (name == "oidn")
+        return make_shared<oidn_denoiser>();
+#endif
+    return nullptr;
+}
+
+/**
+\brief Replaces the averages of the framebuffer with the filtered colors. Sample counts and statistics stay, so the image is written as usual.
+*/
+inline void apply_denoised(framebuffer& fb, const std::vector<color>& output) {
+    for (size_t k = 0; k < fb.pixels.size(); ++k)
+        if (fb.samples[k] > 0)
+            fb.pixels[k] = output[k] * fb.samples[k];
+}
+
+#endif
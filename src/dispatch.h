@@ -0,0 +1,71 @@
+/**
+\file
+\brief .h file that contains hit_primitive: intersection of the built-in hittables without virtual calls
+*/
+
+#ifndef DISPATCH_H
+#define DISPATCH_H
+
+#include "utility.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "sphere_batch.h"
+#include "aarect.h"
+#include "box.h"
+#include "box_batch.h"
+#include "triangle_mesh.h"
+#include "constant_medium.h"
+#include "volume.h"
+#include "bvh.h"
+#include "instance.h"
+
+/**
+\brief Intersects a hittable. Built-in types are called with a qualified (non-virtual) call the compiler can inline,
+instances and containers call hit_primitive again for their children, so translate(rotate_y(bvh)) makes no virtual call at all.
+*/
+inline bool hit_primitive(const hittable& object, const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) {
+    switch (object.kind) {
+    case hittable_kind::sphere:
+        return kind_cast<sphere>(object).sphere::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::moving_sphere:
+        return kind_cast<moving_sphere>(object).moving_sphere::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::xy_rect:
+        return kind_cast<xy_rect>(object).xy_rect::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::xz_rect:
+        return kind_cast<xz_rect>(object).xz_rect::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::yz_rect:
+        return kind_cast<yz_rect>(object).yz_rect::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::box:
+        return kind_cast<box>(object).box::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::box_batch:
+        return kind_cast<box_batch>(object).box_batch::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::sphere_batch:
+        return kind_cast<sphere_batch>(object).sphere_batch::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::triangle_mesh:
+        return kind_cast<triangle_mesh>(object).triangle_mesh::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::constant_medium:
+        return kind_cast<constant_medium>(object).constant_medium::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::grid_medium:
+        return kind_cast<grid_medium>(object).grid_medium::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::fog:
+        return kind_cast<fog_medium>(object).fog_medium::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::translate:
+        return kind_cast<translate>(object).translate::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::rotate_y:
+        return kind_cast<rotate_y>(object).rotate_y::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::instance:
+        return kind_cast<instance>(object).instance::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::list:
+        return kind_cast<hittable_list>(object).hittable_list::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::bvh:
+        return kind_cast<flat_bvh>(object).flat_bvh::hit(r, t_min, t_max, rec, gen);
+    case hittable_kind::custom:
+        break;
+    }
+    return object.hit(r, t_min, t_max, rec, gen);
+}
+
+#endif
@@ -0,0 +1,653 @@
+/**
+\file
+\brief .h file that contains distributed rendering: a coordinator deals tiles and sample ranges to worker processes over TCP and merges their pixels
+*/
+
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include "utility.h"
+#include "renderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <csignal>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+/**
+\brief What is rendered. Coordinator and workers must agree on it, so workers are started with the same scene options as the coordinator.
+*/
+struct render_job {
+    std::int32_t width;
+    std::int32_t height;
+    std::int32_t samples_per_pixel;
+    std::uint32_t seed;
+    std::uint64_t scene_hash; // see hash_bytes, e.g. of the scene_view and the size of the scene BVH
+
+    bool operator==(const render_job& other) const {
+        return width == other.width && height == other.height && samples_per_pixel == other.samples_per_pixel
+            && seed == other.seed && scene_hash == other.scene_hash;
+    }
+};
+
+/**
+\brief FNV-1a hash of bytes, continued from hash.
+*/
+inline std::uint64_t hash_bytes(const void* data, size_t size, std::uint64_t hash = 0xcbf29ce484222325ull) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    for (size_t k = 0; k < size; ++k) {
+        hash ^= bytes[k];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/**
+\brief Samples [first_sample, first_sample + sample_count) of the pixels of one tile.
+*/
+struct work_unit {
+    std::uint32_t id;
+    std::int32_t x0, y0; // lower left pixel (inclusive)
+    std::int32_t x1, y1; // upper right pixel (exclusive)
+    std::int32_t first_sample;
+    std::int32_t sample_count;
+};
+
+namespace net_detail {
+    const std::uint32_t magic = 0x574e5452; // "RTNW"
+    const std::uint32_t version = 1;
+    const std::uint32_t byte_order = 0x01020304; // machines of one cluster must share the byte order
+
+    enum class message : std::uint32_t {
+        hello = 1, // worker -> coordinator: hello_message
+        unit = 2, // coordinator -> worker: work_unit
+        result = 3, // worker -> coordinator: unit id, then a pixel_record per pixel of the unit, rows from the bottom
+        done = 4, // coordinator -> worker: all units are merged, exit
+        reject = 5 // coordinator -> worker: other job or protocol
+    };
+
+    struct message_header {
+        std::uint32_t type;
+        std::uint32_t size; // bytes that follow
+    };
+
+    struct hello_message {
+        std::uint32_t magic;
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::int32_t capacity; // units the worker renders at once
+        render_job job;
+    };
+
+    /**
+    \brief Pixel of a result, the framebuffer accumulators of the samples of the unit.
+    */
+    struct pixel_record {
+        double sum[3];
+        double mean;
+        double m2;
+        std::int32_t samples;
+        std::int32_t padding;
+    };
+
+#ifdef _WIN32
+    typedef SOCKET socket_handle;
+    const socket_handle invalid_socket = INVALID_SOCKET;
+    inline void close_socket(socket_handle s) { closesocket(s); }
+    inline int poll_sockets(pollfd* fds, size_t count, int timeout_ms) { return WSAPoll(fds, static_cast<ULONG>(count), timeout_ms); }
+#else
+    typedef int socket_handle;
+    const socket_handle invalid_socket = -1;
+    inline void close_socket(socket_handle s) { close(s); }
+    inline int poll_sockets(pollfd* fds, size_t count, int timeout_ms) { return poll(fds, static_cast<nfds_t>(count), timeout_ms); }
+#endif
+
+    /**
+    \brief Starts the socket library. A peer that goes away must not kill the process with SIGPIPE, writes just fail.
+    */
+    inline bool start_network() {
+#ifdef _WIN32
+        WSADATA data;
+        return WSAStartup(MAKEWORD(2, 2), &data) == 0;
+#else
+        std::signal(SIGPIPE, SIG_IGN);
+        return true;
+#endif
+    }
+
+    /**
+    \brief Lets TCP notice a peer whose node is gone (no FIN ever comes) in about half a minute.
+    */
+    inline void set_keepalive(socket_handle s) {
+        int on = 1;
+        setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char*>(&on), sizeof(on));
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+#ifdef TCP_KEEPIDLE
+        int idle = 10, interval = 5, count = 3;
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPINTVL, &interval, sizeof(interval));
+        setsockopt(s, IPPROTO_TCP, TCP_KEEPCNT, &count, sizeof(count));
+#endif
+    }
+
+    /**
+    \brief Makes a send to a peer that stopped reading fail after seconds instead of blocking forever.
+    */
+    inline void set_send_timeout(socket_handle s, int seconds) {
+#ifdef _WIN32
+        const DWORD timeout = static_cast<DWORD>(seconds) * 1000;
+#else
+        timeval timeout = {};
+        timeout.tv_sec = seconds;
+#endif
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+    }
+
+    inline bool send_all(socket_handle s, const void* data, size_t size) {
+        const char* p = static_cast<const char*>(data);
+        while (size > 0) {
+            const auto n = send(s, p, static_cast<int>(std::min<size_t>(size, 1 << 30)), 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    inline bool recv_all(socket_handle s, void* data, size_t size) {
+        char* p = static_cast<char*>(data);
+        while (size > 0) {
+            const auto n = recv(s, p, static_cast<int>(std::min<size_t>(size, 1 << 30)), 0);
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    inline bool send_message(socket_handle s, message type, const void* payload, size_t size) {
+        const message_header header = { static_cast<std::uint32_t>(type), static_cast<std::uint32_t>(size) };
+        return send_all(s, &header, sizeof(header)) && (size == 0 || send_all(s, payload, size));
+    }
+
+    /**
+    \brief Reads one message. Payloads of more than max_size bytes are refused, a broken peer cannot make us allocate anything.
+    */
+    inline bool recv_message(socket_handle s, message& type, std::vector<char>& payload, size_t max_size) {
+        message_header header;
+        if (!recv_all(s, &header, sizeof(header)) || header.size > max_size)
+            return false;
+        type = static_cast<message>(header.type);
+        payload.resize(header.size);
+        return header.size == 0 || recv_all(s, payload.data(), header.size);
+    }
+
+    inline size_t result_size(const work_unit& u) {
+        return sizeof(std::uint32_t) + static_cast<size_t>(u.x1 - u.x0) * (u.y1 - u.y0) * sizeof(pixel_record);
+    }
+}
+
+/**
+\brief Deals work units to worker processes and merges the pixels they send back into the framebuffer.
+
+Units are tiles times ranges of samples, so one frame spreads over as many cores as there are units, on any number of nodes.
+Every sample seeds its generator from its pixel and index (rng::for_sample), so the merged image is the one a single process renders.
+Units of a worker whose connection breaks (process died or, through TCP keepalive, node lost) go back to the front of the queue
+and the other workers render them. Messages are read as bytes arrive, so a worker that stalls in the middle of one never blocks the
+coordinator; a worker that keeps a unit past its deadline is dropped the same way.
+*/
+class render_coordinator {
+public:
+    /**
+    \param target framebuffer that receives the merged samples, its size must match the job
+    \param job what the workers must have loaded
+    \param tile_size tile side in pixels
+    \param unit_samples samples per pixel of one unit
+    \param unit_timeout seconds a worker may keep a unit, or 4 times the slowest unit so far if that is longer
+    */
+    render_coordinator(framebuffer& target, const render_job& job, int tile_size, int unit_samples, double unit_timeout = 120)
+        : fb(target), expected(job), timeout(std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(unit_timeout)))
+    {
+        unit_samples = std::max(1, unit_samples);
+        for (int y0 = 0; y0 < fb.height; y0 += tile_size) {
+            for (int x0 = 0; x0 < fb.width; x0 += tile_size) {
+                for (int s = 0; s < job.samples_per_pixel; s += unit_samples) {
+                    work_unit u;
+                    u.id = static_cast<std::uint32_t>(units.size());
+                    u.x0 = x0;
+                    u.y0 = y0;
+                    u.x1 = std::min(x0 + tile_size, fb.width);
+                    u.y1 = std::min(y0 + tile_size, fb.height);
+                    u.first_sample = s;
+                    u.sample_count = std::min(unit_samples, job.samples_per_pixel - s);
+                    units.push_back(u);
+                }
+            }
+        }
+        // Tiles first, then samples: early units cover the whole image
+        for (int s = 0; s < job.samples_per_pixel; s += unit_samples)
+            for (const auto& u : units)
+                if (u.first_sample == s)
+                    queue.push_back(u.id);
+        merged.assign(units.size(), 0);
+    }
+
+    /**
+    \brief Listens on port and returns when every unit is merged. Returns false if the port cannot be opened.
+    */
+    bool run(int port);
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct issued_unit {
+        std::uint32_t id;
+        clock::time_point sent;
+    };
+
+    struct connection {
+        net_detail::socket_handle socket;
+        std::string name; // address of the worker
+        int capacity = 0; // 0 until the worker said hello
+        std::vector<issued_unit> in_flight; // units sent and not merged yet, oldest first
+        std::vector<char> inbox; // bytes received of messages that are not complete yet
+    };
+
+    /**
+    \brief Closes the connection and puts its units back in front of the queue.
+    */
+    void drop(connection& c, const char* reason) {
+        if (c.capacity > 0 || !c.in_flight.empty()) {
+            std::cerr << "\nWorker " << c.name << " " << reason << ", " << c.in_flight.size() << " units re-issued.\n";
+        }
+        for (auto it = c.in_flight.rbegin(); it != c.in_flight.rend(); ++it)
+            queue.push_front(it->id);
+        c.in_flight.clear();
+        net_detail::close_socket(c.socket);
+        c.socket = net_detail::invalid_socket;
+    }
+
+    /**
+    \brief Reads the bytes a worker has sent (poll said there are some) and handles the messages they complete, false drops the worker.
+    */
+    bool receive(connection& c);
+
+    /**
+    \brief Handles one message of a worker, false drops the worker.
+    */
+    bool handle(connection& c, net_detail::message type, const std::vector<char>& payload);
+
+    /**
+    \brief Adds the pixels of a result to the framebuffer.
+    */
+    bool merge(connection& c, const std::vector<char>& payload);
+
+    framebuffer& fb;
+    render_job expected;
+    std::vector<work_unit> units;
+    std::deque<std::uint32_t> queue; // units waiting for a worker
+    std::vector<char> merged; // 1 if the unit is in the framebuffer
+    size_t merged_count = 0;
+    clock::duration timeout; // shortest deadline of a unit
+    clock::duration slowest = clock::duration::zero(); // longest time from sending a unit to merging it
+};
+
+inline bool render_coordinator::run(int port) {
+    using namespace net_detail;
+    if (!start_network())
+        return false;
+
+    const socket_handle listener = socket(AF_INET6, SOCK_STREAM, 0);
+    if (listener == invalid_socket) {
+        std::cerr << "ERROR: Cannot open a socket.\n";
+        return false;
+    }
+    int on = 1, off = 0;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, reinterpret_cast<const char*>(&off), sizeof(off)); // IPv4 workers too
+
+    sockaddr_in6 address = {};
+    address.sin6_family = AF_INET6;
+    address.sin6_addr = in6addr_any;
+    address.sin6_port = htons(static_cast<std::uint16_t>(port));
+    if (bind(listener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 64) != 0) {
+        std::cerr << "ERROR: Cannot listen on port " << port << ".\n";
+        close_socket(listener);
+        return false;
+    }
+    std::cerr << "Waiting for workers on port " << port << ", " << units.size() << " units.\n";
+
+    std::vector<connection> workers;
+    std::vector<pollfd> fds;
+    auto last_report = clock::now() - std::chrono::seconds(1);
+
+    while (merged_count < units.size()) {
+        fds.clear();
+        fds.push_back({ listener, POLLIN, 0 });
+        for (const auto& c : workers)
+            fds.push_back({ c.socket, POLLIN, 0 });
+        if (poll_sockets(fds.data(), fds.size(), 1000) < 0)
+            continue;
+
+        if (fds[0].revents & POLLIN) {
+            sockaddr_storage peer;
+            socklen_t peer_size = sizeof(peer);
+            const socket_handle s = accept(listener, reinterpret_cast<sockaddr*>(&peer), &peer_size);
+            if (s != invalid_socket) {
+                set_keepalive(s);
+                set_send_timeout(s, 10);
+                char host[NI_MAXHOST] = "?";
+                getnameinfo(reinterpret_cast<const sockaddr*>(&peer), peer_size, host, sizeof(host), nullptr, 0, NI_NUMERICHOST);
+                connection c;
+                c.socket = s;
+                c.name = host;
+                workers.push_back(c);
+            }
+        }
+
+        for (size_t k = 1; k < fds.size(); ++k) {
+            auto& c = workers[k - 1];
+            if (fds[k].revents & (POLLIN | POLLHUP | POLLERR)) {
+                if (!receive(c))
+                    drop(c, "lost");
+            }
+        }
+
+        // A unit that takes much longer than any so far belongs to a stalled worker
+        const auto deadline = std::max(timeout, 4 * slowest);
+        for (auto& c : workers) {
+            if (c.socket != invalid_socket && !c.in_flight.empty() && clock::now() - c.in_flight.front().sent > deadline)
+                drop(c, "timed out");
+        }
+        workers.erase(std::remove_if(workers.begin(), workers.end(),
+            [](const connection& c) { return c.socket == invalid_socket; }), workers.end());
+
+        // Two units per render thread, so a worker never waits for the next one
+        for (auto& c : workers) {
+            while (c.capacity > 0 && static_cast<int>(c.in_flight.size()) < 2 * c.capacity && !queue.empty()) {
+                const std::uint32_t id = queue.front();
+                if (!send_message(c.socket, message::unit, &units[id], sizeof(work_unit))) {
+                    drop(c, "lost");
+                    break;
+                }
+                queue.pop_front();
+                c.in_flight.push_back({ id, clock::now() });
+            }
+        }
+        workers.erase(std::remove_if(workers.begin(), workers.end(),
+            [](const connection& c) { return c.socket == invalid_socket; }), workers.end());
+
+        const auto now = clock::now();
+        if (now - last_report >= std::chrono::milliseconds(250) || merged_count == units.size()) {
+            last_report = now;
+            std::cerr << "\rUnits remaining: " << units.size() - merged_count << ", workers: " << workers.size() << ' ' << std::flush;
+        }
+    }
+
+    for (auto& c : workers) {
+        send_message(c.socket, message::done, nullptr, 0);
+        close_socket(c.socket);
+    }
+    close_socket(listener);
+    return true;
+}
+
+inline bool render_coordinator::receive(connection& c) {
+    using namespace net_detail;
+    const size_t chunk = 1 << 16;
+    const size_t used = c.inbox.size();
+    c.inbox.resize(used + chunk);
+    const auto n = recv(c.socket, c.inbox.data() + used, static_cast<int>(chunk), 0);
+    if (n <= 0)
+        return false;
+    c.inbox.resize(used + static_cast<size_t>(n));
+
+    // Payloads of more than a whole image are refused, a broken peer cannot make us keep anything
+    const size_t max_size = std::max(sizeof(std::uint32_t) + static_cast<size_t>(fb.width) * fb.height * sizeof(pixel_record), sizeof(hello_message));
+    size_t start = 0;
+    std::vector<char> payload;
+    while (c.inbox.size() - start >= sizeof(message_header)) {
+        message_header header;
+        std::memcpy(&header, c.inbox.data() + start, sizeof(header));
+        if (header.size > max_size)
+            return false;
+        if (c.inbox.size() - start - sizeof(header) < header.size)
+            break;
+        const char* body = c.inbox.data() + start + sizeof(header);
+        payload.assign(body, body + header.size);
+        start += sizeof(header) + header.size;
+        if (!handle(c, static_cast<message>(header.type), payload))
+            return false;
+    }
+    c.inbox.erase(c.inbox.begin(), c.inbox.begin() + start);
+    return true;
+}
+
+inline bool render_coordinator::handle(connection& c, net_detail::message type, const std::vector<char>& payload) {
+    using namespace net_detail;
+    if (type == message::hello) {
+        hello_message hello;
+        if (payload.size() != sizeof(hello))
+            return false;
+        std::memcpy(&hello, payload.data(), sizeof(hello));
+        if (hello.magic != magic || hello.version != version || hello.byte_order != byte_order || !(hello.job == expected)) {
+            std::cerr << "\nWorker " << c.name << " rejected: it renders another scene or speaks another protocol.\n";
+            send_message(c.socket, message::reject, nullptr, 0);
+            return false;
+        }
+        c.capacity = std::max(1, hello.capacity);
+        std::cerr << "\nWorker " << c.name << " joined with " << c.capacity << " threads.\n";
+        return true;
+    }
+    if (type == message::result && c.capacity > 0)
+        return merge(c, payload);
+    return false;
+}
+
+inline bool render_coordinator::merge(connection& c, const std::vector<char>& payload) {
+    using namespace net_detail;
+    std::uint32_t id;
+    if (payload.size() < sizeof(id))
+        return false;
+    std::memcpy(&id, payload.data(), sizeof(id));
+
+    const auto it = std::find_if(c.in_flight.begin(), c.in_flight.end(), [id](const issued_unit& u) { return u.id == id; });
+    if (it == c.in_flight.end() || payload.size() != result_size(units[id]))
+        return false;
+    slowest = std::max(slowest, clock::now() - it->sent);
+    c.in_flight.erase(it);
+
+    const work_unit& u = units[id];
+    const char* p = payload.data() + sizeof(id);
+    for (int j = u.y0; j < u.y1; ++j) {
+        for (int i = u.x0; i < u.x1; ++i) {
+            pixel_record px;
+            std::memcpy(&px, p, sizeof(px));
+            p += sizeof(px);
+            fb.merge_samples(i, j, color(px.sum[0], px.sum[1], px.sum[2]), px.samples, px.mean, px.m2);
+        }
+    }
+    merged[id] = 1;
+    ++merged_count;
+    return true;
+}
+
+/**
+\brief Connects to the coordinator, renders the units it sends on threads threads and sends back their pixels until it says done.
+
+Connection is retried for a minute, so workers can be started before the coordinator has built its scene. Returns number of units
+rendered, or -1 if the coordinator could not be reached or rejected the worker.
+
+\param address host:port of the coordinator
+\param job what this process has loaded
+\param threads render threads, one unit each
+\param render_unit function (const work_unit&, framebuffer&) that renders the unit into a framebuffer of the unit size, pixel (0, 0) is (x0, y0)
+*/
+template <typename unit_function>
+int run_render_worker(const char* address, const render_job& job, int threads, const unit_function& render_unit) {
+    using namespace net_detail;
+    if (!start_network())
+        return -1;
+
+    const std::string text(address);
+    const size_t colon = text.rfind(':');
+    if (colon == std::string::npos) {
+        std::cerr << "ERROR: Coordinator address '" << address << "' is not host:port.\n";
+        return -1;
+    }
+    std::string host = text.substr(0, colon);
+    const std::string port = text.substr(colon + 1);
+    if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    socket_handle s = invalid_socket;
+    const auto give_up = std::chrono::steady_clock::now() + std::chrono::minutes(1);
+    while (s == invalid_socket && std::chrono::steady_clock::now() < give_up) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) == 0) {
+            for (addrinfo* a = found; a && s == invalid_socket; a = a->ai_next) {
+                s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                if (s != invalid_socket && connect(s, a->ai_addr, static_cast<int>(a->ai_addrlen)) != 0) {
+                    close_socket(s);
+                    s = invalid_socket;
+                }
+            }
+            freeaddrinfo(found);
+        }
+        if (s == invalid_socket)
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+    if (s == invalid_socket) {
+        std::cerr << "ERROR: Cannot connect to the coordinator at '" << address << "'.\n";
+        return -1;
+    }
+    set_keepalive(s);
+
+    threads = std::max(1, threads);
+    hello_message hello = { magic, version, byte_order, threads, job };
+    if (!send_message(s, message::hello, &hello, sizeof(hello))) {
+        close_socket(s);
+        return -1;
+    }
+    std::cerr << "Connected to the coordinator at '" << address << "'.\n";
+
+    std::mutex lock; // guards units and stop
+    std::condition_variable wake;
+    std::deque<work_unit> waiting;
+    bool stop = false;
+    std::mutex send_lock; // one result at a time on the socket
+    int rendered = 0;
+
+    auto render_thread = [&]() {
+        std::vector<char> payload;
+        while (true) {
+            work_unit u;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&] { return stop || !waiting.empty(); });
+                if (stop)
+                    return;
+                u = waiting.front();
+                waiting.pop_front();
+            }
+
+            framebuffer pixels(u.x1 - u.x0, u.y1 - u.y0);
+            render_unit(u, pixels);
+
+            payload.resize(result_size(u));
+            std::memcpy(payload.data(), &u.id, sizeof(u.id));
+            char* p = payload.data() + sizeof(u.id);
+            for (int j = 0; j < pixels.height; ++j) {
+                for (int i = 0; i < pixels.width; ++i) {
+                    const size_t k = pixels.index(i, j);
+                    const color& c = pixels.pixels[k];
+                    const pixel_record px = { { c.x(), c.y(), c.z() }, pixels.mean[k], pixels.m2[k], pixels.samples[k], 0 };
+                    std::memcpy(p, &px, sizeof(px));
+                    p += sizeof(px);
+                }
+            }
+
+            std::lock_guard<std::mutex> guard(send_lock);
+            if (!send_message(s, message::result, payload.data(), payload.size())) {
+                std::lock_guard<std::mutex> stop_guard(lock);
+                stop = true;
+                wake.notify_all();
+                return;
+            }
+            ++rendered;
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (int k = 0; k < threads; ++k)
+        pool.emplace_back(render_thread);
+
+    bool accepted = true;
+    message type;
+    std::vector<char> payload;
+    while (recv_message(s, type, payload, sizeof(work_unit))) {
+        if (type == message::unit && payload.size() == sizeof(work_unit)) {
+            work_unit u;
+            std::memcpy(&u, payload.data(), sizeof(u));
+            if (u.x0 < 0 || u.y0 < 0 || u.x1 > job.width || u.y1 > job.height || u.x0 >= u.x1 || u.y0 >= u.y1)
+                break;
+            std::lock_guard<std::mutex> guard(lock);
+            waiting.push_back(u);
+            wake.notify_one();
+        }
+        else {
+            accepted = type != message::reject;
+            break;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+        wake.notify_all();
+    }
+    for (auto& t : pool)
+        t.join();
+    net_detail::close_socket(s);
+
+    if (!accepted) {
+        std::cerr << "ERROR: Coordinator rejected this worker, start it with the same scene and image options.\n";
+        return -1;
+    }
+    return rendered;
+}
+
+#endif
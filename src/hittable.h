@@ -7,23 +7,79 @@
 #define HITTABLE_H
 
 #include "ray.h"
+#include "ray_packet.h"
 #include "utility.h"
 #include "aabb.h"
 
+#include <cstdint>
+
 class material;
+class hittable;
+struct hit_record;
+
+/**
+\brief Built-in hittable types. hit_primitive() switches on it and calls their hit directly, so it can be inlined.
+
+Objects of other (user) classes keep custom and go through the virtual hit.
+*/
+enum class hittable_kind : std::uint8_t {
+    custom,
+    sphere,
+    moving_sphere,
+    xy_rect,
+    xz_rect,
+    yz_rect,
+    box,
+    box_batch,
+    sphere_batch,
+    triangle_mesh,
+    constant_medium,
+    translate,
+    rotate_y,
+    instance,
+    list,
+    bvh,
+    grid_medium,
+    fog
+};
+
+/**
+\brief Intersects any hittable with a switch on its kind instead of a virtual call. Defined in dispatch.h.
+
+\param object object to intersect
+\param r ray
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param rec bunch of arguments in the struct
+\param gen generator of the current sample
+*/
+inline bool hit_primitive(const hittable& object, const ray& r, double t_min, double t_max, hit_record& rec, rng& gen);
+
 /**
 \brief The hit_record is to avoid a bunch of arguments so we can stuff whatever info we want in there.You can use arguments instead.
 
 It is just a way to stuff a bunch of arguments into a struct so we can send them as a group.
+Intersection is split in two phases. hit() only has to find t and remember which primitive it was (surface, prim_index);
+finalize() then computes point, normal, (u,v) and material once, for the closest hit only. Instances on the way (translate, rotate_y)
+remember themselves in the record, so finalize can move the ray into the primitive space and the result back.
 */
 struct hit_record {
+    static const int max_instances = 8; // deepest chain of instance wrappers that is deferred
+
     point3 p; // point of hit
     vec3 normal; // normal
-    shared_ptr<material> mat_ptr; // pointer to material
+    const material* mat_ptr; // pointer to material, owned by the scene
     double t; // t which we use to move through ray
     double u; // u surface coordinate of the ray-object hit point
     double v; // v surface coordinate of the ray-object hit point
     bool front_face; // outward/inward checker
+    double uv_per_length = 0; // change of (u,v) per unit of surface length at p, 0 if the primitive does not say
+    double footprint = 0; // width of the ray at p in (u,v) units, set by the integrator for texture filtering
+
+    const hittable* surface = nullptr; // primitive that still has to fill p, normal, u, v and mat_ptr, nullptr if they are filled
+    std::uint32_t prim_index = 0; // primitive inside surface (for batches and meshes)
+    const hittable* instances[max_instances]; // instance wrappers between the hit primitive and the caller, innermost first
+    int instance_count = 0; // number of instances
 
     /**
     \brief Set things up so that normals always point 'outward' from the surface, or always point against the incident ray.
@@ -35,44 +91,194 @@ struct hit_record {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    /**
+    \brief Records a hit whose surface details are computed later by s->finalize.
+
+    \param hit_t t of the hit
+    \param s primitive that was hit
+    \param index primitive inside s
+    */
+    inline void defer(double hit_t, const hittable* s, std::uint32_t index = 0) {
+        t = hit_t;
+        surface = s;
+        prim_index = index;
+        instance_count = 0;
+        uv_per_length = 0;
+    }
+
+    /**
+    \brief Records a hit that already filled everything (volumes).
+    */
+    inline void complete(double hit_t) {
+        t = hit_t;
+        surface = nullptr;
+        instance_count = 0;
+        uv_per_length = 0;
+    }
+
+    inline void add_instance(const hittable* instance, const ray& local_r);
+    inline void finalize(const ray& r);
 };
 
 /**
 \brief Hittable object abstract class. It contains hit function, which is very important.
+
+hit() must change rec only when it returns true, and must call rec.defer() (or rec.complete() if it filled the whole record).
+Built-in classes pass their kind to the constructor and are final (see kind_cast); other classes keep custom.
 */
 class hittable {
 public:
-    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
+    hittable() {}
+    explicit hittable(hittable_kind k) : kind(k) {}
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+    /**
+    \brief Fills point, normal, (u,v) and material of a hit deferred by this primitive.
+
+    \param r ray in the space of the primitive
+    \param rec record with t and prim_index set by hit()
+    */
+    virtual void finalize(const ray& r, hit_record& rec) const {}
+
+    /**
+    \brief Instances only: moves ray from the parent space into the space of the wrapped object.
+    */
+    virtual ray to_local(const ray& r) const { return r; }
+
+    /**
+    \brief Instances only: moves finalized hit from the space of the wrapped object into the parent space.
+
+    \param local_r ray in the space of the wrapped object
+    \param rec finalized record
+    */
+    virtual void to_world(const ray& local_r, hit_record& rec) const {}
+
+    /**
+    \brief True if the object is a light that can be sampled with pdf_value and random. Such objects go into the light list.
+    */
+    virtual bool emits_light() const { return false; }
+
+    /**
+    \brief Density (per solid angle) of the directions returned by random.
+
+    \param o point directions start from
+    \param v direction
+    \param gen generator of the current sample
+    */
+    virtual double pdf_value(const point3& o, const vec3& v, rng& gen) const {
+        return 0.0;
+    }
+
+    /**
+    \brief Random direction from o towards the object.
+
+    \param o point directions start from
+    \param smp sampler of the current sample
+    */
+    virtual vec3 random(const point3& o, sampler& smp) const {
+        return vec3(1, 0, 0);
+    }
+
+    /**
+    \brief Intersects a packet of rays. Returns mask of rays that hit something.
+
+    Default implementation traces rays one by one, acceleration structures override it to traverse the whole packet at once.
+
+    \param packet rays
+    \param t_min minimum t(in a ray) which can be counted as a hit
+    \param t_max maximum t(in a ray) which can be counted as a hit
+    \param rec hit record of every ray
+    \param gen generator of every ray
+    */
+    virtual int hit_packet(const ray_packet& packet, double t_min, double t_max,
+        hit_record rec[ray_packet::size], rng* gen[ray_packet::size]) const {
+        int mask = 0;
+        for (int k = 0; k < ray_packet::size; ++k) {
+            if ((packet.active & (1 << k)) && hit(*packet.rays[k], t_min, t_max, rec[k], *gen[k]))
+                mask |= 1 << k;
+        }
+        return mask;
+    }
+
+public:
+    hittable_kind kind = hittable_kind::custom; // built-in type, see hit_primitive
 };
 
+/**
+\brief Called by an instance after its wrapped object was hit with local_r. When the chain is too deep the hit is finalized right away.
+*/
+inline void hit_record::add_instance(const hittable* instance, const ray& local_r) {
+    if (instance_count == max_instances) {
+        finalize(local_r);
+        instance->to_world(local_r, *this);
+        return;
+    }
+    instances[instance_count++] = instance;
+}
+
+/**
+\brief Computes the surface details of the closest hit. Call it once, after the whole scene was intersected with r.
+
+\param r ray that produced the hit
+*/
+inline void hit_record::finalize(const ray& r) {
+    if (instance_count == 0) {
+        if (surface) surface->finalize(r, *this);
+        surface = nullptr;
+        return;
+    }
+
+    ray local[max_instances + 1];
+    local[instance_count] = r;
+    for (int k = instance_count - 1; k >= 0; --k)
+        local[k] = instances[k]->to_local(local[k + 1]);
+
+    if (surface) surface->finalize(local[0], *this);
+    for (int k = 0; k < instance_count; ++k)
+        instances[k]->to_world(local[k], *this);
+
+    surface = nullptr;
+    instance_count = 0;
+}
+
 /**
 \brief Translation instance implementation.
 
 Instance is a geometric primitive that has been moved or rotated somehow. In ray tracing because we don’t move anything; instead we move the rays in the opposite direction.
 */
-class translate : public hittable {
+class translate final : public hittable {
 public:
     translate(shared_ptr<hittable> p, const vec3& displacement)
-        : ptr(p), offset(displacement) {}
+        : hittable(hittable_kind::translate), ptr(p), offset(displacement) {}
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual ray to_local(const ray& r) const override {
+        return ray(r.origin() - offset, r.direction(), r.time());
+    }
+
+    virtual void to_world(const ray& local_r, hit_record& rec) const override {
+        rec.p += offset;
+        rec.set_face_normal(local_r, rec.normal);
+    }
+
 public:
     shared_ptr<hittable> ptr;
     vec3 offset;
 };
 
-bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
-    if (!ptr->hit(moved_r, t_min, t_max, rec))
+bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    ray moved_r = translate::to_local(r);
+    if (!hit_primitive(*ptr, moved_r, t_min, t_max, rec, gen))
         return false;
 
-    rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
+    rec.add_instance(this, moved_r);
 
     return true;
 }
@@ -95,18 +301,22 @@ for x: y'= cos(theta)*y+sin(theta)*z and z'= −sin(theta)*y+cos(theta)*z
 for y: x'= cos(theta)*x+sin(theta)*z and z'= −sin(theta)*x+cos(theta)*z
 for z: z'= cos(theta)*x+sin(theta)*y and y'= −sin(theta)*x+cos(theta)*y
 */
-class rotate_y : public hittable {
+class rotate_y final : public hittable {
 public:
     rotate_y(shared_ptr<hittable> p, double angle);
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         output_box = bbox;
         return hasbox;
     }
 
+    virtual ray to_local(const ray& r) const override;
+
+    virtual void to_world(const ray& local_r, hit_record& rec) const override;
+
 public:
     shared_ptr<hittable> ptr;
     double sin_theta;
@@ -115,7 +325,7 @@ public:
     aabb bbox;
 };
 
-rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
+rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : hittable(hittable_kind::rotate_y), ptr(p) {
     auto radians = degrees_to_radians(angle);
     sin_theta = sin(radians);
     cos_theta = cos(radians);
@@ -147,7 +357,7 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+ray rotate_y::to_local(const ray& r) const {
     auto origin = r.origin();
     auto direction = r.direction();
 
@@ -157,11 +367,10 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
     direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
-
-    if (!ptr->hit(rotated_r, t_min, t_max, rec))
-        return false;
+    return ray(origin, direction, r.time());
+}
 
+void rotate_y::to_world(const ray& local_r, hit_record& rec) const {
     auto p = rec.p;
     auto normal = rec.normal;
 
@@ -172,7 +381,16 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
     rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
+    rec.set_face_normal(local_r, normal);
+}
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    ray rotated_r = rotate_y::to_local(r);
+
+    if (!hit_primitive(*ptr, rotated_r, t_min, t_max, rec, gen))
+        return false;
+
+    rec.add_instance(this, rotated_r);
 
     return true;
 }
@@ -8,7 +8,9 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "stats.h"
 
+#include <algorithm>
 #include <memory>
 #include <vector>
 
@@ -18,10 +20,10 @@ using std::make_shared;
 /**
 \brief Class that contains hittable objects. We use it to create our worlds.
 */
-class hittable_list : public hittable {
+class hittable_list final : public hittable {
 public:
-    hittable_list() {}
-    hittable_list(shared_ptr<hittable> object) { add(object); }
+    hittable_list() : hittable(hittable_kind::list) {}
+    hittable_list(shared_ptr<hittable> object) : hittable(hittable_kind::list) { add(object); }
 
     /**
     \brief Clears all objects from list.
@@ -33,11 +35,15 @@ public:
     void add(shared_ptr<hittable> object) { objects.push_back(object); }
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(
         double time0, double time1, aabb& output_box) const override;
 
+    virtual double pdf_value(const point3& o, const vec3& v, rng& gen) const override;
+
+    virtual vec3 random(const point3& o, sampler& smp) const override;
+
 public:
     std::vector<shared_ptr<hittable>> objects;
 };
@@ -49,17 +55,18 @@ public:
 \param t_min minimum t(in a ray) which can be counted as a hit
 \param t_max maximum t(in a ray) which can be counted as a hit
 \param rec bunch of arguments in the struct
+\param gen generator of the current sample
 */
-bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
+bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
+    // Objects change rec only on a hit, and the hit is finalized later, so no copy of the record is needed here
+    RT_COUNT(list_tests, objects.size());
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (hit_primitive(*object, r, t_min, closest_so_far, rec, gen)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
@@ -85,4 +92,26 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
     return true;
 }
 
+/**
+\brief Every object is chosen with the same probability, so the density is the average of their densities.
+*/
+double hittable_list::pdf_value(const point3& o, const vec3& v, rng& gen) const {
+    if (objects.empty()) return 0.0;
+
+    auto sum = 0.0;
+    for (const auto& object : objects)
+        sum += object->pdf_value(o, v, gen);
+
+    return sum / static_cast<double>(objects.size());
+}
+
+/**
+\brief Direction towards a random object of the list.
+*/
+vec3 hittable_list::random(const point3& o, sampler& smp) const {
+    const auto size = static_cast<int>(objects.size());
+    const auto k = std::min(static_cast<int>(smp.get_1d() * size), size - 1);
+    return objects[k]->random(o, smp);
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,306 @@
+/**
+\file
+\brief .h file that contains display transform (exposure, tonemapping, gamma) and image writers (ppm, pfm, exr)
+*/
+
+#ifndef IMAGE_OUTPUT_H
+#define IMAGE_OUTPUT_H
+
+#include "utility.h"
+#include "color.h"
+#include "renderer.h"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <cstdio>
+#endif
+
+/**
+\brief Image file formats we can write.
+
+ppm_text is the old P3 output, ppm is binary P6 (8 bit, after the display transform), pfm and exr keep linear float radiance.
+*/
+enum class image_format {
+    ppm_text,
+    ppm,
+    pfm,
+    exr
+};
+
+/**
+\brief Tonemapping operators of the display transform.
+*/
+enum class tonemap_operator {
+    clamp, // values above 1 are clamped (old behaviour)
+    reinhard // c / (1 + luminance(c)), keeps the hue of bright lights
+};
+
+/**
+\brief Display transform: linear radiance to [0, 1] values of an 8 bit image. Float formats skip it.
+*/
+struct display_settings {
+    double exposure = 0; // stops, radiance is multiplied by 2^exposure
+    tonemap_operator tonemap = tonemap_operator::clamp;
+    double gamma = 2.0; // output is radiance^(1/gamma)
+
+    /**
+    \brief Display value of a linear color.
+    */
+    color apply(color c) const {
+        if (exposure != 0)
+            c *= std::pow(2.0, exposure);
+
+        if (tonemap == tonemap_operator::reinhard)
+            c /= 1 + luminance(c);
+
+        // Same as the old write_color for gamma 2
+        if (gamma == 2.0)
+            return color(sqrt(c.x()), sqrt(c.y()), sqrt(c.z()));
+
+        const double inv_gamma = 1 / gamma;
+        return color(std::pow(c.x(), inv_gamma), std::pow(c.y(), inv_gamma), std::pow(c.z(), inv_gamma));
+    }
+};
+
+/**
+\brief Picks the format from the file extension (.pfm, .exr, otherwise binary ppm).
+*/
+inline image_format format_from_filename(const std::string& filename) {
+    auto ends_with = [&](const char* suffix) {
+        const size_t n = std::strlen(suffix);
+        return filename.size() >= n && filename.compare(filename.size() - n, n, suffix) == 0;
+    };
+
+    if (ends_with(".pfm")) return image_format::pfm;
+    if (ends_with(".exr")) return image_format::exr;
+    return image_format::ppm;
+}
+
+/**
+\brief Appends little endian bytes of a value to the buffer.
+*/
+template <typename value_type>
+inline void append_le(std::string& buffer, value_type value) {
+    unsigned char bytes[sizeof(value_type)];
+    std::memcpy(bytes, &value, sizeof(value_type));
+
+    std::uint32_t probe = 1;
+    const bool little_endian = *reinterpret_cast<unsigned char*>(&probe) == 1;
+    for (size_t k = 0; k < sizeof(value_type); ++k)
+        buffer.push_back(static_cast<char>(bytes[little_endian ? k : sizeof(value_type) - 1 - k]));
+}
+
+/**
+\brief Translated [0,255] value of a display value, same rounding as write_color.
+*/
+inline unsigned char to_byte(double x) {
+    return static_cast<unsigned char>(256 * clamp(x, 0.0, 0.999));
+}
+
+/**
+\brief Encodes the image as a text P3 ppm, top row first.
+*/
+inline void encode_ppm_text(std::string& buffer, const framebuffer& fb, const display_settings& display) {
+    buffer += "P3\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n255\n";
+
+    for (int j = fb.height - 1; j >= 0; --j) {
+        for (int i = 0; i < fb.width; ++i) {
+            const color c = display.apply(fb.average(i, j));
+            buffer += std::to_string(to_byte(c.x())) + ' ' + std::to_string(to_byte(c.y())) + ' ' + std::to_string(to_byte(c.z())) + '\n';
+        }
+    }
+}
+
+/**
+\brief Encodes the image as a binary P6 ppm, top row first.
+*/
+inline void encode_ppm(std::string& buffer, const framebuffer& fb, const display_settings& display) {
+    buffer += "P6\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n255\n";
+    buffer.reserve(buffer.size() + fb.pixels.size() * 3);
+
+    for (int j = fb.height - 1; j >= 0; --j) {
+        for (int i = 0; i < fb.width; ++i) {
+            const color c = display.apply(fb.average(i, j));
+            buffer.push_back(static_cast<char>(to_byte(c.x())));
+            buffer.push_back(static_cast<char>(to_byte(c.y())));
+            buffer.push_back(static_cast<char>(to_byte(c.z())));
+        }
+    }
+}
+
+/**
+\brief Encodes linear radiance as a little endian pfm. Pfm stores the bottom row first, like the framebuffer.
+*/
+inline void encode_pfm(std::string& buffer, const framebuffer& fb) {
+    // Negative scale means little endian
+    buffer += "PF\n" + std::to_string(fb.width) + ' ' + std::to_string(fb.height) + "\n-1.0\n";
+    buffer.reserve(buffer.size() + fb.pixels.size() * 3 * sizeof(float));
+
+    for (int j = 0; j < fb.height; ++j) {
+        for (int i = 0; i < fb.width; ++i) {
+            const color c = fb.average(i, j);
+            append_le(buffer, static_cast<float>(c.x()));
+            append_le(buffer, static_cast<float>(c.y()));
+            append_le(buffer, static_cast<float>(c.z()));
+        }
+    }
+}
+
+/**
+\brief Encodes linear radiance as a single part, scanline, uncompressed OpenEXR with 32 bit float B, G, R channels.
+
+Layout: magic and version, header attributes (name, type, size, value), end of header, offset table with one entry per scanline,
+then scanlines from the top: y, byte count and one row per channel in the order of the channel list.
+*/
+inline void encode_exr(std::string& buffer, const framebuffer& fb) {
+    const std::int32_t width = fb.width;
+    const std::int32_t height = fb.height;
+
+    auto attribute = [&](const char* name, const char* type, std::int32_t size) {
+        buffer += name;
+        buffer.push_back('\0');
+        buffer += type;
+        buffer.push_back('\0');
+        append_le(buffer, size);
+    };
+
+    append_le(buffer, static_cast<std::int32_t>(20000630)); // magic number 76 2f 31 01
+    append_le(buffer, static_cast<std::int32_t>(2)); // version 2, single part scanline
+
+    const char* channels[3] = { "B", "G", "R" }; // channels must be sorted by name
+    attribute("channels", "chlist", 3 * (2 + 16) + 1);
+    for (const char* channel : channels) {
+        buffer += channel;
+        buffer.push_back('\0');
+        append_le(buffer, static_cast<std::int32_t>(2)); // FLOAT
+        append_le(buffer, static_cast<std::int32_t>(0)); // pLinear and reserved
+        append_le(buffer, static_cast<std::int32_t>(1)); // x sampling
+        append_le(buffer, static_cast<std::int32_t>(1)); // y sampling
+    }
+    buffer.push_back('\0');
+
+    attribute("compression", "compression", 1);
+    buffer.push_back('\0'); // NO_COMPRESSION
+
+    for (const char* window : { "dataWindow", "displayWindow" }) {
+        attribute(window, "box2i", 16);
+        append_le(buffer, static_cast<std::int32_t>(0));
+        append_le(buffer, static_cast<std::int32_t>(0));
+        append_le(buffer, width - 1);
+        append_le(buffer, height - 1);
+    }
+
+    attribute("lineOrder", "lineOrder", 1);
+    buffer.push_back('\0'); // INCREASING_Y
+
+    attribute("pixelAspectRatio", "float", 4);
+    append_le(buffer, 1.0f);
+
+    attribute("screenWindowCenter", "v2f", 8);
+    append_le(buffer, 0.0f);
+    append_le(buffer, 0.0f);
+
+    attribute("screenWindowWidth", "float", 4);
+    append_le(buffer, 1.0f);
+
+    buffer.push_back('\0'); // end of header
+
+    const std::uint64_t line_size = 2 * sizeof(std::int32_t) + 3 * sizeof(float) * static_cast<std::uint64_t>(width);
+    const std::uint64_t first_line = buffer.size() + sizeof(std::uint64_t) * static_cast<std::uint64_t>(height);
+    for (std::int32_t y = 0; y < height; ++y)
+        append_le(buffer, first_line + line_size * static_cast<std::uint64_t>(y));
+
+    buffer.reserve(buffer.size() + line_size * height);
+
+    // Exr y goes down, framebuffer j goes up
+    for (std::int32_t y = 0; y < height; ++y) {
+        const int j = height - 1 - y;
+        append_le(buffer, y);
+        append_le(buffer, static_cast<std::int32_t>(3 * sizeof(float) * width));
+        for (int channel = 2; channel >= 0; --channel)
+            for (int i = 0; i < width; ++i)
+                append_le(buffer, static_cast<float>(fb.average(i, j)[channel]));
+    }
+}
+
+/**
+\brief Encodes the whole image in memory and writes it with one call.
+
+\param out output stream, opened in binary mode
+\param fb image
+\param format file format
+\param display display transform for 8 bit formats
+*/
+inline void write_image(std::ostream& out, const framebuffer& fb, image_format format, const display_settings& display) {
+    std::string buffer;
+
+    switch (format) {
+    case image_format::ppm_text: encode_ppm_text(buffer, fb, display); break;
+    case image_format::ppm: encode_ppm(buffer, fb, display); break;
+    case image_format::pfm: encode_pfm(buffer, fb); break;
+    case image_format::exr: encode_exr(buffer, fb); break;
+    }
+
+    out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    out.flush();
+}
+
+/**
+\brief Writes the image to a file. Returns false if the file cannot be opened.
+*/
+inline bool write_image(const std::string& filename, const framebuffer& fb, image_format format, const display_settings& display) {
+    std::ofstream out(filename, std::ios::binary);
+    if (!out)
+        return false;
+    write_image(out, fb, format, display);
+    return static_cast<bool>(out);
+}
+
+/**
+\brief Writes the AOVs of the framebuffer (see framebuffer::enable_aovs) as linear float images prefix_albedo, prefix_normal and prefix_depth
+(depth in all three channels, 0 where the camera ray escaped). Returns false if a file cannot be written.
+
+\param prefix path and name the AOV names are appended to
+\param fb image with AOVs
+\param format pfm or exr, other formats are written as pfm
+*/
+inline bool write_aovs(const std::string& prefix, const framebuffer& fb, image_format format) {
+    if (!fb.has_aovs())
+        return false;
+    if (format != image_format::exr)
+        format = image_format::pfm;
+    const char* extension = format == image_format::exr ? ".exr" : ".pfm";
+
+    framebuffer albedo(fb.width, fb.height), normal(fb.width, fb.height), depth(fb.width, fb.height);
+    for (int j = 0; j < fb.height; ++j) {
+        for (int i = 0; i < fb.width; ++i) {
+            albedo.add_sample(i, j, fb.albedo(i, j));
+            normal.add_sample(i, j, fb.normal(i, j));
+            const double d = fb.depth(i, j);
+            depth.add_sample(i, j, color(d, d, d));
+        }
+    }
+    const display_settings linear;
+    return write_image(prefix + "_albedo" + extension, albedo, format, linear)
+        && write_image(prefix + "_normal" + extension, normal, format, linear)
+        && write_image(prefix + "_depth" + extension, depth, format, linear);
+}
+
+/**
+\brief Switches std::cout to binary mode, so Windows does not turn '\n' bytes of binary images into "\r\n".
+*/
+inline void set_binary_stdout() {
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+#endif
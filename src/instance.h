@@ -0,0 +1,253 @@
+/**
+\file
+\brief .h file that contains affine transform and instance, a hittable placed in the scene with a 3x4 matrix
+*/
+
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "utility.h"
+
+#include "hittable.h"
+
+/**
+\brief Affine transform: 3x3 linear part and translation in the last column. Point p goes to m * (p, 1), vector v to m * (v, 0).
+*/
+struct affine_transform {
+    double m[3][4];
+
+    /**
+    \brief Identity transform.
+    */
+    static affine_transform identity() {
+        affine_transform a;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 4; ++j)
+                a.m[i][j] = i == j ? 1 : 0;
+        return a;
+    }
+
+    static affine_transform translation(const vec3& offset) {
+        auto a = identity();
+        for (int i = 0; i < 3; ++i)
+            a.m[i][3] = offset[i];
+        return a;
+    }
+
+    static affine_transform scaling(const vec3& s) {
+        auto a = identity();
+        for (int i = 0; i < 3; ++i)
+            a.m[i][i] = s[i];
+        return a;
+    }
+
+    /**
+    \brief Rotation by angle (degrees) around an axis through the origin (Rodrigues formula).
+    */
+    static affine_transform rotation(const vec3& axis, double angle) {
+        const vec3 k = unit_vector(axis);
+        const double radians = degrees_to_radians(angle);
+        const double c = cos(radians), s = sin(radians), t = 1 - c;
+        const double x = k.x(), y = k.y(), z = k.z();
+
+        auto a = identity();
+        a.m[0][0] = t * x * x + c;     a.m[0][1] = t * x * y - s * z; a.m[0][2] = t * x * z + s * y;
+        a.m[1][0] = t * x * y + s * z; a.m[1][1] = t * y * y + c;     a.m[1][2] = t * y * z - s * x;
+        a.m[2][0] = t * x * z - s * y; a.m[2][1] = t * y * z + s * x; a.m[2][2] = t * z * z + c;
+        return a;
+    }
+
+    /**
+    \brief Rotation around y with precomputed sine and cosine, the same as rotate_y.
+    */
+    static affine_transform rotation_y(double sin_theta, double cos_theta) {
+        auto a = identity();
+        a.m[0][0] = cos_theta;  a.m[0][2] = sin_theta;
+        a.m[2][0] = -sin_theta; a.m[2][2] = cos_theta;
+        return a;
+    }
+
+    /**
+    \brief Transform that applies b first and then this one.
+    */
+    affine_transform operator*(const affine_transform& b) const {
+        affine_transform a;
+        for (int i = 0; i < 3; ++i) {
+            for (int j = 0; j < 4; ++j) {
+                a.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j];
+            }
+            a.m[i][3] += m[i][3];
+        }
+        return a;
+    }
+
+    /**
+    \brief Inverse transform. The linear part is inverted with cofactors, the translation becomes -inverse * translation.
+    */
+    affine_transform inverse() const {
+        affine_transform a;
+        a.m[0][0] = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+        a.m[0][1] = m[0][2] * m[2][1] - m[0][1] * m[2][2];
+        a.m[0][2] = m[0][1] * m[1][2] - m[0][2] * m[1][1];
+        a.m[1][0] = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+        a.m[1][1] = m[0][0] * m[2][2] - m[0][2] * m[2][0];
+        a.m[1][2] = m[0][2] * m[1][0] - m[0][0] * m[1][2];
+        a.m[2][0] = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+        a.m[2][1] = m[0][1] * m[2][0] - m[0][0] * m[2][1];
+        a.m[2][2] = m[0][0] * m[1][1] - m[0][1] * m[1][0];
+
+        const double inv_det = 1 / (m[0][0] * a.m[0][0] + m[0][1] * a.m[1][0] + m[0][2] * a.m[2][0]);
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                a.m[i][j] *= inv_det;
+
+        for (int i = 0; i < 3; ++i)
+            a.m[i][3] = -(a.m[i][0] * m[0][3] + a.m[i][1] * m[1][3] + a.m[i][2] * m[2][3]);
+        return a;
+    }
+
+    point3 point(const point3& p) const {
+        return point3(
+            m[0][0] * p.x() + m[0][1] * p.y() + m[0][2] * p.z() + m[0][3],
+            m[1][0] * p.x() + m[1][1] * p.y() + m[1][2] * p.z() + m[1][3],
+            m[2][0] * p.x() + m[2][1] * p.y() + m[2][2] * p.z() + m[2][3]);
+    }
+
+    vec3 vector(const vec3& v) const {
+        return vec3(
+            m[0][0] * v.x() + m[0][1] * v.y() + m[0][2] * v.z(),
+            m[1][0] * v.x() + m[1][1] * v.y() + m[1][2] * v.z(),
+            m[2][0] * v.x() + m[2][1] * v.y() + m[2][2] * v.z());
+    }
+
+    /**
+    \brief Transposed linear part times v. Normals go to the world with the transposed inverse, so call it on the inverse.
+    */
+    vec3 transposed_vector(const vec3& v) const {
+        return vec3(
+            m[0][0] * v.x() + m[1][0] * v.y() + m[2][0] * v.z(),
+            m[0][1] * v.x() + m[1][1] * v.y() + m[2][1] * v.z(),
+            m[0][2] * v.x() + m[1][2] * v.y() + m[2][2] * v.z());
+    }
+};
+
+/**
+\brief Object placed in the scene with an affine transform (any rotation, scale and translation in one node).
+
+Ray goes to the object space with the inverse matrix. Direction is not normalized, so t is the same in both spaces.
+Normal goes back with the transposed inverse. Its side does not change (dot(M d, M^-T n) = dot(d, n)), so front_face is kept.
+Many instances can share one object, e.g. one bvh_node or sphere_batch (bottom level) under many instances collected by
+the scene BVH (top level), and the geometry is stored once. Volumes inside an instance measure density in object space.
+*/
+class instance final : public hittable {
+public:
+    /**
+    \param p object
+    \param to_world transform from the object space to the scene
+    */
+    instance(shared_ptr<hittable> p, const affine_transform& to_world);
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = bbox;
+        return hasbox;
+    }
+
+    virtual ray to_local(const ray& r) const override {
+        return ray(world_to_object.point(r.origin()), world_to_object.vector(r.direction()), r.time());
+    }
+
+    virtual void to_world(const ray& local_r, hit_record& rec) const override {
+        rec.p = object_to_world.point(rec.p);
+        rec.normal = unit_vector(world_to_object.transposed_vector(rec.normal));
+    }
+
+public:
+    shared_ptr<hittable> ptr;
+    affine_transform object_to_world;
+    affine_transform world_to_object;
+    bool hasbox;
+    aabb bbox;
+};
+
+instance::instance(shared_ptr<hittable> p, const affine_transform& to_world)
+    : hittable(hittable_kind::instance), ptr(p), object_to_world(to_world), world_to_object(to_world.inverse()) {
+    hasbox = ptr->bounding_box(0, 1, bbox);
+
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+
+    // Box of the 8 transformed corners
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            for (int k = 0; k < 2; k++) {
+                const point3 corner(
+                    i ? bbox.max().x() : bbox.min().x(),
+                    j ? bbox.max().y() : bbox.min().y(),
+                    k ? bbox.max().z() : bbox.min().z());
+                const point3 tester = object_to_world.point(corner);
+
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], tester[c]);
+                    max[c] = fmax(max[c], tester[c]);
+                }
+            }
+        }
+    }
+
+    bbox = aabb(min, max);
+}
+
+bool instance::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    const ray local_r = instance::to_local(r);
+    if (!hit_primitive(*ptr, local_r, t_min, t_max, rec, gen))
+        return false;
+
+    rec.add_instance(this, local_r);
+
+    return true;
+}
+
+/**
+\brief Collapses a chain of translate, rotate_y and instance wrappers into one instance with the product of their matrices.
+
+Returns object itself if it is not a transform. Call it at scene build time: one matrix per hit instead of a ray transform per wrapper.
+
+\param object outermost wrapper
+*/
+inline shared_ptr<hittable> flatten_transforms(const shared_ptr<hittable>& object) {
+    auto to_world = affine_transform::identity();
+    shared_ptr<hittable> inner = object;
+    bool flattened = false;
+
+    // world = outer * ... * inner, so every wrapper is multiplied on the right
+    while (true) {
+        if (inner->kind == hittable_kind::translate) {
+            const auto& t = kind_cast<translate>(*inner);
+            to_world = to_world * affine_transform::translation(t.offset);
+            inner = t.ptr;
+        }
+        else if (inner->kind == hittable_kind::rotate_y) {
+            const auto& rot = kind_cast<rotate_y>(*inner);
+            to_world = to_world * affine_transform::rotation_y(rot.sin_theta, rot.cos_theta);
+            inner = rot.ptr;
+        }
+        else if (inner->kind == hittable_kind::instance) {
+            const auto& inst = kind_cast<instance>(*inner);
+            to_world = to_world * inst.object_to_world;
+            inner = inst.ptr;
+        }
+        else {
+            break;
+        }
+        flattened = true;
+    }
+
+    if (!flattened)
+        return object;
+    return make_shared<instance>(inner, to_world);
+}
+
+#endif
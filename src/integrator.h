@@ -0,0 +1,482 @@
+/**
+\file
+\brief .h file that contains iterative and wavefront path tracing integrators
+*/
+
+#ifndef INTEGRATOR_H
+#define INTEGRATOR_H
+
+#include "utility.h"
+
+#include "hittable.h"
+#include "dispatch.h"
+#include "material.h"
+#include "pdf.h"
+#include "ray_packet.h"
+#include "renderer.h"
+#include "stats.h"
+#include "volume.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+/**
+\brief Parameters of the path tracer.
+*/
+struct integrator_settings {
+    color background; // light of the rays that hit nothing
+    int max_depth = 50; // ray bounce limit
+    int roulette_depth = 5; // bounces before Russian roulette starts, 0 turns it off
+    double t_min = 0.001; // ignore hits very near zero (shadow acne)
+    const hittable* lights = nullptr; // objects sampled with shadow rays (see hittable::emits_light), nullptr turns light sampling off
+    double pixel_spread = 0; // angle one pixel covers, in radians, for texture filtering (ray cone), 0 reads textures at full resolution
+    const fog_medium* fog = nullptr; // global fog tested after the scene (see take_global_fog), nullptr if there is none
+};
+
+/**
+\brief Sample dimensions of a path. Camera takes the first ones (pixel jitter 2, lens 2, time 1), then every bounce has its own block:
+scattering (up to 4), light sampling (list choice 1, point on the light 2) and Russian roulette (1).
+Fixed offsets keep a decision in the same dimension for all samples of a pixel, whatever the earlier bounces hit.
+*/
+const std::uint32_t camera_dimensions = 5;
+const std::uint32_t bounce_dimensions = 8;
+const std::uint32_t scatter_dimension = 0; // offsets in the block of a bounce
+const std::uint32_t light_dimension = 4;
+const std::uint32_t roulette_dimension = 7;
+
+/**
+\brief Dimension at offset in the block of a bounce.
+*/
+inline std::uint32_t bounce_dimension(int bounce, std::uint32_t offset) {
+    return camera_dimensions + static_cast<std::uint32_t>(bounce) * bounce_dimensions + offset;
+}
+
+/**
+\brief Lets the global fog scatter a ray before the surface it hit, or anywhere in the fog if it hit nothing. Returns true if rec is now a fog event.
+
+\param settings integrator parameters
+\param r ray
+\param hit true if the scene intersection found rec
+\param rec closest hit of the scene, replaced by the fog event
+\param gen generator of the path
+*/
+inline bool hit_fog(const integrator_settings& settings, const ray& r, bool hit, hit_record& rec, rng& gen) {
+    return settings.fog && settings.fog->fog_medium::hit(r, settings.t_min, hit ? rec.t : infinity, rec, gen);
+}
+
+/**
+\brief Closest hit of the scene and the global fog.
+*/
+inline bool hit_scene(const hittable& world, const ray& r, const integrator_settings& settings, hit_record& rec, rng& gen) {
+    const bool hit = hit_primitive(world, r, settings.t_min, infinity, rec, gen);
+    return hit_fog(settings, r, hit, rec, gen) || hit;
+}
+
+/**
+\brief One light path. Instead of a stack frame per bounce it keeps the product of attenuations (throughput) and the light gathered so far.
+
+Every path owns its sampler, so the result does not depend on the order in which paths are advanced: iterative and wavefront modes give the same image.
+*/
+struct path_state {
+    path_state() {}
+
+    /**
+    \brief Starts a path with a camera ray.
+
+    \param camera_ray primary ray
+    \param sample_smp sampler of the sample after the camera took its dimensions
+    */
+    path_state(const ray& camera_ray, const sampler& sample_smp)
+        : r(camera_ray), throughput(1, 1, 1), radiance(0, 0, 0), smp(sample_smp), bounce(0), last_pdf(0), cone_width(0),
+        albedo(0, 0, 0), normal(0, 0, 0), depth(0), emission(0, 0, 0)
+    {}
+
+    ray r; // ray to trace next
+    color throughput; // product of attenuations along the path
+    color radiance; // light gathered so far
+    sampler smp; // sample values of the path, its generator serves hit tests and volumes
+    int bounce; // number of surfaces hit so far
+    point3 last_point; // where r starts
+    double last_pdf; // density scatter() chose r with, 0 if the lights were not sampled there (camera, mirrors, glass)
+    double cone_width; // width of the ray cone where r starts
+
+    // First hit features (AOVs) for the denoiser, set at bounce 0
+    color albedo; // attenuation of the material, clamped emission of lights, background if the camera ray escapes
+    vec3 normal; // shading normal facing the camera, zero if the camera ray escapes
+    double depth; // distance along the camera ray, zero if it escapes
+    color emission; // light emitted by the first hit, the denoiser keeps it out of the filter
+};
+
+/**
+\brief Counts the ray path is about to trace as primary or secondary (see stats.h).
+*/
+inline void count_path_ray(const path_state& path) {
+#if RT_ENABLE_STATS
+    auto& stats = thread_stats();
+    if (path.bounce == 0)
+        ++stats.primary_rays;
+    else
+        ++stats.secondary_rays;
+#endif
+}
+
+/**
+\brief Counts a finished path by its number of bounces (see stats.h).
+*/
+inline void count_path_end(const path_state& path) {
+    RT_COUNT(path_lengths[std::min(path.bounce, ray_stats::lengths - 1)], 1);
+}
+
+/**
+\brief Adds a finished path to its pixel, with its first hit features if the framebuffer keeps AOVs.
+*/
+inline void add_path_sample(framebuffer& fb, int i, int j, const path_state& path) {
+    count_path_end(path);
+    fb.add_sample(i, j, path.radiance);
+    if (fb.has_aovs())
+        fb.add_aovs(i, j, path.albedo, path.normal, path.depth, path.emission);
+}
+
+/**
+\brief Channels of c clamped to [0, 1], albedo of lights and the background.
+*/
+inline color albedo_of(const color& c) {
+    return color(clamp(c.x(), 0.0, 1.0), clamp(c.y(), 0.0, 1.0), clamp(c.z(), 0.0, 1.0));
+}
+
+/**
+\brief Path ray left the scene.
+*/
+inline void miss_path(path_state& path, const integrator_settings& settings) {
+    path.radiance += path.throughput * settings.background;
+    if (path.bounce == 0)
+        path.albedo = albedo_of(settings.background);
+}
+
+/**
+\brief Next-event estimation: one shadow ray towards a random point of the lights.
+
+Both light sampling and scattering can find the same light, so their results are combined with the balance heuristic
+(multiple importance sampling): shadow ray gets weight p_light / (p_light + p_scatter), scattered ray that hits a light gets the rest (see shade_path).
+For diffuse materials attenuation * p_scatter is the BRDF times cosine, so the shadow ray adds attenuation * p_scatter * emitted / (p_light + p_scatter).
+The light is whatever the shadow ray hits first, so occluded samples add nothing.
+
+\param path path at the surface
+\param rec finalized hit of path.r
+\param attenuation attenuation of the surface
+\param world scene
+\param settings integrator parameters
+*/
+inline void sample_lights(path_state& path, const hit_record& rec, const color& attenuation,
+    const hittable& world, const integrator_settings& settings)
+{
+    hittable_pdf light_pdf(*settings.lights, rec.p, path.smp.generator());
+    path.smp.set_dimension(bounce_dimension(path.bounce, light_dimension));
+    const ray shadow(rec.p, light_pdf.generate(path.smp), path.r.time());
+
+    const double light_p = light_pdf.value(shadow.direction());
+    if (light_p <= 0)
+        return;
+
+    const double scatter_p = material_scattering_pdf(*rec.mat_ptr, path.r, rec, shadow);
+    if (scatter_p <= 0)
+        return;
+
+    hit_record light_rec;
+    RT_COUNT(shadow_rays, 1);
+    if (!hit_scene(world, shadow, settings, light_rec, path.smp.generator()))
+        return;
+
+    light_rec.finalize(shadow);
+    const color emitted = material_emitted(*light_rec.mat_ptr, light_rec.u, light_rec.v, light_rec.p);
+
+    path.radiance += path.throughput * attenuation * emitted * (scatter_p / (light_p + scatter_p));
+}
+
+/**
+\brief Weight of the light a scattered ray finds by itself. Lights were also sampled at the previous surface, so it is p_scatter / (p_light + p_scatter).
+*/
+inline double emission_weight(path_state& path, const integrator_settings& settings) {
+    if (path.last_pdf <= 0)
+        return 1;
+
+    const double light_p = settings.lights->pdf_value(path.last_point, path.r.direction(), path.smp.generator());
+    return path.last_pdf / (path.last_pdf + light_p);
+}
+
+/**
+\brief Shading step shared by both integrators: adds emitted light of the hit, samples the lights, scatters the ray and plays Russian roulette.
+
+Returns false when the path ends (absorbed, bounce limit or roulette). Roulette keeps the path with probability p and divides throughput by p,
+so the expected value is the same as without it.
+
+\param path path that hit the surface
+\param rec hit of path.r, finalized here if it was not yet
+\param world scene, for shadow rays
+\param settings integrator parameters
+*/
+inline bool shade_path(path_state& path, hit_record& rec, const hittable& world, const integrator_settings& settings) {
+    rec.finalize(path.r);
+    const material& mat = *rec.mat_ptr;
+
+    // Ray cone: width grows by the pixel spread per unit of distance, bounces keep spreading it (no curvature term)
+    path.cone_width += settings.pixel_spread * rec.t * path.r.direction().length();
+    rec.footprint = path.cone_width * rec.uv_per_length;
+
+    const color emitted = material_emitted(mat, rec.u, rec.v, rec.p);
+    if (mat.is_emissive())
+        path.radiance += path.throughput * emitted * emission_weight(path, settings);
+    else
+        path.radiance += path.throughput * emitted;
+
+    ray scattered;
+    color attenuation;
+    path.smp.set_dimension(bounce_dimension(path.bounce, scatter_dimension));
+    const bool scatters = scatter_material(mat, path.r, rec, attenuation, scattered, path.smp);
+    if (path.bounce == 0) {
+        path.albedo = mat.is_emissive() ? albedo_of(emitted) : attenuation;
+        path.normal = rec.normal;
+        path.depth = rec.t * path.r.direction().length();
+        path.emission = emitted;
+    }
+    if (!scatters)
+        return false;
+
+    // Light found by the shadow ray is one bounce further, so it has to fit into the bounce limit too.
+    const bool lights_sampled = settings.lights && !mat.is_specular();
+    if (lights_sampled && path.bounce + 1 < settings.max_depth)
+        sample_lights(path, rec, attenuation, world, settings);
+
+    path.last_pdf = lights_sampled ? material_scattering_pdf(mat, path.r, rec, scattered) : 0;
+    path.last_point = rec.p;
+    path.throughput = path.throughput * attenuation;
+    path.r = scattered;
+
+    // If we've exceeded the ray bounce limit, no more light is gathered.
+    if (++path.bounce >= settings.max_depth)
+        return false;
+
+    if (settings.roulette_depth > 0 && path.bounce >= settings.roulette_depth) {
+        const auto& t = path.throughput;
+        const double p = std::min(0.95, static_cast<double>(std::max(t.x(), std::max(t.y(), t.z()))));
+        path.smp.set_dimension(bounce_dimension(path.bounce - 1, roulette_dimension));
+        if (path.smp.get_1d() >= p)
+            return false;
+        path.throughput /= p;
+    }
+
+    return true;
+}
+
+/**
+\brief Follows the path until it ends.
+
+\param path path to trace
+\param world scene
+\param settings integrator parameters
+*/
+inline void trace_path(path_state& path, const hittable& world, const integrator_settings& settings) {
+    hit_record rec;
+
+    while (true) {
+        count_path_ray(path);
+        if (!hit_scene(world, path.r, settings, rec, path.smp.generator()))
+            break;
+        if (!shade_path(path, rec, world, settings))
+            return;
+    }
+
+    // If the ray hits nothing, return the background color.
+    miss_path(path, settings);
+}
+
+/**
+\brief Light that comes back along ray r. Iterative replacement of the old recursive ray_color.
+
+\param r ray
+\param world scene
+\param settings integrator parameters
+\param smp sampler of the current sample
+*/
+inline color ray_color(const ray& r, const hittable& world, const integrator_settings& settings, sampler& smp) {
+    path_state path(r, smp);
+    trace_path(path, world, settings);
+    smp = path.smp;
+    return path.radiance;
+}
+
+/**
+\brief Renders samples [first_sample, first_sample + sample_count) of the active pixels of a tile path by path and adds them to fb.
+
+Pixels go in 2x2 quads. With packets the primary rays of a quad are traced as one packet, bounces go one by one.
+
+\param fb framebuffer to accumulate colors into
+\param t tile
+\param first_sample index of the first sample
+\param sample_count number of sample passes
+\param world scene
+\param settings integrator parameters
+\param camera_path function (int i, int j, int s) that returns path_state for sample s of pixel (i, j)
+\param packets trace primary rays as packets, otherwise every path is traced alone
+*/
+template <typename camera_path_function>
+void render_tile_paths(framebuffer& fb, const tile& t, int first_sample, int sample_count, const hittable& world,
+    const integrator_settings& settings, const camera_path_function& camera_path, bool packets)
+{
+    for (int j = t.y0; j < t.y1; j += 2) {
+        for (int i = t.x0; i < t.x1; i += 2) {
+            int mask = 0;
+            for (int k = 0; k < ray_packet::size; ++k) {
+                if (i + (k & 1) < t.x1 && j + (k >> 1) < t.y1 && fb.active(i + (k & 1), j + (k >> 1)))
+                    mask |= 1 << k;
+            }
+            if (mask == 0)
+                continue;
+
+            for (int s = first_sample; s < first_sample + sample_count; ++s) {
+                path_state paths[ray_packet::size];
+                ray rays[ray_packet::size];
+                rng* gen_ptrs[ray_packet::size];
+
+                for (int k = 0; k < ray_packet::size; ++k) {
+                    gen_ptrs[k] = &paths[k].smp.generator();
+                    if (!(mask & (1 << k)))
+                        continue;
+                    paths[k] = camera_path(i + (k & 1), j + (k >> 1), s);
+                    rays[k] = paths[k].r;
+                }
+
+                if (!packets) {
+                    for (int k = 0; k < ray_packet::size; ++k) {
+                        if (!(mask & (1 << k)))
+                            continue;
+                        trace_path(paths[k], world, settings);
+                        add_path_sample(fb, i + (k & 1), j + (k >> 1), paths[k]);
+                    }
+                    continue;
+                }
+
+                hit_record recs[ray_packet::size];
+                int hits = world.hit_packet(ray_packet(rays, mask), settings.t_min, infinity, recs, gen_ptrs);
+                if (settings.fog) {
+                    for (int k = 0; k < ray_packet::size; ++k)
+                        if ((mask & (1 << k)) && hit_fog(settings, rays[k], (hits & (1 << k)) != 0, recs[k], paths[k].smp.generator()))
+                            hits |= 1 << k;
+                }
+
+                for (int k = 0; k < ray_packet::size; ++k) {
+                    if (!(mask & (1 << k)))
+                        continue;
+                    count_path_ray(paths[k]);
+                    if (!(hits & (1 << k)))
+                        miss_path(paths[k], settings);
+                    else if (shade_path(paths[k], recs[k], world, settings))
+                        trace_path(paths[k], world, settings);
+                    add_path_sample(fb, i + (k & 1), j + (k >> 1), paths[k]);
+                }
+            }
+        }
+    }
+}
+
+/**
+\brief Wavefront integrator: advances all paths of a tile one bounce at a time.
+
+Every sample pass generates camera rays for all pixels of the tile, then repeats: intersect all live paths, sort the hits by material,
+shade them (shadow rays are traced right in the shading step) and compact the survivors. Shading works on runs of the same material and there is no recursion at all.
+Buffers are kept between tiles, so use one object per thread.
+*/
+class wavefront_integrator {
+public:
+    /**
+    \brief Renders samples [first_sample, first_sample + sample_count) of the active pixels of a tile and adds them to fb.
+
+    \param fb framebuffer to accumulate colors into
+    \param t tile
+    \param first_sample index of the first sample
+    \param sample_count number of sample passes
+    \param world scene
+    \param settings integrator parameters
+    \param camera_path function (int i, int j, int s) that returns path_state for sample s of pixel (i, j)
+    */
+    template <typename camera_path_function>
+    void render_tile(framebuffer& fb, const tile& t, int first_sample, int sample_count, const hittable& world,
+        const integrator_settings& settings, const camera_path_function& camera_path)
+    {
+        pixels.clear();
+        for (int j = t.y0; j < t.y1; ++j)
+            for (int i = t.x0; i < t.x1; ++i)
+                if (fb.active(i, j))
+                    pixels.push_back(pixel{ i, j });
+
+        const std::uint32_t count = static_cast<std::uint32_t>(pixels.size());
+        paths.resize(count);
+        records.resize(count);
+
+        for (int s = first_sample; s < first_sample + sample_count; ++s) {
+            active.clear();
+            for (std::uint32_t k = 0; k < count; ++k) {
+                paths[k] = camera_path(pixels[k].i, pixels[k].j, s);
+                active.push_back(k);
+            }
+
+            while (!active.empty()) {
+                intersect(world, settings);
+                shade(world, settings);
+            }
+
+            for (std::uint32_t k = 0; k < count; ++k) {
+                add_path_sample(fb, pixels[k].i, pixels[k].j, paths[k]);
+            }
+        }
+    }
+
+private:
+    /**
+    \brief Intersects all live paths. Missed paths end here, the others go to hits sorted by material.
+    */
+    void intersect(const hittable& world, const integrator_settings& settings) {
+        hits.clear();
+        for (const auto k : active) {
+            auto& path = paths[k];
+            count_path_ray(path);
+            if (!hit_scene(world, path.r, settings, records[k], path.smp.generator())) {
+                miss_path(path, settings);
+                continue;
+            }
+            records[k].finalize(path.r);
+            hits.push_back(k);
+        }
+
+        std::sort(hits.begin(), hits.end(), [this](std::uint32_t a, std::uint32_t b) {
+            return std::less<const material*>()(records[a].mat_ptr, records[b].mat_ptr);
+        });
+    }
+
+    /**
+    \brief Shades the hits and compacts the paths that go on into active, back in pixel order so neighbouring rays are traced together.
+    */
+    void shade(const hittable& world, const integrator_settings& settings) {
+        active.clear();
+        for (const auto k : hits) {
+            if (shade_path(paths[k], records[k], world, settings))
+                active.push_back(k);
+        }
+        std::sort(active.begin(), active.end());
+    }
+
+private:
+    struct pixel {
+        int i, j;
+    };
+
+    std::vector<pixel> pixels; // active pixels of the tile
+    std::vector<path_state> paths; // one path per active pixel
+    std::vector<hit_record> records; // hit of every path
+    std::vector<std::uint32_t> active; // paths that still have to be intersected
+    std::vector<std::uint32_t> hits; // paths that hit something, sorted by material
+};
+
+#endif
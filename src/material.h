@@ -9,14 +9,39 @@
 #include "utility.h"
 #include "hittable.h"
 #include "texture.h"
+#include "stats.h"
+
+#include <cstdint>
 
 struct hit_record;
 
+/**
+\brief Built-in material types, see scatter_material.
+*/
+enum class material_kind : std::uint8_t {
+    custom,
+    lambertian,
+    metal,
+    dielectric,
+    diffuse_light,
+    isotropic
+};
+
+/**
+\brief Names of the material kinds in enum order, for statistics.
+*/
+static const char* const material_kind_names[] = { "custom", "lambertian", "metal", "dielectric", "diffuse_light", "isotropic" };
+
 /**
 \brief Abstract material class.
+
+Built-in classes pass their kind to the constructor and are final (see kind_cast); other classes keep custom.
 */
 class material {
 public:
+    material() {}
+    explicit material(material_kind k) : kind(k) {}
+
     virtual color emitted(double u, double v, const point3& p) const {
         return color(0, 0, 0);
     }
@@ -28,35 +53,71 @@ public:
     \param rec hit record struct with params
     \param attenuation attenuation color
     \param scattered scattered ray
+    \param smp sampler of the current sample, a scattering takes at most 4 dimensions
     */
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
     ) const = 0;
+
+    /**
+    \brief Density of the directions scatter() produces. Only needed when is_specular() is false.
+
+    For such materials attenuation * scattering_pdf is the BRDF times cosine, so the light of any direction (e.g. towards a light) can be weighted.
+
+    \param r_in input ray
+    \param rec hit record struct with params
+    \param scattered direction to evaluate
+    */
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const {
+        return 0;
+    }
+
+    /**
+    \brief True if scatter() directions cannot be evaluated (mirrors, glass), such surfaces do not sample lights.
+    */
+    virtual bool is_specular() const { return true; }
+
+    /**
+    \brief True if the material emits light, so objects made of it can go into the light list.
+    */
+    virtual bool is_emissive() const { return false; }
+
+public:
+    material_kind kind = material_kind::custom; // built-in type, see scatter_material
 };
 
 /**
 \brief Lambertian diffuse class to simulate matte surfaces.
 */
-class lambertian : public material {
+class lambertian final : public material {
 public:
-    lambertian(const color& a) : albedo(make_shared<solid_color>(a)) {}
-    lambertian(shared_ptr<texture> a) : albedo(a) {}
+    lambertian(const color& a) : material(material_kind::lambertian), albedo(make_shared<solid_color>(a)) {}
+    lambertian(shared_ptr<texture> a) : material(material_kind::lambertian), albedo(a) {}
 
     // Lambertian reflectance
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
     ) const override {
-        auto scatter_direction = rec.normal + random_unit_vector();
+        const auto s = smp.get_2d();
+        auto scatter_direction = rec.normal + sample_unit_vector(s.u, s.v);
 
         // Catch degenerate scatter direction
         if (scatter_direction.near_zero())
             scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        attenuation = texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    // Normal plus random unit vector is distributed as cos(theta)/pi
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+        auto cosine = dot(rec.normal, unit_vector(scattered.direction()));
+        return cosine < 0 ? 0 : cosine / pi;
+    }
+
+    virtual bool is_specular() const override { return false; }
+
 public:
     shared_ptr<texture> albedo; // https://en.wikipedia.org/wiki/Albedo
 };
@@ -64,16 +125,17 @@ public:
 /**
 \brief Metalic sufaces diffuse class.
 */
-class metal : public material {
+class metal final : public material {
 public:
-    metal(const color& a, double f) : albedo(a), fuzz(f < 1 ? f : 1) {}
+    metal(const color& a, double f) : material(material_kind::metal), albedo(a), fuzz(f < 1 ? f : 1) {}
 
     // Mirrored Light Reflection for metalic surfaces
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
     ) const override {
         vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-        scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(), r_in.time());
+        const auto s = smp.get_2d();
+        scattered = ray(rec.p, reflected + fuzz * sample_in_unit_sphere(s.u, s.v, smp.get_1d()), r_in.time());
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
@@ -86,9 +148,9 @@ public:
 /**
 \brief Dielectric(glass) sufaces diffuse class.
 */
-class dielectric : public material {
+class dielectric final : public material {
 public:
-    dielectric(double index_of_refraction) : ir(index_of_refraction) {}
+    dielectric(double index_of_refraction) : material(material_kind::dielectric), ir(index_of_refraction) {}
 
     /**
     \brief Dielectric(glass) sufaces diffuse class.
@@ -113,7 +175,7 @@ public:
     We can solve for sin_theta using the trigonometric qualities: sin theta = sqrt(1−cos^2(theta)) and cos_theta = R*n
     */
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
     ) const override {
         attenuation = color(1.0, 1.0, 1.0);
         double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
@@ -125,7 +187,7 @@ public:
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
         vec3 direction;
 
-        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double())
+        if (cannot_refract || reflectance(cos_theta, refraction_ratio) > smp.get_1d())
             direction = reflect(unit_direction, rec.normal);
         else
             direction = refract(unit_direction, rec.normal, refraction_ratio);
@@ -149,21 +211,23 @@ private:
 /**
 \brief Light emitting material. Like the background, it just tells the ray what color it is and performs no reflection.
 */
-class diffuse_light : public material {
+class diffuse_light final : public material {
 public:
-    diffuse_light(shared_ptr<texture> a) : emit(a) {}
-    diffuse_light(color c) : emit(make_shared<solid_color>(c)) {}
+    diffuse_light(shared_ptr<texture> a) : material(material_kind::diffuse_light), emit(a) {}
+    diffuse_light(color c) : material(material_kind::diffuse_light), emit(make_shared<solid_color>(c)) {}
 
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
     ) const override {
         return false;
     }
 
     virtual color emitted(double u, double v, const point3& p) const override {
-        return emit->value(u, v, p);
+        return texture_value(*emit, u, v, p);
     }
 
+    virtual bool is_emissive() const override { return true; }
+
 public:
     shared_ptr<texture> emit;
 };
@@ -171,24 +235,86 @@ public:
 /**
 \brief Isotropic material which basically means it is a gas-like material.
 */
-class isotropic : public material {
+class isotropic final : public material {
 public:
-    isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
-    isotropic(shared_ptr<texture> a) : albedo(a) {}
+    isotropic(color c) : material(material_kind::isotropic), albedo(make_shared<solid_color>(c)) {}
+    isotropic(shared_ptr<texture> a) : material(material_kind::isotropic), albedo(a) {}
 
     /**
     \brief The scattering function of isotropic picks a uniform random direction.
     */
     virtual bool scatter(
-        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered
+        const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
     ) const override {
-        scattered = ray(rec.p, random_in_unit_sphere(), r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        const auto s = smp.get_2d();
+        scattered = ray(rec.p, sample_unit_vector(s.u, s.v), r_in.time());
+        attenuation = texture_value(*albedo, rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    // Uniform over the whole sphere of directions
+    virtual double scattering_pdf(const ray& r_in, const hit_record& rec, const ray& scattered) const override {
+        return 1 / (4 * pi);
+    }
+
+    virtual bool is_specular() const override { return false; }
+
 public:
     shared_ptr<texture> albedo;
 };
 
+/**
+\brief material::scatter with a switch on the kind instead of a virtual call.
+*/
+inline bool scatter_material(
+    const material& mat, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered, sampler& smp
+) {
+    RT_COUNT(scatter_calls[static_cast<int>(mat.kind)], 1);
+    switch (mat.kind) {
+    case material_kind::lambertian:
+        return kind_cast<lambertian>(mat).lambertian::scatter(r_in, rec, attenuation, scattered, smp);
+    case material_kind::metal:
+        return kind_cast<metal>(mat).metal::scatter(r_in, rec, attenuation, scattered, smp);
+    case material_kind::dielectric:
+        return kind_cast<dielectric>(mat).dielectric::scatter(r_in, rec, attenuation, scattered, smp);
+    case material_kind::diffuse_light:
+        return kind_cast<diffuse_light>(mat).diffuse_light::scatter(r_in, rec, attenuation, scattered, smp);
+    case material_kind::isotropic:
+        return kind_cast<isotropic>(mat).isotropic::scatter(r_in, rec, attenuation, scattered, smp);
+    case material_kind::custom:
+        break;
+    }
+    return mat.scatter(r_in, rec, attenuation, scattered, smp);
+}
+
+/**
+\brief material::emitted with a switch on the kind. Only diffuse_light of the built-in materials emits.
+*/
+inline color material_emitted(const material& mat, double u, double v, const point3& p) {
+    switch (mat.kind) {
+    case material_kind::diffuse_light:
+        return kind_cast<diffuse_light>(mat).diffuse_light::emitted(u, v, p);
+    case material_kind::custom:
+        return mat.emitted(u, v, p);
+    default:
+        return color(0, 0, 0);
+    }
+}
+
+/**
+\brief material::scattering_pdf with a switch on the kind. Built-in specular materials have density 0.
+*/
+inline double material_scattering_pdf(const material& mat, const ray& r_in, const hit_record& rec, const ray& scattered) {
+    switch (mat.kind) {
+    case material_kind::lambertian:
+        return kind_cast<lambertian>(mat).lambertian::scattering_pdf(r_in, rec, scattered);
+    case material_kind::isotropic:
+        return kind_cast<isotropic>(mat).isotropic::scattering_pdf(r_in, rec, scattered);
+    case material_kind::custom:
+        return mat.scattering_pdf(r_in, rec, scattered);
+    default:
+        return 0;
+    }
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,826 @@
+/**
+\file
+\brief .h file that contains memory mapped, multithreaded OBJ and PLY loaders for triangle_mesh
+*/
+
+#ifndef MESH_LOADER_H
+#define MESH_LOADER_H
+
+#include "utility.h"
+
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+\brief Read only memory mapping of a whole file. Pages are read by the OS on first touch, so parser threads load the file in parallel.
+*/
+class mapped_file {
+public:
+    mapped_file() {}
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+    ~mapped_file() { close(); }
+
+    /**
+    \brief Maps the file. Returns false if it cannot be opened or is empty.
+
+    \param filename file
+    \param sequential file is read front to back once (mesh parsers), the system reads ahead and drops pages behind
+    */
+    bool open(const char* filename, bool sequential = true) {
+        close();
+#ifdef _WIN32
+        file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+            sequential ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            file = nullptr;
+            return false;
+        }
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+            close();
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        bytes = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        length = static_cast<size_t>(file_size.QuadPart);
+#else
+        const int fd = ::open(filename, O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat info;
+        if (fstat(fd, &info) != 0 || info.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd); // mapping keeps the file open
+        if (view == MAP_FAILED)
+            return false;
+        if (sequential)
+            madvise(view, static_cast<size_t>(info.st_size), MADV_SEQUENTIAL);
+        bytes = static_cast<const char*>(view);
+        length = static_cast<size_t>(info.st_size);
+#endif
+        if (!bytes) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file) CloseHandle(file);
+        mapping = nullptr;
+        file = nullptr;
+#else
+        if (bytes) munmap(const_cast<char*>(bytes), length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    const char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = nullptr;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+/**
+\brief Number of loader threads: threads if positive, otherwise all cores.
+*/
+inline int loader_threads(int threads) {
+    if (threads > 0)
+        return threads;
+    const int cores = static_cast<int>(std::thread::hardware_concurrency());
+    return cores > 0 ? cores : 1;
+}
+
+// Text parsing helpers. from_chars does not depend on the locale and does not need a zero terminated string.
+
+inline void skip_blanks(const char*& p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+}
+
+inline void skip_line(const char*& p, const char* end) {
+    while (p < end && *p != '\n')
+        ++p;
+    if (p < end)
+        ++p;
+}
+
+inline bool parse_number(const char*& p, const char* end, float& value) {
+    skip_blanks(p, end);
+    if (p < end && *p == '+')
+        ++p;
+    const auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc())
+        return false;
+    p = result.ptr;
+    return true;
+}
+
+inline bool parse_number(const char*& p, const char* end, std::int64_t& value) {
+    skip_blanks(p, end);
+    if (p < end && *p == '+')
+        ++p;
+    const auto result = std::from_chars(p, end, value);
+    if (result.ec != std::errc())
+        return false;
+    p = result.ptr;
+    return true;
+}
+
+/**
+\brief Part of an OBJ file parsed by one thread.
+
+Face indices are kept as they were written until every part knows how many vertices the parts before it have:
+positive OBJ indices are absolute, negative ones count back from the last vertex so far (obj_relative marks them).
+*/
+struct obj_part {
+    static constexpr std::int64_t obj_relative = std::int64_t(1) << 40; // added to a local (relative) index
+    static constexpr std::int64_t obj_missing = -1; // corner without uv or normal
+
+    std::vector<float> positions; // x, y, z
+    std::vector<float> normals; // x, y, z
+    std::vector<float> uvs; // u, v
+    std::vector<std::int64_t> corners; // 3 per corner (position, uv, normal), 3 corners per triangle
+    bool missing_uvs = false;
+    bool missing_normals = false;
+    size_t bad_lines = 0;
+
+    /**
+    \brief Turns an index of the file into an absolute one (0 based) or a marked local one.
+    */
+    static std::int64_t local_index(std::int64_t index, size_t local_count) {
+        if (index > 0)
+            return index - 1;
+        return obj_relative + static_cast<std::int64_t>(local_count) + index;
+    }
+
+    /**
+    \brief Parses one face corner: v, v/vt, v//vn or v/vt/vn.
+    */
+    bool parse_corner(const char*& p, const char* end, std::int64_t corner[3]) {
+        std::int64_t index;
+        if (!parse_number(p, end, index) || index == 0)
+            return false;
+        corner[0] = local_index(index, positions.size() / 3);
+        corner[1] = obj_missing;
+        corner[2] = obj_missing;
+
+        if (p < end && *p == '/') {
+            ++p;
+            if (p < end && *p != '/') {
+                if (!parse_number(p, end, index) || index == 0)
+                    return false;
+                corner[1] = local_index(index, uvs.size() / 2);
+            }
+            if (p < end && *p == '/') {
+                ++p;
+                if (!parse_number(p, end, index) || index == 0)
+                    return false;
+                corner[2] = local_index(index, normals.size() / 3);
+            }
+        }
+        return true;
+    }
+
+    /**
+    \brief Parses lines of [p, end). Polygons are split into triangle fans. Lines other than v, vt, vn and f are skipped.
+    */
+    void parse(const char* p, const char* end) {
+        std::vector<std::int64_t> polygon;
+
+        while (p < end) {
+            skip_blanks(p, end);
+            const char* line = p;
+            skip_line(p, end);
+
+            if (line + 1 >= p || (line[1] != ' ' && line[1] != '\t' && line[1] != 't' && line[1] != 'n'))
+                continue;
+
+            bool ok = true;
+            if (line[0] == 'v' && (line[1] == ' ' || line[1] == '\t')) {
+                const char* q = line + 1;
+                float x, y, z;
+                ok = parse_number(q, p, x) && parse_number(q, p, y) && parse_number(q, p, z);
+                if (ok) {
+                    positions.push_back(x);
+                    positions.push_back(y);
+                    positions.push_back(z);
+                }
+            }
+            else if (line[0] == 'v' && line[1] == 'n') {
+                const char* q = line + 2;
+                float x, y, z;
+                ok = parse_number(q, p, x) && parse_number(q, p, y) && parse_number(q, p, z);
+                if (ok) {
+                    normals.push_back(x);
+                    normals.push_back(y);
+                    normals.push_back(z);
+                }
+            }
+            else if (line[0] == 'v' && line[1] == 't') {
+                const char* q = line + 2;
+                float u, v = 0;
+                ok = parse_number(q, p, u);
+                if (ok) {
+                    parse_number(q, p, v); // 1D texture coordinates have no v
+                    uvs.push_back(u);
+                    uvs.push_back(v);
+                }
+            }
+            else if (line[0] == 'f' && (line[1] == ' ' || line[1] == '\t')) {
+                const char* q = line + 1;
+                polygon.clear();
+                while (true) {
+                    skip_blanks(q, p);
+                    if (q >= p || *q == '\n' || *q == '#')
+                        break;
+                    std::int64_t corner[3];
+                    if (!parse_corner(q, p, corner)) {
+                        ok = false;
+                        break;
+                    }
+                    polygon.insert(polygon.end(), corner, corner + 3);
+                }
+                const size_t n = polygon.size() / 3;
+                if (ok && n >= 3) {
+                    for (size_t k = 1; k + 1 < n; ++k) {
+                        for (const size_t c : { size_t(0), k, k + 1 }) {
+                            corners.insert(corners.end(), polygon.begin() + 3 * c, polygon.begin() + 3 * c + 3);
+                            missing_uvs |= polygon[3 * c + 1] == obj_missing;
+                            missing_normals |= polygon[3 * c + 2] == obj_missing;
+                        }
+                    }
+                }
+                ok = ok && n >= 3;
+            }
+
+            if (!ok)
+                ++bad_lines;
+        }
+    }
+};
+
+/**
+\brief Loads a Wavefront OBJ file (v, vt, vn and polygon f lines) into mesh.
+
+The mapped file is split at line breaks into one part per thread. Parts are parsed in parallel, then their vertices and triangles are copied
+into the mesh in parallel, every part into its own range. Uvs and normals are kept only if every corner has them.
+Returns false (and prints the reason) if the file cannot be read or an index is out of range.
+
+\param filename file
+\param mesh mesh to add the triangles to, it must be empty
+\param threads number of threads, 0 means all cores
+*/
+inline bool load_obj(const char* filename, triangle_mesh& mesh, int threads = 0) {
+    mapped_file file;
+    if (!file.open(filename)) {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return false;
+    }
+
+    const char* data = file.data();
+    const size_t size = file.size();
+    const int parts = static_cast<int>(std::min<size_t>(loader_threads(threads), size / 4096 + 1));
+
+    // Part boundaries are moved forward to the next line start
+    std::vector<size_t> bounds(parts + 1, size);
+    bounds[0] = 0;
+    for (int k = 1; k < parts; ++k) {
+        size_t b = std::max(size * k / parts, bounds[k - 1]);
+        while (b < size && data[b - 1] != '\n')
+            ++b;
+        bounds[k] = b;
+    }
+
+    std::vector<obj_part> results(parts);
+    parallel_parts(parts, parts, [&](int, size_t first, size_t last) {
+        for (size_t k = first; k < last; ++k)
+            results[k].parse(data + bounds[k], data + bounds[k + 1]);
+    });
+
+    // Offsets of every part in the merged arrays
+    std::vector<size_t> position_base(parts + 1, 0), normal_base(parts + 1, 0), uv_base(parts + 1, 0), corner_base(parts + 1, 0);
+    bool keep_uvs = true, keep_normals = true;
+    size_t bad_lines = 0;
+    for (int k = 0; k < parts; ++k) {
+        position_base[k + 1] = position_base[k] + results[k].positions.size() / 3;
+        normal_base[k + 1] = normal_base[k] + results[k].normals.size() / 3;
+        uv_base[k + 1] = uv_base[k] + results[k].uvs.size() / 2;
+        corner_base[k + 1] = corner_base[k] + results[k].corners.size() / 3;
+        keep_uvs &= !results[k].missing_uvs;
+        keep_normals &= !results[k].missing_normals;
+        bad_lines += results[k].bad_lines;
+    }
+    keep_uvs &= uv_base[parts] > 0;
+    keep_normals &= normal_base[parts] > 0;
+
+    if (bad_lines)
+        std::cerr << "WARNING: Skipped " << bad_lines << " malformed lines in '" << filename << "'.\n";
+    if (position_base[parts] > UINT32_MAX || corner_base[parts] > UINT32_MAX) {
+        std::cerr << "ERROR: Mesh '" << filename << "' has too many vertices for 32 bit indices.\n";
+        return false;
+    }
+
+    mesh.pos_x.resize(position_base[parts]);
+    mesh.pos_y.resize(position_base[parts]);
+    mesh.pos_z.resize(position_base[parts]);
+    mesh.indices.resize(corner_base[parts]);
+    if (keep_normals) {
+        mesh.normal_x.resize(normal_base[parts]);
+        mesh.normal_y.resize(normal_base[parts]);
+        mesh.normal_z.resize(normal_base[parts]);
+        mesh.normal_indices.resize(corner_base[parts]);
+    }
+    if (keep_uvs) {
+        mesh.uv_u.resize(uv_base[parts]);
+        mesh.uv_v.resize(uv_base[parts]);
+        mesh.uv_indices.resize(corner_base[parts]);
+    }
+
+    std::vector<char> index_errors(parts, 0);
+    parallel_parts(parts, parts, [&](int, size_t first, size_t last) {
+        for (size_t k = first; k < last; ++k) {
+            const auto& part = results[k];
+
+            for (size_t i = 0; i < part.positions.size() / 3; ++i) {
+                mesh.pos_x[position_base[k] + i] = part.positions[3 * i];
+                mesh.pos_y[position_base[k] + i] = part.positions[3 * i + 1];
+                mesh.pos_z[position_base[k] + i] = part.positions[3 * i + 2];
+            }
+            for (size_t i = 0; keep_normals && i < part.normals.size() / 3; ++i) {
+                mesh.normal_x[normal_base[k] + i] = part.normals[3 * i];
+                mesh.normal_y[normal_base[k] + i] = part.normals[3 * i + 1];
+                mesh.normal_z[normal_base[k] + i] = part.normals[3 * i + 2];
+            }
+            for (size_t i = 0; keep_uvs && i < part.uvs.size() / 2; ++i) {
+                mesh.uv_u[uv_base[k] + i] = part.uvs[2 * i];
+                mesh.uv_v[uv_base[k] + i] = part.uvs[2 * i + 1];
+            }
+
+            // Absolute index, checked against the number of entries in the whole file
+            auto resolve = [&](std::int64_t index, size_t base, size_t total, std::uint32_t& out) {
+                if (index >= obj_part::obj_relative / 2)
+                    index = static_cast<std::int64_t>(base) + (index - obj_part::obj_relative);
+                if (index < 0 || index >= static_cast<std::int64_t>(total)) {
+                    index_errors[k] = 1;
+                    out = 0;
+                    return;
+                }
+                out = static_cast<std::uint32_t>(index);
+            };
+
+            for (size_t c = 0; c < part.corners.size() / 3; ++c) {
+                const auto out = corner_base[k] + c;
+                resolve(part.corners[3 * c], position_base[k], position_base[parts], mesh.indices[out]);
+                if (keep_uvs)
+                    resolve(part.corners[3 * c + 1], uv_base[k], uv_base[parts], mesh.uv_indices[out]);
+                if (keep_normals)
+                    resolve(part.corners[3 * c + 2], normal_base[k], normal_base[parts], mesh.normal_indices[out]);
+            }
+        }
+    });
+
+    if (std::find(index_errors.begin(), index_errors.end(), 1) != index_errors.end()) {
+        std::cerr << "ERROR: Mesh '" << filename << "' has face indices out of range.\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+\brief Scalar types of PLY properties.
+*/
+enum class ply_type {
+    int8, uint8, int16, uint16, int32, uint32, float32, float64, invalid
+};
+
+inline ply_type ply_type_from_name(const std::string& name) {
+    if (name == "char" || name == "int8") return ply_type::int8;
+    if (name == "uchar" || name == "uint8") return ply_type::uint8;
+    if (name == "short" || name == "int16") return ply_type::int16;
+    if (name == "ushort" || name == "uint16") return ply_type::uint16;
+    if (name == "int" || name == "int32") return ply_type::int32;
+    if (name == "uint" || name == "uint32") return ply_type::uint32;
+    if (name == "float" || name == "float32") return ply_type::float32;
+    if (name == "double" || name == "float64") return ply_type::float64;
+    return ply_type::invalid;
+}
+
+inline size_t ply_type_size(ply_type type) {
+    switch (type) {
+    case ply_type::int8: case ply_type::uint8: return 1;
+    case ply_type::int16: case ply_type::uint16: return 2;
+    case ply_type::int32: case ply_type::uint32: case ply_type::float32: return 4;
+    case ply_type::float64: return 8;
+    default: return 0;
+    }
+}
+
+inline bool ply_is_integer(ply_type type) {
+    return type != ply_type::float32 && type != ply_type::float64;
+}
+
+/**
+\brief Parses one ascii value. Integer types are parsed as integers, so indices above 2^24 keep every digit.
+*/
+inline bool parse_ply_value(const char*& p, const char* end, ply_type type, double& value) {
+    if (ply_is_integer(type)) {
+        std::int64_t v;
+        if (!parse_number(p, end, v)) return false;
+        value = static_cast<double>(v);
+    }
+    else {
+        float v;
+        if (!parse_number(p, end, v)) return false;
+        value = v;
+    }
+    return true;
+}
+
+/**
+\brief Reads one binary value. swap reverses the bytes (file endianness differs from the machine).
+*/
+inline double read_ply_value(const char* p, ply_type type, bool swap) {
+    unsigned char bytes[8];
+    const size_t n = ply_type_size(type);
+    std::memcpy(bytes, p, n);
+    if (swap)
+        std::reverse(bytes, bytes + n);
+
+    switch (type) {
+    case ply_type::int8: { std::int8_t v; std::memcpy(&v, bytes, 1); return v; }
+    case ply_type::uint8: { std::uint8_t v; std::memcpy(&v, bytes, 1); return v; }
+    case ply_type::int16: { std::int16_t v; std::memcpy(&v, bytes, 2); return v; }
+    case ply_type::uint16: { std::uint16_t v; std::memcpy(&v, bytes, 2); return v; }
+    case ply_type::int32: { std::int32_t v; std::memcpy(&v, bytes, 4); return v; }
+    case ply_type::uint32: { std::uint32_t v; std::memcpy(&v, bytes, 4); return v; }
+    case ply_type::float32: { float v; std::memcpy(&v, bytes, 4); return v; }
+    case ply_type::float64: { double v; std::memcpy(&v, bytes, 8); return v; }
+    default: return 0;
+    }
+}
+
+/**
+\brief Property of a PLY element. Lists have a count type and an item type.
+*/
+struct ply_property {
+    std::string name;
+    ply_type type = ply_type::invalid; // type of the value, or of the list items
+    ply_type count_type = ply_type::invalid; // type of the list count, invalid if it is not a list
+
+    bool is_list() const { return count_type != ply_type::invalid; }
+};
+
+/**
+\brief Element of a PLY file (vertex, face or anything else) with its properties in file order.
+*/
+struct ply_element {
+    std::string name;
+    size_t count = 0;
+    std::vector<ply_property> properties;
+
+    int find(const char* property) const {
+        for (size_t k = 0; k < properties.size(); ++k)
+            if (properties[k].name == property)
+                return static_cast<int>(k);
+        return -1;
+    }
+
+    /**
+    \brief Bytes of one binary record, 0 if the element has lists (records differ in size).
+    */
+    size_t record_size() const {
+        size_t size = 0;
+        for (const auto& property : properties) {
+            if (property.is_list())
+                return 0;
+            size += ply_type_size(property.type);
+        }
+        return size;
+    }
+};
+
+/**
+\brief Reads the values of one record. Binary reads from p and moves it, ascii parses numbers of one line.
+Lists put count values after their count. Returns false at the end of the data or at a negative list count.
+*/
+inline bool read_ply_record(const char*& p, const char* end, const ply_element& element, bool ascii, bool swap,
+    std::vector<double>& values) {
+    values.clear();
+    for (const auto& property : element.properties) {
+        size_t count = 1;
+        if (property.is_list()) {
+            double n;
+            if (ascii) {
+                if (!parse_ply_value(p, end, property.count_type, n)) return false;
+            }
+            else {
+                if (p + ply_type_size(property.count_type) > end) return false;
+                n = read_ply_value(p, property.count_type, swap);
+                p += ply_type_size(property.count_type);
+            }
+            if (n < 0) return false;
+            count = static_cast<size_t>(n);
+            values.push_back(n);
+        }
+        for (size_t k = 0; k < count; ++k) {
+            if (ascii) {
+                double v;
+                if (!parse_ply_value(p, end, property.type, v)) return false;
+                values.push_back(v);
+            }
+            else {
+                if (p + ply_type_size(property.type) > end) return false;
+                values.push_back(read_ply_value(p, property.type, swap));
+                p += ply_type_size(property.type);
+            }
+        }
+    }
+    if (ascii)
+        skip_line(p, end);
+    return true;
+}
+
+/**
+\brief Loads a PLY file (ascii, binary little or big endian) with a vertex element (x, y, z, optional nx, ny, nz and u, v or s, t)
+and a face element (vertex_indices or vertex_index list). Polygons are split into triangle fans, other elements are skipped.
+
+Binary vertex records all have the same size, so they are converted in parallel straight from the mapped file.
+Returns false (and prints the reason) if the file cannot be read.
+
+\param filename file
+\param mesh mesh to add the triangles to, it must be empty
+\param threads number of threads, 0 means all cores
+*/
+inline bool load_ply(const char* filename, triangle_mesh& mesh, int threads = 0) {
+    mapped_file file;
+    if (!file.open(filename)) {
+        std::cerr << "ERROR: Could not open mesh file '" << filename << "'.\n";
+        return false;
+    }
+
+    const char* p = file.data();
+    const char* end = p + file.size();
+    auto fail = [&](const char* reason) {
+        std::cerr << "ERROR: Mesh '" << filename << "': " << reason << ".\n";
+        return false;
+    };
+
+    // Header
+    auto next_line = [&]() {
+        const char* line = p;
+        skip_line(p, end);
+        std::string text(line, p);
+        while (!text.empty() && (text.back() == '\n' || text.back() == '\r'))
+            text.pop_back();
+        return text;
+    };
+    auto words = [](const std::string& line) {
+        std::vector<std::string> result;
+        size_t k = 0;
+        while (k < line.size()) {
+            while (k < line.size() && (line[k] == ' ' || line[k] == '\t')) ++k;
+            const size_t start = k;
+            while (k < line.size() && line[k] != ' ' && line[k] != '\t') ++k;
+            if (k > start) result.push_back(line.substr(start, k - start));
+        }
+        return result;
+    };
+
+    if (next_line() != "ply")
+        return fail("not a ply file");
+
+    bool ascii = false, big_endian = false;
+    std::vector<ply_element> elements;
+    while (true) {
+        if (p >= end)
+            return fail("header has no end_header");
+        const auto w = words(next_line());
+        if (w.empty() || w[0] == "comment" || w[0] == "obj_info")
+            continue;
+        if (w[0] == "end_header")
+            break;
+        if (w[0] == "format" && w.size() >= 2) {
+            ascii = w[1] == "ascii";
+            big_endian = w[1] == "binary_big_endian";
+            if (!ascii && !big_endian && w[1] != "binary_little_endian")
+                return fail("unknown format");
+        }
+        else if (w[0] == "element" && w.size() >= 3) {
+            ply_element element;
+            element.name = w[1];
+            const char* count_end = w[2].data() + w[2].size();
+            const auto result = std::from_chars(w[2].data(), count_end, element.count);
+            if (result.ec != std::errc() || result.ptr != count_end)
+                return fail("bad element count");
+            elements.push_back(element);
+        }
+        else if (w[0] == "property" && !elements.empty()) {
+            ply_property property;
+            if (w.size() >= 5 && w[1] == "list") {
+                property.count_type = ply_type_from_name(w[2]);
+                property.type = ply_type_from_name(w[3]);
+                property.name = w[4];
+                if (property.count_type == ply_type::invalid)
+                    return fail("unknown property type");
+            }
+            else if (w.size() >= 3) {
+                property.type = ply_type_from_name(w[1]);
+                property.name = w[2];
+            }
+            if (property.type == ply_type::invalid)
+                return fail("unknown property type");
+            elements.back().properties.push_back(property);
+        }
+    }
+
+    std::uint32_t one = 1;
+    const bool little_endian_machine = *reinterpret_cast<unsigned char*>(&one) == 1;
+    const bool swap = !ascii && (big_endian == little_endian_machine);
+
+    std::vector<double> values;
+    for (const auto& element : elements) {
+        if (element.name == "vertex") {
+            const int x = element.find("x"), y = element.find("y"), z = element.find("z");
+            if (x < 0 || y < 0 || z < 0)
+                return fail("vertex has no x, y, z");
+            const int nx = element.find("nx"), ny = element.find("ny"), nz = element.find("nz");
+            int u = element.find("u"), v = element.find("v");
+            if (u < 0 || v < 0) { u = element.find("s"); v = element.find("t"); }
+            if (u < 0 || v < 0) { u = element.find("texture_u"); v = element.find("texture_v"); }
+            const bool normals = nx >= 0 && ny >= 0 && nz >= 0;
+            const bool uvs = u >= 0 && v >= 0;
+
+            const size_t n = element.count;
+            mesh.pos_x.resize(n);
+            mesh.pos_y.resize(n);
+            mesh.pos_z.resize(n);
+            if (normals) {
+                mesh.normal_x.resize(n);
+                mesh.normal_y.resize(n);
+                mesh.normal_z.resize(n);
+            }
+            if (uvs) {
+                mesh.uv_u.resize(n);
+                mesh.uv_v.resize(n);
+            }
+
+            auto store = [&](size_t i, const double* value) {
+                mesh.pos_x[i] = static_cast<float>(value[x]);
+                mesh.pos_y[i] = static_cast<float>(value[y]);
+                mesh.pos_z[i] = static_cast<float>(value[z]);
+                if (normals) {
+                    mesh.normal_x[i] = static_cast<float>(value[nx]);
+                    mesh.normal_y[i] = static_cast<float>(value[ny]);
+                    mesh.normal_z[i] = static_cast<float>(value[nz]);
+                }
+                if (uvs) {
+                    mesh.uv_u[i] = static_cast<float>(value[u]);
+                    mesh.uv_v[i] = static_cast<float>(value[v]);
+                }
+            };
+
+            const size_t stride = element.record_size();
+            if (!ascii && stride > 0) {
+                if (static_cast<size_t>(end - p) < stride * n)
+                    return fail("vertex data is truncated");
+
+                std::vector<size_t> offsets;
+                size_t offset = 0;
+                for (const auto& property : element.properties) {
+                    offsets.push_back(offset);
+                    offset += ply_type_size(property.type);
+                }
+
+                const char* base = p;
+                const int parts = static_cast<int>(std::min<size_t>(loader_threads(threads), n / 65536 + 1));
+                parallel_parts(parts, n, [&](int, size_t first, size_t last) {
+                    std::vector<double> record(element.properties.size());
+                    for (size_t i = first; i < last; ++i) {
+                        const char* r = base + stride * i;
+                        for (size_t k = 0; k < record.size(); ++k)
+                            record[k] = read_ply_value(r + offsets[k], element.properties[k].type, swap);
+                        store(i, record.data());
+                    }
+                });
+                p += stride * n;
+            }
+            else {
+                for (size_t i = 0; i < n; ++i) {
+                    if (!read_ply_record(p, end, element, ascii, swap, values) || values.size() < element.properties.size())
+                        return fail("vertex data is truncated");
+                    store(i, values.data());
+                }
+            }
+        }
+        else if (element.name == "face") {
+            int list = element.find("vertex_indices");
+            if (list < 0)
+                list = element.find("vertex_index");
+            if (list < 0 || !element.properties[list].is_list())
+                return fail("face has no vertex_indices list");
+
+            // Position of the list among the values of a record
+            mesh.indices.reserve(3 * element.count);
+            for (size_t i = 0; i < element.count; ++i) {
+                if (!read_ply_record(p, end, element, ascii, swap, values))
+                    return fail("face data is truncated");
+
+                size_t first = 0;
+                for (int k = 0; k < list; ++k)
+                    first += element.properties[k].is_list() ? 1 + static_cast<size_t>(values[first]) : 1;
+                const size_t count = static_cast<size_t>(values[first]);
+
+                // Checked before the cast, the vertex count is checked once all elements are read
+                for (size_t k = 1; k <= count; ++k)
+                    if (values[first + k] < 0 || values[first + k] > UINT32_MAX)
+                        return fail("face indices out of range");
+                for (size_t k = 1; k + 1 < count; ++k) {
+                    mesh.add_triangle(
+                        static_cast<std::uint32_t>(values[first + 1]),
+                        static_cast<std::uint32_t>(values[first + 1 + k]),
+                        static_cast<std::uint32_t>(values[first + 2 + k]));
+                }
+            }
+        }
+        else {
+            for (size_t i = 0; i < element.count; ++i)
+                if (!read_ply_record(p, end, element, ascii, swap, values))
+                    return fail("data is truncated");
+        }
+    }
+
+    for (const auto index : mesh.indices)
+        if (index >= mesh.pos_x.size())
+            return fail("face indices out of range");
+
+    return true;
+}
+
+/**
+\brief Loads an OBJ or PLY file, picked by the extension.
+
+\param filename file
+\param mesh mesh to add the triangles to, it must be empty
+\param threads number of threads, 0 means all cores
+*/
+inline bool load_mesh(const std::string& filename, triangle_mesh& mesh, int threads = 0) {
+    auto ends_with = [&](const char* suffix) {
+        const size_t n = std::strlen(suffix);
+        if (filename.size() < n)
+            return false;
+        for (size_t k = 0; k < n; ++k)
+            if (std::tolower(static_cast<unsigned char>(filename[filename.size() - n + k])) != suffix[k])
+                return false;
+        return true;
+    };
+
+    if (ends_with(".obj")) return load_obj(filename.c_str(), mesh, threads);
+    if (ends_with(".ply")) return load_ply(filename.c_str(), mesh, threads);
+
+    std::cerr << "ERROR: Unknown mesh format of '" << filename << "' (use .obj or .ply).\n";
+    return false;
+}
+
+#endif
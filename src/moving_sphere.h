@@ -9,24 +9,27 @@
 #include "utility.h"
 #include "hittable.h"
 #include "aabb.h"
+#include "sphere.h"
 
 /**
 \brief Moving sphere class which means we detect sphere in two different times simulating motion blur.
 */
-class moving_sphere : public hittable {
+class moving_sphere final : public hittable {
 public:
-    moving_sphere() {}
+    moving_sphere() : hittable(hittable_kind::moving_sphere) {}
     moving_sphere(
         point3 cen0, point3 cen1, double _time0, double _time1, double r, shared_ptr<material> m)
-        : center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
+        : hittable(hittable_kind::moving_sphere), center0(cen0), center1(cen1), time0(_time0), time1(_time1), radius(r), mat_ptr(m)
     {};
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(
         double _time0, double _time1, aabb& output_box) const override;
 
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+
     point3 center(double time) const;
 
 public:
@@ -46,32 +49,27 @@ point3 moving_sphere::center(double time) const {
 /**
 \brief Same as sphere.
 */
-bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    vec3 oc = r.origin() - center(r.time());
-    auto a = r.direction().length_squared();
-    auto half_b = dot(oc, r.direction());
-    auto c = oc.length_squared() - radius * radius;
+bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    double root;
+    if (!hit_sphere(r.origin(), r.direction(), center(r.time()), radius, t_min, t_max, root))
+        return false;
 
-    auto discriminant = half_b * half_b - a * c;
-    if (discriminant < 0) return false;
-    auto sqrtd = sqrt(discriminant);
+    rec.defer(root, this);
 
-    // Find the nearest root that lies in the acceptable range.
-    auto root = (-half_b - sqrtd) / a;
-    if (root < t_min || t_max < root) {
-        root = (-half_b + sqrtd) / a;
-        if (root < t_min || t_max < root)
-            return false;
-    }
+    return true;
+}
 
-    rec.t = root;
+/**
+\brief Same as sphere.
+*/
+void moving_sphere::finalize(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
-
-    return true;
+    rec.uv_per_length = 1 / (pi * radius);
+    rec.mat_ptr = mat_ptr.get();
 }
+
 /**
 \brief For moving sphere, we can take the box of the sphere at t_0, and the box of the sphere at t_1, and compute the box of those two boxes.
 */
@@ -0,0 +1,82 @@
+/**
+\file
+\brief .h file that contains probability density functions of directions used for importance sampling
+*/
+
+#ifndef PDF_H
+#define PDF_H
+
+#include "utility.h"
+
+#include "hittable.h"
+
+/**
+\brief Orthonormal basis around a vector, to turn directions generated around the z axis into directions around a normal.
+*/
+class onb {
+public:
+    onb() {}
+
+    /**
+    \brief Builds the basis with w along n.
+    */
+    explicit onb(const vec3& n) {
+        axis[2] = unit_vector(n);
+        vec3 a = (fabs(w().x()) > 0.9) ? vec3(0, 1, 0) : vec3(1, 0, 0);
+        axis[1] = unit_vector(cross(w(), a));
+        axis[0] = cross(w(), v());
+    }
+
+    const vec3& u() const { return axis[0]; }
+    const vec3& v() const { return axis[1]; }
+    const vec3& w() const { return axis[2]; }
+
+    /**
+    \brief Vector with coordinates (a.x, a.y, a.z) in this basis.
+    */
+    vec3 local(const vec3& a) const {
+        return a.x() * u() + a.y() * v() + a.z() * w();
+    }
+
+public:
+    vec3 axis[3];
+};
+
+/**
+\brief Probability density of directions. value() is the density of a direction, generate() draws a direction with that density from the sampler.
+*/
+class pdf {
+public:
+    virtual ~pdf() {}
+
+    virtual double value(const vec3& direction) const = 0;
+    virtual vec3 generate(sampler& smp) const = 0;
+};
+
+/**
+\brief Density of directions from origin towards a hittable (usually light or list of lights), see hittable::pdf_value and hittable::random.
+*/
+class hittable_pdf : public pdf {
+public:
+    /**
+    \param p objects to sample
+    \param origin point directions start from
+    \param gen generator of the current sample, for the hit tests of value()
+    */
+    hittable_pdf(const hittable& p, const point3& origin, rng& gen) : o(origin), ptr(p), gen_ptr(&gen) {}
+
+    virtual double value(const vec3& direction) const override {
+        return ptr.pdf_value(o, direction, *gen_ptr);
+    }
+
+    virtual vec3 generate(sampler& smp) const override {
+        return ptr.random(o, smp);
+    }
+
+public:
+    point3 o;
+    const hittable& ptr;
+    rng* gen_ptr;
+};
+
+#endif
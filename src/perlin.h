@@ -6,58 +6,125 @@
 #ifndef PERLIN_H
 #define PERLIN_H
 
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
 #include "utility.h"
+#include "simd.h"
+#include "aabb.h"
 
 /**
 \brief Perlin noise class implementation.
 
 A key part of Perlin noise is that it is repeatable: it takes a 3D point as input and always returns the same randomish number.
+Tables live inside the object in cache line aligned arrays (9 KB): the three permutations are interleaved, so the lattice coordinates
+of a corner are read from one 4 byte row, and every gradient is a padded (x, y, z, 0) row that SIMD reads in one load.
 */
 class perlin {
 public:
     perlin() {
-        ranvec = new vec3[point_count];
         for (int i = 0; i < point_count; ++i) {
-            ranvec[i] = unit_vector(vec3::random(-1, 1));
+            const vec3 g = unit_vector(vec3::random(-1, 1));
+            gradient[i][0] = g.x();
+            gradient[i][1] = g.y();
+            gradient[i][2] = g.z();
+            gradient[i][3] = 0;
         }
 
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        // Same order of random numbers as the three separate tables had
+        for (int axis = 0; axis < 3; ++axis) {
+            int p[point_count];
+            perlin_generate_perm(p);
+            for (int i = 0; i < point_count; ++i)
+                perm[i][axis] = static_cast<std::uint8_t>(p[i]);
+        }
+        for (int i = 0; i < point_count; ++i)
+            perm[i][3] = 0;
     }
 
-    ~perlin() {
-        delete[] ranvec;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
+    /**
+    \brief Noise with given tables, e.g. the ones of a scene file (see gradients and permutations).
+
+    \param gradients point_count rows of (x, y, z, 0)
+    \param permutations point_count rows of the x, y and z permutations and a 0
+    */
+    perlin(const double* gradients, const std::uint8_t* permutations) {
+        std::memcpy(gradient, gradients, sizeof(gradient));
+        std::memcpy(perm, permutations, sizeof(perm));
     }
 
     /**
-    \brief Noise generation itself.
+    \brief Noise generation itself. Sum over the 8 lattice corners of weight * dot(gradient, offset from the corner),
+    where the weight is the product of the Hermite smoothed distances (smooth and blury noise).
 
     \param p point from the camera
     */
     double noise(const point3& p) const {
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());
-
-        auto i = static_cast<int>(floor(p.x()));
-        auto j = static_cast<int>(floor(p.y()));
-        auto k = static_cast<int>(floor(p.z()));
-        vec3 c[2][2][2];
-
-        for (int di = 0; di < 2; di++)
-            for (int dj = 0; dj < 2; dj++)
-                for (int dk = 0; dk < 2; dk++)
-                    c[di][dj][dk] = ranvec[
-                        perm_x[(i + di) & 255] ^
-                            perm_y[(j + dj) & 255] ^
-                            perm_z[(k + dk) & 255]
-                    ];
-
-        return perlin_interp(c, u, v, w);
+        const double fx = floor(p.x());
+        const double fy = floor(p.y());
+        const double fz = floor(p.z());
+        const double u = p.x() - fx;
+        const double v = p.y() - fy;
+        const double w = p.z() - fz;
+
+        const auto i = static_cast<int>(fx);
+        const auto j = static_cast<int>(fy);
+        const auto k = static_cast<int>(fz);
+
+        // Hermitian Smoothing
+        const double uu = u * u * (3 - 2 * u);
+        const double vv = v * v * (3 - 2 * v);
+        const double ww = w * w * (3 - 2 * w);
+        const double weight_x[2] = { 1 - uu, uu };
+        const double weight_y[2] = { 1 - vv, vv };
+        const double weight_z[2] = { 1 - ww, ww };
+
+        // One row of gradient is (x, y, z, 0): a corner is one 256 bit load (or two 128 bit ones) multiplied by its offset.
+#if RT_AVX
+        const __m256d offset = _mm256_set_pd(0, w, v, u);
+        __m256d sum = _mm256_setzero_pd();
+#elif RT_SSE2
+        const __m128d offset_xy = _mm_set_pd(v, u);
+        const __m128d offset_z = _mm_set_sd(w);
+        __m128d sum_xy = _mm_setzero_pd();
+        __m128d sum_z = _mm_setzero_pd();
+#else
+        double accum = 0.0;
+#endif
+
+        for (int di = 0; di < 2; di++) {
+            const auto px = perm[(i + di) & 255][0];
+            for (int dj = 0; dj < 2; dj++) {
+                const auto pxy = px ^ perm[(j + dj) & 255][1];
+                const double wxy = weight_x[di] * weight_y[dj];
+                for (int dk = 0; dk < 2; dk++) {
+                    const double* g = gradient[pxy ^ perm[(k + dk) & 255][2]];
+                    const double weight = wxy * weight_z[dk];
+#if RT_AVX
+                    const __m256d corner_offset = _mm256_sub_pd(offset, _mm256_set_pd(0, dk, dj, di));
+                    sum = _mm256_add_pd(sum, _mm256_mul_pd(_mm256_set1_pd(weight), _mm256_mul_pd(_mm256_load_pd(g), corner_offset)));
+#elif RT_SSE2
+                    const __m128d weight2 = _mm_set1_pd(weight);
+                    const __m128d offset2 = _mm_sub_pd(offset_xy, _mm_set_pd(dj, di));
+                    sum_xy = _mm_add_pd(sum_xy, _mm_mul_pd(weight2, _mm_mul_pd(_mm_load_pd(g), offset2)));
+                    sum_z = _mm_add_sd(sum_z, _mm_mul_sd(weight2, _mm_mul_sd(_mm_load_sd(g + 2), _mm_sub_sd(offset_z, _mm_set_sd(dk)))));
+#else
+                    accum += weight * (g[0] * (u - di) + g[1] * (v - dj) + g[2] * (w - dk));
+#endif
+                }
+            }
+        }
+
+#if RT_AVX
+        const __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+        return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+#elif RT_SSE2
+        const __m128d xyz = _mm_add_pd(sum_xy, sum_z);
+        return _mm_cvtsd_f64(_mm_add_sd(xyz, _mm_unpackhi_pd(xyz, xyz)));
+#else
+        return accum;
+#endif
     }
 
     /**
@@ -80,22 +147,20 @@ public:
         return fabs(accum);
     }
 
-private:
     static const int point_count = 256;
-    vec3* ranvec;
-    int* perm_x;
-    int* perm_y;
-    int* perm_z;
 
-    static int* perlin_generate_perm() {
-        auto p = new int[point_count];
+    const double* gradients() const { return &gradient[0][0]; } // point_count * 4 numbers
+    const std::uint8_t* permutations() const { return &perm[0][0]; } // point_count * 4 bytes
 
+private:
+    alignas(64) double gradient[point_count][4]; // random unit gradients (x, y, z, 0), one 32 byte row each
+    alignas(64) std::uint8_t perm[point_count][4]; // permutations of x, y and z side by side
+
+    static void perlin_generate_perm(int* p) {
         for (int i = 0; i < perlin::point_count; i++)
             p[i] = i;
 
         permute(p, point_count);
-
-        return p;
     }
 
     static void permute(int* p, int n) {
@@ -106,29 +171,76 @@ private:
             p[target] = tmp;
         }
     }
+};
 
+/**
+\brief Turbulence of a perlin noise baked into a 3D grid over a box, trilinearly interpolated.
+
+One lookup is 8 float reads instead of 7 octaves of noise. Grid has to be fine enough for the highest octave that matters:
+octave n has features of size 1/2^n, so a box of side L needs about L * 2^n samples per axis. Points outside the box are not covered.
+*/
+class baked_turbulence {
+public:
     /**
-    \brief Makes noise smooth and blury.
+    \param noise noise to sample
+    \param region box the grid covers
+    \param resolution samples per axis
+    \param depth octaves of turbulence
     */
-    static double perlin_interp(vec3 c[2][2][2], double u, double v, double w) {
-        // Hermitian Smoothing
-        auto uu = u * u * (3 - 2 * u);
-        auto vv = v * v * (3 - 2 * v);
-        auto ww = w * w * (3 - 2 * w);
-        auto accum = 0.0;
+    baked_turbulence(const perlin& noise, const aabb& region, int resolution, int depth = 7)
+        : box(region), n(resolution < 2 ? 2 : resolution), values(static_cast<size_t>(n) * n * n) {
+        for (int a = 0; a < 3; ++a) {
+            const double extent = box.max()[a] - box.min()[a];
+            cell[a] = extent / (n - 1);
+            inv_cell[a] = extent > 0 ? (n - 1) / extent : 0.0;
+        }
 
-        for (int i = 0; i < 2; i++)
-            for (int j = 0; j < 2; j++)
-                for (int k = 0; k < 2; k++) {
-                    vec3 weight_v(u - i, v - j, w - k);
-                    accum += (i * uu + (1 - i) * (1 - uu))
-                        * (j * vv + (1 - j) * (1 - vv))
-                        * (k * ww + (1 - k) * (1 - ww))
-                        * dot(c[i][j][k], weight_v);
+        for (int z = 0; z < n; ++z)
+            for (int y = 0; y < n; ++y)
+                for (int x = 0; x < n; ++x) {
+                    const point3 p(box.min().x() + x * cell[0], box.min().y() + y * cell[1], box.min().z() + z * cell[2]);
+                    values[index(x, y, z)] = static_cast<float>(noise.turb(p, depth));
                 }
+    }
 
-        return accum;
+    /**
+    \brief Returns false if p is outside the box.
+    */
+    bool lookup(const point3& p, double& turbulence) const {
+        double f[3];
+        int c[3];
+        for (int a = 0; a < 3; ++a) {
+            const double g = (p[a] - box.min()[a]) * inv_cell[a];
+            if (!(g >= 0 && g <= n - 1))
+                return false;
+            c[a] = g >= n - 1 ? n - 2 : static_cast<int>(g);
+            f[a] = g - c[a];
+        }
+
+        const float* v = &values[index(c[0], c[1], c[2])];
+        const size_t sy = static_cast<size_t>(n), sz = static_cast<size_t>(n) * n;
+        const double x00 = v[0] + f[0] * (v[1] - v[0]);
+        const double x10 = v[sy] + f[0] * (v[sy + 1] - v[sy]);
+        const double x01 = v[sz] + f[0] * (v[sz + 1] - v[sz]);
+        const double x11 = v[sz + sy] + f[0] * (v[sz + sy + 1] - v[sz + sy]);
+        const double y0 = x00 + f[1] * (x10 - x00);
+        const double y1 = x01 + f[1] * (x11 - x01);
+        turbulence = y0 + f[2] * (y1 - y0);
+        return true;
+    }
+
+    size_t memory_bytes() const { return values.size() * sizeof(float); }
+
+private:
+    size_t index(int x, int y, int z) const {
+        return (static_cast<size_t>(z) * n + y) * n + x;
     }
+
+    aabb box;
+    int n;
+    double cell[3];
+    double inv_cell[3];
+    std::vector<float> values; // x fastest
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,406 @@
+/**
+\file
+\brief .h file that contains the interactive preview: a shared memory image that viewers watch and edit commands read from the console
+*/
+
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "utility.h"
+
+#include "renderer.h"
+#include "image_output.h"
+#include "material.h"
+#include "scene_file.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+/**
+\brief Side of the pixel blocks of the first pass after a (re)start: only the lower left pixel of every block is rendered, and the display
+fills the block with it, so the first frame costs a sixteenth of a sample per pixel.
+*/
+const int preview_block_size = 4;
+
+/**
+\brief Activates the lower left pixel of every block (corners true) or all other pixels (corners false), see preview_block_size.
+Rendering sample 0 for both sets gives every pixel the same sample 0 as a render without the coarse pass.
+*/
+inline void select_preview_pixels(framebuffer& fb, bool corners) {
+    for (int j = 0; j < fb.height; ++j) {
+        for (int i = 0; i < fb.width; ++i) {
+            const bool corner = i % preview_block_size == 0 && j % preview_block_size == 0;
+            fb.converged[fb.index(i, j)] = corner != corners;
+        }
+    }
+}
+
+/**
+\brief Binary ppm in a shared, writable memory mapping of a file. Every update is visible to other processes at once, without a new file:
+image viewers that reload on change show it, and tools can map the same file and poll the frame number.
+
+The header is "P6\n# frame F restart R spp S\nW H\n255\n" with fixed width numbers, so it stays a valid ppm while frames are written.
+The frame number is written after the pixels.
+*/
+class shared_image {
+public:
+    shared_image() {}
+    shared_image(const shared_image&) = delete;
+    shared_image& operator=(const shared_image&) = delete;
+    ~shared_image() { close(); }
+
+    /**
+    \brief Creates or resizes the file and maps it. Returns false if it cannot.
+    */
+    bool open(const char* filename, int image_width, int image_height) {
+        close();
+        width = image_width;
+        height = image_height;
+        char text[128];
+        header_size = static_cast<size_t>(format_header(text, sizeof(text), 0, 0, 0));
+        length = header_size + static_cast<size_t>(width) * height * 3;
+#ifdef _WIN32
+        file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            file = nullptr;
+            return false;
+        }
+        const std::uint64_t size = length;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+        if (!mapping) {
+            close();
+            return false;
+        }
+        bytes = static_cast<char*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, length));
+#else
+        const int fd = ::open(filename, O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return false;
+        if (ftruncate(fd, static_cast<off_t>(length)) != 0) {
+            ::close(fd);
+            return false;
+        }
+        void* view = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd); // mapping keeps the file open
+        if (view != MAP_FAILED)
+            bytes = static_cast<char*>(view);
+#endif
+        if (!bytes) {
+            close();
+            return false;
+        }
+        std::memcpy(bytes, text, header_size);
+        std::memset(bytes + header_size, 0, length - header_size);
+        return true;
+    }
+
+    void close() {
+#ifdef _WIN32
+        if (bytes) UnmapViewOfFile(bytes);
+        if (mapping) CloseHandle(mapping);
+        if (file) CloseHandle(file);
+        mapping = nullptr;
+        file = nullptr;
+#else
+        if (bytes) munmap(bytes, length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+    bool is_open() const { return bytes != nullptr; }
+
+    /**
+    \brief Writes the display values of the framebuffer, top row first, then the header. Pixels without samples show the lower left
+    pixel of their block (see preview_block_size).
+
+    \param fb framebuffer of the image size
+    \param display display transform
+    \param restart number of accumulation restarts so far
+    \param spp samples of the pixels with the fewest samples
+    */
+    void update(const framebuffer& fb, const display_settings& display, std::uint32_t restart, int spp) {
+        if (!bytes || fb.width != width || fb.height != height)
+            return;
+        unsigned char* p = reinterpret_cast<unsigned char*>(bytes + header_size);
+        for (int j = fb.height - 1; j >= 0; --j) {
+            for (int i = 0; i < fb.width; ++i) {
+                const bool empty = fb.samples[fb.index(i, j)] == 0;
+                const color c = display.apply(empty
+                    ? fb.average(i - i % preview_block_size, j - j % preview_block_size) : fb.average(i, j));
+                *p++ = to_byte(c.x());
+                *p++ = to_byte(c.y());
+                *p++ = to_byte(c.z());
+            }
+        }
+        char text[128];
+        format_header(text, sizeof(text), ++frame, restart, spp);
+        std::memcpy(bytes, text, header_size);
+#ifdef _WIN32
+        FlushViewOfFile(bytes, 0); // viewers that read the file (not the mapping) see the frame
+#endif
+    }
+
+private:
+    int format_header(char* text, size_t size, std::uint32_t frame_number, std::uint32_t restart, int spp) const {
+        return std::snprintf(text, size, "P6\n# frame %010u restart %010u spp %07d\n%d %d\n255\n",
+            frame_number, restart, std::min(spp, 9999999), width, height);
+    }
+
+    char* bytes = nullptr;
+    size_t length = 0;
+    size_t header_size = 0;
+    int width = 0, height = 0;
+    std::uint32_t frame = 0;
+#ifdef _WIN32
+    HANDLE file = nullptr;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+/**
+\brief Edits of the interactive preview, one per console line.
+*/
+enum class preview_command_type {
+    lookfrom, lookat, vup, vfov, aperture, focus, background, // camera and scene_view: restart accumulation, the BVH stays
+    depth, lights, // integrator settings: restart
+    spp, // more or fewer samples per pixel: accumulation goes on
+    exposure, tonemap, // display transform: the image is only written again
+    albedo, fuzz, ior, emit, // material of the surface at a pixel: restart, the BVH stays
+    pick, // prints the material at a pixel
+    quit
+};
+
+/**
+\brief True if the command invalidates the samples so far (and quit). Such commands cancel the running pass, the others wait for its end.
+*/
+inline bool preview_command_restarts(preview_command_type type) {
+    return type != preview_command_type::spp && type != preview_command_type::exposure && type != preview_command_type::tonemap
+        && type != preview_command_type::pick;
+}
+
+/**
+\brief Parsed command. Material commands start with the pixel (column, row from the top, as viewers show it).
+*/
+struct preview_command {
+    preview_command_type type;
+    double values[5] = {};
+    std::string text; // argument of lights (on|off) and tonemap (clamp|reinhard)
+};
+
+/**
+\brief Help text of the commands.
+*/
+inline const char* preview_command_help() {
+    return "Commands: lookfrom X Y Z, lookat X Y Z, vup X Y Z, vfov DEG, aperture A, focus D, background R G B, depth N, lights on|off,\n"
+        "spp N, exposure STOPS, tonemap clamp|reinhard, albedo X Y R G B, fuzz X Y F, ior X Y N, emit X Y R G B, pick X Y, quit.\n"
+        "X Y is a pixel (row 0 at the top), material commands edit the material of the surface seen there.\n";
+}
+
+/**
+\brief Parses one line. Returns false with an error message for unknown commands and missing numbers, empty lines give false and no error.
+*/
+inline bool parse_preview_command(const std::string& line, preview_command& command, std::string& error) {
+    struct command_spec {
+        const char* name;
+        preview_command_type type;
+        int numbers;
+        bool word;
+    };
+    static const command_spec specs[] = {
+        { "lookfrom", preview_command_type::lookfrom, 3, false }, { "lookat", preview_command_type::lookat, 3, false },
+        { "vup", preview_command_type::vup, 3, false }, { "vfov", preview_command_type::vfov, 1, false },
+        { "aperture", preview_command_type::aperture, 1, false }, { "focus", preview_command_type::focus, 1, false },
+        { "background", preview_command_type::background, 3, false }, { "depth", preview_command_type::depth, 1, false },
+        { "lights", preview_command_type::lights, 0, true }, { "spp", preview_command_type::spp, 1, false },
+        { "exposure", preview_command_type::exposure, 1, false }, { "tonemap", preview_command_type::tonemap, 0, true },
+        { "albedo", preview_command_type::albedo, 5, false }, { "fuzz", preview_command_type::fuzz, 3, false },
+        { "ior", preview_command_type::ior, 3, false }, { "emit", preview_command_type::emit, 5, false },
+        { "pick", preview_command_type::pick, 2, false }, { "quit", preview_command_type::quit, 0, false }
+    };
+
+    error.clear();
+    std::istringstream in(line);
+    std::string name;
+    if (!(in >> name))
+        return false;
+
+    for (const auto& spec : specs) {
+        if (name != spec.name)
+            continue;
+        command = preview_command();
+        command.type = spec.type;
+        for (int k = 0; k < spec.numbers; ++k) {
+            if (!(in >> command.values[k])) {
+                error = "'" + name + "' needs " + std::to_string(spec.numbers) + " numbers.";
+                return false;
+            }
+        }
+        if (spec.word && !(in >> command.text)) {
+            error = "'" + name + "' needs an argument.";
+            return false;
+        }
+        return true;
+    }
+    error = "Unknown command '" + name + "'.";
+    return false;
+}
+
+/**
+\brief Reads commands from the console on its own thread, so a pass can be cancelled as soon as an edit arrives.
+*/
+class command_reader {
+public:
+    command_reader() : shared(std::make_shared<state>()) {
+        // The thread may still wait for a line when the program ends, so it is detached and owns the state together with the reader.
+        std::thread([s = shared]() {
+            std::string line, error;
+            while (std::getline(std::cin, line)) {
+                preview_command command;
+                if (!parse_preview_command(line, command, error)) {
+                    if (!error.empty())
+                        std::cerr << "\n" << error << "\n" << preview_command_help();
+                    continue;
+                }
+                std::lock_guard<std::mutex> guard(s->lock);
+                s->commands.push_back(command);
+                if (preview_command_restarts(command.type))
+                    s->pending = true;
+                s->wake.notify_all();
+            }
+            std::lock_guard<std::mutex> guard(s->lock);
+            s->closed = true;
+            s->wake.notify_all();
+        }).detach();
+    }
+
+    /**
+    \brief Turns true when a command that restarts accumulation is waiting, for the cancel flag of render_tiles.
+    */
+    const std::atomic<bool>& pending() const { return shared->pending; }
+
+    /**
+    \brief Moves the waiting commands to commands. Returns false if there were none.
+    */
+    bool take(std::deque<preview_command>& commands) {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        commands.swap(shared->commands);
+        shared->commands.clear();
+        shared->pending = false;
+        return !commands.empty();
+    }
+
+    /**
+    \brief Waits until a command arrives or the console is closed.
+    */
+    void wait() {
+        std::unique_lock<std::mutex> guard(shared->lock);
+        shared->wake.wait(guard, [&] { return !shared->commands.empty() || shared->closed; });
+    }
+
+    /**
+    \brief True after the end of the console input (e.g. of a piped script).
+    */
+    bool closed() const {
+        std::lock_guard<std::mutex> guard(shared->lock);
+        return shared->closed && shared->commands.empty();
+    }
+
+private:
+    struct state {
+        std::mutex lock;
+        std::condition_variable wake;
+        std::deque<preview_command> commands;
+        std::atomic<bool> pending{ false };
+        bool closed = false;
+    };
+    std::shared_ptr<state> shared;
+};
+
+/**
+\brief Applies a camera or background command to the view. Returns false for other commands.
+*/
+inline bool apply_view_command(scene_view& view, const preview_command& command) {
+    auto copy3 = [&](double* target) {
+        for (int k = 0; k < 3; ++k)
+            target[k] = command.values[k];
+    };
+    switch (command.type) {
+    case preview_command_type::lookfrom: copy3(view.lookfrom); return true;
+    case preview_command_type::lookat: copy3(view.lookat); return true;
+    case preview_command_type::vup: copy3(view.vup); return true;
+    case preview_command_type::vfov: view.vfov = clamp(command.values[0], 0.01, 179.0); return true;
+    case preview_command_type::aperture: view.aperture = std::max(0.0, command.values[0]); return true;
+    case preview_command_type::focus: view.dist_to_focus = std::max(1e-6, command.values[0]); return true;
+    case preview_command_type::background: copy3(view.background); return true;
+    default: return false;
+    }
+}
+
+/**
+\brief Applies a material command to the material of a built-in kind. Returns false if the material has no such parameter.
+Textured albedos and emissions are replaced by a solid color; a texture shared with other materials is not changed.
+*/
+inline bool edit_material(material& m, const preview_command& command) {
+    const color c(command.values[2], command.values[3], command.values[4]);
+    switch (command.type) {
+    case preview_command_type::albedo:
+        if (m.kind == material_kind::lambertian) {
+            kind_cast<lambertian>(m).albedo = make_shared<solid_color>(c);
+            return true;
+        }
+        if (m.kind == material_kind::metal) {
+            kind_cast<metal>(m).albedo = c;
+            return true;
+        }
+        if (m.kind == material_kind::isotropic) {
+            kind_cast<isotropic>(m).albedo = make_shared<solid_color>(c);
+            return true;
+        }
+        return false;
+    case preview_command_type::fuzz:
+        if (m.kind != material_kind::metal)
+            return false;
+        kind_cast<metal>(m).fuzz = clamp(command.values[2], 0.0, 1.0);
+        return true;
+    case preview_command_type::ior:
+        if (m.kind != material_kind::dielectric)
+            return false;
+        kind_cast<dielectric>(m).ir = std::max(1e-3, command.values[2]);
+        return true;
+    case preview_command_type::emit:
+        if (m.kind != material_kind::diffuse_light)
+            return false;
+        kind_cast<diffuse_light>(m).emit = make_shared<solid_color>(c);
+        return true;
+    default:
+        return false;
+    }
+}
+
+#endif
@@ -12,17 +12,27 @@
 \brief Ray class implementation.
 
 We see ray as a function P(t) = A + tb. Here P is a 3D position along a line in 3D. A is ray origin and b is track direction. Plug in different t and we move along the ray.
+Inverse direction and its signs are computed once in the constructor, because every bounding box test on the way through the BVH needs them.
 */
 class ray {
 public:
     ray() {}
     ray(const point3& origin, const vec3& direction, double time = 0.0)
-        : orig(origin), dir(direction), tm(time)
-    {}
+        : orig(origin), dir(direction), tm(time),
+        inv_dir(1.0 / direction.x(), 1.0 / direction.y(), 1.0 / direction.z())
+    {
+        sign[0] = inv_dir.x() < 0;
+        sign[1] = inv_dir.y() < 0;
+        sign[2] = inv_dir.z() < 0;
+    }
 
     point3 origin() const { return orig; }
     vec3 direction() const { return dir; }
     double time() const { return tm; }
+    /**
+    \brief 1 / direction for every axis (infinity for zero components).
+    */
+    const vec3& inverse_direction() const { return inv_dir; }
 
     /**
     \brief P(t) = A + tb
@@ -37,6 +47,8 @@ public:
     point3 orig; // ray origin
     vec3 dir; // ray direction
     double tm; // time for movable objects
+    vec3 inv_dir; // 1 / direction
+    int sign[3]; // 1 if the direction is negative on the axis
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,57 @@
+/**
+\file
+\brief .h file that contains packet of coherent rays in SoA layout
+*/
+
+#ifndef RAY_PACKET_H
+#define RAY_PACKET_H
+
+#include "ray.h"
+
+/**
+\brief Packet of 4 rays stored as structure of arrays, so one SSE register holds the same coordinate of all rays.
+
+Used for primary rays of a 2x2 pixel quad: they start at the same point and go in almost the same direction,
+so they visit the same BVH nodes and one node fetch serves all of them. Float copies are for the box tests only,
+primitives are still intersected with the original double rays.
+*/
+struct ray_packet {
+    static const int size = 4;
+
+    ray_packet() : active(0) {}
+
+    /**
+    \brief Builds the packet.
+
+    \param r rays of the packet
+    \param mask bit k is set if ray k is used (quads on the image border are incomplete)
+    */
+    ray_packet(const ray* r, int mask) : active(mask) {
+        for (int k = 0; k < size; ++k) {
+            rays[k] = &r[mask & (1 << k) ? k : first_active()];
+            const auto& inv = rays[k]->inverse_direction();
+            orig[0][k] = static_cast<float>(rays[k]->orig.x());
+            orig[1][k] = static_cast<float>(rays[k]->orig.y());
+            orig[2][k] = static_cast<float>(rays[k]->orig.z());
+            inv_dir[0][k] = static_cast<float>(inv.x());
+            inv_dir[1][k] = static_cast<float>(inv.y());
+            inv_dir[2][k] = static_cast<float>(inv.z());
+        }
+    }
+
+    /**
+    \brief Index of the first used ray. Unused lanes copy it, so they never produce NaNs or extra work.
+    */
+    int first_active() const {
+        for (int k = 0; k < size; ++k)
+            if (active & (1 << k)) return k;
+        return 0;
+    }
+
+    alignas(16) float orig[3][size]; // origins, [axis][ray]
+    alignas(16) float inv_dir[3][size]; // inverse directions, [axis][ray]
+    const ray* rays[size]; // original rays
+    int active; // mask of used rays
+};
+
+#endif
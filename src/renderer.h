@@ -0,0 +1,350 @@
+/**
+\file
+\brief .h file that contains framebuffer, tile scheduler and multithreaded render loop
+*/
+
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include "utility.h"
+#include "color.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+\brief Image we accumulate colors into. Every pixel stores the sum of its samples, their number and running statistics of their luminance.
+
+Pixel (0, 0) is the lower left corner of the image, like in the camera.
+Mean and variance are updated with Welford's method, so adaptive sampling can tell when a pixel is good enough and stop sampling it.
+*/
+class framebuffer {
+public:
+    framebuffer() : width(0), height(0) {}
+    framebuffer(int w, int h)
+        : width(w), height(h), pixels(static_cast<size_t>(w) * h), samples(pixels.size(), 0),
+        mean(pixels.size(), 0.0), m2(pixels.size(), 0.0), converged(pixels.size(), 0)
+    {}
+
+    size_t index(int i, int j) const { return static_cast<size_t>(j) * width + i; }
+
+    /**
+    \brief Drops all samples, accumulation starts again.
+    */
+    void clear() {
+        std::fill(pixels.begin(), pixels.end(), color(0, 0, 0));
+        std::fill(samples.begin(), samples.end(), 0);
+        std::fill(mean.begin(), mean.end(), 0.0);
+        std::fill(m2.begin(), m2.end(), 0.0);
+        std::fill(converged.begin(), converged.end(), 0);
+        std::fill(albedo_sum.begin(), albedo_sum.end(), color(0, 0, 0));
+        std::fill(normal_sum.begin(), normal_sum.end(), vec3(0, 0, 0));
+        std::fill(depth_sum.begin(), depth_sum.end(), 0.0);
+        std::fill(emission_sum.begin(), emission_sum.end(), color(0, 0, 0));
+    }
+
+    /**
+    \brief Keeps first hit albedo, normal, depth and emission of every sample from now on (see add_path_sample), for the denoiser and AOV output.
+    */
+    void enable_aovs() {
+        albedo_sum.assign(pixels.size(), color(0, 0, 0));
+        normal_sum.assign(pixels.size(), vec3(0, 0, 0));
+        depth_sum.assign(pixels.size(), 0.0);
+        emission_sum.assign(pixels.size(), color(0, 0, 0));
+    }
+
+    bool has_aovs() const { return !albedo_sum.empty(); }
+
+    /**
+    \brief Adds the first hit features of a sample, after add_sample of the same sample.
+    */
+    void add_aovs(int i, int j, const color& albedo, const vec3& normal, double depth, const color& emission) {
+        const size_t k = index(i, j);
+        albedo_sum[k] += albedo;
+        normal_sum[k] += normal;
+        depth_sum[k] += depth;
+        emission_sum[k] += emission;
+    }
+
+    /**
+    \brief Average albedo, normal (not normalized, shorter at silhouettes), depth and emission of the samples of the pixel. Needs has_aovs().
+    */
+    color albedo(int i, int j) const {
+        const size_t k = index(i, j);
+        return samples[k] > 0 ? albedo_sum[k] / samples[k] : color(0, 0, 0);
+    }
+
+    vec3 normal(int i, int j) const {
+        const size_t k = index(i, j);
+        return samples[k] > 0 ? normal_sum[k] / samples[k] : vec3(0, 0, 0);
+    }
+
+    double depth(int i, int j) const {
+        const size_t k = index(i, j);
+        return samples[k] > 0 ? depth_sum[k] / samples[k] : 0.0;
+    }
+
+    color emission(int i, int j) const {
+        const size_t k = index(i, j);
+        return samples[k] > 0 ? emission_sum[k] / samples[k] : color(0, 0, 0);
+    }
+
+    /**
+    \brief Pixel at column i and row j.
+    */
+    color& at(int i, int j) { return pixels[index(i, j)]; }
+    const color& at(int i, int j) const { return pixels[index(i, j)]; }
+
+    /**
+    \brief Linear radiance of the pixel: sum of its samples divided by their number.
+    */
+    color average(int i, int j) const {
+        const size_t k = index(i, j);
+        return samples[k] > 0 ? pixels[k] / samples[k] : color(0, 0, 0);
+    }
+
+    /**
+    \brief Adds one sample to the pixel at column i and row j.
+    */
+    void add_sample(int i, int j, const color& c) {
+        const size_t k = index(i, j);
+        pixels[k] += c;
+
+        const double y = luminance(c);
+        const double delta = y - mean[k];
+        mean[k] += delta / ++samples[k];
+        m2[k] += delta * (y - mean[k]);
+    }
+
+    /**
+    \brief Adds count samples rendered elsewhere (e.g. by a worker process) to the pixel, with their sum and luminance mean and m2.
+    Statistics combine as in Chan et al., so error() is the same as if the samples had been added one by one. AOVs are not merged.
+    */
+    void merge_samples(int i, int j, const color& sum, int count, double other_mean, double other_m2) {
+        if (count <= 0)
+            return;
+        const size_t k = index(i, j);
+        pixels[k] += sum;
+
+        const int total = samples[k] + count;
+        const double delta = other_mean - mean[k];
+        mean[k] += delta * count / total;
+        m2[k] += other_m2 + delta * delta * (static_cast<double>(samples[k]) * count / total);
+        samples[k] = total;
+    }
+
+    /**
+    \brief Standard error of the pixel after gamma 2 (the value we write), estimated from luminance: d(sqrt(y)) = dy / (2 sqrt(y)).
+    */
+    double error(int i, int j) const {
+        const size_t k = index(i, j);
+        if (samples[k] < 2)
+            return infinity;
+        if (m2[k] <= 0)
+            return 0;
+
+        const double variance = m2[k] / (samples[k] - 1);
+        return sqrt(variance / samples[k]) / (2 * sqrt(mean[k]));
+    }
+
+    /**
+    \brief True if the pixel still needs samples.
+    */
+    bool active(int i, int j) const { return !converged[index(i, j)]; }
+
+    /**
+    \brief Marks pixels that reached max_samples, or have at least min_samples and error below target_error. Returns number of pixels that are still active.
+
+    \param target_error error to reach, 0 means only max_samples counts
+    \param min_samples samples before error is trusted
+    \param max_samples samples after which the pixel is done anyway
+    */
+    size_t update_convergence(double target_error, int min_samples, int max_samples) {
+        size_t active_count = 0;
+        for (int j = 0; j < height; ++j) {
+            for (int i = 0; i < width; ++i) {
+                const size_t k = index(i, j);
+                if (converged[k])
+                    continue;
+                if (samples[k] >= max_samples || (target_error > 0 && samples[k] >= min_samples && error(i, j) < target_error))
+                    converged[k] = 1;
+                else
+                    ++active_count;
+            }
+        }
+        return active_count;
+    }
+
+public:
+    int width, height; // image characteristics
+    std::vector<color> pixels; // summed samples of every pixel
+    std::vector<int> samples; // number of samples of every pixel
+    std::vector<double> mean; // running mean of sample luminance
+    std::vector<double> m2; // running sum of squared differences from the mean of luminance
+    std::vector<char> converged; // 1 if the pixel needs no more samples
+    std::vector<color> albedo_sum; // summed first hit albedo of the samples, empty unless enable_aovs was called
+    std::vector<vec3> normal_sum; // summed first hit normals
+    std::vector<double> depth_sum; // summed first hit distances
+    std::vector<color> emission_sum; // summed light emitted by the first hits
+};
+
+/**
+\brief Rectangular piece of the image that one thread renders at a time.
+*/
+struct tile {
+    int index; // tile number
+    int x0, y0; // lower left pixel (inclusive)
+    int x1, y1; // upper right pixel (exclusive)
+};
+
+/**
+\brief Work stealing tile scheduler.
+
+Every worker owns a queue of tiles. Worker takes tiles from the front of its own queue and when it is empty it steals from the back of the other queues,
+so the threads that got cheap tiles (background) help the ones that got expensive tiles (glass, smoke).
+*/
+class tile_scheduler {
+public:
+    tile_scheduler(int image_width, int image_height, int tile_size, int worker_count)
+        : queues(worker_count)
+    {
+        const int tiles_x = (image_width + tile_size - 1) / tile_size;
+        const int tiles_y = (image_height + tile_size - 1) / tile_size;
+
+        // Start from the top of the image, same as the old scanline order, and deal the tiles round robin.
+        int index = 0;
+        for (int ty = tiles_y - 1; ty >= 0; --ty) {
+            for (int tx = 0; tx < tiles_x; ++tx) {
+                tile t;
+                t.index = ty * tiles_x + tx;
+                t.x0 = tx * tile_size;
+                t.y0 = ty * tile_size;
+                t.x1 = std::min(t.x0 + tile_size, image_width);
+                t.y1 = std::min(t.y0 + tile_size, image_height);
+                queues[index % worker_count].tiles.push_back(t);
+                ++index;
+            }
+        }
+        total = index;
+    }
+
+    /**
+    \brief Gets next tile for worker. Returns false when the whole image is done.
+
+    \param worker worker number
+    \param t output tile
+    */
+    bool next(int worker, tile& t) {
+        if (queues[worker].pop_front(t))
+            return true;
+
+        const int count = static_cast<int>(queues.size());
+        for (int k = 1; k < count; ++k) {
+            if (queues[(worker + k) % count].pop_back(t))
+                return true;
+        }
+        return false;
+    }
+
+    int tile_count() const { return total; }
+
+private:
+    /**
+    \brief Queue of tiles guarded by its own mutex, so owners and thieves rarely wait on each other.
+    */
+    struct tile_queue {
+        std::mutex lock;
+        std::deque<tile> tiles;
+
+        bool pop_front(tile& t) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty()) return false;
+            t = tiles.front();
+            tiles.pop_front();
+            return true;
+        }
+
+        bool pop_back(tile& t) {
+            std::lock_guard<std::mutex> guard(lock);
+            if (tiles.empty()) return false;
+            t = tiles.back();
+            tiles.pop_back();
+            return true;
+        }
+    };
+
+    std::vector<tile_queue> queues;
+    int total;
+};
+
+/**
+\brief Renders the image on thread_count threads.
+
+Image is split into square tiles and every tile is rendered by exactly one thread into its own part of the framebuffer, so no locking is needed for pixels.
+render_tile must seed its random generators from the pixel (see rng::for_sample), then output is the same for any number of threads.
+
+\param fb framebuffer to accumulate colors into
+\param tile_size tile side in pixels
+\param thread_count number of render threads
+\param render_tile function (const tile&) that renders all pixels of the tile into fb
+\param deadline tiles that did not start before it are skipped
+\param cancel if not nullptr, tiles that did not start before it turns true are skipped (interactive preview restarts a pass with it)
+*/
+template <typename tile_function>
+void render_tiles(framebuffer& fb, int tile_size, int thread_count, const tile_function& render_tile,
+    std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max(),
+    const std::atomic<bool>* cancel = nullptr) {
+    if (thread_count < 1) thread_count = 1;
+
+    tile_scheduler scheduler(fb.width, fb.height, tile_size, thread_count);
+    std::atomic<int> tiles_done(0);
+    std::mutex progress_lock;
+    auto last_report = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+
+    auto worker = [&](int worker_index) {
+#if RT_ENABLE_STATS
+        trace_thread_id() = worker_index;
+#endif
+        tile t;
+        while (std::chrono::steady_clock::now() < deadline && !(cancel && cancel->load(std::memory_order_relaxed))
+            && scheduler.next(worker_index, t)) {
+            {
+                RT_TILE_TIMER("tile", t.x0, t.y0);
+                render_tile(t);
+            }
+
+            // Progress goes to stderr at most 10 times a second, the other threads do not wait for the lock.
+            const int done = ++tiles_done;
+            const bool last = done == scheduler.tile_count();
+            std::unique_lock<std::mutex> guard(progress_lock, std::defer_lock);
+            if (last)
+                guard.lock();
+            else if (!guard.try_lock())
+                continue;
+
+            const auto now = std::chrono::steady_clock::now();
+            if (last || now - last_report >= std::chrono::milliseconds(100)) {
+                last_report = now;
+                std::cerr << "\rTiles remaining: " << scheduler.tile_count() - done << ' ' << std::flush;
+            }
+        }
+        flush_thread_stats();
+    };
+
+    std::vector<std::thread> threads;
+    for (int k = 1; k < thread_count; ++k)
+        threads.emplace_back(worker, k);
+    worker(0);
+
+    for (auto& thread : threads)
+        thread.join();
+}
+
+#endif
@@ -0,0 +1,79 @@
+/**
+\file
+\brief .h file that contains small and fast random number generator
+*/
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+/**
+\brief PCG32 random number generator. http://www.pcg-random.org
+
+State is only 16 bytes, so every pixel sample can own its generator. Renderer creates one generator per (seed, pixel, sample) and passes it
+by reference to everything that needs random numbers (camera, materials, volumes), so renders are reproducible and threads share nothing.
+*/
+class rng {
+public:
+    rng() : rng(0x853c49e6748fea9bull, 0xda3e39cb94b95bdbull) {}
+
+    /**
+    \brief Creates generator.
+
+    \param seed starting state
+    \param stream sequence selector, generators with different streams produce different sequences for the same seed
+    */
+    rng(std::uint64_t seed, std::uint64_t stream) {
+        state = 0u;
+        inc = (stream << 1u) | 1u;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    /**
+    \brief Generator for one sample of one pixel. Result depends only on the arguments, not on the order pixels are rendered.
+
+    \param seed image seed
+    \param pixel pixel index (j * width + i)
+    \param sample sample index of the pixel
+    */
+    static rng for_sample(std::uint32_t seed, std::uint32_t pixel, std::uint32_t sample) {
+        return rng(mix((static_cast<std::uint64_t>(pixel) << 32) | sample), seed);
+    }
+
+    /**
+    \brief Gets next random 32 bit integer.
+    */
+    std::uint32_t next_uint() {
+        std::uint64_t old_state = state;
+        state = old_state * 6364136223846793005ull + inc;
+        auto xorshifted = static_cast<std::uint32_t>(((old_state >> 18u) ^ old_state) >> 27u);
+        auto rot = static_cast<std::uint32_t>(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((0u - rot) & 31u));
+    }
+
+    /**
+    \brief Gets random double in range [0.0, 1.0).
+    */
+    double next_double() {
+        return next_uint() * (1.0 / 4294967296.0);
+    }
+
+    /**
+    \brief splitmix64 finalizer, spreads neighbouring pixels and samples over the whole state space. Samplers hash with it too.
+    */
+    static std::uint64_t mix(std::uint64_t z) {
+        z += 0x9e3779b97f4a7c15ull;
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+private:
+    std::uint64_t state; // current state
+    std::uint64_t inc; // stream, always odd
+};
+
+#endif
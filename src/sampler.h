@@ -0,0 +1,331 @@
+/**
+\file
+\brief .h file that contains samplers: independent, stratified, Sobol and blue noise sample values for camera, lights and materials
+*/
+
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+
+#include "utility.h"
+
+/**
+\brief Sample patterns, see sampler.
+*/
+enum class sampler_kind : std::uint8_t {
+    independent,
+    stratified,
+    sobol,
+    blue_noise
+};
+
+/**
+\brief Names of the sampler kinds in enum order, for options and messages.
+*/
+static const char* const sampler_kind_names[] = { "independent", "stratified", "sobol", "bluenoise" };
+
+/**
+\brief What every sampler of an image shares.
+*/
+struct sampler_settings {
+    sampler_kind kind = sampler_kind::sobol; // pattern
+    std::uint32_t seed = 0; // image seed
+    int image_width = 1, image_height = 1; // image size, blue noise orders pixels along a Morton curve over it
+    int samples_per_pixel = 1; // number of strata of stratified, block of samples of a pixel for blue noise (rounded up to a power of 2)
+};
+
+/**
+\brief Two sample values, e.g. for a point of the unit square.
+*/
+struct sample_2d {
+    double u, v;
+};
+
+/**
+\brief Reverses the order of the 32 bits of v.
+*/
+inline std::uint32_t reverse_bits(std::uint32_t v) {
+    v = ((v >> 1) & 0x55555555u) | ((v & 0x55555555u) << 1);
+    v = ((v >> 2) & 0x33333333u) | ((v & 0x33333333u) << 2);
+    v = ((v >> 4) & 0x0f0f0f0fu) | ((v & 0x0f0f0f0fu) << 4);
+    v = ((v >> 8) & 0x00ff00ffu) | ((v & 0x00ff00ffu) << 8);
+    return (v >> 16) | (v << 16);
+}
+
+/**
+\brief Owen scrambling of the binary fraction 0.v (bit 31 first) with the hash of Burley, "Practical Hash-based Owen Scrambling" (2020).
+
+Every bit is flipped depending on the bits above it, so points of an elementary interval stay in one interval. Scrambling the sample index
+with it shuffles the order of the points, but the first 2^m indices still map to a full set of 2^m low bits.
+
+\param v value to scramble
+\param seed scramble, different seeds give independent scrambles
+*/
+inline std::uint32_t owen_scramble(std::uint32_t v, std::uint32_t seed) {
+    v = reverse_bits(v);
+    v += seed;
+    v ^= v * 0x6c50b47cu;
+    v ^= v * 0xb82f1e52u;
+    v ^= v * 0xc7afe638u;
+    v ^= v * 0x8d22f6e6u;
+    return reverse_bits(v);
+}
+
+/**
+\brief Second dimension of the Sobol sequence (the first is reverse_bits(index)). Its direction numbers are v(k+1) = v(k) ^ (v(k) >> 1).
+
+Point is the xor of the direction numbers of the set index bits, so it is looked up per byte of the index: scrambled indices use all 32 bits
+and a loop over them costs more than the rest of the sample.
+*/
+inline std::uint32_t sobol_dimension1(std::uint32_t index) {
+    struct byte_tables {
+        std::uint32_t points[4][256];
+
+        byte_tables() {
+            std::uint32_t v[32];
+            v[0] = 1u << 31;
+            for (int k = 1; k < 32; ++k)
+                v[k] = v[k - 1] ^ (v[k - 1] >> 1);
+            for (int b = 0; b < 4; ++b) {
+                for (std::uint32_t i = 0; i < 256; ++i) {
+                    std::uint32_t result = 0;
+                    for (int k = 0; k < 8; ++k)
+                        if (i & (1u << k))
+                            result ^= v[8 * b + k];
+                    points[b][i] = result;
+                }
+            }
+        }
+    };
+    static const byte_tables tables;
+
+    return tables.points[0][index & 0xff] ^ tables.points[1][(index >> 8) & 0xff]
+        ^ tables.points[2][(index >> 16) & 0xff] ^ tables.points[3][index >> 24];
+}
+
+/**
+\brief Element i of a random permutation of [0, l), chosen by p. Kensler, "Correlated Multi-Jittered Sampling" (2013).
+*/
+inline std::uint32_t permutation_element(std::uint32_t i, std::uint32_t l, std::uint32_t p) {
+    std::uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do { // walks the cycle of a permutation of [0, w] until it lands in [0, l)
+        i ^= p; i *= 0xe170893du; i ^= p >> 16;
+        i ^= (i & w) >> 4; i ^= p >> 8; i *= 0x0929eb3fu; i ^= p >> 23;
+        i ^= (i & w) >> 1; i *= 1 | p >> 27; i *= 0x6935fa69u;
+        i ^= (i & w) >> 11; i *= 0x74dcb303u; i ^= (i & w) >> 2;
+        i *= 0x9e501cc3u; i ^= (i & w) >> 2; i *= 0xc860a3dfu;
+        i &= w; i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+/**
+\brief Interleaves the low 16 bits of x (even bits) and y (odd bits).
+*/
+inline std::uint32_t morton_2d(std::uint32_t x, std::uint32_t y) {
+    auto spread = [](std::uint32_t v) {
+        v &= 0xffffu;
+        v = (v | (v << 8)) & 0x00ff00ffu;
+        v = (v | (v << 4)) & 0x0f0f0f0fu;
+        v = (v | (v << 2)) & 0x33333333u;
+        v = (v | (v << 1)) & 0x55555555u;
+        return v;
+    };
+    return spread(x) | (spread(y) << 1);
+}
+
+/**
+\brief Sample values of one pixel sample. Every get_1d or get_2d call takes the next dimension(s), set_dimension jumps to a fixed one,
+so the same decision of different samples (lens point, scattering at bounce 2, ...) gets its values from the same dimension.
+
+Kinds:
+- independent: the PCG32 generator of the sample, as before samplers.
+- stratified: sample s of a dimension falls into stratum s of a random permutation of samples_per_pixel strata (a grid in 2D), jittered inside.
+- sobol: Owen scrambled Sobol (0,2)-sequence padded over dimension pairs: every dimension scrambles and shuffles the sample index
+  with its own hash (Burley 2020), so any prefix of 2^m samples is stratified in every pair of dimensions and the count need not be known.
+- blue_noise: one Sobol sequence over the whole image, pixels take blocks of it in Morton order (Ahmed and Wonka 2020, ZSobol in pbrt-v4).
+  The Morton index is Owen scrambled, so every base 4 digit (2x2 pixels at some level) is permuted by a hash of the digits above it
+  and neighbouring pixels get complementary points: the error is spread as blue noise. pbrt picks any of the 24 digit permutations,
+  the scramble only the 8 that flip bits, but it costs one hash per dimension instead of one per digit.
+  Only the low 32 bits of the index are used: 2 * log2(image size) + log2(samples per pixel) should stay within 32.
+  Samples past the block of a pixel (progressive and interactive renders) repeat the pattern with a new scramble for every block.
+
+Values are hashed from seed, pixel, sample and dimension only, so the sampler is a small copyable value and the image does not depend on thread count.
+The PCG32 generator is still there (generator()) for random decisions that have no fixed dimension, such as free flight in volumes.
+*/
+class sampler {
+public:
+    sampler() : kind(sampler_kind::independent), sample(0), dimension(0), morton_index_top(0), index_bits(0), log2_samples(0),
+        strata(1), strata_x(1), strata_y(1), pixel_hash(0), block_hash(0)
+    {}
+
+    /**
+    \brief Sampler of sample s of pixel (i, j).
+
+    \param settings pattern and image
+    \param i pixel column
+    \param j pixel row
+    \param s sample index of the pixel
+    */
+    sampler(const sampler_settings& settings, int i, int j, int s)
+        : kind(settings.kind), sample(static_cast<std::uint32_t>(s)), dimension(0), morton_index_top(0), index_bits(0), log2_samples(0),
+        strata(1), strata_x(1), strata_y(1), pixel_hash(0), block_hash(0),
+        gen(rng::for_sample(settings.seed, static_cast<std::uint32_t>(j * settings.image_width + i), static_cast<std::uint32_t>(s)))
+    {
+        if (kind == sampler_kind::independent)
+            return;
+
+        // Only what the kind uses, the sampler is built for every sample
+        const auto spp = static_cast<std::uint32_t>(settings.samples_per_pixel > 1 ? settings.samples_per_pixel : 1);
+        const std::uint64_t seed_hash = rng::mix(settings.seed);
+        pixel_hash = rng::mix(seed_hash ^ ((static_cast<std::uint64_t>(j) << 32) | static_cast<std::uint32_t>(i)));
+
+        if (kind == sampler_kind::stratified) {
+            strata = spp;
+            while ((strata_x + 1) * (strata_x + 1) <= spp)
+                ++strata_x;
+            strata_y = spp / strata_x;
+        }
+        else if (kind == sampler_kind::blue_noise) {
+            const int side = settings.image_width > settings.image_height ? settings.image_width : settings.image_height;
+            log2_samples = ceil_log2(spp);
+            index_bits = 2 * ceil_log2(static_cast<std::uint32_t>(side)) + log2_samples;
+            const std::uint64_t morton_index = (static_cast<std::uint64_t>(morton_2d(static_cast<std::uint32_t>(i), static_cast<std::uint32_t>(j))) << log2_samples)
+                | (sample & ((1u << log2_samples) - 1));
+            morton_index_top = index_bits < 32 ? static_cast<std::uint32_t>(morton_index << (32 - index_bits)) : static_cast<std::uint32_t>(morton_index);
+            block_hash = rng::mix(seed_hash + (sample >> log2_samples));
+        }
+    }
+
+    /**
+    \brief Next sample value in [0, 1).
+    */
+    double get_1d() {
+        const std::uint32_t d = dimension++;
+        if (kind == sampler_kind::independent)
+            return gen.next_double();
+        return pattern_1d(d);
+    }
+
+    /**
+    \brief Next two sample values in [0, 1), stratified together.
+    */
+    sample_2d get_2d() {
+        const std::uint32_t d = dimension;
+        dimension += 2;
+        if (kind == sampler_kind::independent) {
+            const double u = gen.next_double();
+            return sample_2d{ u, gen.next_double() };
+        }
+        return pattern_2d(d);
+    }
+
+    /**
+    \brief Next get_1d or get_2d call starts at dimension d.
+    */
+    void set_dimension(std::uint32_t d) { dimension = d; }
+
+    /**
+    \brief Generator of the sample, for hit tests and other random decisions outside the dimensions.
+    */
+    rng& generator() { return gen; }
+
+private:
+    static double to_unit(std::uint32_t v) {
+        return v * (1.0 / 4294967296.0);
+    }
+
+    /**
+    \brief Value of dimension d for the pattern kinds. Kept out of get_1d, so the independent path stays small where it is inlined.
+    */
+    double pattern_1d(std::uint32_t d) const {
+        switch (kind) {
+        case sampler_kind::stratified: {
+            const std::uint64_t h = rng::mix(rng::mix(pixel_hash + d) ^ (sample / strata));
+            const std::uint32_t stratum = permutation_element(sample % strata, strata, static_cast<std::uint32_t>(h));
+            return (stratum + to_unit(static_cast<std::uint32_t>(h >> 32))) / strata;
+        }
+        case sampler_kind::sobol: {
+            const std::uint64_t h = rng::mix(pixel_hash + d);
+            const std::uint32_t index = owen_scramble(sample, static_cast<std::uint32_t>(h));
+            return to_unit(owen_scramble(reverse_bits(index), static_cast<std::uint32_t>(h >> 32)));
+        }
+        case sampler_kind::blue_noise: {
+            const std::uint64_t h = rng::mix(block_hash + d);
+            return to_unit(owen_scramble(reverse_bits(blue_noise_index(d)), static_cast<std::uint32_t>(h)));
+        }
+        case sampler_kind::independent:
+            break;
+        }
+        return 0;
+    }
+
+    /**
+    \brief Values of dimensions d and d + 1 for the pattern kinds.
+    */
+    sample_2d pattern_2d(std::uint32_t d) const {
+        switch (kind) {
+        case sampler_kind::stratified: {
+            const std::uint32_t count = strata_x * strata_y;
+            const std::uint64_t h = rng::mix(rng::mix(pixel_hash + d) ^ (sample / count));
+            const std::uint32_t stratum = permutation_element(sample % count, count, static_cast<std::uint32_t>(h));
+            const std::uint64_t jitter = rng::mix(h);
+            return sample_2d{
+                (stratum % strata_x + to_unit(static_cast<std::uint32_t>(jitter))) / strata_x,
+                (stratum / strata_x + to_unit(static_cast<std::uint32_t>(jitter >> 32))) / strata_y
+            };
+        }
+        case sampler_kind::sobol: {
+            const std::uint64_t h = rng::mix(pixel_hash + d);
+            const std::uint64_t h2 = rng::mix(h);
+            const std::uint32_t index = owen_scramble(sample, static_cast<std::uint32_t>(h));
+            return sample_2d{
+                to_unit(owen_scramble(reverse_bits(index), static_cast<std::uint32_t>(h >> 32))),
+                to_unit(owen_scramble(sobol_dimension1(index), static_cast<std::uint32_t>(h2)))
+            };
+        }
+        case sampler_kind::blue_noise: {
+            const std::uint64_t h = rng::mix(block_hash + d);
+            const std::uint32_t index = blue_noise_index(d);
+            return sample_2d{
+                to_unit(owen_scramble(reverse_bits(index), static_cast<std::uint32_t>(h))),
+                to_unit(owen_scramble(sobol_dimension1(index), static_cast<std::uint32_t>(h >> 32)))
+            };
+        }
+        case sampler_kind::independent:
+            break;
+        }
+        return sample_2d{ 0, 0 };
+    }
+
+    /**
+    \brief Index of this sample in the image wide Sobol sequence of dimension d: Morton code of the pixel followed by the sample index,
+    scrambled from the top bit down with a hash of dimension and block.
+    */
+    std::uint32_t blue_noise_index(std::uint32_t d) const {
+        const std::uint32_t scrambled = owen_scramble(morton_index_top, static_cast<std::uint32_t>(rng::mix(block_hash ^ (0x55555555ull * d))));
+        if (index_bits >= 32)
+            return scrambled;
+        return index_bits > 0 ? scrambled >> (32 - index_bits) : 0;
+    }
+
+    sampler_kind kind;
+    std::uint32_t sample; // sample index of the pixel
+    std::uint32_t dimension; // dimension the next value comes from
+    std::uint32_t morton_index_top; // Morton code of the pixel and sample index in the block, shifted up to bit 31
+    int index_bits; // bits of the blue noise index: 2 * log2 of the larger image side + log2_samples
+    int log2_samples; // log2 of samples per pixel, rounded up
+    std::uint32_t strata; // strata of 1D stratified values
+    std::uint32_t strata_x, strata_y; // strata grid of 2D stratified values
+    std::uint64_t pixel_hash; // hash of seed and pixel
+    std::uint64_t block_hash; // hash of seed and block of samples, blue noise scrambles the same way in every pixel
+    rng gen; // generator of the sample
+};
+
+#endif
@@ -0,0 +1,842 @@
+/**
+\file
+\brief .h file that contains binary scene file: writer, and loader that renders from the memory mapped file
+*/
+
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "utility.h"
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "box.h"
+#include "box_batch.h"
+#include "sphere_batch.h"
+#include "triangle_mesh.h"
+#include "constant_medium.h"
+#include "volume.h"
+#include "instance.h"
+#include "bvh.h"
+#include "material.h"
+#include "texture.h"
+#include "arena.h"
+#include "mesh_loader.h"
+
+/*
+File layout (version 2), every offset is from the start of the file and every array starts on a 64 byte boundary:
+
+    scene_file_header       magic, version, byte order, camera and the ranges of the tables below
+    arrays                  buffers of batches and meshes, their flat BVH nodes and the perlin tables of noise textures, exactly as they are in memory
+    strings                 zero terminated file names of image textures
+    textures, materials     scene_texture_record and scene_material_record tables
+    objects, children       scene_object_record table, children of an object are a range of object indices
+
+Objects, textures and materials are shared by index, so an object used by several instances is stored once. Children and checker
+textures always come before their parents, so the loader creates everything in one pass and a file cannot contain a cycle.
+Numbers are stored in the byte order of the machine that wrote the file; a machine of the other order refuses it.
+*/
+
+const char scene_file_magic[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0' };
+const std::uint32_t scene_file_version = 2;
+const std::uint32_t scene_byte_order = 0x01020304;
+const std::uint32_t scene_none = 0xFFFFFFFFu; // no material or texture
+const size_t scene_array_alignment = 64;
+
+/**
+\brief Array of count elements at offset (bytes from the start of the file).
+*/
+struct scene_range {
+    std::uint64_t offset;
+    std::uint64_t count;
+};
+
+/**
+\brief Camera and render settings stored with the scene.
+*/
+struct scene_view {
+    double lookfrom[3];
+    double lookat[3];
+    double vup[3];
+    double vfov; // vertical field of view in degrees
+    double aperture;
+    double dist_to_focus;
+    double aspect_ratio;
+    double background[3];
+    double time0, time1; // shutter
+    std::int32_t image_width;
+    std::int32_t samples_per_pixel;
+};
+
+/**
+\brief Fills scene_view from camera and render settings. Shutter is [0, 1].
+*/
+inline scene_view make_scene_view(const point3& lookfrom, const point3& lookat, const vec3& vup, double vfov, double aperture,
+    double dist_to_focus, double aspect_ratio, const color& background, int image_width, int samples_per_pixel) {
+    return scene_view{
+        { lookfrom.x(), lookfrom.y(), lookfrom.z() }, { lookat.x(), lookat.y(), lookat.z() }, { vup.x(), vup.y(), vup.z() },
+        vfov, aperture, dist_to_focus, aspect_ratio, { background.x(), background.y(), background.z() },
+        0.0, 1.0, image_width, samples_per_pixel };
+}
+
+/**
+\brief Vector of three numbers of a scene_view.
+*/
+inline vec3 scene_vector(const double v[3]) {
+    return vec3(v[0], v[1], v[2]);
+}
+
+struct scene_file_header {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t byte_order; // scene_byte_order as the writer stored it
+    std::uint32_t root; // object index of the world list
+    std::uint32_t reserved;
+    std::uint64_t file_size;
+    scene_view view;
+    scene_range strings, textures, materials, objects, children;
+};
+
+/**
+\brief Texture: value is the solid color, value[0] is the scale of noise and arrays are its perlin gradients and permutations.
+Image file name is an offset into strings.
+*/
+struct scene_texture_record {
+    std::uint32_t kind; // texture_kind
+    std::uint32_t name; // image texture file name, scene_none if the image could not be opened
+    std::uint32_t odd, even; // textures of a checker
+    double value[4];
+    scene_range arrays[2];
+};
+
+/**
+\brief Material: albedo and param are metal color and fuzz, param is the index of refraction of dielectric, the others use texture.
+*/
+struct scene_material_record {
+    std::uint32_t kind; // material_kind
+    std::uint32_t texture;
+    double albedo[3];
+    double param;
+};
+
+/**
+\brief Object: shape numbers (see scene_writer::add_object for each kind), children, material, and the arrays of batches and meshes.
+*/
+struct scene_object_record {
+    static const int max_arrays = 12;
+
+    std::uint32_t kind; // hittable_kind
+    std::uint32_t material;
+    std::uint32_t first_child; // first entry in children
+    std::uint32_t child_count;
+    std::uint64_t count; // spheres, boxes or triangles of a batch or mesh
+    double params[12];
+    scene_range arrays[max_arrays];
+};
+
+static_assert(sizeof(scene_texture_record) == 80, "scene_texture_record is part of the file format");
+static_assert(sizeof(scene_material_record) == 40, "scene_material_record is part of the file format");
+static_assert(sizeof(scene_object_record) == 312, "scene_object_record is part of the file format");
+
+/**
+\brief Calls visit on every buffer of a sphere batch, in the order they are stored.
+*/
+template <typename batch_type, typename visitor>
+void scene_arrays(batch_type& b, sphere_batch*, const visitor& visit) {
+    visit(b.center_x); visit(b.center_y); visit(b.center_z); visit(b.radius);
+    visit(b.material_index);
+    visit(b.tree.nodes); visit(b.tree.indices);
+}
+
+/**
+\brief Calls visit on every buffer of a box batch, in the order they are stored.
+*/
+template <typename batch_type, typename visitor>
+void scene_arrays(batch_type& b, box_batch*, const visitor& visit) {
+    visit(b.min_x); visit(b.min_y); visit(b.min_z);
+    visit(b.max_x); visit(b.max_y); visit(b.max_z);
+    visit(b.material_index);
+    visit(b.tree.nodes); visit(b.tree.indices);
+}
+
+/**
+\brief Calls visit on every buffer of a mesh, in the order they are stored.
+*/
+template <typename mesh_type, typename visitor>
+void scene_arrays(mesh_type& m, triangle_mesh*, const visitor& visit) {
+    visit(m.pos_x); visit(m.pos_y); visit(m.pos_z);
+    visit(m.normal_x); visit(m.normal_y); visit(m.normal_z);
+    visit(m.uv_u); visit(m.uv_v);
+    visit(m.indices); visit(m.normal_indices); visit(m.uv_indices);
+    visit(m.tree.nodes);
+}
+
+/**
+\brief Calls visit on every buffer of a density grid, in the order they are stored.
+*/
+template <typename grid_type, typename visitor>
+void scene_arrays(grid_type& g, density_grid*, const visitor& visit) {
+    visit(g.brick_index); visit(g.voxels);
+}
+
+/**
+\brief Writes a built scene into one file: objects, materials, textures, camera and the flat BVHs of batches and meshes.
+
+Supports every built-in object, material and texture kind; translate and rotate_y are stored as instances. Objects of kind custom,
+and materials or textures of kind custom, cannot be stored and make write fail. Noise textures store their perlin tables, so a loaded
+scene renders the same pattern; baked turbulence is not stored. BVHs over objects (bvh_node) only store their objects and are built again on load, they are small next to the trees of batches and meshes.
+*/
+class scene_writer {
+public:
+    /**
+    \brief Returns false and prints why if the scene has something that cannot be stored or the file cannot be written.
+
+    \param filename output file
+    \param world top level objects of the scene
+    \param view camera and render settings
+    */
+    bool write(const char* filename, const hittable_list& world, const scene_view& view);
+
+private:
+    std::uint32_t add_object(const shared_ptr<hittable>& object);
+    std::uint32_t add_material(const material* mat);
+    std::uint32_t add_texture(const texture* tex);
+
+    template <typename T>
+    scene_range add_array(const T* data, size_t count) {
+        blob.resize((blob.size() + scene_array_alignment - 1) / scene_array_alignment * scene_array_alignment);
+        scene_range range = { blob.size(), count };
+        if (count > 0) {
+            const auto* bytes = reinterpret_cast<const char*>(data);
+            blob.insert(blob.end(), bytes, bytes + count * sizeof(T));
+        }
+        return range;
+    }
+
+    template <typename owner_type>
+    void add_arrays(const owner_type& owner, scene_object_record& record) {
+        int k = 0;
+        scene_arrays(owner, static_cast<owner_type*>(nullptr), [&](const auto& buffer) {
+            record.arrays[k++] = add_array(buffer.data(), buffer.size());
+        });
+    }
+
+    void fail(const std::string& reason) {
+        if (error.empty())
+            error = reason;
+    }
+
+    std::vector<char> blob; // whole file, header is filled in last
+    std::string strings;
+    std::vector<scene_texture_record> textures;
+    std::vector<scene_material_record> materials;
+    std::vector<scene_object_record> objects;
+    std::vector<std::uint32_t> children;
+    std::unordered_map<const hittable*, std::uint32_t> object_index;
+    std::unordered_map<const material*, std::uint32_t> material_index;
+    std::unordered_map<const texture*, std::uint32_t> texture_index;
+    std::vector<shared_ptr<hittable>> flattened; // instances made from translate and rotate_y, kept alive while their address is a key
+    std::string error;
+};
+
+inline bool scene_writer::write(const char* filename, const hittable_list& world, const scene_view& view) {
+    blob.assign(sizeof(scene_file_header), 0);
+
+    std::vector<std::uint32_t> top;
+    for (const auto& object : world.objects)
+        top.push_back(add_object(object));
+
+    scene_object_record root = {};
+    root.kind = static_cast<std::uint32_t>(hittable_kind::list);
+    root.first_child = static_cast<std::uint32_t>(children.size());
+    root.child_count = static_cast<std::uint32_t>(top.size());
+    children.insert(children.end(), top.begin(), top.end());
+    objects.push_back(root);
+
+    if (!error.empty()) {
+        std::cerr << "ERROR: Scene '" << filename << "': " << error << ".\n";
+        return false;
+    }
+
+    scene_file_header header = {};
+    std::memcpy(header.magic, scene_file_magic, sizeof(header.magic));
+    header.version = scene_file_version;
+    header.byte_order = scene_byte_order;
+    header.root = static_cast<std::uint32_t>(objects.size() - 1);
+    header.view = view;
+    header.strings = add_array(strings.data(), strings.size());
+    header.textures = add_array(textures.data(), textures.size());
+    header.materials = add_array(materials.data(), materials.size());
+    header.objects = add_array(objects.data(), objects.size());
+    header.children = add_array(children.data(), children.size());
+    header.file_size = blob.size();
+    std::memcpy(blob.data(), &header, sizeof(header));
+
+    std::ofstream out(filename, std::ios::binary);
+    out.write(blob.data(), static_cast<std::streamsize>(blob.size()));
+    if (!out) {
+        std::cerr << "ERROR: Cannot write scene '" << filename << "'.\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+\brief Adds object and everything it uses, returns its index.
+
+Numbers in params by kind: sphere center and radius; moving_sphere center0, center1, time0, time1 and radius; rectangles their two ranges and k;
+box minimum and maximum corner; constant_medium its negative inverse density; grid_medium the grid resolution, its two corners and the
+density scale; fog its center, radius and negative inverse density; instance the 3x4 object to world matrix; bvh its shutter.
+*/
+inline std::uint32_t scene_writer::add_object(const shared_ptr<hittable>& object) {
+    const auto known = object_index.find(object.get());
+    if (known != object_index.end())
+        return known->second;
+
+    auto store_point = [](double* out, const point3& p) {
+        out[0] = p.x();
+        out[1] = p.y();
+        out[2] = p.z();
+    };
+
+    scene_object_record record = {};
+    record.kind = static_cast<std::uint32_t>(object->kind);
+    record.material = scene_none;
+    std::vector<std::uint32_t> object_children;
+
+    switch (object->kind) {
+    case hittable_kind::sphere: {
+        const auto& s = kind_cast<sphere>(*object);
+        store_point(record.params, s.center);
+        record.params[3] = s.radius;
+        record.material = add_material(s.mat_ptr.get());
+        break;
+    }
+    case hittable_kind::moving_sphere: {
+        const auto& s = kind_cast<moving_sphere>(*object);
+        store_point(record.params, s.center0);
+        store_point(record.params + 3, s.center1);
+        record.params[6] = s.time0;
+        record.params[7] = s.time1;
+        record.params[8] = s.radius;
+        record.material = add_material(s.mat_ptr.get());
+        break;
+    }
+    case hittable_kind::xy_rect: {
+        const auto& rect = kind_cast<xy_rect>(*object);
+        const double p[5] = { rect.x0, rect.x1, rect.y0, rect.y1, rect.k };
+        std::memcpy(record.params, p, sizeof(p));
+        record.material = add_material(rect.mp.get());
+        break;
+    }
+    case hittable_kind::xz_rect: {
+        const auto& rect = kind_cast<xz_rect>(*object);
+        const double p[5] = { rect.x0, rect.x1, rect.z0, rect.z1, rect.k };
+        std::memcpy(record.params, p, sizeof(p));
+        record.material = add_material(rect.mp.get());
+        break;
+    }
+    case hittable_kind::yz_rect: {
+        const auto& rect = kind_cast<yz_rect>(*object);
+        const double p[5] = { rect.y0, rect.y1, rect.z0, rect.z1, rect.k };
+        std::memcpy(record.params, p, sizeof(p));
+        record.material = add_material(rect.mp.get());
+        break;
+    }
+    case hittable_kind::box: {
+        const auto& b = kind_cast<box>(*object);
+        store_point(record.params, b.box_min);
+        store_point(record.params + 3, b.box_max);
+        record.material = add_material(b.mp.get());
+        break;
+    }
+    case hittable_kind::sphere_batch: {
+        const auto& batch = kind_cast<sphere_batch>(*object);
+        record.count = batch.size();
+        add_arrays(batch, record);
+        for (const auto& m : batch.materials)
+            object_children.push_back(add_material(m.get()));
+        break;
+    }
+    case hittable_kind::box_batch: {
+        const auto& batch = kind_cast<box_batch>(*object);
+        record.count = batch.size();
+        add_arrays(batch, record);
+        for (const auto& m : batch.materials)
+            object_children.push_back(add_material(m.get()));
+        break;
+    }
+    case hittable_kind::triangle_mesh: {
+        const auto& mesh = kind_cast<triangle_mesh>(*object);
+        record.count = mesh.size();
+        add_arrays(mesh, record);
+        record.material = add_material(mesh.mat_ptr.get());
+        break;
+    }
+    case hittable_kind::constant_medium: {
+        const auto& medium = kind_cast<constant_medium>(*object);
+        record.params[0] = medium.neg_inv_density;
+        record.material = add_material(medium.phase_function.get());
+        object_children.push_back(add_object(medium.boundary));
+        break;
+    }
+    case hittable_kind::grid_medium: {
+        const auto& medium = kind_cast<grid_medium>(*object);
+        for (int a = 0; a < 3; ++a)
+            record.params[a] = medium.grid.resolution[a];
+        store_point(record.params + 3, medium.grid.bounds_min);
+        store_point(record.params + 6, medium.grid.bounds_max);
+        record.params[9] = medium.density_scale;
+        record.material = add_material(medium.phase_function.get());
+        add_arrays(medium.grid, record);
+        break;
+    }
+    case hittable_kind::fog: {
+        const auto& fog = kind_cast<fog_medium>(*object);
+        store_point(record.params, fog.center);
+        record.params[3] = fog.radius;
+        record.params[4] = fog.neg_inv_density;
+        record.material = add_material(fog.phase_function.get());
+        break;
+    }
+    case hittable_kind::translate:
+    case hittable_kind::rotate_y: {
+        flattened.push_back(flatten_transforms(object));
+        const auto index = add_object(flattened.back());
+        object_index[object.get()] = index;
+        return index;
+    }
+    case hittable_kind::instance: {
+        const auto& inst = kind_cast<instance>(*object);
+        std::memcpy(record.params, inst.object_to_world.m, sizeof(inst.object_to_world.m));
+        object_children.push_back(add_object(inst.ptr));
+        break;
+    }
+    case hittable_kind::list: {
+        for (const auto& child : kind_cast<hittable_list>(*object).objects)
+            object_children.push_back(add_object(child));
+        break;
+    }
+    case hittable_kind::bvh: {
+        const auto& tree = kind_cast<flat_bvh>(*object);
+        record.params[0] = tree.time_begin;
+        record.params[1] = tree.time_end;
+        for (const auto& child : tree.objects)
+            object_children.push_back(add_object(child));
+        break;
+    }
+    case hittable_kind::custom:
+        fail("object of a custom hittable class cannot be stored");
+        return 0;
+    }
+
+    // Batches list their materials in children, they are material indices there
+    record.first_child = static_cast<std::uint32_t>(children.size());
+    record.child_count = static_cast<std::uint32_t>(object_children.size());
+    children.insert(children.end(), object_children.begin(), object_children.end());
+
+    const auto index = static_cast<std::uint32_t>(objects.size());
+    objects.push_back(record);
+    object_index[object.get()] = index;
+    return index;
+}
+
+inline std::uint32_t scene_writer::add_material(const material* mat) {
+    if (!mat)
+        return scene_none;
+    const auto known = material_index.find(mat);
+    if (known != material_index.end())
+        return known->second;
+
+    scene_material_record record = {};
+    record.kind = static_cast<std::uint32_t>(mat->kind);
+    record.texture = scene_none;
+
+    switch (mat->kind) {
+    case material_kind::lambertian:
+        record.texture = add_texture(kind_cast<lambertian>(*mat).albedo.get());
+        break;
+    case material_kind::metal: {
+        const auto& m = kind_cast<metal>(*mat);
+        for (int a = 0; a < 3; ++a)
+            record.albedo[a] = m.albedo[a];
+        record.param = m.fuzz;
+        break;
+    }
+    case material_kind::dielectric:
+        record.param = kind_cast<dielectric>(*mat).ir;
+        break;
+    case material_kind::diffuse_light:
+        record.texture = add_texture(kind_cast<diffuse_light>(*mat).emit.get());
+        break;
+    case material_kind::isotropic:
+        record.texture = add_texture(kind_cast<isotropic>(*mat).albedo.get());
+        break;
+    case material_kind::custom:
+        fail("material of a custom class cannot be stored");
+        return scene_none;
+    }
+
+    const auto index = static_cast<std::uint32_t>(materials.size());
+    materials.push_back(record);
+    material_index[mat] = index;
+    return index;
+}
+
+inline std::uint32_t scene_writer::add_texture(const texture* tex) {
+    if (!tex)
+        return scene_none;
+    const auto known = texture_index.find(tex);
+    if (known != texture_index.end())
+        return known->second;
+
+    scene_texture_record record = {};
+    record.kind = static_cast<std::uint32_t>(tex->kind);
+    record.name = record.odd = record.even = scene_none;
+
+    switch (tex->kind) {
+    case texture_kind::solid_color: {
+        const color c = tex->value(0, 0, point3(0, 0, 0));
+        for (int a = 0; a < 3; ++a)
+            record.value[a] = c[a];
+        break;
+    }
+    case texture_kind::checker: {
+        const auto& checker = kind_cast<checker_texture>(*tex);
+        record.odd = add_texture(checker.odd.get());
+        record.even = add_texture(checker.even.get());
+        break;
+    }
+    case texture_kind::noise: {
+        const auto& noise = kind_cast<noise_texture>(*tex);
+        record.value[0] = noise.scale;
+        record.arrays[0] = add_array(noise.noise.gradients(), perlin::point_count * 4);
+        record.arrays[1] = add_array(noise.noise.permutations(), perlin::point_count * 4);
+        break;
+    }
+    case texture_kind::image: {
+        const auto& image = kind_cast<image_texture>(*tex).image;
+        if (image) {
+            record.name = static_cast<std::uint32_t>(strings.size());
+            strings.append(image->filename.c_str(), image->filename.size() + 1);
+        }
+        break;
+    }
+    case texture_kind::custom:
+        fail("texture of a custom class cannot be stored");
+        return scene_none;
+    }
+
+    const auto index = static_cast<std::uint32_t>(textures.size());
+    textures.push_back(record);
+    texture_index[tex] = index;
+    return index;
+}
+
+/**
+\brief Scene file mapped into memory. Loaded batches and meshes read their arrays and BVH nodes straight from the mapping:
+nothing is parsed or built again except small object BVHs, pages are read when rays first touch them, and every process that renders
+the same file shares them.
+
+Header and tables are checked; the contents of the arrays (vertex indices, BVH nodes) are trusted like the scene that wrote them.
+Keep the scene_file alive as long as the objects loaded from it: declare it before the arena.
+*/
+class scene_file {
+public:
+    /**
+    \brief Maps the file and creates its objects in arena. Returns false and prints why if the file cannot be read.
+
+    \param filename scene file
+    \param arena owner of the created objects
+    \param world receives the top level objects
+    \param view receives camera and render settings
+    */
+    bool load(const char* filename, scene_arena& arena, hittable_list& world, scene_view& view);
+
+    size_t size() const { return file.size(); }
+
+private:
+    template <typename T>
+    const T* section(const scene_range& range) const {
+        if (range.count == 0)
+            return nullptr;
+        if (range.offset % alignof(T) != 0 || range.offset > file.size()
+            || range.count > (file.size() - range.offset) / sizeof(T))
+            return nullptr;
+        return reinterpret_cast<const T*>(file.data() + range.offset);
+    }
+
+    template <typename owner_type>
+    bool view_arrays(owner_type& owner, const scene_object_record& record) {
+        int k = 0;
+        bool ok = true;
+        scene_arrays(owner, static_cast<owner_type*>(nullptr), [&](auto& buffer) {
+            using element = typename std::remove_reference<decltype(buffer[0])>::type;
+            const scene_range& range = record.arrays[k++];
+            const element* data = section<element>(range);
+            if (range.count > 0 && !data)
+                ok = false;
+            buffer = std::remove_const_t<std::remove_reference_t<decltype(buffer)>>::view(data, static_cast<size_t>(range.count));
+        });
+        return ok;
+    }
+
+    mapped_file file;
+};
+
+inline bool scene_file::load(const char* filename, scene_arena& arena, hittable_list& world, scene_view& view) {
+    auto fail = [&](const char* reason) {
+        std::cerr << "ERROR: Scene '" << filename << "': " << reason << ".\n";
+        return false;
+    };
+
+    if (!file.open(filename, false))
+        return fail("cannot open the file");
+    if (file.size() < sizeof(scene_file_header))
+        return fail("file is too short");
+
+    scene_file_header header;
+    std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, scene_file_magic, sizeof(header.magic)) != 0)
+        return fail("not a scene file");
+    if (header.byte_order != scene_byte_order)
+        return fail("file was written on a machine of the other byte order");
+    if (header.version != scene_file_version)
+        return fail("unsupported version");
+    if (header.file_size != file.size())
+        return fail("file is truncated");
+
+    const char* strings = section<char>(header.strings);
+    const auto* texture_records = section<scene_texture_record>(header.textures);
+    const auto* material_records = section<scene_material_record>(header.materials);
+    const auto* object_records = section<scene_object_record>(header.objects);
+    const auto* child_records = section<std::uint32_t>(header.children);
+    if ((header.strings.count && !strings) || (header.textures.count && !texture_records)
+        || (header.materials.count && !material_records) || !object_records
+        || (header.children.count && !child_records))
+        return fail("table outside of the file");
+    if (header.root >= header.objects.count)
+        return fail("bad root object");
+    if (header.strings.count && strings[header.strings.count - 1] != '\0')
+        return fail("bad string table");
+
+    // Textures refer to earlier textures only
+
+    std::vector<shared_ptr<texture>> textures(static_cast<size_t>(header.textures.count));
+    auto texture_at = [&](std::uint32_t k, size_t limit) {
+        return k < limit ? textures[k] : nullptr;
+    };
+    for (size_t k = 0; k < textures.size(); ++k) {
+        const auto& record = texture_records[k];
+        const color value(record.value[0], record.value[1], record.value[2]);
+        switch (static_cast<texture_kind>(record.kind)) {
+        case texture_kind::solid_color:
+            textures[k] = arena.make<solid_color>(value);
+            break;
+        case texture_kind::checker: {
+            auto checker = arena.make<checker_texture>();
+            checker->odd = texture_at(record.odd, k);
+            checker->even = texture_at(record.even, k);
+            if (!checker->odd || !checker->even)
+                return fail("bad checker texture");
+            textures[k] = checker;
+            break;
+        }
+        case texture_kind::noise: {
+            const auto* gradients = section<double>(record.arrays[0]);
+            const auto* permutations = section<std::uint8_t>(record.arrays[1]);
+            if (!gradients || !permutations || record.arrays[0].count != perlin::point_count * 4
+                || record.arrays[1].count != perlin::point_count * 4)
+                return fail("bad noise texture");
+            textures[k] = arena.make<noise_texture>(record.value[0], gradients, permutations);
+            break;
+        }
+        case texture_kind::image:
+            if (record.name != scene_none && record.name >= header.strings.count)
+                return fail("bad image file name");
+            textures[k] = record.name == scene_none ? arena.make<image_texture>() : arena.make<image_texture>(strings + record.name);
+            break;
+        default:
+            return fail("unknown texture kind");
+        }
+    }
+
+    std::vector<shared_ptr<material>> materials(static_cast<size_t>(header.materials.count));
+    for (size_t k = 0; k < materials.size(); ++k) {
+        const auto& record = material_records[k];
+        const auto tex = texture_at(record.texture, textures.size());
+        const bool needs_texture = record.kind == static_cast<std::uint32_t>(material_kind::lambertian)
+            || record.kind == static_cast<std::uint32_t>(material_kind::diffuse_light)
+            || record.kind == static_cast<std::uint32_t>(material_kind::isotropic);
+        if (needs_texture && !tex)
+            return fail("material without texture");
+        switch (static_cast<material_kind>(record.kind)) {
+        case material_kind::lambertian:
+            materials[k] = arena.make<lambertian>(tex);
+            break;
+        case material_kind::metal:
+            materials[k] = arena.make<metal>(color(record.albedo[0], record.albedo[1], record.albedo[2]), record.param);
+            break;
+        case material_kind::dielectric:
+            materials[k] = arena.make<dielectric>(record.param);
+            break;
+        case material_kind::diffuse_light:
+            materials[k] = arena.make<diffuse_light>(tex);
+            break;
+        case material_kind::isotropic:
+            materials[k] = arena.make<isotropic>(tex);
+            break;
+        default:
+            return fail("unknown material kind");
+        }
+    }
+    auto material_at = [&](std::uint32_t k) {
+        return k < materials.size() ? materials[k] : nullptr;
+    };
+
+    // Objects refer to earlier objects only
+
+    std::vector<shared_ptr<hittable>> objects(static_cast<size_t>(header.objects.count));
+    for (size_t k = 0; k < objects.size(); ++k) {
+        const auto& record = object_records[k];
+        const double* p = record.params;
+        const auto mat = material_at(record.material);
+        if (record.first_child > header.children.count || record.child_count > header.children.count - record.first_child)
+            return fail("bad children");
+        const std::uint32_t* kids = child_records ? child_records + record.first_child : nullptr;
+
+        hittable_list list;
+        const auto kind = static_cast<hittable_kind>(record.kind);
+        if (kind == hittable_kind::instance || kind == hittable_kind::constant_medium
+            || kind == hittable_kind::list || kind == hittable_kind::bvh) {
+            for (std::uint32_t c = 0; c < record.child_count; ++c) {
+                if (kids[c] >= k)
+                    return fail("bad children");
+                list.add(objects[kids[c]]);
+            }
+        }
+
+        switch (kind) {
+        case hittable_kind::sphere:
+            objects[k] = arena.make<sphere>(point3(p[0], p[1], p[2]), p[3], mat);
+            break;
+        case hittable_kind::moving_sphere:
+            objects[k] = arena.make<moving_sphere>(point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]), p[6], p[7], p[8], mat);
+            break;
+        case hittable_kind::xy_rect:
+            objects[k] = arena.make<xy_rect>(p[0], p[1], p[2], p[3], p[4], mat);
+            break;
+        case hittable_kind::xz_rect:
+            objects[k] = arena.make<xz_rect>(p[0], p[1], p[2], p[3], p[4], mat);
+            break;
+        case hittable_kind::yz_rect:
+            objects[k] = arena.make<yz_rect>(p[0], p[1], p[2], p[3], p[4], mat);
+            break;
+        case hittable_kind::box:
+            objects[k] = arena.make<box>(point3(p[0], p[1], p[2]), point3(p[3], p[4], p[5]), mat);
+            break;
+        case hittable_kind::sphere_batch:
+        case hittable_kind::box_batch: {
+            std::vector<shared_ptr<material>> batch_materials;
+            for (std::uint32_t c = 0; c < record.child_count; ++c) {
+                batch_materials.push_back(material_at(kids[c]));
+                if (!batch_materials.back())
+                    return fail("bad batch material");
+            }
+            if (kind == hittable_kind::sphere_batch) {
+                auto batch = arena.make<sphere_batch>();
+                if (!view_arrays(*batch, record))
+                    return fail("array outside of the file");
+                batch->materials = batch_materials;
+                batch->set_built(static_cast<size_t>(record.count));
+                objects[k] = batch;
+            }
+            else {
+                auto batch = arena.make<box_batch>();
+                if (!view_arrays(*batch, record))
+                    return fail("array outside of the file");
+                batch->materials = batch_materials;
+                batch->set_built(static_cast<size_t>(record.count));
+                objects[k] = batch;
+            }
+            break;
+        }
+        case hittable_kind::triangle_mesh: {
+            auto mesh = arena.make<triangle_mesh>(mat);
+            if (!view_arrays(*mesh, record))
+                return fail("array outside of the file");
+            objects[k] = mesh;
+            break;
+        }
+        case hittable_kind::constant_medium: {
+            if (list.objects.size() != 1 || !mat)
+                return fail("bad volume");
+            auto medium = arena.make<constant_medium>(list.objects[0], -1 / p[0], color(1, 1, 1));
+            medium->phase_function = mat;
+            objects[k] = medium;
+            break;
+        }
+        case hittable_kind::grid_medium: {
+            if (!mat || !(p[0] >= 1 && p[1] >= 1 && p[2] >= 1 && p[0] * p[1] * p[2] < 1e10))
+                return fail("bad volume");
+            auto medium = arena.make<grid_medium>(density_grid(static_cast<int>(p[0]), static_cast<int>(p[1]), static_cast<int>(p[2]),
+                point3(p[3], p[4], p[5]), point3(p[6], p[7], p[8])), p[9], mat);
+            auto& grid = medium->grid;
+            const size_t bricks = grid.brick_index.size();
+            if (!view_arrays(grid, record))
+                return fail("array outside of the file");
+            if (grid.brick_index.size() != bricks)
+                return fail("bad volume");
+            for (const auto b : grid.brick_index)
+                if (b != density_grid::empty_brick && b >= grid.brick_count())
+                    return fail("bad volume");
+            grid.update_majorant();
+            objects[k] = medium;
+            break;
+        }
+        case hittable_kind::fog: {
+            if (!mat)
+                return fail("bad volume");
+            auto fog = arena.make<fog_medium>(point3(p[0], p[1], p[2]), p[3], 1.0, mat);
+            fog->neg_inv_density = p[4];
+            objects[k] = fog;
+            break;
+        }
+        case hittable_kind::instance: {
+            if (list.objects.size() != 1)
+                return fail("bad instance");
+            affine_transform to_world;
+            std::memcpy(to_world.m, p, sizeof(to_world.m));
+            objects[k] = arena.make<instance>(list.objects[0], to_world);
+            break;
+        }
+        case hittable_kind::list:
+            objects[k] = arena.make<hittable_list>(list);
+            break;
+        case hittable_kind::bvh:
+            objects[k] = arena.make<bvh_node>(list, p[0], p[1]);
+            break;
+        default:
+            return fail("unknown object kind");
+        }
+    }
+
+    if (object_records[header.root].kind != static_cast<std::uint32_t>(hittable_kind::list))
+        return fail("root is not a list");
+    world = kind_cast<hittable_list>(*objects[header.root]);
+    view = header.view;
+    return true;
+}
+
+#endif
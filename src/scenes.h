@@ -0,0 +1,523 @@
+/**
+\file
+\brief .h file that contains the built-in demo scenes
+*/
+
+#ifndef SCENES_H
+#define SCENES_H
+
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+
+#include "utility.h"
+
+#include "hittable_list.h"
+#include "sphere.h"
+#include "sphere_batch.h"
+#include "material.h"
+#include "moving_sphere.h"
+#include "aarect.h"
+#include "box.h"
+#include "box_batch.h"
+#include "constant_medium.h"
+#include "volume.h"
+#include "bvh.h"
+#include "instance.h"
+#include "triangle_mesh.h"
+#include "mesh_loader.h"
+#include "arena.h"
+#include "scene_file.h"
+
+// Demos
+hittable_list random_scene(scene_arena& arena) {
+    hittable_list world;
+    // All static spheres go into one batch, moving ones stay separate objects.
+    auto spheres = arena.make<sphere_batch>();
+
+    auto ground_material = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+    spheres->add(point3(0, -1000, 0), 1000, ground_material);
+
+    for (int a = -11; a < 11; a++) {
+        for (int b = -11; b < 11; b++) {
+            auto choose_mat = random_double();
+            point3 center(a + 0.9 * random_double(), 0.2, b + 0.9 * random_double());
+
+            if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
+                shared_ptr<material> sphere_material;
+
+                if (choose_mat < 0.8) {
+                    // diffuse
+                    auto albedo = color::random() * color::random();
+                    sphere_material = arena.make<lambertian>(albedo);
+                    auto center2 = center + vec3(0, random_double(0, .5), 0);
+                    world.add(arena.make<moving_sphere>(
+                        center, center2, 0.0, 1.0, 0.2, sphere_material));
+                }
+                else if (choose_mat < 0.95) {
+                    // metal
+                    auto albedo = color::random(0.5, 1);
+                    auto fuzz = random_double(0, 0.5);
+                    sphere_material = arena.make<metal>(albedo, fuzz);
+                    spheres->add(center, 0.2, sphere_material);
+                }
+                else {
+                    // glass
+                    sphere_material = arena.make<dielectric>(1.5);
+                    spheres->add(center, 0.2, sphere_material);
+                }
+            }
+        }
+
+    }
+
+    auto material1 = arena.make<dielectric>(1.5);
+    spheres->add(point3(0, 1, 0), 1.0, material1);
+
+    auto material2 = arena.make<lambertian>(color(0.4, 0.2, 0.1));
+    spheres->add(point3(-4, 1, 0), 1.0, material2);
+
+    auto material3 = arena.make<metal>(color(0.7, 0.6, 0.5), 0.0);
+    spheres->add(point3(4, 1, 0), 1.0, material3);
+
+    spheres->build();
+    world.add(spheres);
+
+    return world;
+}
+
+hittable_list two_spheres(scene_arena& arena) {
+    hittable_list objects;
+
+    auto checker = arena.make<checker_texture>(color(0.2, 0.3, 0.1), color(0.9, 0.9, 0.9));
+
+    objects.add(arena.make<sphere>(point3(0, -10, 0), 10, arena.make<lambertian>(checker)));
+    objects.add(arena.make<sphere>(point3(0, 10, 0), 10, arena.make<lambertian>(checker)));
+
+    return objects;
+}
+
+hittable_list two_perlin_spheres(scene_arena& arena) {
+    hittable_list objects;
+    auto pertext = arena.make<noise_texture>(4);
+    objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(pertext)));
+    objects.add(arena.make<sphere>(point3(0, 2, 0), 2, arena.make<lambertian>(pertext)));
+
+    return objects;
+}
+
+hittable_list earth(scene_arena& arena) {
+    auto earth_texture = arena.make<image_texture>("earthmap.jpg");
+    auto earth_surface = arena.make<lambertian>(earth_texture);
+    auto globe = arena.make<sphere>(point3(0, 0, 0), 2, earth_surface);
+
+    return hittable_list(globe);
+}
+
+hittable_list simple_light(scene_arena& arena) {
+    hittable_list objects;
+
+    auto pertext = arena.make<noise_texture>(4);
+    objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, arena.make<lambertian>(pertext)));
+    objects.add(arena.make<sphere>(point3(0, 2, 0), 2, arena.make<lambertian>(pertext)));
+
+    auto difflight = arena.make<diffuse_light>(color(4, 4, 4));
+    objects.add(arena.make<xy_rect>(3, 5, 1, 3, -2, difflight));
+
+    return objects;
+}
+
+hittable_list cornell_box(scene_arena& arena) {
+    hittable_list objects;
+
+    auto red = arena.make<lambertian>(color(.65, .05, .05));
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    auto green = arena.make<lambertian>(color(.12, .45, .15));
+    auto light = arena.make<diffuse_light>(color(15, 15, 15));
+
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena.make<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    shared_ptr<hittable> box1 = arena.make<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+    box1 = arena.make<rotate_y>(box1, 15);
+    box1 = arena.make<translate>(box1, vec3(265, 0, 295));
+    objects.add(box1);
+
+    shared_ptr<hittable> box2 = arena.make<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+    box2 = arena.make<rotate_y>(box2, -18);
+    box2 = arena.make<translate>(box2, vec3(130, 0, 65));
+    objects.add(box2);
+
+    return objects;
+}
+
+hittable_list cornell_smoke(scene_arena& arena) {
+    hittable_list objects;
+
+    auto red = arena.make<lambertian>(color(.65, .05, .05));
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    auto green = arena.make<lambertian>(color(.12, .45, .15));
+    auto light = arena.make<diffuse_light>(color(7, 7, 7));
+
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena.make<xz_rect>(113, 443, 127, 432, 554, light));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    shared_ptr<hittable> box1 = arena.make<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+    box1 = arena.make<rotate_y>(box1, 15);
+    box1 = arena.make<translate>(box1, vec3(265, 0, 295));
+
+    shared_ptr<hittable> box2 = arena.make<box>(point3(0, 0, 0), point3(165, 165, 165), white);
+    box2 = arena.make<rotate_y>(box2, -18);
+    box2 = arena.make<translate>(box2, vec3(130, 0, 65));
+
+    objects.add(arena.make<constant_medium>(flatten_transforms(box1), 0.01, color(0, 0, 0)));
+    objects.add(arena.make<constant_medium>(flatten_transforms(box2), 0.01, color(1, 1, 1)));
+
+    return objects;
+}
+
+hittable_list presentation(scene_arena& arena) {
+    auto boxes1 = arena.make<box_batch>();
+    auto ground = arena.make<lambertian>(color(0.48, 0.83, 0.53));
+
+    const int boxes_per_side = 20;
+    for (int i = 0; i < boxes_per_side; i++) {
+        for (int j = 0; j < boxes_per_side; j++) {
+            auto w = 100.0;
+            auto x0 = -1000.0 + i * w;
+            auto z0 = -1000.0 + j * w;
+            auto y0 = 0.0;
+            auto x1 = x0 + w;
+            auto y1 = random_double(1, 101);
+            auto z1 = z0 + w;
+
+            boxes1->add(point3(x0, y0, z0), point3(x1, y1, z1), ground);
+        }
+    }
+
+    hittable_list objects;
+
+    boxes1->build();
+    objects.add(boxes1);
+
+    auto light = arena.make<diffuse_light>(color(7, 7, 7));
+    objects.add(arena.make<xz_rect>(123, 423, 147, 412, 554, light));
+
+    auto center1 = point3(400, 400, 200);
+    auto center2 = center1 + vec3(30, 0, 0);
+    auto moving_sphere_material = arena.make<lambertian>(color(0.7, 0.3, 0.1));
+    objects.add(arena.make<moving_sphere>(center1, center2, 0, 1, 50, moving_sphere_material));
+
+    objects.add(arena.make<sphere>(point3(260, 150, 45), 50, arena.make<dielectric>(1.5)));
+    objects.add(arena.make<sphere>(
+        point3(0, 150, 145), 50, arena.make<metal>(color(0.8, 0.8, 0.9), 1.0)
+        ));
+
+    auto boundary = arena.make<sphere>(point3(360, 150, 145), 70, arena.make<dielectric>(1.5));
+    objects.add(boundary);
+    objects.add(arena.make<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
+    objects.add(arena.make<fog_medium>(point3(0, 0, 0), 5000, .0001, color(1, 1, 1)));
+
+    auto emat = arena.make<lambertian>(arena.make<image_texture>("earthmap.jpg"));
+    objects.add(arena.make<sphere>(point3(400, 200, 400), 100, emat));
+    auto pertext = arena.make<noise_texture>(0.1);
+    objects.add(arena.make<sphere>(point3(220, 280, 300), 80, arena.make<lambertian>(pertext)));
+
+    auto boxes2 = arena.make<sphere_batch>();
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    int ns = 1000;
+    for (int j = 0; j < ns; j++) {
+        boxes2->add(point3::random(0, 165), 10, white);
+    }
+    boxes2->build();
+
+    objects.add(arena.make<translate>(
+        arena.make<rotate_y>(boxes2, 15),
+        vec3(-100, 270, 395)
+        )
+    );
+
+    return objects;
+}
+
+hittable_list cornell_cloud(scene_arena& arena) {
+    hittable_list objects;
+
+    auto red = arena.make<lambertian>(color(.65, .05, .05));
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    auto green = arena.make<lambertian>(color(.12, .45, .15));
+    auto light = arena.make<diffuse_light>(color(15, 15, 15));
+
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 555, green));
+    objects.add(arena.make<yz_rect>(0, 555, 0, 555, 0, red));
+    objects.add(arena.make<xz_rect>(213, 343, 227, 332, 554, light));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 555, white));
+    objects.add(arena.make<xz_rect>(0, 555, 0, 555, 0, white));
+    objects.add(arena.make<xy_rect>(0, 555, 0, 555, 555, white));
+
+    // Ball of turbulent smoke, the empty corners of the grid cost no memory
+    const int n = 96;
+    const point3 low(148, 0, 148), high(408, 260, 408);
+    density_grid grid(n, n, n, low, high);
+    perlin noise;
+    for (int z = 0; z < n; ++z) {
+        for (int y = 0; y < n; ++y) {
+            for (int x = 0; x < n; ++x) {
+                const vec3 q = vec3(x, y, z) / (n - 1) * 2 - vec3(1, 1, 1);
+                const double falloff = 1 - q.length();
+                if (falloff <= 0)
+                    continue;
+                const double d = 2 * falloff - 0.6 + noise.turb(5 * q);
+                if (d > 0)
+                    grid.set(x, y, z, static_cast<float>(d));
+            }
+        }
+    }
+    objects.add(arena.make<grid_medium>(grid, 0.05, color(0.8, 0.8, 0.8)));
+
+    return objects;
+}
+
+hittable_list instanced_clusters(scene_arena& arena) {
+    hittable_list objects;
+
+    auto ground = arena.make<lambertian>(color(0.48, 0.83, 0.53));
+    objects.add(arena.make<sphere>(point3(0, -100000, 0), 100000, ground));
+
+    // One cluster of 1000 spheres (bottom level), stored once
+    auto cluster = arena.make<sphere_batch>();
+    auto white = arena.make<lambertian>(color(.73, .73, .73));
+    for (int j = 0; j < 1000; j++)
+        cluster->add(point3::random(-80, 80), 8, white);
+    cluster->build();
+
+    // Many instances of it under one BVH (top level)
+    hittable_list clusters;
+    const int clusters_per_side = 6;
+    for (int i = 0; i < clusters_per_side; i++) {
+        for (int j = 0; j < clusters_per_side; j++) {
+            const double scale = random_double(0.4, 1.0);
+            const vec3 offset(-1000 + 400 * i, 90 * scale, -1000 + 400 * j);
+            const auto to_world = affine_transform::translation(offset)
+                * affine_transform::rotation(vec3::random(-1, 1), random_double(0, 360))
+                * affine_transform::scaling(vec3(scale, scale, scale));
+            clusters.add(arena.make<instance>(cluster, to_world));
+        }
+    }
+    objects.add(arena.make<bvh_node>(clusters, 0, 1));
+
+    auto light = arena.make<diffuse_light>(color(7, 7, 7));
+    objects.add(arena.make<xz_rect>(-600, 600, -600, 600, 1500, light));
+
+    return objects;
+}
+
+/**
+\brief Torus of segments x rings quads (2 triangles each) with per vertex normals and uvs, used when no mesh file is given.
+*/
+void make_torus(triangle_mesh& mesh, double major_radius, double minor_radius, int segments, int rings) {
+    for (int i = 0; i <= segments; i++) {
+        const double phi = 2 * pi * i / segments;
+        for (int j = 0; j <= rings; j++) {
+            const double theta = 2 * pi * j / rings;
+            const vec3 n(cos(phi) * cos(theta), sin(theta), sin(phi) * cos(theta));
+            const point3 center(major_radius * cos(phi), 0, major_radius * sin(phi));
+            mesh.add_vertex(center + minor_radius * n);
+            mesh.add_normal(n);
+            mesh.add_uv(static_cast<double>(i) / segments, static_cast<double>(j) / rings);
+        }
+    }
+    for (int i = 0; i < segments; i++) {
+        for (int j = 0; j < rings; j++) {
+            const auto a = static_cast<std::uint32_t>(i * (rings + 1) + j);
+            const auto b = a + static_cast<std::uint32_t>(rings + 1);
+            mesh.add_triangle(a, a + 1, b);
+            mesh.add_triangle(b, a + 1, b + 1);
+        }
+    }
+}
+
+/**
+\brief Mesh from filename (OBJ or PLY) fitted into a box of height 2 on the ground, or a torus if there is no file or it cannot be loaded.
+Triangle count, load time and memory go to std::cerr.
+*/
+hittable_list mesh_scene(scene_arena& arena, const char* filename, int threads) {
+    hittable_list objects;
+
+    auto ground = arena.make<lambertian>(color(0.5, 0.5, 0.5));
+    objects.add(arena.make<sphere>(point3(0, -1000, 0), 1000, ground));
+
+    auto mesh = arena.make<triangle_mesh>(arena.make<metal>(color(0.8, 0.6, 0.2), 0.1));
+    const auto load_start = std::chrono::steady_clock::now();
+    if (!filename || !load_mesh(filename, *mesh, threads)) {
+        *mesh = triangle_mesh(mesh->mat_ptr);
+        make_torus(*mesh, 1, 0.4, 256, 64);
+    }
+    const auto build_start = std::chrono::steady_clock::now();
+    mesh->build();
+    const auto build_end = std::chrono::steady_clock::now();
+
+    const double load_ms = std::chrono::duration<double, std::milli>(build_start - load_start).count();
+    const double build_ms = std::chrono::duration<double, std::milli>(build_end - build_start).count();
+    std::cerr << "Mesh: " << mesh->size() << " triangles, loaded in " << load_ms << " ms, BVH built in " << build_ms << " ms, "
+        << static_cast<double>(mesh->memory_bytes()) / std::max<size_t>(1, mesh->size()) << " bytes per triangle.\n";
+
+    aabb box;
+    if (!mesh->bounding_box(0, 1, box))
+        return objects;
+
+    // Largest side becomes 2, the mesh stands on the ground at the origin
+    const vec3 extent = box.max() - box.min();
+    const double scale = 2 / fmax(extent.x(), fmax(extent.y(), extent.z()));
+    const vec3 center = 0.5 * (box.min() + box.max());
+    const auto to_world = affine_transform::translation(vec3(0, scale * extent.y() / 2, 0))
+        * affine_transform::scaling(vec3(scale, scale, scale))
+        * affine_transform::translation(-center);
+    objects.add(arena.make<instance>(mesh, to_world));
+
+    auto light = arena.make<diffuse_light>(color(4, 4, 4));
+    objects.add(arena.make<sphere>(point3(-3, 8, 4), 2, light));
+
+    return objects;
+}
+
+/**
+\brief Built-in scene with its camera and render settings: 1 random spheres, 2 two checkered spheres, 3 two perlin spheres, 4 earth,
+5 simple light, 6 Cornell box, 7 Cornell smoke, 8 presentation (also any other number), 9 instanced clusters, 10 mesh, 11 Cornell box with a smoke cloud.
+
+\param number scene number
+\param arena owner of the objects
+\param view receives camera and render settings
+\param mesh_file OBJ or PLY file of scene 10, nullptr for the torus
+\param threads mesh loader threads, 0 means all cores
+*/
+hittable_list builtin_scene(int number, scene_arena& arena, scene_view& view, const char* mesh_file, int threads) {
+    hittable_list world;
+
+    auto aspect_ratio = 16.0 / 9.0;
+    int image_width = 400;
+    int samples_per_pixel = 100;
+
+    point3 lookfrom;
+    point3 lookat;
+    auto vfov = 40.0;
+    auto aperture = 0.0;
+    color background(0, 0, 0);
+
+    switch (number) {
+    case 1:
+        world = random_scene(arena);
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(13, 2, 3);
+        lookat = point3(0, 0, 0);
+        vfov = 20.0;
+        aperture = 0.1;
+        break;
+
+    case 2:
+        world = two_spheres(arena);
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(13, 2, 3);
+        lookat = point3(0, 0, 0);
+        vfov = 20.0;
+        break;
+    case 3:
+        world = two_perlin_spheres(arena);
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(13, 2, 3);
+        lookat = point3(0, 0, 0);
+        vfov = 20.0;
+        break;
+    case 4:
+        world = earth(arena);
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(13, 2, 3);
+        lookat = point3(0, 0, 0);
+        vfov = 20.0;
+        break;
+    case 5:
+        world = simple_light(arena);
+        samples_per_pixel = 400;
+        background = color(0, 0, 0);
+        lookfrom = point3(26, 3, 6);
+        lookat = point3(0, 2, 0);
+        vfov = 20.0;
+        break;
+    case 6:
+        world = cornell_box(arena);
+        aspect_ratio = 1.0;
+        image_width = 600;
+        samples_per_pixel = 200;
+        background = color(0, 0, 0);
+        lookfrom = point3(278, 278, -800);
+        lookat = point3(278, 278, 0);
+        vfov = 40.0;
+        break;
+    case 7:
+        world = cornell_smoke(arena);
+        aspect_ratio = 1.0;
+        image_width = 600;
+        samples_per_pixel = 200;
+        lookfrom = point3(278, 278, -800);
+        lookat = point3(278, 278, 0);
+        vfov = 40.0;
+        break;
+    default:
+    case 8:
+        world = presentation(arena);
+        aspect_ratio = 1.0;
+        image_width = 800;
+        samples_per_pixel = 2000;
+        background = color(0, 0, 0);
+        lookfrom = point3(478, 278, -600);
+        lookat = point3(278, 278, 0);
+        vfov = 40.0;
+        break;
+
+    case 9:
+        world = instanced_clusters(arena);
+        aspect_ratio = 16.0 / 9.0;
+        image_width = 800;
+        samples_per_pixel = 200;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(1800, 1200, -1800);
+        lookat = point3(0, 0, 0);
+        vfov = 40.0;
+        break;
+
+    case 10:
+        world = mesh_scene(arena, mesh_file, threads);
+        aspect_ratio = 16.0 / 9.0;
+        image_width = 800;
+        samples_per_pixel = 100;
+        background = color(0.70, 0.80, 1.00);
+        lookfrom = point3(6, 3, 9);
+        lookat = point3(0, 1, 0);
+        vfov = 20.0;
+        break;
+
+    case 11:
+        world = cornell_cloud(arena);
+        aspect_ratio = 1.0;
+        image_width = 600;
+        samples_per_pixel = 200;
+        background = color(0, 0, 0);
+        lookfrom = point3(278, 278, -800);
+        lookat = point3(278, 278, 0);
+        vfov = 40.0;
+        break;
+    }
+
+    view = make_scene_view(lookfrom, lookat, vec3(0, 1, 0), vfov, aperture, 10.0, aspect_ratio, background, image_width, samples_per_pixel);
+    return world;
+}
+
+#endif
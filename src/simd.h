@@ -0,0 +1,33 @@
+/**
+\file
+\brief .h file that detects SIMD instruction sets and includes their intrinsics
+*/
+
+#ifndef SIMD_H
+#define SIMD_H
+
+// Define RT_NO_SIMD to build the plain scalar code paths everywhere.
+#if !defined(RT_NO_SIMD)
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RT_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSE4_1__) || defined(__AVX__)
+#define RT_SSE41 1
+#include <smmintrin.h>
+#endif
+
+#if defined(__AVX__)
+#define RT_AVX 1
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX2__)
+#define RT_AVX2 1
+#endif
+
+#endif
+
+#endif
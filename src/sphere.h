@@ -9,28 +9,77 @@
 #include "hittable.h"
 #include "vec3.h"
 #include "material.h"
+#include "pdf.h"
+
+/**
+\brief Nearest root t in [t_min, t_max] of |o + t*d - center|^2 = radius^2. Returns false if there is none.
+
+Always solved in double, also when real is float: for big spheres like the r=1000 ground of random_scene,
+|o - center|^2 - radius^2 cancels out all digits of a float.
+Look at sphere::hit for the derivation.
+
+\param o ray origin
+\param d ray direction
+\param center center of the sphere
+\param radius radius of the sphere
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param root output t
+*/
+inline bool hit_sphere(const point3& o, const vec3& d, const point3& center, double radius,
+    double t_min, double t_max, double& root)
+{
+    const double ocx = static_cast<double>(o.x()) - center.x();
+    const double ocy = static_cast<double>(o.y()) - center.y();
+    const double ocz = static_cast<double>(o.z()) - center.z();
+    const double dx = d.x(), dy = d.y(), dz = d.z();
+
+    // b=2h
+    const double a = dx * dx + dy * dy + dz * dz;
+    const double half_b = ocx * dx + ocy * dy + ocz * dz;
+    const double c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius * radius;
+
+    const double discriminant = half_b * half_b - a * c;
+    if (discriminant < 0) return false;
+    const double sqrtd = sqrt(discriminant);
+
+    root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+    return true;
+}
 
 /**
 \brief Abstract sphere class.
 */
-class sphere : public hittable {
+class sphere final : public hittable {
 public:
-    sphere() {}
-    sphere(point3 cen, double r) : center(cen), radius(r) {};
+    sphere() : hittable(hittable_kind::sphere) {}
+    sphere(point3 cen, double r) : hittable(hittable_kind::sphere), center(cen), radius(r) {};
     sphere(point3 cen, double r, shared_ptr<material> m)
-        : center(cen), radius(r), mat_ptr(m) {};
+        : hittable(hittable_kind::sphere), center(cen), radius(r), mat_ptr(m) {};
 
     virtual bool hit(
-        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+
+    virtual bool emits_light() const override { return mat_ptr && mat_ptr->is_emissive(); }
+
+    virtual double pdf_value(const point3& o, const vec3& v, rng& gen) const override;
+
+    virtual vec3 random(const point3& o, sampler& smp) const override;
+
 public:
     point3 center;
     double radius;
     shared_ptr<material> mat_ptr;
 
-private:
     /**
     \brief Gets (u,v) surface coordinates of the ray-object hit point.
 
@@ -66,34 +115,29 @@ Full form of P: (A+tb−C)*(A+tb−C)=r^2. And we get t2b*b+2tb*(A−C)+(A−C)*
 \param t_min minimum t(in a ray) which can be counted as a hit
 \param t_max maximum t(in a ray) which can be counted as a hit
 \param rec bunch of arguments in the struct
+\param gen generator of the current sample
 */
-bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    vec3 oc = r.origin() - center;
-    // b=2h
-    auto a = r.direction().length_squared();
-    auto half_b = dot(oc, r.direction());
-    auto c = oc.length_squared() - radius * radius;
+bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    double root;
+    if (!hit_sphere(r.origin(), r.direction(), center, radius, t_min, t_max, root))
+        return false;
 
-    auto discriminant = half_b * half_b - a * c;
-    if (discriminant < 0) return false;
-    auto sqrtd = sqrt(discriminant);
+    rec.defer(root, this);
 
-    auto root = (-half_b - sqrtd) / a;
-    if (root < t_min || t_max < root) {
-        root = (-half_b + sqrtd) / a;
-        if (root < t_min || t_max < root)
-            return false;
-    }
+    return true;
+}
 
-    rec.t = root;
+/**
+\brief Fills point, normal, (u,v) and material of the closest hit.
+*/
+void sphere::finalize(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     // Check direction towards surfaces
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
-
-    return true;
+    rec.uv_per_length = 1 / (pi * radius); // v goes pole to pole
+    rec.mat_ptr = mat_ptr.get();
 }
 
 /**
@@ -110,4 +154,47 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
     return true;
 }
 
+/**
+\brief Sphere density of directions from o: uniform over the cone of directions that see the sphere.
+
+Cone with half angle theta_max covers solid angle 2*pi*(1-cos(theta_max)), where sin(theta_max) = radius/distance.
+From inside the sphere every direction hits it and there is no cone, so the density is 0 (it is not sampled).
+*/
+double sphere::pdf_value(const point3& o, const vec3& v, rng& gen) const {
+    const auto distance_squared = (center - o).length_squared();
+    if (distance_squared <= radius * radius)
+        return 0;
+
+    hit_record rec;
+    if (!sphere::hit(ray(o, v), 0.001, infinity, rec, gen))
+        return 0;
+
+    auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    auto solid_angle = 2 * pi * (1 - cos_theta_max);
+
+    return 1 / solid_angle;
+}
+
+/**
+\brief Random direction inside the cone from o that sees the sphere.
+*/
+vec3 sphere::random(const point3& o, sampler& smp) const {
+    const auto s = smp.get_2d();
+    vec3 direction = center - o;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+        return sample_unit_vector(s.u, s.v);
+
+    auto r1 = s.u;
+    auto r2 = s.v;
+    auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
+
+    auto phi = 2 * pi * r1;
+    auto x = cos(phi) * sqrt(1 - z * z);
+    auto y = sin(phi) * sqrt(1 - z * z);
+
+    onb uvw(direction);
+    return uvw.local(vec3(x, y, z));
+}
+
 #endif
@@ -0,0 +1,305 @@
+/**
+\file
+\brief .h file that contains batch of spheres stored as structure of arrays
+*/
+
+#ifndef SPHERE_BATCH_H
+#define SPHERE_BATCH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+#include "simd.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "array_buffer.h"
+#include "bvh_tree.h"
+
+/**
+\brief Many static spheres in one hittable. Centers, radii and material indices are separate arrays (structure of arrays).
+
+Batch builds its own BVH over the spheres and then reorders the arrays in leaf order, so every leaf is a contiguous run of at most
+bvh_tree::max_leaf_size spheres that the SIMD kernel intersects in one go (4 spheres per op with AVX, 2 with SSE2).
+Math is double like in sphere, the r=1000 ground sphere needs it.
+Usage: add() all spheres, then build() once before rendering.
+*/
+class sphere_batch final : public hittable {
+public:
+    sphere_batch() : hittable(hittable_kind::sphere_batch) {}
+
+    /**
+    \brief Adds sphere to the batch.
+
+    \param center center of the sphere
+    \param r radius
+    \param m material
+    */
+    void add(const point3& center, double r, shared_ptr<material> m) {
+        center_x.push_back(center.x());
+        center_y.push_back(center.y());
+        center_z.push_back(center.z());
+        radius.push_back(r);
+        material_index.push_back(material_slot(m));
+        ++count;
+    }
+
+    /**
+    \brief Builds the BVH and puts the spheres in leaf order.
+    */
+    void build();
+
+    /**
+    \brief Takes arrays and tree that are already in leaf order (e.g. views of a scene file, see scene_file.h) instead of add() and build().
+
+    \param n number of spheres, the arrays hold n + padding entries
+    */
+    void set_built(size_t n) { count = n; }
+
+    /**
+    \brief Number of spheres.
+    */
+    size_t size() const { return count; }
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+
+public:
+    array_buffer<double> center_x, center_y, center_z; // centers
+    array_buffer<double> radius; // radii
+    array_buffer<std::uint32_t> material_index; // index into materials
+    std::vector<shared_ptr<material>> materials; // every distinct material once
+    bvh_tree tree;
+
+private:
+    static const int padding = 4; // zero spheres after the last one, so a full SIMD load never reads past the arrays
+
+    size_t count = 0;
+
+    std::uint32_t material_slot(const shared_ptr<material>& m) {
+        // Scenes reuse a handful of materials, so a linear search over the last few is fine.
+        for (size_t k = materials.size(); k > 0; --k) {
+            if (materials[k - 1] == m)
+                return static_cast<std::uint32_t>(k - 1);
+            if (materials.size() - k >= 8)
+                break;
+        }
+        materials.push_back(m);
+        return static_cast<std::uint32_t>(materials.size() - 1);
+    }
+
+    /**
+    \brief Closest sphere of the leaf [first, first + n). Returns its index or -1.
+    */
+    long hit_leaf(const ray& r, std::uint32_t first, std::uint32_t n, double t_min, double& t_max) const;
+
+    template <typename T>
+    static void reorder(array_buffer<T>& v, const array_buffer<std::uint32_t>& order, size_t count) {
+        std::vector<T> sorted(count + padding, T());
+        for (size_t i = 0; i < count; ++i)
+            sorted[i] = v[order[i]];
+        v.swap(sorted);
+    }
+};
+
+void sphere_batch::build() {
+    std::vector<aabb> boxes(count);
+    for (size_t i = 0; i < count; ++i) {
+        const point3 c(center_x[i], center_y[i], center_z[i]);
+        const vec3 r(radius[i], radius[i], radius[i]);
+        boxes[i] = aabb(c - r, c + r);
+    }
+
+    tree.build(boxes, bvh_tree::max_leaf_size);
+
+    reorder(center_x, tree.indices, count);
+    reorder(center_y, tree.indices, count);
+    reorder(center_z, tree.indices, count);
+    reorder(radius, tree.indices, count);
+    reorder(material_index, tree.indices, count);
+    tree.make_indices_identity();
+}
+
+/**
+\brief Walks the BVH, tests every leaf with the SIMD kernel and fills the record only for the winner.
+
+\param r ray that goes through object
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param rec bunch of arguments in the struct
+\param gen generator of the current sample
+*/
+bool sphere_batch::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    long closest = -1;
+
+    tree.traverse_leaves(r, t_min, t_max, [&](std::uint32_t first, std::uint32_t n, double t0, double& t1) {
+        const long k = hit_leaf(r, first, n, t0, t1);
+        if (k < 0)
+            return false;
+        closest = k;
+        return true;
+    });
+
+    if (closest < 0)
+        return false;
+
+    rec.defer(t_max, this, static_cast<std::uint32_t>(closest));
+
+    return true;
+}
+
+/**
+\brief Fills point, normal, (u,v) and material of the sphere found by hit.
+*/
+void sphere_batch::finalize(const ray& r, hit_record& rec) const {
+    const auto k = rec.prim_index;
+    const point3 center(center_x[k], center_y[k], center_z[k]);
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius[k];
+    rec.set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.uv_per_length = 1 / (pi * radius[k]);
+    rec.mat_ptr = materials[material_index[k]].get();
+}
+
+/**
+\brief Same quadratic as sphere::hit, for several spheres at once. t_max is lowered to the closest root.
+*/
+long sphere_batch::hit_leaf(const ray& r, std::uint32_t first, std::uint32_t n, double t_min, double& t_max) const {
+    const auto& o = r.orig;
+    const auto& d = r.dir;
+    long closest = -1;
+
+#if RT_AVX || RT_SSE2
+    const double a = static_cast<double>(d.x()) * d.x() + static_cast<double>(d.y()) * d.y() + static_cast<double>(d.z()) * d.z();
+#endif
+
+#if RT_AVX
+    const __m256d ox = _mm256_set1_pd(o.x()), oy = _mm256_set1_pd(o.y()), oz = _mm256_set1_pd(o.z());
+    const __m256d dx = _mm256_set1_pd(d.x()), dy = _mm256_set1_pd(d.y()), dz = _mm256_set1_pd(d.z());
+    const __m256d va = _mm256_set1_pd(a);
+    const __m256d lo = _mm256_set1_pd(t_min);
+    const __m256d lane = _mm256_set_pd(3, 2, 1, 0);
+
+    for (std::uint32_t base = 0; base < n; base += 4) {
+        const auto i = first + base;
+        const __m256d ocx = _mm256_sub_pd(ox, _mm256_loadu_pd(&center_x[i]));
+        const __m256d ocy = _mm256_sub_pd(oy, _mm256_loadu_pd(&center_y[i]));
+        const __m256d ocz = _mm256_sub_pd(oz, _mm256_loadu_pd(&center_z[i]));
+        const __m256d rad = _mm256_loadu_pd(&radius[i]);
+
+        const __m256d half_b = _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, dx), _mm256_mul_pd(ocy, dy)), _mm256_mul_pd(ocz, dz));
+        const __m256d c = _mm256_sub_pd(
+            _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(ocx, ocx), _mm256_mul_pd(ocy, ocy)), _mm256_mul_pd(ocz, ocz)),
+            _mm256_mul_pd(rad, rad));
+        const __m256d disc = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(va, c));
+
+        const __m256d valid = _mm256_and_pd(
+            _mm256_cmp_pd(disc, _mm256_setzero_pd(), _CMP_GE_OQ),
+            _mm256_cmp_pd(lane, _mm256_set1_pd(static_cast<double>(n - base)), _CMP_LT_OQ));
+        if (_mm256_movemask_pd(valid) == 0)
+            continue;
+
+        const __m256d hi = _mm256_set1_pd(t_max);
+        const __m256d sqrtd = _mm256_sqrt_pd(_mm256_max_pd(disc, _mm256_setzero_pd()));
+        const __m256d neg_b = _mm256_sub_pd(_mm256_setzero_pd(), half_b);
+        const __m256d root1 = _mm256_div_pd(_mm256_sub_pd(neg_b, sqrtd), va);
+        const __m256d root2 = _mm256_div_pd(_mm256_add_pd(neg_b, sqrtd), va);
+        const __m256d ok1 = _mm256_and_pd(_mm256_cmp_pd(root1, lo, _CMP_GE_OQ), _mm256_cmp_pd(root1, hi, _CMP_LE_OQ));
+        const __m256d ok2 = _mm256_and_pd(_mm256_cmp_pd(root2, lo, _CMP_GE_OQ), _mm256_cmp_pd(root2, hi, _CMP_LE_OQ));
+        const __m256d root = _mm256_blendv_pd(root2, root1, ok1);
+        const int mask = _mm256_movemask_pd(_mm256_and_pd(valid, _mm256_or_pd(ok1, ok2)));
+        if (mask == 0)
+            continue;
+
+        alignas(32) double t[4];
+        _mm256_store_pd(t, root);
+        for (int k = 0; k < 4; ++k) {
+            if ((mask & (1 << k)) && t[k] <= t_max) {
+                t_max = t[k];
+                closest = static_cast<long>(i + k);
+            }
+        }
+    }
+#elif RT_SSE2
+    const __m128d ox = _mm_set1_pd(o.x()), oy = _mm_set1_pd(o.y()), oz = _mm_set1_pd(o.z());
+    const __m128d dx = _mm_set1_pd(d.x()), dy = _mm_set1_pd(d.y()), dz = _mm_set1_pd(d.z());
+    const __m128d va = _mm_set1_pd(a);
+    const __m128d lo = _mm_set1_pd(t_min);
+    const __m128d lane = _mm_set_pd(1, 0);
+
+    for (std::uint32_t base = 0; base < n; base += 2) {
+        const auto i = first + base;
+        const __m128d ocx = _mm_sub_pd(ox, _mm_loadu_pd(&center_x[i]));
+        const __m128d ocy = _mm_sub_pd(oy, _mm_loadu_pd(&center_y[i]));
+        const __m128d ocz = _mm_sub_pd(oz, _mm_loadu_pd(&center_z[i]));
+        const __m128d rad = _mm_loadu_pd(&radius[i]);
+
+        const __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, dx), _mm_mul_pd(ocy, dy)), _mm_mul_pd(ocz, dz));
+        const __m128d c = _mm_sub_pd(
+            _mm_add_pd(_mm_add_pd(_mm_mul_pd(ocx, ocx), _mm_mul_pd(ocy, ocy)), _mm_mul_pd(ocz, ocz)),
+            _mm_mul_pd(rad, rad));
+        const __m128d disc = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(va, c));
+
+        const __m128d valid = _mm_and_pd(
+            _mm_cmpge_pd(disc, _mm_setzero_pd()),
+            _mm_cmplt_pd(lane, _mm_set1_pd(static_cast<double>(n - base))));
+        if (_mm_movemask_pd(valid) == 0)
+            continue;
+
+        const __m128d hi = _mm_set1_pd(t_max);
+        const __m128d sqrtd = _mm_sqrt_pd(_mm_max_pd(disc, _mm_setzero_pd()));
+        const __m128d neg_b = _mm_sub_pd(_mm_setzero_pd(), half_b);
+        const __m128d root1 = _mm_div_pd(_mm_sub_pd(neg_b, sqrtd), va);
+        const __m128d root2 = _mm_div_pd(_mm_add_pd(neg_b, sqrtd), va);
+        const __m128d ok1 = _mm_and_pd(_mm_cmpge_pd(root1, lo), _mm_cmple_pd(root1, hi));
+        const __m128d ok2 = _mm_and_pd(_mm_cmpge_pd(root2, lo), _mm_cmple_pd(root2, hi));
+        const __m128d root = _mm_or_pd(_mm_and_pd(ok1, root1), _mm_andnot_pd(ok1, root2));
+        const int mask = _mm_movemask_pd(_mm_and_pd(valid, _mm_or_pd(ok1, ok2)));
+        if (mask == 0)
+            continue;
+
+        alignas(16) double t[2];
+        _mm_store_pd(t, root);
+        for (int k = 0; k < 2; ++k) {
+            if ((mask & (1 << k)) && t[k] <= t_max) {
+                t_max = t[k];
+                closest = static_cast<long>(i + k);
+            }
+        }
+    }
+#else
+    for (std::uint32_t k = 0; k < n; ++k) {
+        const auto i = first + k;
+        double root;
+        if (!hit_sphere(o, d, point3(center_x[i], center_y[i], center_z[i]), radius[i], t_min, t_max, root))
+            continue;
+        t_max = root;
+        closest = static_cast<long>(i);
+    }
+#endif
+
+    return closest;
+}
+
+/**
+\brief Box around all spheres of the batch.
+
+\param time0 minumum time
+\param time1 maximum time
+\param output_box output aabb box
+*/
+bool sphere_batch::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (tree.empty())
+        return false;
+    output_box = tree.root_box();
+    return true;
+}
+
+#endif
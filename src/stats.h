@@ -0,0 +1,307 @@
+/**
+\file
+\brief .h file that contains ray and traversal counters, scoped timers and the Chrome trace timeline
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+\brief Counters and timers are compiled in only when RT_ENABLE_STATS is 1, so the renderer pays nothing for them.
+bench.cpp turns them on before it includes anything. Building the renderer with -DRT_ENABLE_STATS=1 prints the totals after a render
+and makes --trace FILE write the timeline.
+*/
+#ifndef RT_ENABLE_STATS
+#define RT_ENABLE_STATS 0
+#endif
+
+/**
+\brief Rays traced and work done by the acceleration structures, the integrator and the materials.
+*/
+struct ray_stats {
+    static const int kinds = 8; // slots of scatter_calls, at least the number of material kinds
+    static const int lengths = 16; // slots of path_lengths, the last one counts all longer paths
+
+    std::uint64_t primary_rays = 0; // camera rays
+    std::uint64_t secondary_rays = 0; // bounces of a path
+    std::uint64_t shadow_rays = 0; // light sampling rays
+    std::uint64_t nodes_visited = 0; // BVH boxes tested against a ray
+    std::uint64_t primitives_tested = 0; // primitives in the leaves a ray reached
+    std::uint64_t list_tests = 0; // objects tested by linear hittable_list scans
+    std::uint64_t medium_samples = 0; // distances sampled inside constant_medium
+    std::uint64_t texture_lookups = 0; // texture_value calls
+    std::uint64_t scatter_calls[kinds] = {}; // scatter_material calls by material_kind
+    std::uint64_t path_lengths[lengths] = {}; // finished paths by number of bounces
+
+    void add(const ray_stats& other) {
+        primary_rays += other.primary_rays;
+        secondary_rays += other.secondary_rays;
+        shadow_rays += other.shadow_rays;
+        nodes_visited += other.nodes_visited;
+        primitives_tested += other.primitives_tested;
+        list_tests += other.list_tests;
+        medium_samples += other.medium_samples;
+        texture_lookups += other.texture_lookups;
+        for (int k = 0; k < kinds; ++k)
+            scatter_calls[k] += other.scatter_calls[k];
+        for (int k = 0; k < lengths; ++k)
+            path_lengths[k] += other.path_lengths[k];
+    }
+
+    std::uint64_t rays() const { return primary_rays + secondary_rays + shadow_rays; }
+
+    std::uint64_t paths() const {
+        std::uint64_t n = 0;
+        for (int k = 0; k < lengths; ++k)
+            n += path_lengths[k];
+        return n;
+    }
+
+    /**
+    \brief Average bounces of the finished paths (paths longer than the histogram count as lengths - 1).
+    */
+    double average_path_length() const {
+        std::uint64_t bounces = 0;
+        for (int k = 0; k < lengths; ++k)
+            bounces += k * path_lengths[k];
+        return paths() > 0 ? static_cast<double>(bounces) / paths() : 0;
+    }
+};
+
+/**
+\brief Span of time one thread spent in a scoped timer, an "X" event of the Chrome trace format.
+*/
+struct trace_event {
+    const char* name; // static string
+    int thread; // see trace_thread_id
+    double start; // microseconds since the first timer
+    double duration; // microseconds
+    int x, y; // tile corner, -1 for other timers
+};
+
+/**
+\brief Counters of the calling thread. Each thread counts alone and adds its counts to the total in flush_thread_stats.
+*/
+inline ray_stats& thread_stats() {
+    thread_local ray_stats stats;
+    return stats;
+}
+
+/**
+\brief Timer events of the calling thread that were not flushed yet.
+*/
+inline std::vector<trace_event>& thread_events() {
+    thread_local std::vector<trace_event> events;
+    return events;
+}
+
+/**
+\brief Row of the calling thread in the trace. render_tiles sets it to the worker index, other threads are 0.
+*/
+inline int& trace_thread_id() {
+    thread_local int id = 0;
+    return id;
+}
+
+/**
+\brief Microseconds since the first call, the time base of all events.
+*/
+inline double trace_clock() {
+    static const auto origin = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - origin).count();
+}
+
+namespace stats_detail {
+    inline std::mutex& total_lock() {
+        static std::mutex lock;
+        return lock;
+    }
+
+    inline ray_stats& total() {
+        static ray_stats stats;
+        return stats;
+    }
+
+    inline std::vector<trace_event>& events() {
+        static std::vector<trace_event> all;
+        return all;
+    }
+}
+
+/**
+\brief Records the time from construction to destruction as an event of the calling thread. Use it through RT_TIMER and RT_TILE_TIMER.
+*/
+class scoped_timer {
+public:
+    explicit scoped_timer(const char* timer_name, int tile_x = -1, int tile_y = -1)
+        : name(timer_name), x(tile_x), y(tile_y), start(trace_clock()) {}
+
+    ~scoped_timer() { stop(); }
+
+    /**
+    \brief Records the event now instead of at the end of the scope, for stages whose results outlive the scope (see RT_TIMER_START).
+    */
+    void stop() {
+        if (!name)
+            return;
+        const double end = trace_clock();
+        thread_events().push_back({ name, trace_thread_id(), start, end - start, x, y });
+        name = nullptr;
+    }
+
+    scoped_timer(const scoped_timer&) = delete;
+    scoped_timer& operator=(const scoped_timer&) = delete;
+
+private:
+    const char* name;
+    int x, y;
+    double start;
+};
+
+/**
+\brief Adds counters and events of the calling thread to the totals and clears them. render_tiles calls it when a worker is done.
+*/
+inline void flush_thread_stats() {
+#if RT_ENABLE_STATS
+    auto& stats = thread_stats();
+    auto& events = thread_events();
+    std::lock_guard<std::mutex> guard(stats_detail::total_lock());
+    stats_detail::total().add(stats);
+    stats = ray_stats();
+    stats_detail::events().insert(stats_detail::events().end(), events.begin(), events.end());
+    events.clear();
+#endif
+}
+
+/**
+\brief Total of all flushed counters.
+*/
+inline ray_stats collect_stats() {
+    std::lock_guard<std::mutex> guard(stats_detail::total_lock());
+    return stats_detail::total();
+}
+
+/**
+\brief Clears the totals and the counters and events of the calling thread.
+*/
+inline void reset_stats() {
+    std::lock_guard<std::mutex> guard(stats_detail::total_lock());
+    stats_detail::total() = ray_stats();
+    stats_detail::events().clear();
+    thread_stats() = ray_stats();
+    thread_events().clear();
+}
+
+/**
+\brief Prints the counters and the time spent in every timer (summed over threads).
+Last thread still holding events must call flush_thread_stats first.
+
+\param out stream
+\param material_names names of the material kinds, in material_kind order
+\param material_count number of names
+*/
+inline void report_stats(std::ostream& out, const char* const* material_names, int material_count) {
+    const ray_stats stats = collect_stats();
+    const double rays = static_cast<double>(std::max<std::uint64_t>(1, stats.rays()));
+
+    out << "Rays: " << stats.primary_rays << " primary, " << stats.secondary_rays << " secondary, " << stats.shadow_rays << " shadow; "
+        << stats.nodes_visited / rays << " box tests, " << stats.primitives_tested / rays << " primitive tests and "
+        << stats.list_tests / rays << " list tests per ray.\n";
+    out << "Paths: " << stats.paths() << ", " << stats.average_path_length() << " bounces on average; "
+        << stats.medium_samples << " medium samples, " << stats.texture_lookups << " texture lookups.\n";
+    out << "Scatter calls:";
+    for (int k = 0; k < std::min(material_count, static_cast<int>(ray_stats::kinds)); ++k)
+        if (stats.scatter_calls[k] > 0)
+            out << ' ' << material_names[k] << ' ' << stats.scatter_calls[k];
+    out << "\n";
+
+    // Timers by name, in order of first appearance
+
+    struct timer_total {
+        std::string name;
+        double duration; // microseconds
+        int count;
+    };
+    std::vector<timer_total> totals;
+    {
+        std::lock_guard<std::mutex> guard(stats_detail::total_lock());
+        for (const auto& e : stats_detail::events()) {
+            auto it = std::find_if(totals.begin(), totals.end(), [&](const timer_total& t) { return t.name == e.name; });
+            if (it == totals.end()) {
+                totals.push_back({ e.name, e.duration, 1 });
+            }
+            else {
+                it->duration += e.duration;
+                ++it->count;
+            }
+        }
+    }
+    out << "Timers:";
+    for (const auto& t : totals)
+        out << ' ' << t.name << ' ' << t.duration / 1000 << " ms (" << t.count << "x)";
+    out << "\n";
+}
+
+/**
+\brief Writes the flushed events as Chrome trace JSON (chrome://tracing, https://ui.perfetto.dev): a row per thread, tile events carry their corner.
+
+\param filename output file
+*/
+inline bool write_trace(const char* filename) {
+    std::ofstream out(filename);
+    if (!out)
+        return false;
+
+    std::lock_guard<std::mutex> guard(stats_detail::total_lock());
+    const auto& events = stats_detail::events();
+
+    int threads = 0;
+    for (const auto& e : events)
+        threads = std::max(threads, e.thread + 1);
+
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    for (int t = 0; t < threads; ++t) {
+        out << (first ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << t
+            << ",\"args\":{\"name\":\"thread " << t << "\"}}";
+        first = false;
+    }
+    for (const auto& e : events) {
+        out << (first ? "" : ",") << "\n{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+            << ",\"ts\":" << e.start << ",\"dur\":" << e.duration;
+        if (e.x >= 0)
+            out << ",\"args\":{\"x\":" << e.x << ",\"y\":" << e.y << "}";
+        out << "}";
+        first = false;
+    }
+    out << "\n]}\n";
+    return static_cast<bool>(out);
+}
+
+#define RT_STATS_CONCAT2(a, b) a##b
+#define RT_STATS_CONCAT(a, b) RT_STATS_CONCAT2(a, b)
+
+#if RT_ENABLE_STATS
+#define RT_COUNT(counter, n) (thread_stats().counter += (n))
+#define RT_TIMER(name) scoped_timer RT_STATS_CONCAT(rt_timer_, __LINE__)(name)
+#define RT_TILE_TIMER(name, x, y) scoped_timer RT_STATS_CONCAT(rt_timer_, __LINE__)(name, x, y)
+#define RT_TIMER_START(id, name) scoped_timer id(name)
+#define RT_TIMER_STOP(id) id.stop()
+#else
+#define RT_COUNT(counter, n) ((void)0)
+#define RT_TIMER(name) ((void)0)
+#define RT_TILE_TIMER(name, x, y) ((void)0)
+#define RT_TIMER_START(id, name) ((void)0)
+#define RT_TIMER_STOP(id) ((void)0)
+#endif
+
+#endif
@@ -8,25 +8,48 @@
 
 #include "utility.h"
 #include "perlin.h"
-#include "c_stb_image.h"
+#include "texture_cache.h"
+#include "stats.h"
 
 #include<iostream>
+#include <cstdint>
+
+/**
+\brief Built-in texture types, see texture_value.
+*/
+enum class texture_kind : std::uint8_t {
+    custom,
+    solid_color,
+    checker,
+    noise,
+    image
+};
 
 /**
 \brief Texture abstract class.
+
+Built-in classes pass their kind to the constructor and are final (see kind_cast); other classes keep custom.
 */
 class texture {
 public:
+    texture() {}
+    explicit texture(texture_kind k) : kind(k) {}
+
     virtual color value(double u, double v, const point3& p) const = 0;
+
+public:
+    texture_kind kind = texture_kind::custom; // built-in type, see texture_value
 };
 
+inline color texture_value(const texture& tex, double u, double v, const point3& p, double footprint = 0);
+
 /**
 \brief Ordinary solid color texture, it interacts with a ray just sending its color. Nuff said.
 */
-class solid_color : public texture {
+class solid_color final : public texture {
 public:
-    solid_color() {}
-    solid_color(color c) : color_value(c) {}
+    solid_color() : texture(texture_kind::solid_color) {}
+    solid_color(color c) : texture(texture_kind::solid_color), color_value(c) {}
 
     solid_color(double red, double green, double blue)
         : solid_color(color(red, green, blue)) {}
@@ -42,15 +65,15 @@ private:
 /**
 \brief If we multiply trig functions in all three dimensions, the sign of that product forms a 3D checker pattern. 
 */
-class checker_texture : public texture {
+class checker_texture final : public texture {
 public:
-    checker_texture() {}
+    checker_texture() : texture(texture_kind::checker) {}
 
     checker_texture(shared_ptr<texture> _even, shared_ptr<texture> _odd)
-        : even(_even), odd(_odd) {}
+        : texture(texture_kind::checker), even(_even), odd(_odd) {}
 
     checker_texture(color c1, color c2)
-        : even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
+        : texture(texture_kind::checker), even(make_shared<solid_color>(c1)), odd(make_shared<solid_color>(c2)) {}
 
     /**
     \brief Value of trig function multiplication.
@@ -62,9 +85,9 @@ public:
     virtual color value(double u, double v, const point3& p) const override {
         auto sines = sin(10 * p.x()) * sin(10 * p.y()) * sin(10 * p.z());
         if (sines < 0)
-            return odd->value(u, v, p);
+            return texture_value(*odd, u, v, p);
         else
-            return even->value(u, v, p);
+            return texture_value(*even, u, v, p);
     }
 
 public:
@@ -75,10 +98,12 @@ public:
 /**
 \brief Noise texture that takes floats between 0 and 1 and creates grey colors.
 */
-class noise_texture : public texture {
+class noise_texture final : public texture {
 public:
-    noise_texture() {}
-    noise_texture(double sc) : scale(sc) {}
+    noise_texture() : texture(texture_kind::noise) {}
+    noise_texture(double sc) : texture(texture_kind::noise), scale(sc) {}
+    noise_texture(double sc, const double* gradients, const std::uint8_t* permutations)
+        : texture(texture_kind::noise), noise(gradients, permutations), scale(sc) {}
 
     /*
     \brief Function that creates grey colors from point p. 
@@ -90,72 +115,88 @@ public:
     \param p point p from camera
     */
     virtual color value(double u, double v, const point3& p) const override {
-        return color(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 10 * noise.turb(p)));
+        double turbulence;
+        if (!baked || !baked->lookup(p, turbulence))
+            turbulence = noise.turb(p);
+        return color(1, 1, 1) * 0.5 * (1 + sin(scale * p.z() + 10 * turbulence));
+    }
+
+    /**
+    \brief Bakes turbulence over region into a grid of resolution^3 floats. Hits inside it interpolate the grid, other hits compute the noise.
+    Fine detail of the highest octaves is lost if the grid is too coarse (see baked_turbulence).
+
+    \param region box the grid covers, e.g. the bounding box of the object
+    \param resolution samples per axis
+    */
+    void bake(const aabb& region, int resolution) {
+        baked = make_shared<baked_turbulence>(noise, region, resolution);
     }
 
 public:
     perlin noise; // perlin noise class
     double scale; // scale of noise
+    shared_ptr<baked_turbulence> baked; // optional cache of turb()
 };
 
 /**
 \brief Texture class that holds an image.
 
-Read in an image and use the 2D (u,v) texture coordinate to index into the image. Texture class that holds an image.
-Uses texture coordinates instead of image pixel coordinates. These are just some form of fractional position in the image. 
+Uses texture coordinates instead of image pixel coordinates. These are just some form of fractional position in the image.
 For example, for pixel (i,j) in an N_x by N_y image, the image texture position is: u = i/(N_x−1) and v = j/(N_y−1).
+Image lives in shared_texture_cache(): textures of the same file share it, it is decoded on the first lookup and kept as mipmapped tiles.
 */
-class image_texture : public texture {
+class image_texture final : public texture {
 public:
-    const static int bytes_per_pixel = 3;
-
-    image_texture()
-        : data(nullptr), width(0), height(0), bytes_per_scanline(0) {}
-
-    image_texture(const char* filename) {
-        auto components_per_pixel = bytes_per_pixel;
+    image_texture() : texture(texture_kind::image) {}
 
-        data = stbi_load(
-            filename, &width, &height, &components_per_pixel, components_per_pixel);
+    image_texture(const char* filename) : texture(texture_kind::image), image(shared_texture_cache().open(filename)) {}
 
-        if (!data) {
-            std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
-            width = height = 0;
-        }
-
-        bytes_per_scanline = bytes_per_pixel * width;
+    virtual color value(double u, double v, const vec3& p) const override {
+        return filtered_value(u, v, 0);
     }
 
-    ~image_texture() {
-        delete data;
-    }
+    /**
+    \brief Trilinear lookup of the mip level that matches the footprint.
 
-    virtual color value(double u, double v, const vec3& p) const override {
+    \param u surface coordinate u
+    \param v surface coordinate v
+    \param footprint width of the ray at the hit in (u,v) units, 0 reads the full resolution
+    */
+    color filtered_value(double u, double v, double footprint) const {
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (data == nullptr)
+        if (!image)
             return color(0, 1, 1);
+        return image->sample(u, v, footprint);
+    }
 
-        // Clamp input texture coordinates to [0,1] x [1,0]
-        u = clamp(u, 0.0, 1.0);
-        v = 1.0 - clamp(v, 0.0, 1.0);  // Flip V to image coordinates
-
-        auto i = static_cast<int>(u * width);
-        auto j = static_cast<int>(v * height);
-
-        // Clamp integer mapping, since actual coordinates should be less than 1.0
-        if (i >= width)  i = width - 1;
-        if (j >= height) j = height - 1;
+public:
+    shared_ptr<mip_image> image; // image in the texture cache, nullptr if the file could not be read
+};
 
-        const auto color_scale = 1.0 / 255.0;
-        auto pixel = data + j * bytes_per_scanline + i * bytes_per_pixel;
+/**
+\brief Value of a texture with a switch on its kind instead of a virtual call.
 
-        return color(color_scale * pixel[0], color_scale * pixel[1], color_scale * pixel[2]);
+\param tex texture
+\param u surface coordinate u
+\param v surface coordinate v
+\param p point of texture
+\param footprint width of the ray at the hit in (u,v) units, image textures use it to pick a mip level
+*/
+inline color texture_value(const texture& tex, double u, double v, const point3& p, double footprint) {
+    RT_COUNT(texture_lookups, 1);
+    switch (tex.kind) {
+    case texture_kind::solid_color:
+        return kind_cast<solid_color>(tex).solid_color::value(u, v, p);
+    case texture_kind::checker:
+        return kind_cast<checker_texture>(tex).checker_texture::value(u, v, p);
+    case texture_kind::noise:
+        return kind_cast<noise_texture>(tex).noise_texture::value(u, v, p);
+    case texture_kind::image:
+        return kind_cast<image_texture>(tex).image_texture::filtered_value(u, v, footprint);
+    case texture_kind::custom:
+        break;
     }
-
-private:
-    unsigned char* data; // image data
-    int width, height; // image characteristics
-    int bytes_per_scanline; // bytes per scanline
-};
+    return tex.value(u, v, p);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,398 @@
+/**
+\file
+\brief .h file that contains the shared cache of mipmapped, tiled image textures
+*/
+
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "utility.h"
+#include "c_stb_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#endif
+
+class texture_cache;
+
+/**
+\brief Moves the position of file to offset bytes from the start. long of std::fseek is 32 bits on Windows, and tile files of big textures pass 2 GB.
+*/
+inline bool seek_file(std::FILE* file, std::int64_t offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, static_cast<off_t>(offset), SEEK_SET) == 0;
+#endif
+}
+
+/**
+\brief Square tile of one mip level, 8 bit RGB. Tiles at the right and bottom edges repeat the last texel.
+*/
+struct texture_tile {
+    static const int size = 32; // texels per side
+    static const int bytes = size * size * 3;
+
+    unsigned char texels[bytes];
+};
+
+/**
+\brief Image file opened through texture_cache.
+
+Only the header is read when it is opened. First lookup decodes the file, builds the mip levels (2x2 box filter down to 1x1),
+writes all of them as tiles into a temporary file and frees the decoded image; from then on tiles are read from that file
+when the cache does not have them.
+*/
+class mip_image {
+public:
+    /**
+    \brief Size of one mip level and where its tiles start in the tile file.
+    */
+    struct level {
+        int width, height;
+        int tiles_x, tiles_y;
+        std::int64_t first_tile;
+    };
+
+    mip_image(texture_cache& owner, const std::string& name, std::uint32_t image_id);
+    mip_image(const mip_image&) = delete;
+    mip_image& operator=(const mip_image&) = delete;
+
+    ~mip_image() {
+        if (tile_file)
+            std::fclose(tile_file);
+    }
+
+    /**
+    \brief Decodes the image on first call. Returns false if it cannot be loaded.
+    */
+    bool ready() const {
+        std::call_once(converted, [this]() { const_cast<mip_image*>(this)->convert(); });
+        return valid;
+    }
+
+    /**
+    \brief Trilinear lookup. A footprint of one texel or less reads the full resolution level.
+
+    \param u surface coordinate u in [0,1]
+    \param v surface coordinate v in [0,1], 0 is the bottom of the image
+    \param footprint width of the lookup in (u,v) units, 0 for the sharpest level
+    */
+    color sample(double u, double v, double footprint) const;
+
+    /**
+    \brief Copies tile index of level k from the tile file.
+    */
+    void read_tile(int k, int index, texture_tile& out) const;
+
+    int level_count() const { return static_cast<int>(levels.size()); }
+
+public:
+    std::string filename;
+    std::uint32_t id; // key of the image in the tile cache
+    int width = 0, height = 0; // size of the full resolution level, read from the header
+
+private:
+    void convert();
+    color texel(int k, int x, int y) const;
+    color bilinear(int k, double u, double v) const;
+
+    texture_cache& cache;
+    mutable std::once_flag converted;
+    bool valid = false;
+    std::vector<level> levels;
+    std::FILE* tile_file = nullptr;
+    mutable std::mutex file_mutex;
+};
+
+/**
+\brief Texture images shared by file name, with their tiles in a least recently used cache of bounded size.
+
+Every image file is decoded once, however many textures use it. Tiles are kept in shards with their own lock and LRU list,
+so render threads rarely wait for each other; every thread also remembers the last tiles it used, so most texel reads take no lock at all.
+Memory stays around the budget however many and however big the images are (plus the tiles threads hold).
+*/
+class texture_cache {
+public:
+    static const int shard_count = 16;
+    static const int thread_memo_size = 16; // tiles every thread keeps without locking
+
+    explicit texture_cache(size_t budget_bytes = size_t(256) << 20) { set_memory_budget(budget_bytes); }
+    texture_cache(const texture_cache&) = delete;
+    texture_cache& operator=(const texture_cache&) = delete;
+
+    /**
+    \brief Image of the file, opened once per name. Returns nullptr (and prints an error) if the file cannot be read.
+    */
+    shared_ptr<mip_image> open(const std::string& filename) {
+        std::lock_guard<std::mutex> guard(open_mutex);
+        auto found = images.find(filename);
+        if (found != images.end())
+            return found->second;
+
+        int w, h, components;
+        shared_ptr<mip_image> image;
+        if (stbi_info(filename.c_str(), &w, &h, &components)) {
+            image = make_shared<mip_image>(*this, filename, next_id++);
+            image->width = w;
+            image->height = h;
+        }
+        else {
+            std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+        }
+        images[filename] = image;
+        return image;
+    }
+
+    /**
+    \brief Sets the memory of all cached tiles. Tiles above the budget are dropped on the next insert.
+    */
+    void set_memory_budget(size_t bytes) {
+        const size_t tiles = std::max<size_t>(bytes / sizeof(texture_tile) / shard_count, 2);
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            s.capacity = tiles;
+        }
+    }
+
+    /**
+    \brief Texel (x, y) of a tile, the tile is read from the image file if it is not in the cache.
+    Pointer stays valid until the calling thread reads another tile.
+    */
+    const unsigned char* texel(const mip_image& image, int level, int tile_index, int x, int y) {
+        const std::uint64_t key = (static_cast<std::uint64_t>(image.id) << 32) | (static_cast<std::uint64_t>(level) << 24)
+            | static_cast<std::uint64_t>(tile_index);
+
+        thread_local memo_entry memo[thread_memo_size];
+        auto& entry = memo[(key ^ (key >> 32)) % thread_memo_size];
+        if (entry.owner != this || entry.key != key) {
+            entry.tile = find_or_load(image, level, tile_index, key);
+            entry.key = key;
+            entry.owner = this;
+        }
+        return entry.tile->texels + 3 * (y * texture_tile::size + x);
+    }
+
+    /**
+    \brief Prints number of images, tile reads, evictions and the memory in use.
+    */
+    void report(std::ostream& out) const {
+        std::lock_guard<std::mutex> images_guard(open_mutex);
+        size_t resident = 0;
+        for (auto& s : shards) {
+            std::lock_guard<std::mutex> guard(s.lock);
+            resident += s.entries.size();
+        }
+        out << "Texture cache: " << images.size() << " images, " << tile_reads << " tiles read, " << evictions << " evicted, "
+            << static_cast<double>(resident * sizeof(texture_tile)) / (1 << 20) << " MB in use.\n";
+    }
+
+    size_t image_count() const {
+        std::lock_guard<std::mutex> guard(open_mutex);
+        return images.size();
+    }
+
+private:
+    struct memo_entry {
+        std::uint64_t key = 0;
+        const texture_cache* owner = nullptr;
+        shared_ptr<const texture_tile> tile;
+    };
+
+    struct shard {
+        mutable std::mutex lock;
+        std::list<std::pair<std::uint64_t, shared_ptr<const texture_tile>>> entries; // most recently used first
+        std::unordered_map<std::uint64_t, decltype(entries)::iterator> index;
+        size_t capacity = 2; // tiles
+    };
+
+    shared_ptr<const texture_tile> find_or_load(const mip_image& image, int level, int tile_index, std::uint64_t key) {
+        auto& s = shards[(key * 0x9E3779B97F4A7C15ull) >> 60];
+        {
+            std::lock_guard<std::mutex> guard(s.lock);
+            auto found = s.index.find(key);
+            if (found != s.index.end()) {
+                s.entries.splice(s.entries.begin(), s.entries, found->second);
+                return found->second->second;
+            }
+        }
+
+        // Read without the lock, another thread may load the same tile meanwhile
+        auto tile = make_shared<texture_tile>();
+        image.read_tile(level, tile_index, *tile);
+        ++tile_reads;
+
+        std::lock_guard<std::mutex> guard(s.lock);
+        auto found = s.index.find(key);
+        if (found != s.index.end())
+            return found->second->second;
+
+        s.entries.emplace_front(key, tile);
+        s.index[key] = s.entries.begin();
+        while (s.entries.size() > s.capacity) {
+            s.index.erase(s.entries.back().first);
+            s.entries.pop_back();
+            ++evictions;
+        }
+        return tile;
+    }
+
+    mutable std::mutex open_mutex;
+    std::unordered_map<std::string, shared_ptr<mip_image>> images;
+    std::uint32_t next_id = 1;
+    shard shards[shard_count];
+    std::atomic<size_t> tile_reads{ 0 };
+    std::atomic<size_t> evictions{ 0 };
+};
+
+/**
+\brief Cache of all image textures of the program. Its budget is set from the command line before the scene is built.
+*/
+inline texture_cache& shared_texture_cache() {
+    static texture_cache cache;
+    return cache;
+}
+
+inline mip_image::mip_image(texture_cache& owner, const std::string& name, std::uint32_t image_id)
+    : filename(name), id(image_id), cache(owner) {}
+
+/**
+\brief Decodes the file and writes its mip levels as tiles. Decodes run one at a time, so only one full image is in memory at once.
+*/
+inline void mip_image::convert() {
+    static std::mutex decode_mutex;
+    std::lock_guard<std::mutex> guard(decode_mutex);
+
+    int w, h, components;
+    unsigned char* data = stbi_load(filename.c_str(), &w, &h, &components, 3);
+    if (!data) {
+        std::cerr << "ERROR: Could not load texture image file '" << filename << "'.\n";
+        return;
+    }
+    std::vector<unsigned char> current(data, data + static_cast<size_t>(w) * h * 3);
+    stbi_image_free(data);
+
+    tile_file = std::tmpfile();
+    if (!tile_file) {
+        std::cerr << "ERROR: Could not create the tile file of texture '" << filename << "'.\n";
+        return;
+    }
+
+    std::int64_t first_tile = 0;
+    texture_tile tile;
+    while (true) {
+        const level l{ w, h, (w + texture_tile::size - 1) / texture_tile::size, (h + texture_tile::size - 1) / texture_tile::size, first_tile };
+        levels.push_back(l);
+
+        for (int ty = 0; ty < l.tiles_y; ++ty) {
+            for (int tx = 0; tx < l.tiles_x; ++tx) {
+                for (int y = 0; y < texture_tile::size; ++y) {
+                    const int sy = std::min(ty * texture_tile::size + y, h - 1);
+                    for (int x = 0; x < texture_tile::size; ++x) {
+                        const int sx = std::min(tx * texture_tile::size + x, w - 1);
+                        const unsigned char* src = &current[3 * (static_cast<size_t>(sy) * w + sx)];
+                        unsigned char* dst = tile.texels + 3 * (y * texture_tile::size + x);
+                        dst[0] = src[0];
+                        dst[1] = src[1];
+                        dst[2] = src[2];
+                    }
+                }
+                std::fwrite(tile.texels, 1, texture_tile::bytes, tile_file);
+            }
+        }
+        first_tile += static_cast<std::int64_t>(l.tiles_x) * l.tiles_y;
+
+        if (w == 1 && h == 1)
+            break;
+
+        // Next level: average of 2x2 texels, an odd last row or column is averaged with itself
+        const int nw = std::max(w / 2, 1), nh = std::max(h / 2, 1);
+        std::vector<unsigned char> next(static_cast<size_t>(nw) * nh * 3);
+        for (int y = 0; y < nh; ++y) {
+            const int y0 = std::min(2 * y, h - 1), y1 = std::min(2 * y + 1, h - 1);
+            for (int x = 0; x < nw; ++x) {
+                const int x0 = std::min(2 * x, w - 1), x1 = std::min(2 * x + 1, w - 1);
+                for (int c = 0; c < 3; ++c) {
+                    const int sum = current[3 * (static_cast<size_t>(y0) * w + x0) + c] + current[3 * (static_cast<size_t>(y0) * w + x1) + c]
+                        + current[3 * (static_cast<size_t>(y1) * w + x0) + c] + current[3 * (static_cast<size_t>(y1) * w + x1) + c];
+                    next[3 * (static_cast<size_t>(y) * nw + x) + c] = static_cast<unsigned char>((sum + 2) / 4);
+                }
+            }
+        }
+        current.swap(next);
+        w = nw;
+        h = nh;
+    }
+
+    std::fflush(tile_file);
+    valid = true;
+}
+
+inline void mip_image::read_tile(int k, int index, texture_tile& out) const {
+    std::lock_guard<std::mutex> guard(file_mutex);
+    if (!seek_file(tile_file, (levels[k].first_tile + index) * texture_tile::bytes)
+        || std::fread(out.texels, 1, texture_tile::bytes, tile_file) != static_cast<size_t>(texture_tile::bytes))
+        std::fill(out.texels, out.texels + texture_tile::bytes, static_cast<unsigned char>(0));
+}
+
+/**
+\brief Texel of level k, coordinates are clamped to the level.
+*/
+inline color mip_image::texel(int k, int x, int y) const {
+    const auto& l = levels[k];
+    x = std::min(std::max(x, 0), l.width - 1);
+    y = std::min(std::max(y, 0), l.height - 1);
+
+    const int tile_index = (y / texture_tile::size) * l.tiles_x + x / texture_tile::size;
+    const unsigned char* t = cache.texel(*this, k, tile_index, x % texture_tile::size, y % texture_tile::size);
+
+    const double color_scale = 1.0 / 255.0;
+    return color(color_scale * t[0], color_scale * t[1], color_scale * t[2]);
+}
+
+/**
+\brief Bilinear lookup of level k, texel centers are at half integer coordinates.
+*/
+inline color mip_image::bilinear(int k, double u, double v) const {
+    const auto& l = levels[k];
+    const double x = u * l.width - 0.5;
+    const double y = (1 - v) * l.height - 0.5; // image rows go down
+    const double fx = floor(x), fy = floor(y);
+    const double ax = x - fx, ay = y - fy;
+    const int x0 = static_cast<int>(fx), y0 = static_cast<int>(fy);
+
+    return (1 - ay) * ((1 - ax) * texel(k, x0, y0) + ax * texel(k, x0 + 1, y0))
+        + ay * ((1 - ax) * texel(k, x0, y0 + 1) + ax * texel(k, x0 + 1, y0 + 1));
+}
+
+inline color mip_image::sample(double u, double v, double footprint) const {
+    if (!ready())
+        return color(0, 1, 1);
+
+    u = clamp(u, 0.0, 1.0);
+    v = clamp(v, 0.0, 1.0);
+
+    // Level where the footprint covers about one texel
+    const double texels = footprint * std::max(width, height);
+    const double lod = texels > 1 ? std::min(std::log2(texels), static_cast<double>(level_count() - 1)) : 0.0;
+    const int k = static_cast<int>(lod);
+    const double blend = lod - k;
+
+    const color fine = bilinear(k, u, v);
+    if (blend <= 0 || k + 1 >= level_count())
+        return fine;
+    return (1 - blend) * fine + blend * bilinear(k + 1, u, v);
+}
+
+#endif
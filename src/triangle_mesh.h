@@ -0,0 +1,327 @@
+/**
+\file
+\brief .h file that contains indexed triangle mesh with its own BVH
+*/
+
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "utility.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "array_buffer.h"
+#include "bvh_tree.h"
+
+/**
+\brief Möller–Trumbore ray/triangle test ("Fast, Minimum Storage Ray/Triangle Intersection"). Math is double.
+
+Returns t and barycentric coordinates (b1, b2) of vertices p1 and p2; p0 gets 1 - b1 - b2.
+
+\param o ray origin
+\param d ray direction
+\param p0 first vertex
+\param p1 second vertex
+\param p2 third vertex
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param t t of the hit
+\param b1 barycentric coordinate of p1
+\param b2 barycentric coordinate of p2
+*/
+inline bool hit_triangle(const double o[3], const double d[3], const double p0[3], const double p1[3], const double p2[3],
+    double t_min, double t_max, double& t, double& b1, double& b2) {
+    const double e1[3] = { p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2] };
+    const double e2[3] = { p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2] };
+
+    const double pv[3] = { d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2], d[0] * e2[1] - d[1] * e2[0] };
+    const double det = e1[0] * pv[0] + e1[1] * pv[1] + e1[2] * pv[2];
+    if (det == 0)
+        return false; // ray is parallel to the triangle
+    const double inv_det = 1 / det;
+
+    const double tv[3] = { o[0] - p0[0], o[1] - p0[1], o[2] - p0[2] };
+    const double u = (tv[0] * pv[0] + tv[1] * pv[1] + tv[2] * pv[2]) * inv_det;
+    if (u < 0 || u > 1)
+        return false;
+
+    const double qv[3] = { tv[1] * e1[2] - tv[2] * e1[1], tv[2] * e1[0] - tv[0] * e1[2], tv[0] * e1[1] - tv[1] * e1[0] };
+    const double v = (d[0] * qv[0] + d[1] * qv[1] + d[2] * qv[2]) * inv_det;
+    if (v < 0 || u + v > 1)
+        return false;
+
+    const double hit_t = (e2[0] * qv[0] + e2[1] * qv[1] + e2[2] * qv[2]) * inv_det;
+    if (hit_t < t_min || hit_t > t_max)
+        return false;
+
+    t = hit_t;
+    b1 = u;
+    b2 = v;
+    return true;
+}
+
+/**
+\brief Triangle mesh: shared vertices, normals and uvs in float arrays (structure of arrays) and 32 bit index buffers.
+
+Normals and uvs can have their own index buffers like in OBJ files, so a loader never has to merge vertex combinations; when such a buffer is
+empty they are per vertex and use the vertex indices (PLY). Both are optional: without normals the mesh is flat shaded, without uvs (u,v)
+are the barycentric coordinates. Mesh builds its own BVH and puts the triangles in leaf order, so a triangle costs 12 bytes of indices, about 30 bytes of nodes and its share of the vertices (6 bytes on a closed mesh,
+16 with normals and uvs) instead of one object per triangle.
+Usage: add vertices and triangles (or use load_mesh), then build() once before rendering.
+*/
+class triangle_mesh final : public hittable {
+public:
+    triangle_mesh() : hittable(hittable_kind::triangle_mesh) {}
+    explicit triangle_mesh(shared_ptr<material> m) : hittable(hittable_kind::triangle_mesh), mat_ptr(m) {}
+
+    std::uint32_t add_vertex(const point3& p) {
+        pos_x.push_back(static_cast<float>(p.x()));
+        pos_y.push_back(static_cast<float>(p.y()));
+        pos_z.push_back(static_cast<float>(p.z()));
+        return static_cast<std::uint32_t>(pos_x.size() - 1);
+    }
+
+    std::uint32_t add_normal(const vec3& n) {
+        normal_x.push_back(static_cast<float>(n.x()));
+        normal_y.push_back(static_cast<float>(n.y()));
+        normal_z.push_back(static_cast<float>(n.z()));
+        return static_cast<std::uint32_t>(normal_x.size() - 1);
+    }
+
+    std::uint32_t add_uv(double u, double v) {
+        uv_u.push_back(static_cast<float>(u));
+        uv_v.push_back(static_cast<float>(v));
+        return static_cast<std::uint32_t>(uv_u.size() - 1);
+    }
+
+    /**
+    \brief Adds triangle of vertices a, b, c. Counter-clockwise order (seen from outside) gives the outward normal.
+    */
+    void add_triangle(std::uint32_t a, std::uint32_t b, std::uint32_t c) {
+        indices.push_back(a);
+        indices.push_back(b);
+        indices.push_back(c);
+    }
+
+    /**
+    \brief Number of triangles.
+    */
+    size_t size() const { return indices.size() / 3; }
+
+    bool has_normals() const { return !normal_x.empty(); }
+    bool has_uvs() const { return !uv_u.empty(); }
+
+    /**
+    \brief Normal index of corner c of triangle k.
+    */
+    std::uint32_t normal_index(size_t k, int c) const {
+        return normal_indices.empty() ? indices[3 * k + c] : normal_indices[3 * k + c];
+    }
+
+    /**
+    \brief Uv index of corner c of triangle k.
+    */
+    std::uint32_t uv_index(size_t k, int c) const {
+        return uv_indices.empty() ? indices[3 * k + c] : uv_indices[3 * k + c];
+    }
+
+    /**
+    \brief Builds the BVH and puts the triangles in leaf order.
+    */
+    void build();
+
+    /**
+    \brief Bytes of all buffers and of the BVH.
+    */
+    size_t memory_bytes() const;
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+    virtual void finalize(const ray& r, hit_record& rec) const override;
+
+public:
+    array_buffer<float> pos_x, pos_y, pos_z; // vertex positions
+    array_buffer<float> normal_x, normal_y, normal_z; // vertex normals, optional
+    array_buffer<float> uv_u, uv_v; // texture coordinates, optional
+    array_buffer<std::uint32_t> indices; // 3 vertex indices per triangle
+    array_buffer<std::uint32_t> normal_indices; // 3 normal indices per triangle, empty for per vertex normals
+    array_buffer<std::uint32_t> uv_indices; // 3 uv indices per triangle, empty for per vertex uvs
+    shared_ptr<material> mat_ptr;
+    bvh_tree tree;
+
+private:
+    void vertex(std::uint32_t k, double p[3]) const {
+        p[0] = pos_x[k];
+        p[1] = pos_y[k];
+        p[2] = pos_z[k];
+    }
+
+    /**
+    \brief Closest triangle of the leaf [first, first + n). Returns its index or -1, and its barycentric coordinates.
+    */
+    long hit_leaf(const double o[3], const double d[3], std::uint32_t first, std::uint32_t n,
+        double t_min, double& t_max, double& b1, double& b2) const;
+
+    static void reorder(array_buffer<std::uint32_t>& v, const array_buffer<std::uint32_t>& order) {
+        if (v.empty())
+            return;
+        std::vector<std::uint32_t> sorted(v.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            for (int c = 0; c < 3; ++c)
+                sorted[3 * i + c] = v[3 * order[i] + c];
+        v.swap(sorted);
+    }
+};
+
+void triangle_mesh::build() {
+    const size_t count = size();
+    std::vector<aabb> boxes(count);
+    for (size_t i = 0; i < count; ++i) {
+        double p[3];
+        vertex(indices[3 * i], p);
+        point3 lo(p[0], p[1], p[2]), hi = lo;
+        for (int c = 1; c < 3; ++c) {
+            vertex(indices[3 * i + c], p);
+            for (int a = 0; a < 3; ++a) {
+                lo[a] = fmin(lo[a], p[a]);
+                hi[a] = fmax(hi[a], p[a]);
+            }
+        }
+        boxes[i] = aabb(lo, hi);
+    }
+
+    tree.build(boxes);
+
+    reorder(indices, tree.indices);
+    reorder(normal_indices, tree.indices);
+    reorder(uv_indices, tree.indices);
+
+    // Leaves now read triangle ranges directly, the index array is not needed anymore
+    tree.indices.clear();
+    tree.indices.shrink_to_fit();
+    tree.nodes.shrink_to_fit();
+}
+
+size_t triangle_mesh::memory_bytes() const {
+    return sizeof(float) * (pos_x.capacity() + pos_y.capacity() + pos_z.capacity()
+            + normal_x.capacity() + normal_y.capacity() + normal_z.capacity() + uv_u.capacity() + uv_v.capacity())
+        + sizeof(std::uint32_t) * (indices.capacity() + normal_indices.capacity() + uv_indices.capacity() + tree.indices.capacity())
+        + sizeof(flat_bvh_node) * tree.nodes.capacity();
+}
+
+/**
+\brief Walks the BVH and tests the triangles of every leaf. Barycentric coordinates of the winner go to (u,v) until finalize.
+
+\param r ray that goes through object
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param rec bunch of arguments in the struct
+\param gen generator of the current sample
+*/
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    const double o[3] = { r.origin().x(), r.origin().y(), r.origin().z() };
+    const double d[3] = { r.direction().x(), r.direction().y(), r.direction().z() };
+    long closest = -1;
+    double b1 = 0, b2 = 0;
+
+    tree.traverse_leaves(r, t_min, t_max, [&](std::uint32_t first, std::uint32_t n, double t0, double& t1) {
+        const long k = hit_leaf(o, d, first, n, t0, t1, b1, b2);
+        if (k < 0)
+            return false;
+        closest = k;
+        return true;
+    });
+
+    if (closest < 0)
+        return false;
+
+    rec.defer(t_max, this, static_cast<std::uint32_t>(closest));
+    rec.u = b1;
+    rec.v = b2;
+
+    return true;
+}
+
+long triangle_mesh::hit_leaf(const double o[3], const double d[3], std::uint32_t first, std::uint32_t n,
+    double t_min, double& t_max, double& b1, double& b2) const {
+    long closest = -1;
+
+    for (std::uint32_t k = first; k < first + n; ++k) {
+        double p0[3], p1[3], p2[3];
+        vertex(indices[3 * k], p0);
+        vertex(indices[3 * k + 1], p1);
+        vertex(indices[3 * k + 2], p2);
+
+        double t, u, v;
+        if (!hit_triangle(o, d, p0, p1, p2, t_min, t_max, t, u, v))
+            continue;
+        t_max = t;
+        b1 = u;
+        b2 = v;
+        closest = static_cast<long>(k);
+    }
+
+    return closest;
+}
+
+/**
+\brief Fills point, normal, (u,v) and material of the triangle found by hit. front_face comes from the geometric normal,
+the interpolated normal is turned to the same side.
+*/
+void triangle_mesh::finalize(const ray& r, hit_record& rec) const {
+    const auto k = rec.prim_index;
+    const double b1 = rec.u, b2 = rec.v, b0 = 1 - b1 - b2;
+
+    double p0[3], p1[3], p2[3];
+    vertex(indices[3 * k], p0);
+    vertex(indices[3 * k + 1], p1);
+    vertex(indices[3 * k + 2], p2);
+    const vec3 e1(p1[0] - p0[0], p1[1] - p0[1], p1[2] - p0[2]);
+    const vec3 e2(p2[0] - p0[0], p2[1] - p0[1], p2[2] - p0[2]);
+
+    rec.p = r.at(rec.t);
+    rec.set_face_normal(r, unit_vector(cross(e1, e2)));
+
+    if (has_normals()) {
+        const auto n0 = normal_index(k, 0), n1 = normal_index(k, 1), n2 = normal_index(k, 2);
+        const vec3 shading(
+            b0 * normal_x[n0] + b1 * normal_x[n1] + b2 * normal_x[n2],
+            b0 * normal_y[n0] + b1 * normal_y[n1] + b2 * normal_y[n2],
+            b0 * normal_z[n0] + b1 * normal_z[n1] + b2 * normal_z[n2]);
+        if (shading.length_squared() > 0) {
+            const vec3 n = unit_vector(shading);
+            rec.normal = dot(n, rec.normal) < 0 ? -n : n;
+        }
+    }
+
+    if (has_uvs()) {
+        const auto t0 = uv_index(k, 0), t1 = uv_index(k, 1), t2 = uv_index(k, 2);
+        rec.u = b0 * uv_u[t0] + b1 * uv_u[t1] + b2 * uv_u[t2];
+        rec.v = b0 * uv_v[t0] + b1 * uv_v[t1] + b2 * uv_v[t2];
+    }
+
+    rec.mat_ptr = mat_ptr.get();
+}
+
+/**
+\brief Box around all triangles of the mesh.
+
+\param time0 minumum time
+\param time1 maximum time
+\param output_box output aabb box
+*/
+bool triangle_mesh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (tree.empty())
+        return false;
+    output_box = tree.root_box();
+    return true;
+}
+
+#endif
@@ -6,10 +6,17 @@
 #ifndef UTILITY_H
 #define UTILITY_H
 
-#include <random>
+#include <cassert>
 #include <cmath>
+#include <cstdint>
 #include <limits>
 #include <memory>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
+#include <vector>
+
+#include "rng.h"
 
 using std::shared_ptr;
 using std::make_shared;
@@ -20,16 +27,24 @@ const double infinity = std::numeric_limits<double>::infinity(); // mathematical
 const double pi = 3.1415926535897932385; // mathematical pi
 
 /**
-\brief Gets random double in range [0.0, 1.0]
+\brief Random generator used while building scenes (random_scene, perlin tables, ...).
+
+Rendering never touches it: every pixel sample gets its own rng that is passed through camera, hittables and materials.
+*/
+inline rng& scene_random_generator() {
+    thread_local rng generator;
+    return generator;
+}
+
+/**
+\brief Gets random double in range [0.0, 1.0) from the scene generator.
 */
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return scene_random_generator().next_double();
 }
 
 /**
-\brief Returns a random real in [min,max).
+\brief Returns a random real in [min,max) from the scene generator.
 
 \param min minimal value
 \param max maximum value
@@ -38,6 +53,26 @@ inline double random_double(double min, double max) {
     return min + (max - min) * random_double();
 }
 
+/**
+\brief Gets random double in range [0.0, 1.0).
+
+\param gen generator of the current sample
+*/
+inline double random_double(rng& gen) {
+    return gen.next_double();
+}
+
+/**
+\brief Returns a random real in [min,max).
+
+\param gen generator of the current sample
+\param min minimal value
+\param max maximum value
+*/
+inline double random_double(rng& gen, double min, double max) {
+    return min + (max - min) * gen.next_double();
+}
+
 /**
 \brief Converts degrees to radians.
 
@@ -72,8 +107,60 @@ inline int random_int(int min, int max) {
     return static_cast<int>(random_double(min, max + 1));
 }
 
+inline int random_int(rng& gen, int min, int max) {
+    // Returns a random integer in [min,max] from generator of the current sample.
+    return static_cast<int>(random_double(gen, min, max + 1));
+}
+
+/**
+\brief Smallest r with 2^r >= v, at most 31.
+*/
+inline int ceil_log2(std::uint32_t v) {
+    int r = 0;
+    while (r < 31 && (1u << r) < v)
+        ++r;
+    return r;
+}
+
+/**
+\brief Runs work(part, begin, end) on threads for parts [0, parts) of [0, count), every part gets about the same share.
+Part 0 runs on the calling thread.
+
+\param parts number of parts (and threads)
+\param count number of items
+\param work function (part, first item, one past the last item)
+*/
+template <typename work_function>
+inline void parallel_parts(int parts, size_t count, const work_function& work) {
+    std::vector<std::thread> workers;
+    for (int part = 1; part < parts; ++part)
+        workers.emplace_back(work, part, count * part / parts, count * (part + 1) / parts);
+    work(0, 0, count / parts);
+    for (auto& worker : workers)
+        worker.join();
+}
+
+/**
+\brief Built-in hittable, material or texture picked by its kind tag. Classes with a kind tag are final, so the tag cannot hide a derived
+class whose overrides the kind switches would skip; debug builds also check that the tag matches the dynamic type.
+*/
+template <typename built_in, typename base>
+inline const built_in& kind_cast(const base& object) {
+    static_assert(std::is_final<built_in>::value, "only final classes have a kind tag");
+    assert(typeid(object) == typeid(built_in));
+    return static_cast<const built_in&>(object);
+}
+
+template <typename built_in, typename base>
+inline built_in& kind_cast(base& object) {
+    static_assert(std::is_final<built_in>::value, "only final classes have a kind tag");
+    assert(typeid(object) == typeid(built_in));
+    return static_cast<built_in&>(object);
+}
+
 
 #include "ray.h"
 #include "vec3.h"
+#include "sampler.h"
 
 #endif
\ No newline at end of file
@@ -9,28 +9,76 @@
 #include <cmath>
 #include <iostream>
 
+#include "simd.h"
+
 using std::sqrt;
 
+/**
+\brief Scalar type of vectors, points and colors. Build with RT_SINGLE_PRECISION defined to get float.
+
+Float halves the size of rays, hit records and primitives. Code that needs double for robustness (sphere and moving sphere
+quadratics, sphere_batch arrays, ray t values) keeps double explicitly, float is only used where storage is the bottleneck of traversal.
+*/
+#ifdef RT_SINGLE_PRECISION
+using real = float;
+#else
+using real = double;
+#endif
+
+// Vector lives in SIMD registers: one SSE register for float, one AVX register for double, or two SSE2 registers (x, y and z, 0)
+// for double without AVX, which is every x64 build. Fourth lane is padding and stays 0. RT_NO_SIMD (see simd.h) keeps three scalars.
+#if defined(RT_SINGLE_PRECISION) && RT_SSE2
+#define RT_VEC3_SSE 1
+#elif !defined(RT_SINGLE_PRECISION) && RT_AVX
+#define RT_VEC3_AVX 1
+#elif !defined(RT_SINGLE_PRECISION) && RT_SSE2
+#define RT_VEC3_SSE2 1
+#endif
+
 /**
 \brief Vector class implementation
+
+With RT_VEC3_SSE, RT_VEC3_AVX or RT_VEC3_SSE2 the coordinates are padded to 4 and stored in registers,
+arithmetic, dot and unit_vector use intrinsics. Results are the same as the scalar code except unit_vector of float vectors and of
+RT_VEC3_SSE2 double vectors, which use the fast reciprocal square root.
 */
 class vec3 {
 public:
+#if RT_VEC3_SSE
+    using simd_type = __m128;
+
+    vec3() : m(_mm_setzero_ps()) {}
+    vec3(real e0, real e1, real e2) : m(_mm_set_ps(0, e2, e1, e0)) {}
+    explicit vec3(simd_type v) : m(v) {}
+#elif RT_VEC3_AVX
+    using simd_type = __m256d;
+
+    vec3() : m(_mm256_setzero_pd()) {}
+    vec3(real e0, real e1, real e2) : m(_mm256_set_pd(0, e2, e1, e0)) {}
+    explicit vec3(simd_type v) : m(v) {}
+#elif RT_VEC3_SSE2
+    using simd_type = __m128d;
+
+    vec3() : m{ _mm_setzero_pd(), _mm_setzero_pd() } {}
+    vec3(real e0, real e1, real e2) : m{ _mm_set_pd(e1, e0), _mm_set_sd(e2) } {}
+    vec3(simd_type xy, simd_type z0) : m{ xy, z0 } {}
+#else
     vec3() : e{ 0,0,0 } {}
-    vec3(double e0, double e1, double e2) : e{ e0, e1, e2 } {}
+    vec3(real e0, real e1, real e2) : e{ e0, e1, e2 } {}
+#endif
 
     /**
     \brief Return x from vector.
     */
-    double x() const { return e[0]; }
+    real x() const { return e[0]; }
     /**
     \brief Return y from vector.
     */
-    double y() const { return e[1]; }
+    real y() const { return e[1]; }
     /**
     \brief Return z from vector.
     */
-    double z() const { return e[2]; }
+    real z() const { return e[2]; }
 
     /**
     \brief Return true if the vector is close to zero in all dimensions.
@@ -43,9 +91,17 @@ public:
     /**
     \brief Operator - makes coordinates of vector negative.
     */
+#if RT_VEC3_SSE
+    vec3 operator-() const { return vec3(_mm_sub_ps(_mm_setzero_ps(), m)); }
+#elif RT_VEC3_AVX
+    vec3 operator-() const { return vec3(_mm256_sub_pd(_mm256_setzero_pd(), m)); }
+#elif RT_VEC3_SSE2
+    vec3 operator-() const { return vec3(_mm_sub_pd(_mm_setzero_pd(), m[0]), _mm_sub_pd(_mm_setzero_pd(), m[1])); }
+#else
     vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
-    double operator[](int i) const { return e[i]; }
-    double& operator[](int i) { return e[i]; }
+#endif
+    real operator[](int i) const { return e[i]; }
+    real& operator[](int i) { return e[i]; }
 
     /**
     \brief Operator += adds two vector together.
@@ -53,9 +109,18 @@ public:
     \param v input vector
     */
     vec3& operator+=(const vec3& v) {
+#if RT_VEC3_SSE
+        m = _mm_add_ps(m, v.m);
+#elif RT_VEC3_AVX
+        m = _mm256_add_pd(m, v.m);
+#elif RT_VEC3_SSE2
+        m[0] = _mm_add_pd(m[0], v.m[0]);
+        m[1] = _mm_add_pd(m[1], v.m[1]);
+#else
         e[0] += v.e[0];
         e[1] += v.e[1];
         e[2] += v.e[2];
+#endif
         return *this;
     }
 
@@ -64,10 +129,20 @@ public:
 
     \param t constant
     */
-    vec3& operator*=(const double t) {
+    vec3& operator*=(const real t) {
+#if RT_VEC3_SSE
+        m = _mm_mul_ps(m, _mm_set1_ps(t));
+#elif RT_VEC3_AVX
+        m = _mm256_mul_pd(m, _mm256_set1_pd(t));
+#elif RT_VEC3_SSE2
+        const __m128d tt = _mm_set1_pd(t);
+        m[0] = _mm_mul_pd(m[0], tt);
+        m[1] = _mm_mul_pd(m[1], tt);
+#else
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
+#endif
         return *this;
     }
 
@@ -76,23 +151,21 @@ public:
 
     \param t constant
     */
-    vec3& operator/=(const double t) {
+    vec3& operator/=(const real t) {
         return *this *= 1 / t;
     }
 
     /**
     \brief Gets length of vector.
     */
-    double length() const {
+    real length() const {
         return sqrt(length_squared());
     }
 
     /**
     \brief Gets length squared of vector.
     */
-    double length_squared() const {
-        return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
-    }
+    real length_squared() const;
 
     /**
     \brief Fill vector with 3 random coordinates.
@@ -111,20 +184,33 @@ public:
         return vec3(random_double(min, max), random_double(min, max), random_double(min, max));
     }
 
+    /**
+    \brief Fill vector with 3 random coordinates in range (min, max) from generator of the current sample.
+
+    \param gen generator of the current sample
+    \param min minimum number in range
+    \param max maximum number in range
+    */
+    inline static vec3 random(rng& gen, double min, double max) {
+        return vec3(random_double(gen, min, max), random_double(gen, min, max), random_double(gen, min, max));
+    }
+
 public:
-    double e[3];
+#if RT_VEC3_SSE || RT_VEC3_AVX
+    union {
+        simd_type m; // coordinates in a register
+        real e[4]; // coordinates, e[3] is padding
+    };
+#elif RT_VEC3_SSE2
+    union {
+        simd_type m[2]; // (x, y) and (z, 0) in two registers
+        real e[4]; // coordinates, e[3] is padding
+    };
+#else
+    real e[3];
+#endif
 };
 
-/**
-\brief Pick a random point in a unit radius sphere.
-*/
-vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1, 1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
-}
 
 using point3 = vec3;   // 3D point
 using color = vec3;    // RGB color
@@ -139,6 +225,132 @@ inline std::ostream& operator<<(std::ostream& out, const vec3& v) {
     return out << v.e[0] << ' ' << v.e[1] << ' ' << v.e[2];
 }
 
+#if RT_VEC3_SSE
+
+inline vec3 operator+(const vec3& u, const vec3& v) { return vec3(_mm_add_ps(u.m, v.m)); }
+inline vec3 operator-(const vec3& u, const vec3& v) { return vec3(_mm_sub_ps(u.m, v.m)); }
+inline vec3 operator*(const vec3& u, const vec3& v) { return vec3(_mm_mul_ps(u.m, v.m)); }
+inline vec3 operator*(real t, const vec3& v) { return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m)); }
+
+/**
+\brief Makes dot out of two vectors. Lanes are added in the same order as the scalar code: (x + y) + z.
+*/
+inline real dot(const vec3& u, const vec3& v) {
+    const __m128 p = _mm_mul_ps(u.m, v.m);
+    const __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+    const __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+    return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(p, y), z));
+}
+
+/**
+\brief Cross product function: u.yzx * v.zxy - u.zxy * v.yzx.
+*/
+inline vec3 cross(const vec3& u, const vec3& v) {
+    const __m128 u_yzx = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 u_zxy = _mm_shuffle_ps(u.m, u.m, _MM_SHUFFLE(3, 1, 0, 2));
+    const __m128 v_yzx = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 0, 2, 1));
+    const __m128 v_zxy = _mm_shuffle_ps(v.m, v.m, _MM_SHUFFLE(3, 1, 0, 2));
+    return vec3(_mm_sub_ps(_mm_mul_ps(u_yzx, v_zxy), _mm_mul_ps(u_zxy, v_yzx)));
+}
+
+/**
+\brief Makes unit vector out of any other vector. Approximate reciprocal square root plus one Newton step (about 22 bits).
+*/
+inline vec3 unit_vector(vec3 v) {
+    const __m128 len2 = _mm_set1_ps(dot(v, v));
+    const __m128 r = _mm_rsqrt_ps(len2);
+    // r' = r * (1.5 - 0.5 * len2 * r * r)
+    const __m128 refined = _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), len2), _mm_mul_ps(r, r))));
+    return vec3(_mm_mul_ps(v.m, refined));
+}
+
+#elif RT_VEC3_AVX
+
+inline vec3 operator+(const vec3& u, const vec3& v) { return vec3(_mm256_add_pd(u.m, v.m)); }
+inline vec3 operator-(const vec3& u, const vec3& v) { return vec3(_mm256_sub_pd(u.m, v.m)); }
+inline vec3 operator*(const vec3& u, const vec3& v) { return vec3(_mm256_mul_pd(u.m, v.m)); }
+inline vec3 operator*(real t, const vec3& v) { return vec3(_mm256_mul_pd(_mm256_set1_pd(t), v.m)); }
+
+/**
+\brief Makes dot out of two vectors. Lanes are added in the same order as the scalar code: (x + y) + z.
+*/
+inline real dot(const vec3& u, const vec3& v) {
+    const __m256d p = _mm256_mul_pd(u.m, v.m);
+    const __m128d xy = _mm256_castpd256_pd128(p);
+    const __m128d zw = _mm256_extractf128_pd(p, 1);
+    return _mm_cvtsd_f64(_mm_add_sd(_mm_add_sd(xy, _mm_unpackhi_pd(xy, xy)), zw));
+}
+
+/**
+\brief Cross product function. AVX has no cheap shuffle across the two halves of a register, so it is scalar.
+*/
+inline vec3 cross(const vec3& u, const vec3& v) {
+    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+        u.e[2] * v.e[0] - u.e[0] * v.e[2],
+        u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+}
+
+/**
+\brief Makes unit vector out of any other vector.
+*/
+inline vec3 unit_vector(vec3 v) {
+    return (1 / sqrt(dot(v, v))) * v;
+}
+
+#elif RT_VEC3_SSE2
+
+inline vec3 operator+(const vec3& u, const vec3& v) { return vec3(_mm_add_pd(u.m[0], v.m[0]), _mm_add_pd(u.m[1], v.m[1])); }
+inline vec3 operator-(const vec3& u, const vec3& v) { return vec3(_mm_sub_pd(u.m[0], v.m[0]), _mm_sub_pd(u.m[1], v.m[1])); }
+inline vec3 operator*(const vec3& u, const vec3& v) { return vec3(_mm_mul_pd(u.m[0], v.m[0]), _mm_mul_pd(u.m[1], v.m[1])); }
+inline vec3 operator*(real t, const vec3& v) {
+    const __m128d tt = _mm_set1_pd(t);
+    return vec3(_mm_mul_pd(tt, v.m[0]), _mm_mul_pd(tt, v.m[1]));
+}
+
+/**
+\brief Makes dot out of two vectors. Lanes are added in the same order as the scalar code: (x + y) + z.
+*/
+inline real dot(const vec3& u, const vec3& v) {
+    const __m128d xy = _mm_mul_pd(u.m[0], v.m[0]);
+    const __m128d z = _mm_mul_sd(u.m[1], v.m[1]);
+    return _mm_cvtsd_f64(_mm_add_sd(_mm_add_sd(xy, _mm_unpackhi_pd(xy, xy)), z));
+}
+
+/**
+\brief Cross product function: (u.y, u.z) * (v.z, v.x) - (u.z, u.x) * (v.y, v.z) for x and y, u.x * v.y - u.y * v.x for z.
+*/
+inline vec3 cross(const vec3& u, const vec3& v) {
+    const __m128d u_yz = _mm_shuffle_pd(u.m[0], u.m[1], 1);
+    const __m128d v_zx = _mm_unpacklo_pd(v.m[1], v.m[0]);
+    const __m128d u_zx = _mm_unpacklo_pd(u.m[1], u.m[0]);
+    const __m128d v_yz = _mm_shuffle_pd(v.m[0], v.m[1], 1);
+    const __m128d p = _mm_mul_pd(u.m[0], _mm_shuffle_pd(v.m[0], v.m[0], 1)); // (u.x * v.y, u.y * v.x)
+    const __m128d z = _mm_sub_sd(p, _mm_unpackhi_pd(p, p));
+    return vec3(_mm_sub_pd(_mm_mul_pd(u_yz, v_zx), _mm_mul_pd(u_zx, v_yz)), _mm_move_sd(_mm_setzero_pd(), z));
+}
+
+/**
+\brief Makes unit vector out of any other vector. Float reciprocal square root plus two Newton steps in double (about 44 bits);
+lengths out of the float range take the exact division.
+*/
+inline vec3 unit_vector(vec3 v) {
+    const double len2 = dot(v, v);
+    if (!(len2 > 1e-30 && len2 < 1e30))
+        return (1 / sqrt(len2)) * v;
+    const __m128d l = _mm_set1_pd(len2);
+    const __m128 r_float = _mm_rsqrt_ss(_mm_cvtsd_ss(_mm_setzero_ps(), l));
+    __m128d r = _mm_cvtss_sd(_mm_setzero_pd(), r_float);
+    r = _mm_unpacklo_pd(r, r);
+    // r' = r * (1.5 - 0.5 * len2 * r * r)
+    const __m128d half_l = _mm_mul_pd(_mm_set1_pd(0.5), l);
+    const __m128d three_halves = _mm_set1_pd(1.5);
+    r = _mm_mul_pd(r, _mm_sub_pd(three_halves, _mm_mul_pd(half_l, _mm_mul_pd(r, r))));
+    r = _mm_mul_pd(r, _mm_sub_pd(three_halves, _mm_mul_pd(half_l, _mm_mul_pd(r, r))));
+    return vec3(_mm_mul_pd(v.m[0], r), _mm_mul_pd(v.m[1], r));
+}
+
+#else
+
 /**
 \brief Operator + that adds two vectors together.
 */
@@ -163,63 +375,111 @@ inline vec3 operator*(const vec3& u, const vec3& v) {
 /**
 \brief Operator * that multiplies constant and vector.
 */
-inline vec3 operator*(double t, const vec3& v) {
+inline vec3 operator*(real t, const vec3& v) {
     return vec3(t * v.e[0], t * v.e[1], t * v.e[2]);
 }
 
+/**
+\brief Makes dot out of two vectors.
+*/
+inline real dot(const vec3& u, const vec3& v) {
+    return u.e[0] * v.e[0]
+        + u.e[1] * v.e[1]
+        + u.e[2] * v.e[2];
+}
+
+/**
+\brief Cross product function.
+*/
+inline vec3 cross(const vec3& u, const vec3& v) {
+    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
+        u.e[2] * v.e[0] - u.e[0] * v.e[2],
+        u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+}
+
+/**
+\brief Makes unit vector out of any other vector.
+*/
+inline vec3 unit_vector(vec3 v) {
+    return (1 / v.length()) * v;
+}
+
+#endif
+
 /**
 \brief Operator * that multiplies vector and constant.
 */
-inline vec3 operator*(const vec3& v, double t) {
+inline vec3 operator*(const vec3& v, real t) {
     return t * v;
 }
 
 /**
 \brief Operator / that divides vector by constant.
 */
-inline vec3 operator/(vec3 v, double t) {
+inline vec3 operator/(vec3 v, real t) {
     return (1 / t) * v;
 }
 
 /**
-\brief Makes dot out of two vectors.
+\brief Gets length squared of vector.
 */
-inline double dot(const vec3& u, const vec3& v) {
-    return u.e[0] * v.e[0]
-        + u.e[1] * v.e[1]
-        + u.e[2] * v.e[2];
+inline real vec3::length_squared() const {
+    return dot(*this, *this);
 }
 
 /**
-\brief Cross product function.
+\brief Unit vector for a point of the unit square, uniform over the sphere: z is uniform in [-1, 1] (Archimedes), phi in [0, 2pi).
+
+\param u1 sample value for z
+\param u2 sample value for phi
 */
-inline vec3 cross(const vec3& u, const vec3& v) {
-    return vec3(u.e[1] * v.e[2] - u.e[2] * v.e[1],
-        u.e[2] * v.e[0] - u.e[0] * v.e[2],
-        u.e[0] * v.e[1] - u.e[1] * v.e[0]);
+vec3 sample_unit_vector(double u1, double u2) {
+    const auto z = 1 - 2 * u1;
+    const auto r = sqrt(fmax(0.0, 1 - z * z));
+    const auto phi = 2 * pi * u2;
+    return vec3(r * cos(phi), r * sin(phi), z);
 }
 
 /**
-\brief Makes unit vector out of any other vector.
+\brief Point in a unit radius sphere for a point of the unit cube, uniform over its volume: direction times cube root of u3.
+
+\param u1 sample value for z of the direction
+\param u2 sample value for phi of the direction
+\param u3 sample value for the radius
 */
-inline vec3 unit_vector(vec3 v) {
-    return v / v.length();
+vec3 sample_in_unit_sphere(double u1, double u2, double u3) {
+    return std::cbrt(u3) * sample_unit_vector(u1, u2);
+}
+
+/**
+\brief Pick a random point in a unit radius sphere.
+
+\param gen generator of the current sample
+*/
+vec3 random_in_unit_sphere(rng& gen) {
+    const auto u1 = random_double(gen);
+    const auto u2 = random_double(gen);
+    return sample_in_unit_sphere(u1, u2, random_double(gen));
 }
 
 /**
 \brief Gives random unit vector.
+
+\param gen generator of the current sample
 */
-vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+vec3 random_unit_vector(rng& gen) {
+    const auto u1 = random_double(gen);
+    return sample_unit_vector(u1, random_double(gen));
 }
 
 /**
 \brief Returns vector in the same hemisphere as 'normal' vector.
 
 \param normal vector that exists in the same hemisphere we need.
+\param gen generator of the current sample
 */
-vec3 random_in_hemisphere(const vec3& normal) {
-    vec3 in_unit_sphere = random_in_unit_sphere();
+vec3 random_in_hemisphere(const vec3& normal, rng& gen) {
+    vec3 in_unit_sphere = random_in_unit_sphere(gen);
     if (dot(in_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
         return in_unit_sphere;
     else
@@ -251,14 +511,39 @@ vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) { // Accordin
 }
 
 /**
-\brief Random vector in unit disk.
+\brief Point in the unit disk (z = 0) for a point of the unit square, concentric map of Shirley and Chiu.
+
+Squares around the center go to rings, so strata of the square stay compact on the disk and nothing is rejected.
+
+\param u1 sample value for x of the square
+\param u2 sample value for y of the square
 */
-vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
+vec3 sample_in_unit_disk(double u1, double u2) {
+    const auto a = 2 * u1 - 1;
+    const auto b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    double r, phi;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        phi = (pi / 4) * (b / a);
     }
+    else {
+        r = b;
+        phi = pi / 2 - (pi / 4) * (a / b);
+    }
+    return vec3(r * cos(phi), r * sin(phi), 0);
+}
+
+/**
+\brief Random vector in unit disk.
+
+\param gen generator of the current sample
+*/
+vec3 random_in_unit_disk(rng& gen) {
+    const auto u1 = random_double(gen);
+    return sample_in_unit_disk(u1, random_double(gen));
 }
 
 #endif
\ No newline at end of file
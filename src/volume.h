@@ -0,0 +1,371 @@
+/**
+\file
+\brief .h file that contains volumes: boundary intervals, free flight sampling, sparse density grids, heterogeneous media and global fog
+*/
+
+#ifndef VOLUME_H
+#define VOLUME_H
+
+#include "utility.h"
+
+#include "hittable.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "sphere.h"
+#include "box.h"
+#include "instance.h"
+#include "array_buffer.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+
+/**
+\brief Distances where a ray enters and leaves a sphere, both roots of the quadratic.
+*/
+inline bool sphere_interval(const ray& r, const point3& center, double radius, double& t0, double& t1) {
+    const vec3 oc = r.origin() - center;
+    const auto a = r.direction().length_squared();
+    const auto half_b = dot(oc, r.direction());
+    const auto c = oc.length_squared() - radius * radius;
+
+    const auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0)
+        return false;
+    const auto sqrtd = sqrt(discriminant);
+
+    t0 = (-half_b - sqrtd) / a;
+    t1 = (-half_b + sqrtd) / a;
+    return true;
+}
+
+/**
+\brief Distances where a ray enters and leaves an axis aligned box.
+*/
+inline bool box_interval(const ray& r, const point3& box_min, const point3& box_max, double& t0, double& t1) {
+    const auto& inv = r.inverse_direction();
+    t0 = -infinity;
+    t1 = infinity;
+    for (int a = 0; a < 3; ++a) {
+        double near_t = (box_min[a] - r.origin()[a]) * inv[a];
+        double far_t = (box_max[a] - r.origin()[a]) * inv[a];
+        if (near_t > far_t)
+            std::swap(near_t, far_t);
+        // NaN (ray in the slab plane) leaves the interval as it is
+        t0 = std::max(t0, near_t);
+        t1 = std::min(t1, far_t);
+    }
+    return t0 < t1;
+}
+
+/**
+\brief Entry and exit distance of a ray through a convex boundary, over the whole line (like hit() from -infinity).
+
+Spheres, boxes and instances of them are solved in closed form. Other boundaries take two intersection calls, the second one
+starts just behind the entry.
+
+\param boundary convex object
+\param r ray
+\param t0 entry distance
+\param t1 exit distance
+\param gen generator of the current sample
+*/
+inline bool boundary_interval(const hittable& boundary, const ray& r, double& t0, double& t1, rng& gen) {
+    switch (boundary.kind) {
+    case hittable_kind::sphere: {
+        const auto& s = kind_cast<sphere>(boundary);
+        return sphere_interval(r, s.center, s.radius, t0, t1);
+    }
+    case hittable_kind::box: {
+        const auto& b = kind_cast<box>(boundary);
+        return box_interval(r, b.box_min, b.box_max, t0, t1);
+    }
+    case hittable_kind::instance: {
+        // Distances along the local ray are the same as along the world ray
+        const auto& inst = kind_cast<instance>(boundary);
+        return boundary_interval(*inst.ptr, inst.instance::to_local(r), t0, t1, gen);
+    }
+    default:
+        break;
+    }
+
+    hit_record rec1, rec2;
+    if (!hit_primitive(boundary, r, -infinity, infinity, rec1, gen))
+        return false;
+    if (!hit_primitive(boundary, r, rec1.t + 0.0001, infinity, rec2, gen))
+        return false;
+    t0 = rec1.t;
+    t1 = rec2.t;
+    return true;
+}
+
+/**
+\brief Fills a hit record for a scattering event at distance t of a volume, the phase function is its material.
+*/
+inline void complete_medium_hit(const ray& r, double t, const material* phase_function, hit_record& rec) {
+    rec.complete(t);
+    rec.p = r.at(t);
+    rec.normal = vec3(1, 0, 0);  // arbitrary
+    rec.front_face = true;     // also arbitrary
+    rec.mat_ptr = phase_function;
+}
+
+/**
+\brief Samples the free flight distance in a homogeneous medium. The ray scatters if the distance ends before the ray leaves [t0, t1].
+
+\param r ray
+\param t0 distance where the ray enters the medium, already clipped to the ray range
+\param t1 distance where it leaves, may be infinity
+\param neg_inv_density -1 / density
+\param phase_function material of the scattering event
+\param rec receives the event
+\param gen generator of the current sample
+*/
+inline bool sample_homogeneous(const ray& r, double t0, double t1, double neg_inv_density, const material* phase_function,
+    hit_record& rec, rng& gen) {
+    if (t0 >= t1)
+        return false;
+    if (t0 < 0)
+        t0 = 0;
+
+    const auto ray_length = r.direction().length();
+    const auto distance_inside_boundary = (t1 - t0) * ray_length;
+    RT_COUNT(medium_samples, 1);
+    const auto hit_distance = neg_inv_density * log(random_double(gen));
+
+    if (hit_distance > distance_inside_boundary)
+        return false;
+
+    complete_medium_hit(r, t0 + hit_distance / ray_length, phase_function, rec);
+    return true;
+}
+
+/**
+\brief Sparse grid of densities, stored in bricks of 8x8x8 voxels like the leaves of NanoVDB. Bricks that are all zero are not stored.
+
+Lookup is two array reads and a trilinear blend, no virtual call. majorant is the largest voxel, media use it to sample free flights.
+*/
+class density_grid {
+public:
+    static const int brick_size = 8;
+    static const std::uint32_t empty_brick = 0xffffffffu;
+
+    density_grid() {}
+
+    /**
+    \param nx voxels along x
+    \param ny voxels along y
+    \param nz voxels along z
+    \param grid_min corner of voxel (0, 0, 0)
+    \param grid_max opposite corner of voxel (nx - 1, ny - 1, nz - 1)
+    */
+    density_grid(int nx, int ny, int nz, const point3& grid_min, const point3& grid_max)
+        : bounds_min(grid_min), bounds_max(grid_max) {
+        resolution[0] = nx;
+        resolution[1] = ny;
+        resolution[2] = nz;
+        for (int a = 0; a < 3; ++a)
+            bricks[a] = (resolution[a] + brick_size - 1) / brick_size;
+        brick_index.resize(static_cast<size_t>(bricks[0]) * bricks[1] * bricks[2], static_cast<std::uint32_t>(empty_brick));
+    }
+
+    /**
+    \brief Sets one voxel. The first non zero voxel of a brick allocates it.
+    */
+    void set(int x, int y, int z, float value) {
+        if (x < 0 || y < 0 || z < 0 || x >= resolution[0] || y >= resolution[1] || z >= resolution[2])
+            return;
+        const size_t b = brick_of(x, y, z);
+        if (brick_index[b] == empty_brick) {
+            if (value == 0)
+                return;
+            brick_index[b] = static_cast<std::uint32_t>(voxels.size() / brick_voxels);
+            voxels.resize(voxels.size() + brick_voxels, 0.0f);
+        }
+        voxels[brick_index[b] * brick_voxels + voxel_in_brick(x, y, z)] = value;
+        majorant = std::max(majorant, value);
+    }
+
+    /**
+    \brief Voxel value, 0 outside of the grid and in empty bricks.
+    */
+    float voxel(int x, int y, int z) const {
+        if (x < 0 || y < 0 || z < 0 || x >= resolution[0] || y >= resolution[1] || z >= resolution[2])
+            return 0;
+        const std::uint32_t b = brick_index[brick_of(x, y, z)];
+        return b == empty_brick ? 0.0f : voxels[b * brick_voxels + voxel_in_brick(x, y, z)];
+    }
+
+    /**
+    \brief Trilinear density at a point, 0 outside of the grid.
+    */
+    double density(const point3& p) const {
+        double f[3];
+        int i[3];
+        for (int a = 0; a < 3; ++a) {
+            const double g = (p[a] - bounds_min[a]) / (bounds_max[a] - bounds_min[a]) * (resolution[a] - 1);
+            const double fl = floor(g);
+            i[a] = static_cast<int>(fl);
+            f[a] = g - fl;
+        }
+
+        double sum = 0;
+        for (int dz = 0; dz < 2; ++dz)
+            for (int dy = 0; dy < 2; ++dy)
+                for (int dx = 0; dx < 2; ++dx) {
+                    const double w = (dx ? f[0] : 1 - f[0]) * (dy ? f[1] : 1 - f[1]) * (dz ? f[2] : 1 - f[2]);
+                    sum += w * voxel(i[0] + dx, i[1] + dy, i[2] + dz);
+                }
+        return sum;
+    }
+
+    /**
+    \brief Bricks that hold voxels.
+    */
+    size_t brick_count() const { return voxels.size() / brick_voxels; }
+
+    /**
+    \brief Recomputes majorant from the voxels, e.g. after the arrays were loaded.
+    */
+    void update_majorant() {
+        majorant = 0;
+        for (const float v : voxels)
+            majorant = std::max(majorant, v);
+    }
+
+public:
+    int resolution[3] = { 0, 0, 0 }; // voxels per axis
+    int bricks[3] = { 0, 0, 0 }; // bricks per axis
+    point3 bounds_min; // corner of the first voxel
+    point3 bounds_max; // corner of the last voxel
+    float majorant = 0; // largest value
+    array_buffer<std::uint32_t> brick_index; // brick slot of every brick, empty_brick if it is all zero
+    array_buffer<float> voxels; // brick_size^3 values per stored brick, x fastest
+
+private:
+    static const std::uint32_t brick_voxels = brick_size * brick_size * brick_size;
+
+    size_t brick_of(int x, int y, int z) const {
+        return (static_cast<size_t>(z / brick_size) * bricks[1] + y / brick_size) * bricks[0] + x / brick_size;
+    }
+
+    static std::uint32_t voxel_in_brick(int x, int y, int z) {
+        return ((z % brick_size) * brick_size + y % brick_size) * brick_size + x % brick_size;
+    }
+};
+
+/**
+\brief Volume whose density comes from a density_grid, scaled by density_scale.
+
+Scattering distances are sampled by delta tracking: tentative collisions are drawn with the majorant (the densest voxel), and a collision at p
+is real with probability density(p) / majorant, otherwise the ray goes on. Result is unbiased for any density below the majorant.
+*/
+class grid_medium final : public hittable {
+public:
+    grid_medium(const density_grid& g, double scale, shared_ptr<material> phase)
+        : hittable(hittable_kind::grid_medium), grid(g), density_scale(scale), phase_function(phase) {}
+
+    grid_medium(const density_grid& g, double scale, color c)
+        : grid_medium(g, scale, make_shared<isotropic>(c)) {}
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = aabb(grid.bounds_min, grid.bounds_max);
+        return true;
+    }
+
+public:
+    density_grid grid;
+    double density_scale; // density of a voxel of value 1
+    shared_ptr<material> phase_function;
+};
+
+/**
+\brief Delta tracking through the grid box. See grid_medium class for more info.
+
+\param r ray that goes through object
+\param t_min minimum t(in a ray) which can be counted as a hit
+\param t_max maximum t(in a ray) which can be counted as a hit
+\param rec bunch of arguments in the struct
+\param gen generator of the current sample
+*/
+bool grid_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const {
+    const double sigma_max = density_scale * grid.majorant;
+    if (sigma_max <= 0)
+        return false;
+
+    double t0, t1;
+    if (!box_interval(r, grid.bounds_min, grid.bounds_max, t0, t1))
+        return false;
+    t0 = std::max(t0, t_min);
+    t1 = std::min(t1, t_max);
+    if (t0 >= t1)
+        return false;
+
+    const double inv_sigma_length = 1 / (sigma_max * r.direction().length());
+    double t = t0;
+    while (true) {
+        t -= log(1 - random_double(gen)) * inv_sigma_length;
+        if (t >= t1)
+            return false;
+        RT_COUNT(medium_samples, 1);
+        if (random_double(gen) * sigma_max < density_scale * grid.density(r.at(t))) {
+            complete_medium_hit(r, t, phase_function.get(), rec);
+            return true;
+        }
+    }
+}
+
+/**
+\brief Homogeneous fog inside a sphere around the scene, or everywhere when radius is infinity.
+
+It needs no boundary object and no BVH: the integrator takes it out of the scene (see take_global_fog) and tests it after the scene
+intersection, only up to the surface the ray hit. Inside a hierarchy it still works as an ordinary object.
+*/
+class fog_medium final : public hittable {
+public:
+    fog_medium(const point3& c, double r, double d, shared_ptr<material> phase)
+        : hittable(hittable_kind::fog), center(c), radius(r), neg_inv_density(-1 / d), phase_function(phase) {}
+
+    fog_medium(const point3& c, double r, double d, color albedo)
+        : fog_medium(c, r, d, make_shared<isotropic>(albedo)) {}
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec, rng& gen) const override {
+        double t0 = -infinity, t1 = infinity;
+        if (radius < infinity && !sphere_interval(r, center, radius, t0, t1))
+            return false;
+        return sample_homogeneous(r, std::max(t0, t_min), std::min(t1, t_max), neg_inv_density, phase_function.get(), rec, gen);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        if (!(radius < infinity))
+            return false;
+        output_box = aabb(center - vec3(radius, radius, radius), center + vec3(radius, radius, radius));
+        return true;
+    }
+
+public:
+    point3 center;
+    double radius; // infinity for fog everywhere
+    double neg_inv_density;
+    shared_ptr<material> phase_function;
+};
+
+/**
+\brief Removes the first fog_medium at the top level of the scene and returns it for integrator_settings::fog, nullptr if there is none.
+*/
+inline shared_ptr<const fog_medium> take_global_fog(hittable_list& world) {
+    for (auto it = world.objects.begin(); it != world.objects.end(); ++it) {
+        if ((*it)->kind == hittable_kind::fog) {
+            auto fog = std::static_pointer_cast<const fog_medium>(*it);
+            world.objects.erase(it);
+            return fog;
+        }
+    }
+    return nullptr;
+}
+
+#endif